@@ -0,0 +1,277 @@
+#include "broker.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+// Ventanas disponibles: $agg/<nombre>/<topic>
+static const struct {
+    const char* name;
+    int seconds;
+} windows[AGG_NUM_WINDOWS] = {
+    { "1m", 60 },
+    { "5m", 300 },
+    { "1h", 3600 },
+};
+
+// Un resumen armado con el lock del topic tomado y emitido despues de
+// soltarlo (emitir publica, y eso no debe hacerse con locks propios).
+typedef struct {
+    char topic[MAX_TOPIC_LEN];
+    int topic_len;
+    char data[192];
+    int data_len;
+    time_t end;
+} AggSummary;
+
+
+// =========================================================
+// TABLA DE TOPICS
+// =========================================================
+
+#define AGG_INITIAL_BUCKETS 64
+
+static unsigned int hash_topic(const char* topic) {
+    unsigned int h = 2166136261u;   // FNV-1a
+    while (*topic) {
+        h ^= (unsigned char)*topic++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static AggTopic* find_topic(AggStore* store, const char* topic) {
+    AggTopic* t = store->buckets[hash_topic(topic) & (store->num_buckets - 1)];
+    while (t) {
+        if (strcmp(t->topic, topic) == 0)
+            return t;
+        t = t->next;
+    }
+    return NULL;
+}
+
+// Se llama con el lock de la tabla tomado en escritura.
+static void grow_table(AggStore* store) {
+    unsigned int size = store->num_buckets * 2;
+    AggTopic** buckets = calloc(size, sizeof(AggTopic*));
+    if (!buckets)
+        return;
+
+    for (unsigned int i = 0; i < store->num_buckets; i++) {
+        AggTopic* t = store->buckets[i];
+        while (t) {
+            AggTopic* nx = t->next;
+            unsigned int b = hash_topic(t->topic) & (size - 1);
+            t->next = buckets[b];
+            buckets[b] = t;
+            t = nx;
+        }
+    }
+
+    free(store->buckets);
+    store->buckets = buckets;
+    store->num_buckets = size;
+}
+
+static AggTopic* get_topic(AggStore* store, const char* topic) {
+    pthread_rwlock_rdlock(&store->lock);
+    AggTopic* t = find_topic(store, topic);
+    pthread_rwlock_unlock(&store->lock);
+
+    if (t)
+        return t;
+
+    pthread_rwlock_wrlock(&store->lock);
+
+    t = find_topic(store, topic);
+    if (!t && (t = calloc(1, sizeof(AggTopic))) != NULL) {
+        strncpy(t->topic, topic, MAX_TOPIC_LEN - 1);
+        pthread_mutex_init(&t->mutex, NULL);
+
+        if (store->num_topics >= store->num_buckets)
+            grow_table(store);
+
+        unsigned int b = hash_topic(topic) & (store->num_buckets - 1);
+        t->next = store->buckets[b];
+        store->buckets[b] = t;
+        store->num_topics++;
+    }
+
+    pthread_rwlock_unlock(&store->lock);
+    return t;
+}
+
+
+// =========================================================
+// VENTANAS
+// =========================================================
+
+// Valor numerico de una lectura: el payload entero o el campo "value".
+static int reading_value(const char* data, size_t len, double* value) {
+    char buf[MAX_DATA_LEN];
+    char* end;
+
+    if (len == 0 || len >= sizeof(buf))
+        return 0;
+    memcpy(buf, data, len);
+    buf[len] = '\0';
+
+    char* p = buf;
+    if (*p == '{') {
+        p = strstr(buf, "\"value\"");
+        if (!p || !(p = strchr(p + 7, ':')))
+            return 0;
+        p++;
+    }
+
+    *value = strtod(p, &end);
+    if (end == p || !isfinite(*value))
+        return 0;
+
+    // Suelto tiene que ser solo el numero
+    if (buf[0] != '{') {
+        while (*end == ' ')
+            end++;
+        if (*end)
+            return 0;
+    }
+    return 1;
+}
+
+static int summarize(const AggTopic* t, int w, AggSummary* out) {
+    const AggWindow* win = &t->win[w];
+
+    out->topic_len = snprintf(out->topic, sizeof(out->topic), AGG_PREFIX "%s/%s",
+                              windows[w].name, t->topic);
+    if (out->topic_len >= (int)sizeof(out->topic))
+        return 0;
+
+    out->end = win->start + windows[w].seconds;
+    out->data_len = snprintf(out->data, sizeof(out->data),
+                             "{\"min\":%.2f,\"max\":%.2f,\"avg\":%.2f,\"count\":%lu,"
+                             "\"start\":%ld,\"end\":%ld}",
+                             win->min, win->max, win->sum / win->count, win->count,
+                             (long)win->start, (long)out->end);
+    return out->data_len < (int)sizeof(out->data);
+}
+
+static void emit_all(AggSummary* s, int n, AggEmitFn emit, void* ctx) {
+    for (int i = 0; i < n; i++)
+        emit(s[i].topic, s[i].topic_len, s[i].data, s[i].data_len, s[i].end, ctx);
+}
+
+
+// =========================================================
+// API
+// =========================================================
+
+int agg_init(AggStore* store) {
+    store->buckets = calloc(AGG_INITIAL_BUCKETS, sizeof(AggTopic*));
+    if (!store->buckets)
+        return 0;
+
+    store->num_buckets = AGG_INITIAL_BUCKETS;
+    store->num_topics = 0;
+    pthread_rwlock_init(&store->lock, NULL);
+    return 1;
+}
+
+void agg_destroy(AggStore* store) {
+    for (unsigned int i = 0; i < store->num_buckets; i++) {
+        AggTopic* t = store->buckets[i];
+        while (t) {
+            AggTopic* nx = t->next;
+            pthread_mutex_destroy(&t->mutex);
+            free(t);
+            t = nx;
+        }
+    }
+
+    free(store->buckets);
+    store->buckets = NULL;
+    store->num_buckets = 0;
+    store->num_topics = 0;
+    pthread_rwlock_destroy(&store->lock);
+}
+
+void agg_add(AggStore* store, Message* msg, AggEmitFn emit, void* ctx) {
+    AggSummary closed[AGG_NUM_WINDOWS];
+    int n = 0;
+    double v;
+
+    if (msg->topic[0] == '$' || !reading_value(msg->data, msg->data_len, &v))
+        return;
+
+    AggTopic* t = get_topic(store, msg->topic);
+    if (!t)
+        return;
+
+    pthread_mutex_lock(&t->mutex);
+
+    for (int w = 0; w < AGG_NUM_WINDOWS; w++) {
+        AggWindow* win = &t->win[w];
+        time_t start = msg->timestamp - msg->timestamp % windows[w].seconds;
+
+        // Una lectura atrasada (de una ventana ya cerrada) se cuenta en
+        // la ventana en curso
+        if (win->count > 0 && start > win->start) {
+            if (summarize(t, w, &closed[n]))
+                n++;
+            win->count = 0;
+        }
+
+        if (win->count == 0) {
+            win->start = start;
+            win->min = win->max = win->sum = v;
+            win->count = 1;
+        } else {
+            if (v < win->min) win->min = v;
+            if (v > win->max) win->max = v;
+            win->sum += v;
+            win->count++;
+        }
+    }
+
+    pthread_mutex_unlock(&t->mutex);
+
+    emit_all(closed, n, emit, ctx);
+}
+
+void agg_flush(AggStore* store, time_t now, AggEmitFn emit, void* ctx) {
+    AggSummary* closed = NULL;
+    int n = 0, cap = 0;
+
+    pthread_rwlock_rdlock(&store->lock);
+
+    for (unsigned int i = 0; i < store->num_buckets; i++) {
+        for (AggTopic* t = store->buckets[i]; t; t = t->next) {
+            pthread_mutex_lock(&t->mutex);
+
+            for (int w = 0; w < AGG_NUM_WINDOWS; w++) {
+                AggWindow* win = &t->win[w];
+                if (win->count == 0 || now < win->start + windows[w].seconds)
+                    continue;
+
+                if (n == cap) {
+                    int ncap = cap ? cap * 2 : 16;
+                    AggSummary* c = realloc(closed, ncap * sizeof(AggSummary));
+                    if (!c)
+                        break;
+                    closed = c;
+                    cap = ncap;
+                }
+
+                if (summarize(t, w, &closed[n]))
+                    n++;
+                win->count = 0;
+            }
+
+            pthread_mutex_unlock(&t->mutex);
+        }
+    }
+
+    pthread_rwlock_unlock(&store->lock);
+
+    emit_all(closed, n, emit, ctx);
+    free(closed);
+}
@@ -0,0 +1,68 @@
+#ifndef AGG_H
+#define AGG_H
+
+#include <pthread.h>
+#include <time.h>
+#include "message.h"
+
+// Se incluye desde broker.h (usa MAX_TOPIC_LEN).
+
+// =========================================================
+// Agregados por ventana de tiempo: por cada topic con lecturas
+// numericas se lleva min/max/suma/cantidad de la ventana en curso
+// (ventanas fijas alineadas al reloj, sin solapamiento). Al cerrar una
+// ventana se publica un resumen en
+//
+//   $agg/<ventana>/<topic>   {"min":..,"max":..,"avg":..,"count":..,
+//                             "start":..,"end":..}
+//
+// Quien solo necesita la tendencia se suscribe ahi y recibe un mensaje
+// por ventana en lugar de cada lectura. Una ventana se cierra con la
+// primera lectura que cae en la siguiente, o con agg_flush() si el
+// topic dejo de publicar.
+//
+// El valor de una lectura es el payload si es un numero, o el campo
+// "value" si es JSON (el formato de los gateways).
+// =========================================================
+
+#define AGG_PREFIX "$agg/"
+#define AGG_NUM_WINDOWS 3
+
+typedef struct {
+    double min;
+    double max;
+    double sum;
+    unsigned long count;
+    time_t start;                 // inicio de la ventana en curso
+} AggWindow;
+
+typedef struct AggTopic {
+    char topic[MAX_TOPIC_LEN];
+    pthread_mutex_t mutex;
+    AggWindow win[AGG_NUM_WINDOWS];
+    struct AggTopic* next;        // cadena del bucket
+} AggTopic;
+
+typedef struct {
+    AggTopic** buckets;
+    unsigned int num_buckets;
+    unsigned int num_topics;
+    pthread_rwlock_t lock;        // protege solo la tabla de topics
+} AggStore;
+
+// Recibe cada resumen listo para publicar (topic $agg/..., payload JSON).
+typedef void (*AggEmitFn)(const char* topic, size_t topic_len,
+                          const char* data, size_t data_len,
+                          time_t timestamp, void* ctx);
+
+int  agg_init(AggStore* store);
+void agg_destroy(AggStore* store);
+
+// Suma la lectura de 'msg' y emite las ventanas que cerro. Ignora los
+// topics que empiezan con '$' y los payloads no numericos.
+void agg_add(AggStore* store, Message* msg, AggEmitFn emit, void* ctx);
+
+// Emite las ventanas que ya terminaron a la hora 'now'.
+void agg_flush(AggStore* store, time_t now, AggEmitFn emit, void* ctx);
+
+#endif
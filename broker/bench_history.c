@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "broker.h"
+
+// ==================== BENCHMARK DEL HISTORIAL ====================
+//
+// Llena el historial con un dia de lecturas por sensor (una cada
+// SAMPLE_PERIOD segundos, con el formato del gateway) y con payloads de
+// texto cualquiera, y mide:
+//
+//   - bytes por muestra que ocupa el historial (bloques sellados, mas
+//     el bloque abierto y la tabla), contra lo que ocuparian los Message
+//   - lectura: muestras/segundo al pedir todo el rango de cada topic
+
+#define SENSORS 32
+#define SAMPLE_PERIOD 5
+#define SAMPLES (24 * 3600 / SAMPLE_PERIOD)
+#define READ_ROUNDS 5
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef int (*PayloadFn)(char* out, int sensor, int i, time_t ts);
+
+// Temperatura que deriva de a centesimos, como la simula el gateway.
+static int reading_payload(char* out, int sensor, int i, time_t ts) {
+    static double value[SENSORS];
+    if (i == 0)
+        value[sensor] = 20 + sensor;
+    value[sensor] += (rand() % 21 - 10) / 100.0;
+    return sprintf(out, "{\"value\":%.2f,\"timestamp\":%ld}", value[sensor], (long)ts);
+}
+
+static int text_payload(char* out, int sensor, int i, time_t ts) {
+    (void)ts;
+    return sprintf(out, "estado=%s reintentos=%d sensor=%d", i % 10 ? "ok" : "degradado",
+                   i % 4, sensor);
+}
+
+static void bench(const char* name, PayloadFn payload) {
+    HistoryStore store;
+    size_t raw = 0;
+    char topic[64], data[128];
+
+    history_init(&store, SAMPLES, 0);
+    srand(1);
+
+    time_t t0 = 1700000000;
+    for (int i = 0; i < SAMPLES; i++) {
+        time_t ts = t0 + (time_t)i * SAMPLE_PERIOD + (rand() % 10 == 0);
+        for (int s = 0; s < SENSORS; s++) {
+            int tl = sprintf(topic, "gateway/gw%d/publisher/p%d/sensor/temperature", s % 4, s);
+            int dl = payload(data, s, i, ts);
+
+            Message* m = message_create(topic, tl, data, dl, ts);
+            raw += sizeof(Message) + m->frame_len + 1 + m->text_len + m->topic_len + 1 +
+                   sizeof(Message*) + sizeof(time_t);
+            history_append(&store, m);
+            message_release(m);
+        }
+    }
+
+    long samples = (long)SAMPLES * SENSORS;
+    size_t used = history_memory(&store);
+
+    printf("%s: %ld muestras, %.1f bytes/muestra (%.1f sin comprimir, %.1fx)\n",
+           name, samples, (double)used / samples, (double)raw / samples, (double)raw / used);
+
+    long decoded = 0;
+    size_t checksum = 0;
+    double start = now_sec();
+
+    for (int r = 0; r < READ_ROUNDS; r++) {
+        for (int s = 0; s < SENSORS; s++) {
+            HistoryResult res = {0};
+            sprintf(topic, "gateway/gw%d/publisher/p%d/sensor/temperature", s % 4, s);
+            history_collect(&store, topic, 0, LLONG_MAX, SAMPLES, &res);
+
+            decoded += res.count;
+            for (int k = 0; k < res.count; k++)
+                checksum += res.hits[k].msg->data_len;
+            history_result_free(&res);
+        }
+    }
+
+    double secs = now_sec() - start;
+    printf("%s: lectura de %ld muestras en %.3f s -> %.2f M muestras/s\n",
+           name, decoded, secs, decoded / secs / 1e6);
+
+    if (checksum == 0)
+        printf("checksum invalido\n");
+
+    history_destroy(&store);
+}
+
+int main(void) {
+    printf("%d sensores, %d muestras por sensor (un dia cada %d s)\n",
+           SENSORS, SAMPLES, SAMPLE_PERIOD);
+
+    bench("lecturas de gateway", reading_payload);
+    bench("payloads de texto", text_payload);
+    return 0;
+}
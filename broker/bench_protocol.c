@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "protocol.h"
+#include "wire.h"
+
+// ==================== BENCHMARK DEL FRAMER Y PARSER ====================
+//
+// Alimenta un Framer con un flujo de comandos cortado en trozos de
+// tamanio aleatorio (como llegan por recv) y mide comandos/segundo en
+// un solo hilo, en texto y con los frames binarios de wire.h. Como
+// referencia mide tambien el parseo con sscanf.
+
+#define STREAM_COMMANDS 100000
+#define ROUNDS 20
+
+static char* stream;
+static size_t stream_len;
+static char* frames;
+static size_t frames_len;
+
+static void build_stream(void) {
+    stream = malloc(STREAM_COMMANDS * 128);
+    frames = malloc(STREAM_COMMANDS * 128);
+    stream_len = 0;
+    frames_len = 0;
+
+    for (int i = 0; i < STREAM_COMMANDS; i++) {
+        char topic[64], data[64];
+        int tl = sprintf(topic, "gateway/gw%d/publisher/p%d/sensor/temperature", i % 8, i % 50);
+        int dl = sprintf(data, "{\"value\":%d.%02d,\"timestamp\":%d}",
+                         20 + i % 10, i % 100, 1700000000 + i);
+
+        stream_len += sprintf(stream + stream_len, "PUBLISH %s %s\n", topic, data);
+        frames_len += wire_encode(frames + frames_len, 128, WIRE_PUBLISH, topic, tl, data, dl);
+    }
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long parsed;
+static size_t checksum;
+
+static void on_command(Command* cmd, void* ctx) {
+    (void)ctx;
+    if (cmd->type == CMD_PUBLISH) {
+        parsed++;
+        checksum += cmd->arg_len + cmd->data_len;
+    }
+}
+
+static void bench_framer(const char* name, const char* input, size_t input_len, FramingMode mode) {
+    Framer framer;
+    framer_init(&framer);
+    framer.mode = mode;
+    srand(1);
+    parsed = 0;
+
+    double t0 = now_sec();
+
+    for (int r = 0; r < ROUNDS; r++) {
+        size_t off = 0;
+        while (off < input_len) {
+            size_t avail;
+            char* space = framer_space(&framer, &avail);
+
+            size_t n = 1 + rand() % 1500;
+            if (n > avail) n = avail;
+            if (n > input_len - off) n = input_len - off;
+
+            memcpy(space, input + off, n);   // simula el recv
+            framer_commit(&framer, n, on_command, NULL);
+            off += n;
+        }
+    }
+
+    double secs = now_sec() - t0;
+    printf("%s: %ld comandos en %.3f s -> %.2f M comandos/s por core\n",
+           name, parsed, secs, parsed / secs / 1e6);
+}
+
+static void bench_sscanf(void) {
+    char line[1024], topic[128], data[513];
+    long count = 0;
+
+    double t0 = now_sec();
+
+    for (int r = 0; r < ROUNDS; r++) {
+        char* p = stream;
+        char* end = stream + stream_len;
+        while (p < end) {
+            // Como el broker original: cada linea en su propio buffer
+            // terminado en '\0' (sscanf hace strlen de toda la entrada).
+            char* nl = memchr(p, '\n', end - p);
+            size_t len = nl - p;
+            memcpy(line, p, len);
+            line[len] = '\0';
+
+            if (strncmp(line, "PUBLISH", 7) == 0 &&
+                sscanf(line, "PUBLISH %127s %512[^\n]", topic, data) == 2)
+                count++;
+            p = nl + 1;
+        }
+    }
+
+    double secs = now_sec() - t0;
+    printf("sscanf (referencia): %ld comandos en %.3f s -> %.2f M comandos/s por core\n",
+           count, secs, count / secs / 1e6);
+}
+
+int main(void) {
+    build_stream();
+    printf("Flujo de %d comandos (%zu bytes en texto, %zu en binario), %d rondas\n",
+           STREAM_COMMANDS, stream_len, frames_len, ROUNDS);
+
+    bench_framer("framer + parser (texto)", stream, stream_len, FRAMING_TEXT);
+    bench_framer("framer (binario)", frames, frames_len, FRAMING_BINARY);
+    bench_sscanf();
+
+    if (checksum == 0)
+        printf("checksum invalido\n");
+
+    free(stream);
+    free(frames);
+    return 0;
+}
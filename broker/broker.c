@@ -1,142 +1,3359 @@
 #include "broker.h"
+#include "wire.h"
+#include "spsc.h"
+#include "logger.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdint.h>
 #include <arpa/inet.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/time.h>
+#include <sys/un.h>
 
 // =========================================================
 // MANEJO DE LISTAS
 // =========================================================
 
-static void add_gateway(Broker* broker, int socket, const char* id) {
+static void add_gateway(Broker* broker, Connection* conn, const char* id) {
     GatewayClient* g = malloc(sizeof(GatewayClient));
-    g->socket = socket;
+    g->socket = conn->socket;
     strncpy(g->id, id, MAX_GATEWAY_ID);
-    g->next = NULL;
+    g->prev = NULL;
 
     pthread_mutex_lock(&broker->mutex_gateways);
     g->next = broker->gateways;
+    if (g->next)
+        g->next->prev = g;
     broker->gateways = g;
     pthread_mutex_unlock(&broker->mutex_gateways);
 
-    printf("[BROKER] Gateway registrado: %s\n", id);
+    g->owner_next = conn->owned_gateways;
+    conn->owned_gateways = g;
+
+    LOG_DEBUG("[BROKER] Gateway registrado: %s", id);
+}
+
+// Quita los registros de una conexion que se fue: O(registros propios).
+static void remove_gateways(Broker* broker, Connection* conn) {
+    if (!conn->owned_gateways)
+        return;
+
+    pthread_mutex_lock(&broker->mutex_gateways);
+
+    GatewayClient* g = conn->owned_gateways;
+    while (g) {
+        GatewayClient* nx = g->owner_next;
+
+        if (g->prev)
+            g->prev->next = g->next;
+        else
+            broker->gateways = g->next;
+        if (g->next)
+            g->next->prev = g->prev;
+
+        LOG_DEBUG("[BROKER] Gateway dado de baja: %s", g->id);
+        free(g);
+        g = nx;
+    }
+
+    pthread_mutex_unlock(&broker->mutex_gateways);
+    conn->owned_gateways = NULL;
+}
+
+// ---------------------------------------------------------
+// Suscripciones: PUBLISH lee la version vigente sin tomar ningun lock
+// (solo marca su seccion en sub_epoch). Un cambio arma una version
+// nueva, la publica con un store atomico y libera la anterior cuando ya
+// no queda ningun lector que la pueda estar usando. La version nueva
+// comparte con la anterior todo lo que no toca (topic_tree_clone): se
+// copian solo los nodos del camino de cada filtro que cambia, con sus
+// suscripciones.
+// ---------------------------------------------------------
+
+static SubscriberClient* clone_subscription(const SubscriberClient* s) {
+    SubscriberClient* c = malloc(sizeof(SubscriberClient));
+    if (!c)
+        return NULL;
+
+    *c = *s;
+    c->next = NULL;
+    conn_retain(c->conn);
+    return c;
+}
+
+// Version nueva sobre la vigente, para modificarla (con mutex_subscribers
+// tomado).
+static TopicTree* subscriptions_begin(Broker* broker) {
+    TopicTree* next = malloc(sizeof(TopicTree));
+    if (!next)
+        return NULL;
+
+    if (topic_tree_clone(next, broker->subscriptions, clone_subscription) < 0) {
+        free(next);
+        return NULL;
+    }
+    return next;
+}
+
+static void subscriptions_discard(TopicTree* tree) {
+    topic_tree_destroy(tree);
+    free(tree);
+}
+
+// Publica la version nueva y libera la anterior (con mutex_subscribers tomado).
+static void subscriptions_commit(Broker* broker, TopicTree* next) {
+    TopicTree* old = broker->subscriptions;
+
+    __atomic_store_n(&broker->subscriptions, next, __ATOMIC_RELEASE);
+    epoch_synchronize(&broker->sub_epoch);
+
+    subscriptions_discard(old);
+}
+
+// Anota en la conexion un filtro suscripto, para poder quitarlo al
+// desconectarse sin recorrer el arbol.
+static void own_filter(Connection* conn, const char* filter, int conflate) {
+    OwnedFilter* f = malloc(sizeof(OwnedFilter));
+    if (!f)
+        return;
+
+    strncpy(f->filter, filter, MAX_TOPIC_LEN - 1);
+    f->filter[MAX_TOPIC_LEN - 1] = '\0';
+    f->conflate = conflate;
+    f->next = conn->owned_filters;
+    conn->owned_filters = f;
+
+    stats_add(stats_local(conn->stats), STAT_SUBSCRIPTIONS_ADDED, 1);
+}
+
+// Enlace al filtro anotado en la conexion ('*' es NULL si no esta).
+static OwnedFilter** find_owned_filter(Connection* conn, const char* filter) {
+    OwnedFilter** pp = &conn->owned_filters;
+    while (*pp && strcmp((*pp)->filter, filter) != 0)
+        pp = &(*pp)->next;
+    return pp;
+}
+
+static void unlink_owned_filter(Connection* conn, OwnedFilter** pp) {
+    OwnedFilter* f = *pp;
+    *pp = f->next;
+    free(f);
+
+    stats_add(stats_local(conn->stats), STAT_SUBSCRIPTIONS_REMOVED, 1);
+}
+
+// Devuelve 1 si la suscripcion quedo registrada (o ya existia: se le
+// aplica 'conflate'), 0 si el filtro es invalido.
+static int add_subscriber(Broker* broker, Connection* conn, const char* topic, int conflate) {
+    SubscriberClient* s = calloc(1, sizeof(SubscriberClient));
+    s->conn = conn;
+    s->conflate = conflate;
+    strncpy(s->topic, topic, MAX_TOPIC_LEN - 1);
+    s->topic[MAX_TOPIC_LEN - 1] = '\0';
+
+    conn_retain(conn);
+
+    pthread_mutex_lock(&broker->mutex_subscribers);
+
+    // El filtro se valida antes de armar la version nueva
+    int r = -1;
+    TopicTree* next = topic_filter_is_valid(s->topic) ? subscriptions_begin(broker) : NULL;
+    if (next) {
+        r = topic_tree_add(next, s);
+        if (r == 1 || r == 2)
+            subscriptions_commit(broker, next);
+        else
+            subscriptions_discard(next);
+    }
+
+    pthread_mutex_unlock(&broker->mutex_subscribers);
+
+    if (r != 1)
+        conn_release(conn);
+
+    if (r != 1)
+        free(s);
+
+    if (r < 0) {
+        LOG_DEBUG("[BROKER] Filtro de topic invalido '%s' (socket %d)", topic, conn->socket);
+        return 0;
+    }
+
+    // Se copia de 'topic': 's' ya es del arbol y puede liberarse con la
+    // proxima version
+    OwnedFilter* f;
+    if (r == 1)
+        own_filter(conn, topic, conflate);
+    else if (r == 2 && (f = *find_owned_filter(conn, topic)))
+        f->conflate = conflate;
+
+    LOG_DEBUG("[BROKER] Nuevo SUBSCRIBER al topic '%s' (socket %d)", topic, conn->socket);
+    return 1;
+}
+
+// Quita una suscripcion de la conexion. Devuelve 1 si existia.
+static int remove_subscriber(Broker* broker, Connection* conn, const char* filter) {
+    OwnedFilter** pp = find_owned_filter(conn, filter);
+    if (!*pp)
+        return 0;
+
+    pthread_mutex_lock(&broker->mutex_subscribers);
+
+    TopicTree* next = subscriptions_begin(broker);
+    if (!next) {
+        pthread_mutex_unlock(&broker->mutex_subscribers);
+        return 0;
+    }
+    topic_tree_remove(next, filter, conn);
+    subscriptions_commit(broker, next);
+
+    pthread_mutex_unlock(&broker->mutex_subscribers);
+
+    unlink_owned_filter(conn, pp);
+
+    LOG_DEBUG("[BROKER] SUBSCRIBER dado de baja del topic '%s' (socket %d)", filter, conn->socket);
+    return 1;
+}
+
+// Quita todas las suscripciones de una conexion que se fue, en una sola
+// version nueva: se copia el camino de cada filtro propio, sin recorrer
+// el arbol.
+static void remove_all_subscriptions(Broker* broker, Connection* conn) {
+    if (!conn->owned_filters)
+        return;
+
+    pthread_mutex_lock(&broker->mutex_subscribers);
+
+    TopicTree* next = subscriptions_begin(broker);
+    if (next) {
+        for (OwnedFilter* f = conn->owned_filters; f; f = f->next)
+            topic_tree_remove(next, f->filter, conn);
+        subscriptions_commit(broker, next);
+    }
+
+    pthread_mutex_unlock(&broker->mutex_subscribers);
+
+    while (conn->owned_filters)
+        unlink_owned_filter(conn, &conn->owned_filters);
+}
+
+// Cada suscripcion en el arbol retiene su conexion; al liberarla se
+// suelta esa referencia.
+static void free_subscription(SubscriberClient* s) {
+    conn_release(s->conn);
+    free(s);
+}
+
+// 'history' y 'retained' son los del broker, o los del shard dueno del
+// topic.
+static void save_message(Broker* broker, HistoryStore* history, RetainedStore* retained, Message* msg) {
+    history_append(history, msg);
+    retained_set(retained, msg);
+
+    if (broker->log && msglog_append(broker->log, msg->topic, msg->data, msg->data_len, msg->timestamp) < 0)
+        LOG_ERROR("[BROKER] No se pudo escribir en el log: %s", msg->topic);
+}
+
+
+// =========================================================
+// PROCESAMIENTO DE COMANDOS
+// =========================================================
+
+// Suscriptores con entregas encoladas y todavia sin enviar. Lo publicado
+// en una misma lectura se encola primero y cada conexion se vacia una
+// sola vez al final (un sendmsg con todos sus mensajes).
+typedef struct {
+    Connection** conns;
+    int count;
+    int cap;
+} FlushList;
+
+static void flush_list_add(FlushList* l, Connection* c) {
+    if (l->count == l->cap) {
+        int cap = l->cap ? l->cap * 2 : 16;
+        Connection** conns = realloc(l->conns, cap * sizeof(Connection*));
+        if (!conns) {
+            conn_flush(c);
+            return;
+        }
+        l->conns = conns;
+        l->cap = cap;
+    }
+
+    conn_retain(c);
+    l->conns[l->count++] = c;
+}
+
+static void flush_list_run(FlushList* l) {
+    for (int i = 0; i < l->count; i++) {
+        conn_flush(l->conns[i]);
+        conn_release(l->conns[i]);
+    }
+    free(l->conns);
+}
+
+typedef struct {
+    Broker* broker;
+    Message* msg;
+    FlushList* pending;
+    SharePolicy share;
+    int delivered;
+} FanoutCtx;
+
+// Lo que llego de otro broker sigue hacia los demas, salvo al broker
+// donde se publico y al que se lo mando, y mientras no haya cruzado
+// BRIDGE_MAX_HOPS enlaces. Un retenido restaurado (sin origen) no sale.
+static int can_receive(const Connection* conn, const Message* msg) {
+    if (!conn->peer || !msg->bridged)
+        return 1;
+    return msg->origin && msg->origin != conn->peer && msg->via != conn->peer &&
+           msg->hops < BRIDGE_MAX_HOPS;
+}
+
+// Arma el frame WIRE_RELAY del mensaje la primera vez que va a otro
+// broker; los demas enlaces comparten el mismo. Uno publicado aca toma
+// en ese momento su numero. Devuelve 0 si no hay memoria.
+static int relay_frame(Broker* broker, Message* msg) {
+    if (__atomic_load_n(&msg->relay, __ATOMIC_ACQUIRE))
+        return 1;
+
+    const char* origin = msg->bridged ? msg->origin->name : broker->name;
+    size_t origin_len = strlen(origin);
+    uint64_t seq = msg->bridged ? msg->seq
+                                : __atomic_add_fetch(&broker->relay_seq, 1, __ATOMIC_RELAXED);
+    size_t payload_len = 2 + origin_len + 8 + msg->data_len;
+    size_t len = WIRE_HEADER_LEN + msg->topic_len + payload_len;
+
+    char* frame = malloc(len);
+    if (!frame)
+        return 0;
+
+    char* p = frame;
+    wire_put_header(p, WIRE_RELAY, msg->topic_len, payload_len);
+    p += WIRE_HEADER_LEN;
+    memcpy(p, msg->topic, msg->topic_len);
+    p += msg->topic_len;
+    *p++ = (char)(msg->bridged ? msg->hops + 1 : 1);
+    *p++ = (char)origin_len;
+    memcpy(p, origin, origin_len);
+    p += origin_len;
+    for (int i = 7; i >= 0; i--)
+        *p++ = (char)((seq >> (i * 8)) & 0xFF);
+    memcpy(p, msg->data, msg->data_len);
+
+    // Si otro hilo lo armo primero queda el suyo (mismo largo)
+    char* none = NULL;
+    __atomic_store_n(&msg->relay_len, len, __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&msg->relay, &none, frame, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        free(frame);
+    return 1;
+}
+
+// Lo que se puede encolar ya a 'conn'
+static int ready_for(Broker* broker, Connection* conn, Message* msg) {
+    return can_receive(conn, msg) && (!conn->peer || relay_frame(broker, msg));
+}
+
+// Miembro del grupo que recibe el proximo mensaje, entre los que lo
+// pueden recibir (NULL si ninguno). Se saltean los que estan cerrados o
+// con la cola llena; si todos lo estan va al primero desde el turno y su
+// politica de consumidor lento decide.
+static SubscriberClient* pick_member(SubscriberClient* group, const Message* msg,
+                                     SharePolicy policy) {
+    unsigned int turn = __atomic_fetch_add(&group->cursor->turn, 1, __ATOMIC_RELAXED);
+    int start = (int)(turn % (unsigned int)group->num_members);
+
+    SubscriberClient* m = group->members;
+    for (int i = 0; i < start && m->next; i++)
+        m = m->next;
+
+    SubscriberClient* first = NULL;
+    SubscriberClient* best = NULL;
+    int best_backlog = 0;
+
+    for (int i = 0; i < group->num_members; i++, m = m->next ? m->next : group->members) {
+        if (!can_receive(m->conn, msg))
+            continue;
+        if (!first)
+            first = m;
+
+        int backlog = conn_backlog(m->conn);
+
+        if (backlog >= 0 && (!best || backlog < best_backlog)) {
+            best = m;
+            best_backlog = backlog;
+            if (policy == SHARE_ROUND_ROBIN || backlog == 0)
+                break;
+        }
+    }
+
+    return best ? best : first;
+}
+
+// El mensaje ya esta codificado: cada suscriptor solo encola una
+// referencia (en el formato que negocio).
+static void send_to_subscriber(SubscriberClient* s, void* arg) {
+    FanoutCtx* ctx = (FanoutCtx*)arg;
+
+    if (!s->conn)
+        s = pick_member(s, ctx->msg, ctx->share);
+
+    if (!s || !ready_for(ctx->broker, s->conn, ctx->msg))
+        return;
+
+    int r = conn_queue(s->conn, ctx->msg, s->conflate);
+    if (r >= 0)
+        ctx->delivered++;
+    if (r == 1)
+        flush_list_add(ctx->pending, s->conn);
+}
+
+// Entregas y latencia de un fan-out, en el bloque del hilo que lo hizo.
+// 'received' es 0 para los mensajes que arma el broker (agregados).
+static void count_fanout(Stats* stats, FanoutCtx* ctx, uint64_t received) {
+    StatsThread* st = stats_local(stats);
+
+    stats_add(st, STAT_DELIVERIES, ctx->delivered);
+    if (received)
+        stats_record_fanout(st, received);
+}
+
+typedef struct {
+    Broker* broker;
+    Connection* conn;
+    int conflate;
+    int flush_owed;
+} RetainedCtx;
+
+// Copia del frame WIRE_RELAY marcada como retenido: el otro broker la
+// acepta aunque su numero ya haya salido de la ventana de repetidos.
+static Message* retained_relay(const Message* msg) {
+    Message* m = message_create_raw(msg->relay, msg->relay_len);
+    if (m)
+        m->buf[WIRE_HEADER_LEN + msg->topic_len] |= WIRE_RELAY_RETAINED;
+    return m;
+}
+
+static void queue_retained(Message* msg, void* arg) {
+    RetainedCtx* ctx = (RetainedCtx*)arg;
+    Message* out = msg;
+
+    if (!ready_for(ctx->broker, ctx->conn, msg))
+        return;
+    if (ctx->conn->peer && !(out = retained_relay(msg)))
+        return;
+
+    // La copia no tiene topic: a otro broker no se le conflaciona
+    if (conn_queue(ctx->conn, out, out == msg && ctx->conflate) == 1)
+        ctx->flush_owed = 1;
+    if (out != msg)
+        message_release(out);
+}
+
+// Al suscribirse: los valores vigentes de los topics que coinciden con
+// el filtro se encolan juntos y salen en una sola escritura con el resto
+// de lo que deja la lectura.
+//
+// Un grupo compartido no recibe valores retenidos: cada miembro que se
+// une los volveria a procesar.
+static void send_retained(Broker* broker, RetainedStore* retained, Connection* conn,
+                          const char* filter, int conflate, FlushList* pending) {
+    RetainedCtx ctx = { broker, conn, conflate, 0 };
+
+    if (topic_share_filter(filter))
+        return;
+
+    retained_match(retained, filter, queue_retained, &ctx);
+    if (ctx.flush_owed)
+        flush_list_add(pending, conn);
+}
+
+// Entrega en los modos sin shards: historial y suscriptores de la
+// version vigente.
+static void deliver(Broker* broker, Message* msg, FlushList* pending, uint64_t received) {
+    save_message(broker, &broker->history, &broker->retained, msg);
+
+    FanoutCtx ctx = { broker, msg, pending, broker->share_policy, 0 };
+
+    int token = epoch_enter(&broker->sub_epoch);
+    TopicTree* subs = __atomic_load_n(&broker->subscriptions, __ATOMIC_ACQUIRE);
+    topic_tree_match(subs, msg->topic, send_to_subscriber, &ctx);
+    epoch_exit(&broker->sub_epoch, token);
+
+    count_fanout(&broker->stats, &ctx, received);
+}
+
+// Respuestas del protocolo hacia el propio cliente: "OK <msg>" o
+// "ERROR: <msg>" en texto, frames WIRE_OK / WIRE_ERROR en binario.
+static void reply(Connection* conn, int ok, const char* msg) {
+    char buf[256];
+    size_t len;
+
+    // En modo sharded puede responder el shard dueno del filtro, que no es
+    // el que lee la conexion
+    if (__atomic_load_n(&conn->binary, __ATOMIC_ACQUIRE)) {
+        len = wire_encode(buf, sizeof(buf), ok ? WIRE_OK : WIRE_ERROR, "", 0, msg, strlen(msg));
+    } else {
+        int n = snprintf(buf, sizeof(buf), "%s%s\n", ok ? "OK " : "ERROR: ", msg);
+        len = n < (int)sizeof(buf) ? (size_t)n : sizeof(buf) - 1;
+    }
+
+    conn_send(conn, buf, len, 1);
+}
+
+// Le da a un gateway 'n' PUBLISH mas: "CREDIT <n>" o un frame WIRE_CREDIT.
+static void send_credit(Connection* conn, int n) {
+    char buf[32];
+    size_t len;
+
+    if (conn->binary) {
+        unsigned char c[4] = { (unsigned char)(n >> 24), (unsigned char)(n >> 16),
+                               (unsigned char)(n >> 8), (unsigned char)n };
+        len = wire_encode(buf, sizeof(buf), WIRE_CREDIT, "", 0, (const char*)c, sizeof(c));
+    } else {
+        len = snprintf(buf, sizeof(buf), "CREDIT %d\n", n);
+    }
+
+    conn_send(conn, buf, len, 1);
+}
+
+// Repone el credito de un gateway cuando gasto la mitad de la ventana.
+// Se llama despues de procesar y despachar lo leido: lo que el gateway
+// tiene en camino nunca supera una ventana. Lo otorgado en total es la
+// ventana mas lo que ya se proceso, asi que tambien cuenta lo que el
+// gateway mando antes de conocer su credito.
+static void replenish_credit(Connection* conn) {
+    if (conn->credit_window == 0 || conn->credit > conn->credit_window / 2)
+        return;
+
+    send_credit(conn, conn->credit_window - conn->credit);
+    conn->credit = conn->credit_window;
+}
+
+// HELLO elige el formato de la conexion; solo vale como primer comando.
+static void negotiate(Connection* conn, const char* mode) {
+    if (conn->negotiated) {
+        reply(conn, 0, "HELLO must be the first command");
+    } else if (strcmp(mode, "BINARY") == 0) {
+        // La confirmacion va en texto; desde el proximo byte se usan frames
+        conn_send(conn, WIRE_HELLO_OK, strlen(WIRE_HELLO_OK), 1);
+        conn->framer.mode = FRAMING_BINARY;
+        __atomic_store_n(&conn->binary, 1, __ATOMIC_RELEASE);
+    } else if (strcmp(mode, "TEXT") == 0) {
+        reply(conn, 1, "TEXT");
+    } else {
+        reply(conn, 0, "Unknown protocol");
+    }
+}
+
+// HELLO SHM: desde ahora la conexion manda sus comandos por el ring que
+// adjunto al mensaje (ver shm_ring.h). Solo por el socket Unix.
+static void attach_local_gateway(Connection* conn) {
+    if (!conn->local)
+        reply(conn, 0, "SHM needs the Unix socket");
+    else if (conn_attach_ring(conn) < 0)
+        reply(conn, 0, "Invalid shared memory ring");
+    else
+        reply(conn, 1, "SHM");
+}
+
+// ---------------------------------------------------------
+// Modo sharded: cada shard es un hilo con su propio epoll y su propio
+// socket de escucha (SO_REUSEPORT: el kernel reparte las conexiones), y
+// es dueno de una particion de los topics por hash: sus suscripciones,
+// su historial y el fan-out de esos topics viven solo en ese hilo y se
+// usan sin locks.
+//
+// Un PUBLISH que entra por un shard que no es dueno del topic se pasa al
+// dueno por un canal SPSC (uno por cada par de shards). Un filtro sin
+// wildcards vive en el shard de su topic; uno con '+' o '#' puede
+// coincidir con topics de cualquier shard y se instala en todos.
+//
+// El log y la lista de gateways siguen con su mutex: no estan en el
+// camino de cada entrega.
+// ---------------------------------------------------------
+
+#define SHARD_CHANNEL_LEN 1024     // operaciones por canal (potencia de 2)
+
+typedef enum {
+    SHARD_OP_PUBLISH,
+    SHARD_OP_SUBSCRIBE,
+    SHARD_OP_UNSUBSCRIBE
+} ShardOpType;
+
+typedef struct {
+    ShardOpType type;
+    Message* msg;                  // PUBLISH (referencia propia)
+    uint64_t received;             // PUBLISH: cuando se leyo (stats_now)
+    Connection* conn;              // (UN)SUBSCRIBE (referencia propia)
+    int* acks;                     // shards que faltan aplicarla; el ultimo
+                                   // responde al cliente. NULL: sin respuesta
+    int conflate;                  // SUBSCRIBE ... CONFLATE
+    char filter[];                 // (UN)SUBSCRIBE; un PUBLISH no lo lleva
+} ShardOp;
+
+typedef struct Shard {
+    Broker* broker;
+    int id;
+    int listen_fd;
+    int epoll_fd;
+    int wake_fd;                   // eventfd: hay operaciones en la inbox
+    pthread_t thread;
+
+    TopicTree subscriptions;       // solo las de los topics de este shard
+    HistoryStore history;
+    RetainedStore retained;
+
+    SpscRing* inbox;               // inbox[i]: canal desde el shard i
+    uint64_t wake_mask;            // shards a despertar al terminar la vuelta
+
+    AggStore agg;                  // ventanas de los topics de este shard
+    time_t last_sweep;
+} Shard;
+
+static void aggregate(Broker* broker, Shard* shard, AggStore* agg, Message* msg, FlushList* pending);
+
+// FNV-1a del topic. Para un filtro sin wildcards da el shard de los
+// topics que coinciden con el.
+static int shard_of(Broker* broker, const char* topic) {
+    uint32_t h = 2166136261u;
+
+    for (const unsigned char* p = (const unsigned char*)topic; *p; p++) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return (int)(h % (uint32_t)broker->num_loops);
+}
+
+static void shard_wake(Shard* shard) {
+    uint64_t one = 1;
+    if (write(shard->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        LOG_ERROR("[BROKER] eventfd: %s", strerror(errno));
+}
+
+// Historial, log y entrega a los suscriptores, en el shard dueno del topic.
+static void shard_deliver(Shard* shard, Message* msg, FlushList* pending, uint64_t received) {
+    save_message(shard->broker, &shard->history, &shard->retained, msg);
+
+    FanoutCtx ctx = { shard->broker, msg, pending, shard->broker->share_policy, 0 };
+    topic_tree_match(&shard->subscriptions, msg->topic, send_to_subscriber, &ctx);
+    count_fanout(&shard->broker->stats, &ctx, received);
+
+    aggregate(shard->broker, shard, &shard->agg, msg, pending);
+}
+
+static void shard_ack(Connection* conn, int* acks, ShardOpType type) {
+    if (acks && __atomic_sub_fetch(acks, 1, __ATOMIC_ACQ_REL) == 0) {
+        reply(conn, 1, type == SHARD_OP_SUBSCRIBE ? "SUBSCRIBED" : "UNSUBSCRIBED");
+        free(acks);
+    }
+}
+
+// Instala el filtro en el arbol del shard (lo toca solo su hilo, o
+// cualquiera antes de que arranquen).
+static void shard_add_subscription(Shard* shard, Connection* conn, const char* filter, int conflate) {
+    SubscriberClient* s = calloc(1, sizeof(SubscriberClient));
+    if (!s)
+        return;
+
+    s->conn = conn;
+    s->conflate = conflate;
+    strncpy(s->topic, filter, MAX_TOPIC_LEN - 1);
+    conn_retain(conn);
+
+    if (topic_tree_add(&shard->subscriptions, s) != 1) {
+        conn_release(conn);
+        free(s);
+    }
+}
+
+// Aplica una operacion en el shard destino y la libera.
+static void shard_apply(Shard* shard, ShardOp* op, FlushList* pending) {
+    switch (op->type) {
+    case SHARD_OP_PUBLISH:
+        shard_deliver(shard, op->msg, pending, op->received);
+        message_release(op->msg);
+        free(op);
+        return;
+
+    case SHARD_OP_SUBSCRIBE: {
+        shard_add_subscription(shard, op->conn, op->filter, op->conflate);
+
+        // Cada shard manda los valores de sus topics en cuanto instala el
+        // filtro: asi nunca llegan despues de una publicacion mas nueva
+        // del mismo topic. El que responde lo hace antes de mandarlos.
+        shard_ack(op->conn, op->acks, op->type);
+        send_retained(shard->broker, &shard->retained, op->conn, op->filter, op->conflate, pending);
+        conn_release(op->conn);
+        free(op);
+        return;
+    }
+
+    case SHARD_OP_UNSUBSCRIBE:
+        topic_tree_remove(&shard->subscriptions, op->filter, op->conn);
+        break;
+    }
+
+    shard_ack(op->conn, op->acks, op->type);
+    conn_release(op->conn);
+    free(op);
+}
+
+static void shard_drop_op(ShardOp* op) {
+    if (op->type == SHARD_OP_PUBLISH) {
+        message_release(op->msg);
+    } else {
+        shard_ack(op->conn, op->acks, op->type);
+        conn_release(op->conn);
+    }
+    free(op);
+}
+
+// Atiende lo que mandaron los otros shards. Se acota por canal para que
+// un productor rapido no deje sin atender a los sockets propios.
+static void shard_drain(Shard* shard) {
+    FlushList pending = { NULL, 0, 0 };
+
+    for (int i = 0; i < shard->broker->num_loops; i++) {
+        ShardOp* op;
+        int n = 0;
+
+        while (n++ < SHARD_CHANNEL_LEN && (op = spsc_pop(&shard->inbox[i])) != NULL)
+            shard_apply(shard, op, &pending);
+    }
+
+    flush_list_run(&pending);
+}
+
+// Manda 'op' al shard 'to'; se lo despierta al final de la vuelta. Con
+// el canal lleno se atiende la inbox propia mientras se espera, para que
+// dos shards mandandose a la vez no se bloqueen mutuamente.
+static void shard_send(Shard* shard, int to, ShardOp* op) {
+    Shard* dst = &shard->broker->shards[to];
+
+    while (!spsc_push(&dst->inbox[shard->id], op)) {
+        if (!shard->broker->running) {
+            shard_drop_op(op);
+            return;
+        }
+        shard_wake(dst);
+        shard_drain(shard);
+        sched_yield();
+    }
+
+    shard->wake_mask |= 1ULL << to;
+}
+
+static void shard_flush_wakes(Shard* shard) {
+    uint64_t mask = shard->wake_mask;
+    shard->wake_mask = 0;
+
+    for (int i = 0; mask; i++, mask >>= 1) {
+        if (mask & 1)
+            shard_wake(&shard->broker->shards[i]);
+    }
+}
+
+static void shard_publish(Shard* shard, Message* msg, FlushList* pending, uint64_t received) {
+    int owner = shard_of(shard->broker, msg->topic);
+
+    if (owner == shard->id) {
+        shard_deliver(shard, msg, pending, received);
+        return;
+    }
+
+    ShardOp* op = malloc(sizeof(ShardOp));   // sin filtro
+    if (!op)
+        return;
+
+    op->type = SHARD_OP_PUBLISH;
+    op->msg = msg;
+    op->received = received;
+    op->conn = NULL;
+    op->acks = NULL;
+    message_retain(msg);
+
+    shard_send(shard, owner, op);
+}
+
+// ---------------------------------------------------------
+// Agregados: las lecturas se suman en el AggStore del broker, o en el
+// del shard dueno del topic, y cada resumen se publica como un mensaje
+// mas en $agg/<ventana>/<topic> (historial, retenido, log y
+// suscriptores). En modo sharded ese topic puede ser de otro shard.
+// ---------------------------------------------------------
+
+typedef struct {
+    Broker* broker;
+    Shard* shard;
+    FlushList* pending;
+} AggCtx;
+
+static void publish_summary(const char* topic, size_t topic_len,
+                            const char* data, size_t data_len,
+                            time_t timestamp, void* arg) {
+    AggCtx* ctx = (AggCtx*)arg;
+
+    Message* msg = message_create(topic, topic_len, data, data_len, timestamp);
+    if (!msg)
+        return;
+
+    if (ctx->shard)
+        shard_publish(ctx->shard, msg, ctx->pending, 0);
+    else
+        deliver(ctx->broker, msg, ctx->pending, 0);
+
+    message_release(msg);
+}
+
+// Lo que llego por un puente ya lo resume el broker donde se publico
+static void aggregate(Broker* broker, Shard* shard, AggStore* agg, Message* msg, FlushList* pending) {
+    if (msg->bridged)
+        return;
+
+    AggCtx ctx = { broker, shard, pending };
+    agg_add(agg, msg, publish_summary, &ctx);
+}
+
+// Cierra las ventanas de los topics que dejaron de publicar.
+static void sweep_aggregates(Broker* broker, Shard* shard, AggStore* agg) {
+    FlushList pending = { NULL, 0, 0 };
+    AggCtx ctx = { broker, shard, &pending };
+
+    agg_flush(agg, time(NULL), publish_summary, &ctx);
+    flush_list_run(&pending);
+}
+
+// Shards donde vive un filtro: el dueno del topic si no tiene
+// wildcards, si no todos.
+static void filter_shards(Broker* broker, const char* filter, int* first, int* count) {
+    const char* path = topic_share_filter(filter);
+
+    // Un grupo compartido vive donde vive su filtro
+    if (!path)
+        path = filter;
+    if (!strpbrk(path, "+#")) {
+        *first = shard_of(broker, path);
+        *count = 1;
+    } else {
+        *first = 0;
+        *count = broker->num_loops;
+    }
+}
+
+// Lleva un (UN)SUBSCRIBE a los shards donde vive el filtro. Con 'notify'
+// el ultimo shard que lo aplica responde al cliente.
+static void shard_route_filter(Shard* shard, ShardOpType type, Connection* conn,
+                               const char* filter, int conflate, int notify, FlushList* pending) {
+    Broker* broker = shard->broker;
+    int first, count;
+
+    filter_shards(broker, filter, &first, &count);
+
+    size_t len = strnlen(filter, MAX_TOPIC_LEN - 1);
+    int* acks = NULL;
+    if (notify) {
+        acks = malloc(sizeof(int));
+        if (!acks) {
+            reply(conn, 1, type == SHARD_OP_SUBSCRIBE ? "SUBSCRIBED" : "UNSUBSCRIBED");
+        } else {
+            *acks = count;
+        }
+    }
+
+    for (int i = first; i < first + count; i++) {
+        ShardOp* op = malloc(sizeof(ShardOp) + len + 1);
+        if (!op) {
+            shard_ack(conn, acks, type);
+            continue;
+        }
+
+        op->type = type;
+        op->msg = NULL;
+        op->conn = conn;
+        op->acks = acks;
+        op->conflate = conflate;
+        memcpy(op->filter, filter, len);
+        op->filter[len] = '\0';
+        conn_retain(conn);
+
+        if (i == shard->id)
+            shard_apply(shard, op, pending);
+        else
+            shard_send(shard, i, op);
+    }
+}
+
+// Los filtros se anotan en la conexion en el shard que la lee; la
+// respuesta la manda el shard que aplica la operacion.
+static void shard_subscribe(Shard* shard, Connection* conn, Command* cmd, int conflate, FlushList* pending) {
+    if (cmd->arg_len >= MAX_TOPIC_LEN || !topic_filter_is_valid(cmd->arg)) {
+        LOG_DEBUG("[BROKER] Filtro de topic invalido '%s' (socket %d)", cmd->arg, conn->socket);
+        reply(conn, 0, "Invalid topic filter");
+        return;
+    }
+
+    // Repetido: solo se vuelve a mandar a los shards si cambia CONFLATE
+    OwnedFilter* f = *find_owned_filter(conn, cmd->arg);
+    if (f && f->conflate == conflate) {
+        reply(conn, 1, "SUBSCRIBED");
+        return;
+    }
+
+    if (f)
+        f->conflate = conflate;
+    else
+        own_filter(conn, cmd->arg, conflate);
+    LOG_DEBUG("[BROKER] Nuevo SUBSCRIBER al topic '%s' (socket %d)", cmd->arg, conn->socket);
+
+    shard_route_filter(shard, SHARD_OP_SUBSCRIBE, conn, cmd->arg, conflate, 1, pending);
+}
+
+static void shard_unsubscribe(Shard* shard, Connection* conn, Command* cmd, FlushList* pending) {
+    OwnedFilter** pp = find_owned_filter(conn, cmd->arg);
+    if (!*pp) {
+        reply(conn, 0, "Not subscribed");
+        return;
+    }
+
+    shard_route_filter(shard, SHARD_OP_UNSUBSCRIBE, conn, cmd->arg, 0, 1, pending);
+    unlink_owned_filter(conn, pp);
+
+    LOG_DEBUG("[BROKER] SUBSCRIBER dado de baja del topic '%s' (socket %d)", cmd->arg, conn->socket);
+}
+
+static void shard_remove_all_subscriptions(Shard* shard, Connection* conn) {
+    FlushList pending = { NULL, 0, 0 };
+
+    while (conn->owned_filters) {
+        shard_route_filter(shard, SHARD_OP_UNSUBSCRIBE, conn, conn->owned_filters->filter, 0, 0, &pending);
+        unlink_owned_filter(conn, &conn->owned_filters);
+    }
+
+    flush_list_run(&pending);
+}
+
+typedef struct {
+    Broker* broker;
+    Shard* shard;                  // NULL fuera del modo sharded
+    Connection* conn;
+    FlushList pending;
+    int limited;                   // PUBLISH rechazados por limite de tasa
+    StatsThread* stats;            // bloque del hilo que lee
+    uint64_t received;             // cuando se leyo (stats_now)
+} CommandCtx;
+
+// Token buckets del gateway de la conexion y del prefijo del topic. Sin
+// limites configurados no lee el reloj.
+static int admit_publish(Broker* broker, Connection* conn, const char* topic, size_t len) {
+    TokenBucket* topic_bucket = rate_limit_topic(&broker->limits, topic, len);
+
+    if (!conn->rate_bucket && !topic_bucket)
+        return 1;
+
+    uint64_t now = rate_limit_now();
+
+    if (conn->rate_bucket && !token_bucket_take(conn->rate_bucket, now))
+        return 0;
+
+    // Lo rechaza el prefijo: el gateway no pierde su token
+    if (topic_bucket && !token_bucket_take(topic_bucket, now)) {
+        if (conn->rate_bucket)
+            token_bucket_refund(conn->rate_bucket);
+        return 0;
+    }
+    return 1;
+}
+
+// Historial, suscriptores y agregados: en el shard dueno del topic o en
+// el broker.
+static void dispatch(CommandCtx* cc, Message* msg) {
+    if (cc->shard) {
+        shard_publish(cc->shard, msg, &cc->pending, cc->received);
+    } else {
+        deliver(cc->broker, msg, &cc->pending, cc->received);
+        aggregate(cc->broker, NULL, &cc->broker->agg, msg, &cc->pending);
+    }
+}
+
+static void publish(CommandCtx* cc, Command* cmd) {
+    Broker* broker = cc->broker;
+    Connection* conn = cc->conn;
+    char* topic = cmd->arg;
+    char* data = cmd->data;
+
+    // Admision antes de validar o copiar nada. Lo rechazado no gasta
+    // credito: se le devuelve al gateway al terminar la lectura.
+    if (!admit_publish(broker, conn, topic, cmd->arg_len)) {
+        cc->limited++;
+        return;
+    }
+
+    // Un gateway que publica sin credito no pierde el mensaje, pero queda
+    // contado; la proxima reposicion lo descuenta
+    if (conn->credit_window > 0 && conn->credit-- <= 0)
+        conn->credit_overruns++;
+
+    // En un frame el topic puede traer un '\0' en el medio
+    if (cmd->arg_len >= MAX_TOPIC_LEN || memchr(topic, '\0', cmd->arg_len) ||
+        !topic_name_is_valid(topic)) {
+        reply(conn, 0, "Invalid topic");
+        return;
+    }
+    if (cmd->data_len >= MAX_DATA_LEN) {
+        reply(conn, 0, "Payload too large");
+        return;
+    }
+
+    LOG_DEBUG("[BROKER] PUBLISH recibido:\n         Topic: %s\n         Data:  %.*s",
+              topic, (int)cmd->data_len, data);
+
+    // Se codifica una vez; historial y suscriptores comparten el buffer
+    Message* msg = message_create(topic, cmd->arg_len, data, cmd->data_len, time(NULL));
+    if (!msg)
+        return;
+
+    stats_add(cc->stats, STAT_MESSAGES_IN, 1);
+    dispatch(cc, msg);
+    message_release(msg);
+}
+
+// El broker 'name' en la tabla de origenes; se agrega si es nuevo.
+// Devuelve NULL si ya hay BRIDGE_MAX_ORIGINS.
+static Origin* origin_intern(Broker* broker, const char* name, size_t len) {
+    Origin* o;
+
+    if (len == 0 || len >= BROKER_NAME_LEN)
+        return NULL;
+
+    pthread_mutex_lock(&broker->mutex_origins);
+    for (o = broker->origins; o; o = o->next) {
+        if (strncmp(o->name, name, len) == 0 && o->name[len] == '\0')
+            break;
+    }
+    if (!o && broker->num_origins < BRIDGE_MAX_ORIGINS && (o = calloc(1, sizeof(Origin)))) {
+        memcpy(o->name, name, len);
+        o->next = broker->origins;
+        broker->origins = o;
+        broker->num_origins++;
+    }
+    pthread_mutex_unlock(&broker->mutex_origins);
+
+    if (!o)
+        LOG_WARN("[BRIDGE] Demasiados brokers distintos: '%.*s' no se registra", (int)len, name);
+    return o;
+}
+
+// Anota el numero 'seq' de 'o'. Devuelve 1 si ya se habia visto, o si es
+// tan viejo que quedo fuera de la ventana y no es un valor retenido: de
+// esos no se sabe, y el retenido puede ser el ultimo valor de un topic
+// que no se publica hace mucho.
+static int origin_seen(Broker* broker, Origin* o, uint64_t seq, int retained) {
+    uint64_t bit = 1ULL << (seq % 64);
+    size_t word = (size_t)(seq / 64 % (BRIDGE_SEEN_WINDOW / 64));
+    int seen;
+
+    pthread_mutex_lock(&broker->mutex_origins);
+    if (seq > o->high) {
+        // Se corre la ventana: lo que sale de ella queda libre
+        if (seq - o->high >= BRIDGE_SEEN_WINDOW) {
+            memset(o->seen, 0, sizeof(o->seen));
+        } else {
+            for (uint64_t n = o->high + 1; n < seq; n++)
+                o->seen[n / 64 % (BRIDGE_SEEN_WINDOW / 64)] &= ~(1ULL << (n % 64));
+        }
+        o->high = seq;
+        o->seen[word] |= bit;
+        seen = 0;
+    } else if (o->high - seq >= BRIDGE_SEEN_WINDOW) {
+        seen = !retained;
+    } else {
+        seen = (o->seen[word] & bit) != 0;
+        o->seen[word] |= bit;
+    }
+    pthread_mutex_unlock(&broker->mutex_origins);
+
+    return seen;
+}
+
+// Una entrega que llego por un puente saliente se publica aca como la de
+// un cliente local, marcada con su origen (ver "PUENTES ENTRE BROKERS").
+// Lo demas que manda el otro broker (las respuestas a los SUBSCRIBE) se
+// ignora y no se le contesta nada: dos brokers no se responden errores
+// entre si.
+static void bridge_receive(CommandCtx* cc, Command* cmd) {
+    Bridge* b = cc->conn->bridge;
+
+    if (cmd->type != CMD_RELAY) {
+        LOG_DEBUG("[BRIDGE] Respuesta de %s:%d: %.*s", b->host, b->port,
+                  (int)cmd->data_len, cmd->data ? cmd->data : "");
+        return;
+    }
+
+    // Saltos, origen y numero delante del payload (ver wire.h)
+    const unsigned char* p = (const unsigned char*)cmd->data;
+    size_t head = cmd->data_len >= 2 ? 2 + (size_t)p[1] + 8 : 0;
+
+    if (head == 0 || cmd->data_len < head || cmd->data_len - head >= MAX_DATA_LEN ||
+        cmd->arg_len >= MAX_TOPIC_LEN || memchr(cmd->arg, '\0', cmd->arg_len) ||
+        !topic_name_is_valid(cmd->arg) || memchr(p + 2, '\0', p[1])) {
+        LOG_WARN("[BRIDGE] Entrega invalida de %s:%d descartada", b->host, b->port);
+        return;
+    }
+
+    int retained = (p[0] & WIRE_RELAY_RETAINED) != 0;
+    int hops = p[0] & ~WIRE_RELAY_RETAINED;
+    const char* name = (const char*)p + 2;
+    size_t name_len = p[1];
+    uint64_t seq = 0;
+    for (size_t i = 2 + name_len; i < head; i++)
+        seq = (seq << 8) | p[i];
+
+    // Un mensaje propio que dio la vuelta, uno que ya llego por otro
+    // camino o que anduvo demasiado no se publica
+    Origin* origin = NULL;
+    if ((name_len == strlen(cc->broker->name) && memcmp(name, cc->broker->name, name_len) == 0) ||
+        hops == 0 || hops > BRIDGE_MAX_HOPS ||
+        !(origin = origin_intern(cc->broker, name, name_len)) ||
+        origin_seen(cc->broker, origin, seq, retained)) {
+        LOG_DEBUG("[BRIDGE] Entrega de '%.*s' (%d saltos) descartada", (int)name_len, name, hops);
+        stats_add(cc->stats, STAT_BRIDGE_DROPPED, 1);
+        return;
+    }
+
+    Message* msg = message_create(cmd->arg, cmd->arg_len, cmd->data + head, cmd->data_len - head,
+                                  time(NULL));
+    if (!msg)
+        return;
+    msg->bridged = 1;
+    msg->origin = origin;
+    msg->via = b->peer;
+    msg->seq = seq;
+    msg->hops = hops;
+
+    stats_add(cc->stats, STAT_MESSAGES_BRIDGED, 1);
+    dispatch(cc, msg);
+    message_release(msg);
+}
+
+// Otro broker se presenta como puente. Si tiene el mismo nombre es este
+// mismo (un puente hacia si mismo): se rechaza, si no cada mensaje
+// volveria duplicado. Las entregas le van en frames WIRE_RELAY, asi que
+// tiene que haber pedido HELLO BINARY.
+static void accept_bridge(Broker* broker, Connection* conn, Command* cmd) {
+    char msg[16 + BROKER_NAME_LEN];
+
+    if (cmd->arg_len == 0 || cmd->arg_len >= BROKER_NAME_LEN || memchr(cmd->arg, '\0', cmd->arg_len)) {
+        reply(conn, 0, "Invalid broker name");
+        return;
+    }
+    if (!conn->binary) {
+        reply(conn, 0, "Bridge requires binary");
+        return;
+    }
+    if (strcmp(cmd->arg, broker->name) == 0) {
+        LOG_WARN("[BRIDGE] Puente hacia si mismo rechazado (socket %d)", conn->socket);
+        reply(conn, 0, "Bridge loop");
+        return;
+    }
+
+    Origin* peer = origin_intern(broker, cmd->arg, cmd->arg_len);
+    if (!peer) {
+        reply(conn, 0, "Too many brokers");
+        return;
+    }
+
+    conn->peer = peer;
+    LOG_INFO("[BRIDGE] El broker '%s' se conecto como puente (socket %d)", cmd->arg, conn->socket);
+
+    snprintf(msg, sizeof(msg), "BRIDGE %s", broker->name);
+    reply(conn, 1, msg);
+}
+
+// "<since> <until> <limit>": segundos Unix; until = 0 es sin limite.
+static int parse_history_range(const char* data, size_t len, time_t* since, time_t* until, int* limit) {
+    char buf[64];
+    long long v[3];
+
+    if (len >= sizeof(buf))
+        return 0;
+    memcpy(buf, data, len);
+    buf[len] = '\0';
+
+    char* p = buf;
+    for (int i = 0; i < 3; i++) {
+        char* end;
+        v[i] = strtoll(p, &end, 10);
+        if (end == p)
+            return 0;
+        p = end;
+    }
+    while (*p == ' ')
+        p++;
+
+    if (*p || v[0] < 0 || v[1] < 0 || v[2] <= 0)
+        return 0;
+
+    *since = (time_t)v[0];
+    *until = v[1] > 0 ? (time_t)v[1] : (time_t)LLONG_MAX;
+    *limit = v[2] < HISTORY_MAX_RESULTS ? (int)v[2] : HISTORY_MAX_RESULTS;
+    return 1;
+}
+
+// Cada registro en el formato de la conexion: "<timestamp> <topic> <data>"
+// en texto (la linea del mensaje ya codificada), WIRE_RECORD en binario.
+static size_t history_record_len(Message* m, int binary) {
+    return binary ? WIRE_HEADER_LEN + m->topic_len + 8 + m->data_len
+                  : 21 + m->text_len;
+}
+
+static size_t put_history_record(char* out, Message* m, time_t ts, int binary) {
+    if (!binary) {
+        int n = sprintf(out, "%lld ", (long long)ts);
+        memcpy(out + n, m->text, m->text_len);
+        return n + m->text_len;
+    }
+
+    uint64_t t = (uint64_t)ts;
+    char* p = out;
+
+    wire_put_header(p, WIRE_RECORD, m->topic_len, 8 + m->data_len);
+    p += WIRE_HEADER_LEN;
+    memcpy(p, m->topic, m->topic_len);
+    p += m->topic_len;
+    for (int i = 7; i >= 0; i--)
+        *p++ = (char)((t >> (i * 8)) & 0xFF);
+    memcpy(p, m->data, m->data_len);
+    return p + m->data_len - out;
+}
+
+// HISTORY <filtro> <since> <until> <limit>: los registros que coinciden,
+// del mas viejo al mas nuevo, y "OK HISTORY <n>" al final, todo en una
+// sola respuesta. En modo sharded se leen los historiales de los shards
+// duenos (tienen sus propios locks).
+static void query_history(CommandCtx* cc, Command* cmd) {
+    Broker* broker = cc->broker;
+    Connection* conn = cc->conn;
+    time_t since, until;
+    int limit;
+
+    if (cmd->arg_len >= MAX_TOPIC_LEN || !topic_filter_is_valid(cmd->arg) || topic_share_filter(cmd->arg)) {
+        reply(conn, 0, "Invalid topic filter");
+        return;
+    }
+    if (!parse_history_range(cmd->data, cmd->data_len, &since, &until, &limit)) {
+        reply(conn, 0, "Invalid history range");
+        return;
+    }
+
+    HistoryResult res = { NULL, 0, 0, 0 };
+    int r = 0;
+
+    if (!cc->shard) {
+        r = history_collect(&broker->history, cmd->arg, since, until, limit, &res);
+    } else if (!strpbrk(cmd->arg, "+#")) {
+        Shard* owner = &broker->shards[shard_of(broker, cmd->arg)];
+        r = history_collect(&owner->history, cmd->arg, since, until, limit, &res);
+    } else {
+        for (int i = 0; i < broker->num_loops && r == 0; i++)
+            r = history_collect(&broker->shards[i].history, cmd->arg, since, until, limit, &res);
+    }
+
+    history_result_finish(&res, limit);
+
+    int binary = __atomic_load_n(&conn->binary, __ATOMIC_ACQUIRE);
+    size_t total = WIRE_HEADER_LEN + 64;
+    for (int i = 0; i < res.count; i++)
+        total += history_record_len(res.hits[i].msg, binary);
+
+    char* out = r == 0 ? malloc(total) : NULL;
+    if (!out) {
+        history_result_free(&res);
+        reply(conn, 0, "Out of memory");
+        return;
+    }
+
+    size_t len = 0;
+    for (int i = 0; i < res.count; i++)
+        len += put_history_record(out + len, res.hits[i].msg, res.hits[i].msg->timestamp, binary);
+
+    char done[32];
+    int dn = snprintf(done, sizeof(done), "HISTORY %d", res.count);
+    if (binary)
+        len += wire_encode(out + len, total - len, WIRE_OK, "", 0, done, dn);
+    else
+        len += sprintf(out + len, "OK %s\n", done);
+
+    conn_send(conn, out, len, 1);
+
+    free(out);
+    history_result_free(&res);
+}
+
+// ---------------------------------------------------------
+// Metricas: lo que cuentan los hilos (stats.h) mas el estado actual del
+// broker. Las comparten STATS y el volcado periodico.
+// ---------------------------------------------------------
+
+#define STATS_REPLY_LEN 4096
+
+static int count_gateways(Broker* broker) {
+    int n = 0;
+
+    pthread_mutex_lock(&broker->mutex_gateways);
+    for (GatewayClient* g = broker->gateways; g; g = g->next)
+        n++;
+    pthread_mutex_unlock(&broker->mutex_gateways);
+
+    return n;
+}
+
+static int count_bridges_up(Broker* broker) {
+    int n = 0;
+
+    for (Bridge* b = broker->bridges; b; b = b->next)
+        n += __atomic_load_n(&b->up, __ATOMIC_ACQUIRE) != 0;
+    return n;
+}
+
+// Los contadores de distintos hilos se leen en momentos distintos: la
+// baja puede verse antes que el alta.
+static uint64_t gauge(const StatsSnapshot* snap, StatCounter up, StatCounter down) {
+    uint64_t a = snap->counters[up];
+    uint64_t b = snap->counters[down];
+    return a > b ? a - b : 0;
+}
+
+static void visit_stats(Broker* broker, const StatsSnapshot* snap, StatsVisitFn fn, void* ctx) {
+    uint64_t topics = __atomic_load_n(&broker->history.num_topics, __ATOMIC_RELAXED);
+    uint64_t bytes = history_memory(&broker->history);
+
+    for (int i = 0; broker->shards && i < broker->num_loops; i++) {
+        topics += __atomic_load_n(&broker->shards[i].history.num_topics, __ATOMIC_RELAXED);
+        bytes += history_memory(&broker->shards[i].history);
+    }
+
+    fn("uptime_s", (uint64_t)snap->uptime, ctx);
+    fn("connections", gauge(snap, STAT_CONNECTIONS_OPENED, STAT_CONNECTIONS_CLOSED), ctx);
+    fn("gateways", (uint64_t)count_gateways(broker), ctx);
+    fn("bridges_up", (uint64_t)count_bridges_up(broker), ctx);
+    fn("subscriptions", gauge(snap, STAT_SUBSCRIPTIONS_ADDED, STAT_SUBSCRIPTIONS_REMOVED), ctx);
+    fn("history_topics", topics, ctx);
+    fn("history_bytes", bytes, ctx);
+
+    stats_foreach(snap, fn, ctx);
+}
+
+typedef struct {
+    char* out;
+    size_t len;
+    size_t cap;
+    int binary;
+    int count;
+} StatsReply;
+
+// "STAT <nombre> <valor>" en texto, WIRE_STAT en binario
+static void put_stat(const char* name, uint64_t value, void* arg) {
+    StatsReply* r = (StatsReply*)arg;
+    size_t left = r->cap - r->len;
+    size_t n;
+    char num[24];
+
+    int vn = snprintf(num, sizeof(num), "%llu", (unsigned long long)value);
+
+    if (r->binary) {
+        n = wire_encode(r->out + r->len, left, WIRE_STAT, name, strlen(name), num, vn);
+    } else {
+        int k = snprintf(r->out + r->len, left, "STAT %s %s\n", name, num);
+        n = k > 0 && (size_t)k < left ? (size_t)k : 0;
+    }
+
+    if (n > 0) {
+        r->len += n;
+        r->count++;
+    }
+}
+
+// STATS: una metrica por linea (o frame) y "OK STATS <n>", todo en una
+// sola respuesta.
+static void report_stats(CommandCtx* cc) {
+    Connection* conn = cc->conn;
+    StatsSnapshot snap;
+    char out[STATS_REPLY_LEN];
+
+    stats_collect(&cc->broker->stats, &snap);
+
+    // Se deja lugar para el OK final
+    StatsReply r = { out, 0, sizeof(out) - 64, __atomic_load_n(&conn->binary, __ATOMIC_ACQUIRE), 0 };
+    visit_stats(cc->broker, &snap, put_stat, &r);
+
+    char done[32];
+    int dn = snprintf(done, sizeof(done), "STATS %d", r.count);
+    if (r.binary)
+        r.len += wire_encode(out + r.len, sizeof(out) - r.len, WIRE_OK, "", 0, done, dn);
+    else
+        r.len += snprintf(out + r.len, sizeof(out) - r.len, "OK %s\n", done);
+
+    conn_send(conn, out, r.len, 1);
+}
+
+// Opciones despues del filtro de SUBSCRIBE (en binario, el payload):
+// nada o "CONFLATE". Devuelve 0 si hay otra cosa.
+static int subscribe_options(const Command* cmd, int* conflate) {
+    static const char opt[] = "CONFLATE";
+
+    *conflate = cmd->data_len == sizeof(opt) - 1 && memcmp(cmd->data, opt, sizeof(opt) - 1) == 0;
+    return *conflate || cmd->data_len == 0;
+}
+
+// Interpreta un comando completo de un cliente, venga de una linea de
+// texto o de un frame binario. Es comun a todos los modos del broker.
+static void process_command(CommandCtx* cc, Command* cmd) {
+    Broker* broker = cc->broker;
+    Connection* conn = cc->conn;
+
+    stats_command(cc->stats, cmd->type);
+
+    if (conn->bridge) {
+        bridge_receive(cc, cmd);
+        return;
+    }
+
+    if (cmd->type == CMD_HELLO) {
+        // SHM cambia el transporte y no el formato: despues puede venir
+        // otro HELLO (por el ring)
+        if (strcmp(cmd->arg, "SHM") == 0 && !conn->negotiated) {
+            attach_local_gateway(conn);
+            return;
+        }
+        negotiate(conn, cmd->arg);
+        conn->negotiated = 1;
+        return;
+    }
+    if (cmd->type != CMD_EMPTY)
+        conn->negotiated = 1;
+
+    switch (cmd->type) {
+
+    // ------------------- PUBLISH -------------------
+    case CMD_PUBLISH:
+        publish(cc, cmd);
+        break;
+
+    case CMD_PUBLISH_BATCH: {
+        char* pos = cmd->data;
+        char* end = cmd->data + cmd->data_len;
+        Command rec;
+        int r;
+
+        while ((r = protocol_next_record(&pos, end, &rec)) > 0)
+            publish(cc, &rec);
+
+        if (r < 0)
+            reply(conn, 0, "Malformed batch");
+        break;
+    }
+
+    // ------------------- SUBSCRIBE -------------------
+    case CMD_SUBSCRIBE: {
+        int conflate;
+
+        if (!subscribe_options(cmd, &conflate))
+            reply(conn, 0, "Invalid subscribe option");
+        else if (cc->shard)
+            shard_subscribe(cc->shard, conn, cmd, conflate, &cc->pending);
+        else if (cmd->arg_len < MAX_TOPIC_LEN && add_subscriber(broker, conn, cmd->arg, conflate)) {
+            reply(conn, 1, "SUBSCRIBED");
+            send_retained(broker, &broker->retained, conn, cmd->arg, conflate, &cc->pending);
+        } else
+            reply(conn, 0, "Invalid topic filter");
+        break;
+    }
+
+    // ------------------- UNSUBSCRIBE -------------------
+    case CMD_UNSUBSCRIBE:
+        if (cc->shard)
+            shard_unsubscribe(cc->shard, conn, cmd, &cc->pending);
+        else if (remove_subscriber(broker, conn, cmd->arg))
+            reply(conn, 1, "UNSUBSCRIBED");
+        else
+            reply(conn, 0, "Not subscribed");
+        break;
+
+    // ------------------- HISTORY -------------------
+    case CMD_HISTORY:
+        query_history(cc, cmd);
+        break;
+
+    // ------------------- STATS -------------------
+    case CMD_STATS:
+        report_stats(cc);
+        break;
+
+    // ------------------- REGISTER -------------------
+    case CMD_REGISTER:
+        if (cmd->arg_len >= MAX_GATEWAY_ID) {
+            reply(conn, 0, "Invalid gateway id");
+            return;
+        }
+        add_gateway(broker, conn, cmd->arg);
+        conn->rate_bucket = rate_limit_gateway(&broker->limits, cmd->arg);
+        reply(conn, 1, "REGISTERED");
+
+        if (broker->gateway_credit > 0 && conn->credit_window == 0) {
+            conn->credit_window = broker->gateway_credit;
+            conn->credit = conn->credit_window;
+            send_credit(conn, conn->credit);
+        }
+        break;
+
+    // ------------------- BRIDGE -------------------
+    case CMD_BRIDGE:
+        accept_bridge(broker, conn, cmd);
+        break;
+
+    case CMD_HELLO:
+    case CMD_EMPTY:
+        break;
+
+    case CMD_INVALID:
+        reply(conn, 0, "Missing arguments");
+        break;
+
+    case CMD_RELAY:               // solo por un puente saliente
+    case CMD_UNKNOWN:
+        LOG_DEBUG("[BROKER] Comando desconocido: %s", cmd->line ? cmd->line : "(frame binario)");
+        reply(conn, 0, "Unknown command");
+        break;
+    }
+}
+
+static void on_command(Command* cmd, void* arg) {
+    process_command((CommandCtx*)arg, cmd);
+}
+
+// Lee del socket directo al framer de la conexion y procesa todas las
+// comandos completos. Devuelve lo mismo que recv().
+static int read_commands(Broker* broker, Shard* shard, Connection* conn, int from_ring) {
+    size_t avail;
+    char* space = framer_space(&conn->framer, &avail);
+
+    int r = from_ring ? conn_ring_read(conn, space, avail) : conn_recv(conn, space, avail);
+    if (r <= 0)
+        return r;
+
+    StatsThread* st = stats_local(&broker->stats);
+    stats_add(st, STAT_BYTES_IN, (uint64_t)r);
+
+    CommandCtx ctx = { broker, shard, conn, { NULL, 0, 0 }, 0, st, stats_now() };
+    // A un puente no se le contesta (ver bridge_receive)
+    if (framer_commit(&conn->framer, r, on_command, &ctx) > 0 && !conn->bridge)
+        reply(conn, 0, conn->binary ? "Frame too long" : "Line too long");
+
+    // Un solo aviso por lectura, por mas PUBLISH que se hayan rechazado
+    if (ctx.limited > 0) {
+        char msg[64];
+        stats_add(st, STAT_MESSAGES_LIMITED, ctx.limited);
+        snprintf(msg, sizeof(msg), "Rate limited (%d dropped)", ctx.limited);
+        reply(conn, 0, msg);
+
+        // El gateway ya desconto el credito de lo que se rechazo
+        if (conn->credit_window > 0)
+            send_credit(conn, ctx.limited);
+    }
+
+    flush_list_run(&ctx.pending);
+    replenish_credit(conn);
+
+    return r;
+}
+
+// Lecturas del ring de un gateway local por vuelta; si queda algo el
+// lector se reavisa, para no dejar sin atender a las demas conexiones.
+#define RING_READ_BUDGET 64
+
+// Procesa lo que el gateway local dejo en su ring, igual que lo leido del
+// socket. Antes de volver a esperar se marca como dormido (conn_ring_idle)
+// y se revisa una vez mas.
+static void read_ring(Broker* broker, Shard* shard, Connection* conn) {
+    for (int n = 0; conn->ring; ) {
+        while (n < RING_READ_BUDGET && read_commands(broker, shard, conn, 1) > 0)
+            n++;
+
+        if (n == RING_READ_BUDGET) {
+            conn_ring_poke(conn);
+            return;
+        }
+        if (!conn->ring || conn_ring_idle(conn))
+            return;
+    }
+}
+
+// Se anota antes de que su hilo o loop la pueda leer (y desconectar)
+static void register_connection(Broker* broker, Connection* conn) {
+    pthread_mutex_lock(&broker->mutex_connections);
+    conn->prev_conn = NULL;
+    conn->next_conn = broker->connections;
+    if (conn->next_conn)
+        conn->next_conn->prev_conn = conn;
+    broker->connections = conn;
+    pthread_mutex_unlock(&broker->mutex_connections);
+
+    stats_add(stats_local(&broker->stats), STAT_CONNECTIONS_OPENED, 1);
+}
+
+static void unregister_connection(Broker* broker, Connection* conn) {
+    pthread_mutex_lock(&broker->mutex_connections);
+
+    if (conn->prev_conn)
+        conn->prev_conn->next_conn = conn->next_conn;
+    else if (broker->connections == conn)
+        broker->connections = conn->next_conn;
+    if (conn->next_conn)
+        conn->next_conn->prev_conn = conn->prev_conn;
+    conn->prev_conn = conn->next_conn = NULL;
+
+    pthread_mutex_unlock(&broker->mutex_connections);
+}
+
+// Se corto un puente saliente: el hilo de puentes lo reintenta
+static void bridge_lost(Bridge* b) {
+    LOG_WARN("[BRIDGE] Se corto el enlace con %s:%d: se sigue solo con lo local", b->host, b->port);
+    b->warned = 1;
+    __atomic_store_n(&b->up, 0, __ATOMIC_RELEASE);
+}
+
+// Deshace todo lo que registro la conexion y la cierra.
+static void disconnect_client(Broker* broker, Shard* shard, Connection* conn) {
+    LOG_DEBUG("[BROKER] Cliente desconectado (socket %d)", conn->socket);
+    if (conn->bridge)
+        bridge_lost(conn->bridge);
+    stats_add(stats_local(&broker->stats), STAT_CONNECTIONS_CLOSED, 1);
+    unregister_connection(broker, conn);
+
+    if (shard)
+        shard_remove_all_subscriptions(shard, conn);
+    else
+        remove_all_subscriptions(broker, conn);
+    remove_gateways(broker, conn);
+
+    conn_close(conn);
+    conn_release(conn);
+}
+
+// 'local': llego por el socket Unix
+static Connection* new_connection(Broker* broker, int client_socket, int local) {
+    Connection* conn = conn_create(client_socket, broker->out_queue_len, broker->slow_policy);
+    if (conn) {
+        conn->stats = &broker->stats;
+        conn->local = local;
+    }
+    return conn;
+}
+
+
+// =========================================================
+// THREAD DEL CLIENTE
+// =========================================================
+
+// El hilo espera lecturas con este timeout, para notar a tiempo lo que
+// otro hilo dejo encolado sin poder enviar y que el broker se detiene.
+#define CLIENT_POLL_MS 200
+
+typedef struct {
+    Broker* broker;
+    Connection* conn;
+} ClientArgs;
+
+static void* client_thread(void* arg) {
+    ClientArgs* args = (ClientArgs*)arg;
+    Broker* broker = args->broker;
+    Connection* conn = args->conn;
+    int client_socket = conn->socket;
+    free(arg);
+
+    LOG_DEBUG("[BROKER] Nuevo cliente conectado (socket %d)", client_socket);
+    register_connection(broker, conn);
+
+    // Al detenerse el broker el hilo termina sin cerrar la conexion: la
+    // puede seguir atendiendo el proceso que toma el traspaso
+	while (broker->running) {
+        struct pollfd pfd[2];
+        pfd[0].fd = client_socket;
+        pfd[0].events = POLLIN;
+        if (conn_has_pending(conn))
+            pfd[0].events |= POLLOUT;
+
+        // Un gateway local avisa por su eventfd
+        pfd[1].fd = conn->ring ? conn->ring_data_fd : -1;
+        pfd[1].events = POLLIN;
+        pfd[1].revents = 0;
+
+        int pr = poll(pfd, 2, CLIENT_POLL_MS);
+        if (pr <= 0)
+            continue;
+
+        if (pfd[1].revents & POLLIN)
+            read_ring(broker, NULL, conn);
+
+        if (pfd[0].revents & POLLOUT)
+            conn_flush(conn);
+
+        if (!(pfd[0].revents & (POLLIN | POLLHUP | POLLERR)))
+            continue;
+
+        int r = read_commands(broker, NULL, conn, 0);
+
+        if (r < 0 && errno == EINTR)
+            continue;
+
+        if (r <= 0) {
+            disconnect_client(broker, NULL, conn);
+            break;
+        }
+    }
+
+    __atomic_sub_fetch(&broker->client_threads, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static int start_client_thread(Broker* broker, Connection* conn) {
+    ClientArgs* args = malloc(sizeof(ClientArgs));
+    pthread_t th;
+
+    if (!args)
+        return -1;
+    args->broker = broker;
+    args->conn = conn;
+
+    __atomic_add_fetch(&broker->client_threads, 1, __ATOMIC_RELAXED);
+    if (pthread_create(&th, NULL, client_thread, args) != 0) {
+        __atomic_sub_fetch(&broker->client_threads, 1, __ATOMIC_RELAXED);
+        free(args);
+        return -1;
+    }
+    pthread_detach(th);
+    return 0;
+}
+
+
+// =========================================================
+// EVENT LOOPS (MODO EPOLL)
+// =========================================================
+
+#define EPOLL_MAX_EVENTS 64
+#define EPOLL_TIMEOUT_MS 500
+
+typedef struct EventLoop {
+    Broker* broker;
+    int epoll_fd;
+    pthread_t thread;
+} EventLoop;
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Una sola lectura por evento: epoll es level-triggered, asi que si queda
+// algo en el socket se vuelve a notificar y ningun cliente acapara el loop.
+// Con un gateway local el evento puede ser del socket o de su eventfd
+// (los dos apuntan a la conexion): se miran ambos.
+static void handle_readable(Broker* broker, Shard* shard, Connection* conn) {
+    if (conn->ring)
+        read_ring(broker, shard, conn);
+
+    int r = read_commands(broker, shard, conn, 0);
+
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+
+    if (r <= 0)
+        disconnect_client(broker, shard, conn);
+}
+
+static void* event_loop_thread(void* arg) {
+    EventLoop* loop = (EventLoop*)arg;
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+
+    while (loop->broker->running) {
+        int n = epoll_wait(loop->epoll_fd, events, EPOLL_MAX_EVENTS, EPOLL_TIMEOUT_MS);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            LOG_ERROR("[BROKER] epoll_wait: %s", strerror(errno));
+            break;
+        }
+
+        // Una conexion con ring puede venir dos veces en la misma vuelta
+        // (socket y eventfd): se retienen todas hasta el final, y la que
+        // ya se cerro no se vuelve a atender.
+        for (int i = 0; i < n; i++)
+            conn_retain(events[i].data.ptr);
+
+        for (int i = 0; i < n; i++) {
+            Connection* conn = events[i].data.ptr;
+
+            if (conn->closed)
+                continue;
+
+            if (events[i].events & EPOLLOUT)
+                conn_flush(conn);
+
+            if (events[i].events & EPOLLIN)
+                handle_readable(loop->broker, NULL, conn);
+            else if (events[i].events & (EPOLLERR | EPOLLHUP))
+                disconnect_client(loop->broker, NULL, conn);
+        }
+
+        for (int i = 0; i < n; i++)
+            conn_release(events[i].data.ptr);
+    }
+
+    return NULL;
+}
+
+static int start_event_loops(Broker* broker) {
+    broker->loops = calloc(broker->num_loops, sizeof(EventLoop));
+    if (!broker->loops)
+        return -1;
+
+    for (int i = 0; i < broker->num_loops; i++) {
+        EventLoop* loop = &broker->loops[i];
+        loop->broker = broker;
+        loop->epoll_fd = epoll_create1(0);
+
+        if (loop->epoll_fd < 0 ||
+            pthread_create(&loop->thread, NULL, event_loop_thread, loop) != 0) {
+            LOG_ERROR("[BROKER] No se pudo iniciar el event loop: %s", strerror(errno));
+            broker->num_loops = i;
+            return -1;
+        }
+    }
+
+    LOG_INFO("[BROKER] Modo epoll con %d event loops", broker->num_loops);
+    return 0;
+}
+
+static void stop_event_loops(Broker* broker) {
+    if (!broker->loops)
+        return;
+
+    for (int i = 0; i < broker->num_loops; i++) {
+        pthread_join(broker->loops[i].thread, NULL);
+        close(broker->loops[i].epoll_fd);
+    }
+
+    free(broker->loops);
+    broker->loops = NULL;
+}
+
+// Anota la conexion en el proximo loop (round-robin). Con un gateway
+// local ya mapeado (traspaso) tambien su eventfd, antes que el socket:
+// desde que se registra el socket el loop puede leerla, y cerrarla. Si
+// falla se la desconecta con disconnect_client().
+// Lo llaman el hilo que acepta y el de puentes
+static int add_to_loop(Broker* broker, Connection* conn) {
+    unsigned int turn = __atomic_fetch_add((unsigned int*)&broker->next_loop, 1, __ATOMIC_RELAXED);
+    EventLoop* loop = &broker->loops[turn % (unsigned int)broker->num_loops];
+
+    conn->epoll_fd = loop->epoll_fd;
+    register_connection(broker, conn);
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+
+    if (set_nonblocking(conn->socket) < 0 ||
+        (conn->ring && epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, conn->ring_data_fd, &ev) < 0) ||
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, conn->socket, &ev) < 0) {
+        LOG_ERROR("[BROKER] No se pudo registrar el cliente en epoll: %s", strerror(errno));
+        return -1;
+    }
+
+    LOG_DEBUG("[BROKER] Nuevo cliente conectado (socket %d, loop %d)",
+           conn->socket, (int)(loop - broker->loops));
+    return 0;
+}
+
+static void dispatch_to_loop(Broker* broker, int client_socket, int local) {
+    Connection* conn = new_connection(broker, client_socket, local);
+    if (!conn) {
+        close(client_socket);
+        return;
+    }
+
+    if (add_to_loop(broker, conn) < 0)
+        disconnect_client(broker, NULL, conn);
+}
+
+
+// =========================================================
+// AGREGADOS (MODOS SIN SHARDS)
+// =========================================================
+
+// Los shards cierran sus ventanas en su propio loop; en los otros modos
+// lo hace este hilo, una vez por segundo. Duerme de a poco: un traspaso
+// lo espera antes de escribir el snapshot.
+static void* agg_thread(void* arg) {
+    Broker* broker = (Broker*)arg;
+
+    for (int tick = 1; broker->running; tick++) {
+        usleep(100000);
+        if (tick % 10 == 0)
+            sweep_aggregates(broker, NULL, &broker->agg);
+    }
+
+    return NULL;
+}
+
+
+// =========================================================
+// VOLCADO DE METRICAS
+// =========================================================
+
+static void write_stat(const char* name, uint64_t value, void* arg) {
+    fprintf((FILE*)arg, "%s %llu\n", name, (unsigned long long)value);
+}
+
+static void write_rate(FILE* f, const char* name, const StatsSnapshot* cur,
+                       const StatsSnapshot* prev, StatCounter c, double secs) {
+    fprintf(f, "%s_per_s %.1f\n", name, (cur->counters[c] - prev->counters[c]) / secs);
+}
+
+// Cada stats_interval segundos agrega al archivo un bloque "# <hora>"
+// con las metricas de STATS y las tasas del periodo.
+static void* stats_thread(void* arg) {
+    Broker* broker = (Broker*)arg;
+    FILE* f = broker->stats_file;
+    StatsSnapshot* prev = calloc(1, sizeof(StatsSnapshot));
+    StatsSnapshot* cur = calloc(1, sizeof(StatsSnapshot));
+    uint64_t last = stats_now();
+
+    if (!prev || !cur) {
+        free(prev);
+        free(cur);
+        return NULL;
+    }
+
+    while (broker->running) {
+        // De a un segundo, para notar enseguida que el broker termina
+        for (int i = 0; i < broker->stats_interval && broker->running; i++)
+            sleep(1);
+        if (!broker->running)
+            break;
+
+        uint64_t now = stats_now();
+        double secs = (now - last) / 1e9;
+        last = now;
+
+        stats_collect(&broker->stats, cur);
+
+        fprintf(f, "# %lld\n", (long long)time(NULL));
+        visit_stats(broker, cur, write_stat, f);
+        write_rate(f, "messages_in", cur, prev, STAT_MESSAGES_IN, secs);
+        write_rate(f, "deliveries", cur, prev, STAT_DELIVERIES, secs);
+        write_rate(f, "bytes_in", cur, prev, STAT_BYTES_IN, secs);
+        write_rate(f, "bytes_out", cur, prev, STAT_BYTES_OUT, secs);
+        fflush(f);
+
+        StatsSnapshot* t = prev;
+        prev = cur;
+        cur = t;
+    }
+
+    free(prev);
+    free(cur);
+    return NULL;
+}
+
+static void start_stats_dump(Broker* broker) {
+    if (broker->stats_file &&
+        pthread_create(&broker->stats_thread, NULL, stats_thread, broker) == 0)
+        broker->stats_started = 1;
+}
+
+
+// =========================================================
+// SHARDS (MODO SHARDED)
+// =========================================================
+
+static int open_listener(int port, int reuse_port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(fd, BROKER_LISTEN_BACKLOG) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Socket de escucha en 'path' (se borra el de una corrida anterior).
+static int open_unix_listener(const char* path) {
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);   // largo validado en broker_listen_unix
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(fd, BROKER_LISTEN_BACKLOG) < 0 ||
+        set_nonblocking(fd) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Como add_to_loop, en el epoll del shard.
+static int shard_adopt(Shard* shard, Connection* conn) {
+    conn->epoll_fd = shard->epoll_fd;
+    register_connection(shard->broker, conn);
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+
+    if (set_nonblocking(conn->socket) < 0 ||
+        (conn->ring && epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, conn->ring_data_fd, &ev) < 0) ||
+        epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, conn->socket, &ev) < 0) {
+        LOG_ERROR("[BROKER] No se pudo registrar el cliente en epoll: %s", strerror(errno));
+        return -1;
+    }
+
+    LOG_DEBUG("[BROKER] Nuevo cliente conectado (socket %d, shard %d)", conn->socket, shard->id);
+    return 0;
+}
+
+static void shard_accept(Shard* shard, int listen_fd, int local) {
+    while (1) {
+        int client_socket = accept(listen_fd, NULL, NULL);
+        if (client_socket < 0)
+            return;
+
+        Connection* conn = new_connection(shard->broker, client_socket, local);
+        if (!conn) {
+            close(client_socket);
+            continue;
+        }
+
+        if (shard_adopt(shard, conn) < 0)
+            disconnect_client(shard->broker, shard, conn);
+    }
+}
+
+// Como event_loop_thread, mas el socket de escucha propio y la inbox.
+// El listen_fd y el wake_fd se distinguen de las conexiones por data.ptr.
+// Los eventos del shard que no son de una conexion
+static int shard_own_fd(Shard* shard, void* ptr) {
+    return ptr == &shard->listen_fd || ptr == &shard->broker->unix_socket ||
+           ptr == &shard->wake_fd;
+}
+
+static void* shard_thread(void* arg) {
+    Shard* shard = (Shard*)arg;
+    Broker* broker = shard->broker;
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+
+    while (broker->running) {
+        int n = epoll_wait(shard->epoll_fd, events, EPOLL_MAX_EVENTS, EPOLL_TIMEOUT_MS);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            LOG_ERROR("[BROKER] epoll_wait: %s", strerror(errno));
+            break;
+        }
+
+        // Como en event_loop_thread: las conexiones se retienen hasta el
+        // final de la vuelta
+        for (int i = 0; i < n; i++)
+            if (!shard_own_fd(shard, events[i].data.ptr))
+                conn_retain(events[i].data.ptr);
+
+        for (int i = 0; i < n; i++) {
+            void* ptr = events[i].data.ptr;
+
+            if (ptr == &shard->listen_fd) {
+                shard_accept(shard, shard->listen_fd, 0);
+                continue;
+            }
+            if (ptr == &broker->unix_socket) {
+                shard_accept(shard, broker->unix_socket, 1);
+                continue;
+            }
+            if (ptr == &shard->wake_fd) {
+                uint64_t count;
+                if (read(shard->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                    LOG_ERROR("[BROKER] eventfd: %s", strerror(errno));
+                continue;
+            }
+
+            Connection* conn = ptr;
+
+            if (conn->closed)
+                continue;
+
+            if (events[i].events & EPOLLOUT)
+                conn_flush(conn);
+
+            if (events[i].events & EPOLLIN)
+                handle_readable(broker, shard, conn);
+            else if (events[i].events & (EPOLLERR | EPOLLHUP))
+                disconnect_client(broker, shard, conn);
+        }
+
+        for (int i = 0; i < n; i++)
+            if (!shard_own_fd(shard, events[i].data.ptr))
+                conn_release(events[i].data.ptr);
+
+        shard_drain(shard);
+
+        time_t now = time(NULL);
+        if (now != shard->last_sweep) {
+            shard->last_sweep = now;
+            sweep_aggregates(broker, shard, &shard->agg);
+        }
+
+        shard_flush_wakes(shard);
+    }
+
+    return NULL;
+}
+
+static int watch_fd(int epoll_fd, int fd, void* ptr) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = ptr;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static int take_listener(Broker* broker, const char* kind);
+
+static int shard_init(Broker* broker, Shard* shard, int id) {
+    shard->broker = broker;
+    shard->id = id;
+    shard->wake_mask = 0;
+    shard->epoll_fd = -1;
+    shard->wake_fd = -1;
+    shard->listen_fd = -1;
+
+    topic_tree_init(&shard->subscriptions, free_subscription);
+    if (!history_init(&shard->history, broker->history.depth, broker->history.max_age))
+        return -1;
+    if (!retained_init(&shard->retained))
+        return -1;
+    if (!agg_init(&shard->agg))
+        return -1;
+
+    shard->inbox = calloc(broker->num_loops, sizeof(SpscRing));
+    if (!shard->inbox)
+        return -1;
+    for (int i = 0; i < broker->num_loops; i++) {
+        if (spsc_init(&shard->inbox[i], SHARD_CHANNEL_LEN) < 0)
+            return -1;
+    }
+
+    shard->epoll_fd = epoll_create1(0);
+    shard->wake_fd = eventfd(0, EFD_NONBLOCK);
+    shard->listen_fd = take_listener(broker, "tcp");
+    if (shard->listen_fd < 0)
+        shard->listen_fd = open_listener(broker->port, 1);
+
+    if (shard->epoll_fd < 0 || shard->wake_fd < 0 || shard->listen_fd < 0 ||
+        set_nonblocking(shard->listen_fd) < 0 ||
+        watch_fd(shard->epoll_fd, shard->listen_fd, &shard->listen_fd) < 0 ||
+        watch_fd(shard->epoll_fd, shard->wake_fd, &shard->wake_fd) < 0)
+        return -1;
+
+    // El socket Unix es uno solo: lo esperan todos los shards y el
+    // kernel despierta a uno por conexion
+    if (broker->unix_socket >= 0) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = &broker->unix_socket;
+        if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, broker->unix_socket, &ev) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static void shard_destroy(Shard* shard) {
+    int n = shard->broker->num_loops;
+
+    if (shard->inbox) {
+        for (int i = 0; i < n; i++) {
+            ShardOp* op;
+            if (!shard->inbox[i].slots)
+                continue;
+            while ((op = spsc_pop(&shard->inbox[i])) != NULL)
+                shard_drop_op(op);
+            spsc_destroy(&shard->inbox[i]);
+        }
+        free(shard->inbox);
+    }
+
+    if (shard->listen_fd >= 0)
+        close(shard->listen_fd);
+    if (shard->wake_fd >= 0)
+        close(shard->wake_fd);
+    if (shard->epoll_fd >= 0)
+        close(shard->epoll_fd);
+
+    topic_tree_destroy(&shard->subscriptions);
+    history_destroy(&shard->history);
+    if (shard->retained.buckets)
+        retained_destroy(&shard->retained);
+    if (shard->agg.buckets)
+        agg_destroy(&shard->agg);
+}
+
+static void restore_history(Broker* broker);
+static void restore_snapshot(Broker* broker);
+static void restore_connections(Broker* broker);
+static void finish_takeover(Broker* broker);
+
+static int start_shards(Broker* broker) {
+    broker->shards = calloc(broker->num_loops, sizeof(Shard));
+    if (!broker->shards)
+        return -1;
+
+    for (int i = 0; i < broker->num_loops; i++) {
+        if (shard_init(broker, &broker->shards[i], i) < 0) {
+            LOG_ERROR("[BROKER] No se pudo iniciar el shard: %s", strerror(errno));
+            for (int j = 0; j <= i; j++)
+                shard_destroy(&broker->shards[j]);
+            free(broker->shards);
+            broker->shards = NULL;
+            return -1;
+        }
+    }
+
+    // El historial recuperado del log se vuelve a cargar, ahora repartido
+    // entre los shards duenos de cada topic
+    if (broker->log) {
+        int depth = broker->history.depth;
+        int max_age = broker->history.max_age;
+
+        history_destroy(&broker->history);
+        history_init(&broker->history, depth, max_age);
+        retained_destroy(&broker->retained);
+        retained_init(&broker->retained);
+        restore_history(broker);
+    }
+
+    // Lo del snapshot y las conexiones del traspaso, antes de que los
+    // shards empiecen a leer
+    restore_snapshot(broker);
+    restore_connections(broker);
+    finish_takeover(broker);
+    broker->restored = 1;
+
+    for (int i = 0; i < broker->num_loops; i++) {
+        if (pthread_create(&broker->shards[i].thread, NULL, shard_thread, &broker->shards[i]) != 0) {
+            LOG_ERROR("[BROKER] No se pudo iniciar el shard: %s", strerror(errno));
+            broker->running = 0;
+            for (int j = 0; j < i; j++)
+                pthread_join(broker->shards[j].thread, NULL);
+            return -1;
+        }
+    }
+
+    LOG_INFO("[BROKER] Modo sharded con %d shards", broker->num_loops);
+    return 0;
+}
+
+// Los hilos ya terminaron (broker_start los espera).
+static void stop_shards(Broker* broker) {
+    if (!broker->shards)
+        return;
+
+    for (int i = 0; i < broker->num_loops; i++)
+        shard_destroy(&broker->shards[i]);
+
+    free(broker->shards);
+    broker->shards = NULL;
+}
+
+
+// =========================================================
+// PUENTES ENTRE BROKERS
+// =========================================================
+//
+// Un puente trae a este broker lo que se publica en otro: se conecta
+// como un cliente mas, se presenta con "BRIDGE <nombre>", suscribe los
+// filtros configurados y cada entrega que recibe se publica aca
+// (bridge_receive). Para federar en los dos sentidos cada broker
+// configura un puente hacia el otro.
+//
+// Inundacion sin vueltas: cada entrega a otro broker va en un frame
+// WIRE_RELAY con el broker donde se publico, su numero ahi y los enlaces
+// que lleva cruzados. El que la recibe la publica y la sigue pasando a
+// los brokers conectados a el, salvo al de origen y al que se la mando,
+// hasta BRIDGE_MAX_HOPS enlaces. Asi se propaga en cadena (con A-B y
+// B-C, C ve lo que se publica en A) y en una topologia con ciclos cada
+// broker la publica una sola vez: recuerda por origen los ultimos
+// BRIDGE_SEEN_WINDOW numeros y descarta lo que vuelve por otro camino
+// (bridge_dropped). Los numeros parten del reloj al arrancar, asi un
+// broker reiniciado no repite los de antes. Un retenido que llego por
+// un puente y se restaura de un snapshot ya no se reenvia.
+//
+// Lotes: el otro broker encola las entregas del enlace y las manda de a
+// FLUSH_IOV por sendmsg(); aca cada lectura se publica entera con un
+// solo vaciado por suscriptor (en modo sharded, un aviso por shard).
+//
+// Si el otro broker se cae este sigue atendiendo a sus clientes y el
+// hilo de puentes reintenta con espera creciente. Lo que se publico alla
+// mientras tanto no se recupera, salvo el ultimo valor de cada topic,
+// que llega como retenido al volver a suscribirse: marcado con
+// WIRE_RELAY_RETAINED, se acepta aunque su numero sea anterior a la
+// ventana de repetidos.
+
+static void set_timeout(int sock, int ms) {
+    struct timeval tv = { ms / 1000, (ms % 1000) * 1000 };
+
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+// connect() con timeout a la primera direccion del host que responda.
+// Devuelve el socket, bloqueante, o -1.
+static int bridge_dial(const Bridge* b) {
+    struct addrinfo hints, *res;
+    char port[16];
+    int sock = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%d", b->port);
+
+    int err = getaddrinfo(b->host, port, &hints, &res);
+    if (err != 0) {
+        LOG_DEBUG("[BRIDGE] %s: %s", b->host, gai_strerror(err));
+        return -1;
+    }
+
+    for (struct addrinfo* ai = res; ai && sock < 0; ai = ai->ai_next) {
+        sock = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (sock < 0)
+            continue;
+
+        int r = set_nonblocking(sock) < 0 ? -1 : connect(sock, ai->ai_addr, ai->ai_addrlen);
+        if (r < 0 && errno == EINPROGRESS) {
+            struct pollfd pfd = { sock, POLLOUT, 0 };
+            int so_error = 0;
+            socklen_t len = sizeof(so_error);
+
+            if (poll(&pfd, 1, BRIDGE_TIMEOUT_MS) == 1 &&
+                getsockopt(sock, SOL_SOCKET, SO_ERROR, &so_error, &len) == 0 && so_error == 0)
+                r = 0;
+        }
+
+        if (r < 0 || fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK) < 0) {
+            close(sock);
+            sock = -1;
+        }
+    }
+
+    freeaddrinfo(res);
+    return sock;
+}
+
+// Lee exactamente 'len' bytes (el socket tiene timeout).
+static int read_exact(int sock, char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = recv(sock, buf, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// HELLO BINARY y BRIDGE; se espera "OK BINARY" y la respuesta a BRIDGE.
+// Hasta ahi el otro broker no manda nada mas, asi que se lee lo justo.
+// Deja en 'peer' su nombre. Devuelve 0, o -1 si no respondio o no acepta
+// el puente.
+static int bridge_handshake(Broker* broker, Bridge* b, int sock, char* peer, size_t peer_cap) {
+    char buf[WIRE_MAX_FRAME];
+    size_t hello = strlen(WIRE_HELLO_BINARY);
+    size_t ok = strlen(WIRE_HELLO_OK);
+    WireHeader h;
+
+    memcpy(buf, WIRE_HELLO_BINARY, hello);
+    size_t len = hello + wire_encode(buf + hello, sizeof(buf) - hello, WIRE_BRIDGE,
+                                     broker->name, strlen(broker->name), "", 0);
+    if (send(sock, buf, len, MSG_NOSIGNAL) != (ssize_t)len)
+        return -1;
+
+    if (read_exact(sock, buf, ok) < 0 || memcmp(buf, WIRE_HELLO_OK, ok) != 0 ||
+        read_exact(sock, buf, WIRE_HEADER_LEN) < 0)
+        return -1;
+
+    size_t total = wire_decode_header(buf, WIRE_HEADER_LEN, &h);
+    if (total >= sizeof(buf) || read_exact(sock, buf + WIRE_HEADER_LEN, total - WIRE_HEADER_LEN) < 0)
+        return -1;
+
+    char* answer = buf + WIRE_HEADER_LEN + h.topic_len;
+    answer[h.payload_len] = '\0';
+
+    if (h.opcode != WIRE_OK || strncmp(answer, "BRIDGE ", 7) != 0) {
+        LOG_WARN("[BRIDGE] %s:%d no acepta el puente: %s", b->host, b->port, answer);
+        return -1;
+    }
+
+    snprintf(peer, peer_cap, "%s", answer + 7);
+    return 0;
+}
+
+// Todos los SUBSCRIBE en una sola escritura
+static int bridge_subscribe(Bridge* b, int sock) {
+    char buf[MAX_BRIDGE_FILTERS * (WIRE_HEADER_LEN + MAX_TOPIC_LEN)];
+    size_t len = 0;
+
+    for (int i = 0; i < b->num_filters; i++)
+        len += wire_encode(buf + len, sizeof(buf) - len, WIRE_SUBSCRIBE,
+                           b->filters[i], strlen(b->filters[i]), "", 0);
+
+    return send(sock, buf, len, MSG_NOSIGNAL) == (ssize_t)len ? 0 : -1;
+}
+
+// El enlace se atiende como una conexion aceptada, ya en binario. En
+// modo sharded los enlaces se reparten entre los shards.
+static void bridge_adopt(Broker* broker, Bridge* b, int sock) {
+    Shard* shard = NULL;
+    int r;
+
+    Connection* conn = new_connection(broker, sock, 0);
+    if (!conn) {
+        close(sock);
+        return;
+    }
+
+    conn->bridge = b;
+    conn->negotiated = 1;
+    conn->binary = 1;
+    conn->framer.mode = FRAMING_BINARY;
+
+    // Antes de adoptarla: su lector lo baja si la pierde
+    __atomic_store_n(&b->up, 1, __ATOMIC_RELEASE);
+
+    if (broker->shards) {
+        shard = &broker->shards[broker->next_bridge_shard++ % broker->num_loops];
+        r = shard_adopt(shard, conn);
+    } else if (broker->mode == BROKER_MODE_EPOLL) {
+        r = add_to_loop(broker, conn);
+    } else {
+        r = start_client_thread(broker, conn);
+    }
+
+    if (r < 0)
+        disconnect_client(broker, shard, conn);
+}
+
+static void bridge_open(Broker* broker, Bridge* b) {
+    char peer[BROKER_NAME_LEN];
+    time_t now = time(NULL);
+
+    int sock = bridge_dial(b);
+    if (sock >= 0) {
+        set_timeout(sock, BRIDGE_TIMEOUT_MS);
+        if (bridge_handshake(broker, b, sock, peer, sizeof(peer)) < 0 ||
+            !(b->peer = origin_intern(broker, peer, strlen(peer))) ||
+            bridge_subscribe(b, sock) < 0) {
+            close(sock);
+            sock = -1;
+        }
+    }
+
+    if (sock < 0) {
+        if (!b->warned)
+            LOG_WARN("[BRIDGE] Sin enlace con %s:%d: se sigue solo con lo local", b->host, b->port);
+        b->warned = 1;
+        b->next_attempt = now + b->backoff;
+        b->backoff = b->backoff * 2 < BRIDGE_MAX_BACKOFF ? b->backoff * 2 : BRIDGE_MAX_BACKOFF;
+        return;
+    }
+
+    LOG_INFO("[BRIDGE] Enlace con '%s' (%s:%d), %d filtros", peer, b->host, b->port, b->num_filters);
+    set_timeout(sock, 0);
+    b->warned = 0;
+    b->backoff = 1;
+    b->next_attempt = now + 1;    // uno que se corta enseguida no se reabre en cada vuelta
+
+    bridge_adopt(broker, b, sock);
+}
+
+// Abre los puentes que no tienen enlace. Duerme de a poco, como
+// agg_thread, para notar que el broker se detiene.
+static void* bridge_thread(void* arg) {
+    Broker* broker = (Broker*)arg;
+
+    while (broker->running) {
+        time_t now = time(NULL);
+
+        for (Bridge* b = broker->bridges; b && broker->running; b = b->next) {
+            if (!__atomic_load_n(&b->up, __ATOMIC_ACQUIRE) && now >= b->next_attempt)
+                bridge_open(broker, b);
+        }
+        usleep(100000);
+    }
+
+    return NULL;
+}
+
+static void start_bridges(Broker* broker) {
+    if (!broker->bridges)
+        return;
+
+    if (pthread_create(&broker->bridge_thread, NULL, bridge_thread, broker) == 0)
+        broker->bridge_started = 1;
+    else
+        LOG_ERROR("[BRIDGE] No se pudo crear el hilo de puentes");
+}
+
+// Antes de detener loops o shards: el hilo puede estar adoptando un enlace
+static void stop_bridges(Broker* broker) {
+    if (broker->bridge_started)
+        pthread_join(broker->bridge_thread, NULL);
+    broker->bridge_started = 0;
+}
+
+
+
+// =========================================================
+// SNAPSHOT Y TRASPASO
+// =========================================================
+//
+// El snapshot guarda el historial reciente y los valores retenidos de
+// cada topic (snapshot.h). Se escribe cada snapshot_interval segundos y
+// al salir, y se carga con mmap al arrancar: los primeros SUBSCRIBE y
+// HISTORY ya encuentran los datos, sin reconstruirlos desde el log.
+//
+// El traspaso reemplaza un proceso por otro en el mismo host sin cortar
+// a los clientes. El broker viejo espera en un socket Unix de control
+// (handoff_path); el nuevo se conecta, pide "HANDOFF <ruta>" y el viejo:
+//
+//   1. deja de aceptar y detiene sus hilos (las conexiones siguen
+//      abiertas en el kernel)
+//   2. escribe en <ruta> un snapshot con, ademas, los sockets de escucha
+//      y cada conexion: formato, framer con la entrada a medio leer,
+//      credito, gateways, filtros suscriptos y la salida sin enviar
+//   3. pasa todos los descriptores por el socket de control
+//
+// Los puentes salientes no se pasan: el proceso nuevo los vuelve a abrir.
+//
+// El broker no tiene sesiones: el indice de suscripciones es el de las
+// conexiones vivas, y viaja con ellas. Los descriptores se referencian
+// por su posicion en lo que se paso.
+
+typedef enum {
+    SNAP_HISTORY = 1,             // clave topic, datos payload, valor timestamp
+    SNAP_RETAINED,                // igual
+    SNAP_LISTENER,                // clave "tcp" o "unix", valor descriptor
+    SNAP_CONNECTION,              // datos SnapConnection + framer, valor descriptor
+    SNAP_GATEWAY,                 // clave id (de la ultima conexion)
+    SNAP_FILTER,                  // clave filtro, valor conflate
+    SNAP_PENDING,                 // datos: salida sin enviar
+    SNAP_PEER,                    // clave: el otro broker de la conexion (BRIDGE)
+    SNAP_BRIDGED                  // como SNAP_RETAINED, llego por un puente
+} SnapType;
+
+// Con 'ring' los descriptores del gateway local (memfd, data, space)
+// siguen al del socket.
+typedef struct {
+    int32_t local;
+    int32_t binary;
+    int32_t negotiated;
+    int32_t credit_window;
+    int32_t credit;
+    int32_t ring;
+    int32_t framer_mode;
+    int32_t framer_discarding;
+    uint32_t framer_skip;
+    uint32_t input_len;           // bytes del framer, a continuacion
+} SnapConnection;
+
+// Lo recibido del proceso anterior. Cada etapa del arranque toma sus
+// descriptores (quedan en -1); los que sobran se cierran al final.
+typedef struct Takeover {
+    SnapshotReader snap;
+    int* fds;
+    int num_fds;
+    int temporary;                // el snapshot se borra al terminar
+    char path[SNAPSHOT_PATH_LEN];
+} Takeover;
+
+typedef struct {
+    int* fds;
+    int count;
+    int cap;
+    int error;
+} FdList;
+
+static int fd_list_add(FdList* l, int fd) {
+    if (l->count == l->cap) {
+        int cap = l->cap ? l->cap * 2 : 64;
+        int* fds = realloc(l->fds, cap * sizeof(int));
+        if (!fds) {
+            l->error = 1;
+            return -1;
+        }
+        l->fds = fds;
+        l->cap = cap;
+    }
+    l->fds[l->count] = fd;
+    return l->count++;
+}
+
+// ------------------- Escritura -------------------
+
+// history_foreach da cada topic del mensaje mas nuevo al mas viejo: se
+// juntan los de un topic y se escriben al reves, en orden de llegada.
+typedef struct {
+    SnapshotWriter* w;
+    const char* topic;
+    Message** msgs;
+    int count;
+    int cap;
+} HistoryDump;
+
+static void dump_topic(HistoryDump* d) {
+    while (d->count > 0) {
+        Message* m = d->msgs[--d->count];
+        snapshot_put(d->w, SNAP_HISTORY, m->topic, m->topic_len,
+                     m->data, m->data_len, NULL, 0, m->timestamp);
+        message_release(m);
+    }
+}
+
+static void dump_history_message(const char* topic, Message* msg, void* arg) {
+    HistoryDump* d = (HistoryDump*)arg;
+
+    if (topic != d->topic) {
+        dump_topic(d);
+        d->topic = topic;
+    }
+
+    if (d->count == d->cap) {
+        int cap = d->cap ? d->cap * 2 : 64;
+        Message** msgs = realloc(d->msgs, cap * sizeof(Message*));
+        if (!msgs) {
+            d->w->error = 1;
+            return;
+        }
+        d->msgs = msgs;
+        d->cap = cap;
+    }
+
+    message_retain(msg);
+    d->msgs[d->count++] = msg;
+}
+
+// Se conserva la marca de puente: al volver a suscribirse otro broker no
+// recibe como propio lo que le llego a este de el
+static void dump_retained(Message* msg, void* arg) {
+    snapshot_put((SnapshotWriter*)arg, msg->bridged ? SNAP_BRIDGED : SNAP_RETAINED, msg->topic, msg->topic_len,
+                 msg->data, msg->data_len, NULL, 0, msg->timestamp);
+}
+
+static void dump_messages(SnapshotWriter* w, HistoryStore* history, RetainedStore* retained) {
+    HistoryDump d = { w, NULL, NULL, 0, 0 };
+
+    history_foreach(history, dump_history_message, &d);
+    dump_topic(&d);
+    free(d.msgs);
+
+    retained_foreach(retained, dump_retained, w);
+}
+
+static void dump_listener(SnapshotWriter* w, FdList* fds, const char* kind, int fd) {
+    if (fd < 0)
+        return;
+
+    int idx = fd_list_add(fds, fd);
+    if (idx >= 0)
+        snapshot_put(w, SNAP_LISTENER, kind, strlen(kind), NULL, 0, NULL, 0, idx);
+}
+
+// Con los hilos detenidos: nadie mas toca la conexion.
+static void dump_connection(SnapshotWriter* w, FdList* fds, Connection* conn) {
+    SnapConnection sc;
+
+    memset(&sc, 0, sizeof(sc));
+    sc.local = conn->local;
+    sc.binary = conn->binary;
+    sc.negotiated = conn->negotiated;
+    sc.credit_window = conn->credit_window;
+    sc.credit = conn->credit;
+    sc.ring = conn->ring != NULL;
+    sc.framer_mode = conn->framer.mode;
+    sc.framer_discarding = conn->framer.discarding;
+    sc.framer_skip = (uint32_t)conn->framer.skip;
+    sc.input_len = (uint32_t)conn->framer.len;
+
+    int idx = fd_list_add(fds, conn->socket);
+    if (sc.ring) {
+        fd_list_add(fds, conn->ring_mem_fd);
+        fd_list_add(fds, conn->ring_data_fd);
+        fd_list_add(fds, conn->ring_space_fd);
+    }
+    if (fds->error)
+        return;
+
+    snapshot_put(w, SNAP_CONNECTION, NULL, 0, &sc, sizeof(sc),
+                 conn->framer.buf, conn->framer.len, idx);
+
+    for (GatewayClient* g = conn->owned_gateways; g; g = g->owner_next)
+        snapshot_put(w, SNAP_GATEWAY, g->id, strlen(g->id), NULL, 0, NULL, 0, 0);
+
+    if (conn->peer)
+        snapshot_put(w, SNAP_PEER, conn->peer->name, strlen(conn->peer->name), NULL, 0, NULL, 0, 0);
+
+    for (OwnedFilter* f = conn->owned_filters; f; f = f->next)
+        snapshot_put(w, SNAP_FILTER, f->filter, strlen(f->filter), NULL, 0, NULL, 0, f->conflate);
+
+    size_t len;
+    char* out = conn_take_output(conn, &len);
+    if (out)
+        snapshot_put(w, SNAP_PENDING, NULL, 0, out, len, NULL, 0, 0);
+    free(out);
 }
 
-static void add_subscriber(Broker* broker, int socket, const char* topic) {
-    SubscriberClient* s = malloc(sizeof(SubscriberClient));
-    s->socket = socket;
-    strncpy(s->topic, topic, MAX_TOPIC_LEN);
-    s->next = NULL;
+// Con 'fds' es un traspaso: van ademas los sockets de escucha y las
+// conexiones, y sus descriptores quedan en 'fds' en el orden en que se
+// referencian.
+static int write_snapshot(Broker* broker, const char* path, FdList* fds, int* num_conns) {
+    SnapshotWriter w;
 
-    pthread_mutex_lock(&broker->mutex_subscribers);
-    s->next = broker->subscribers;
-    broker->subscribers = s;
-    pthread_mutex_unlock(&broker->mutex_subscribers);
+    if (snapshot_begin(&w, path) < 0)
+        return -1;
+
+    if (fds) {
+        if (broker->shards) {
+            for (int i = 0; i < broker->num_loops; i++)
+                dump_listener(&w, fds, "tcp", broker->shards[i].listen_fd);
+        } else {
+            dump_listener(&w, fds, "tcp", broker->server_socket);
+        }
+        dump_listener(&w, fds, "unix", broker->unix_socket);
+
+        pthread_mutex_lock(&broker->mutex_connections);
+        for (Connection* c = broker->connections; c; c = c->next_conn) {
+            if (c->bridge)
+                continue;
+            dump_connection(&w, fds, c);
+            (*num_conns)++;
+        }
+        pthread_mutex_unlock(&broker->mutex_connections);
+
+        if (fds->error)
+            w.error = 1;
+    }
 
-    printf("[BROKER] Nuevo SUBSCRIBER al topic '%s' (socket %d)\n", topic, socket);
+    if (broker->shards) {
+        for (int i = 0; i < broker->num_loops; i++)
+            dump_messages(&w, &broker->shards[i].history, &broker->shards[i].retained);
+    } else {
+        dump_messages(&w, &broker->history, &broker->retained);
+    }
+
+    return snapshot_commit(&w);
 }
 
-static void save_message(Broker* broker, const char* topic, const char* data) {
-    TopicMessage* m = malloc(sizeof(TopicMessage));
-    strncpy(m->topic, topic, MAX_TOPIC_LEN);
-    strncpy(m->data, data, MAX_DATA_LEN);
-    m->timestamp = time(NULL);
-    m->next = NULL;
+static void save_snapshot(Broker* broker) {
+    uint64_t start = stats_now();
 
-    pthread_mutex_lock(&broker->mutex_history);
-    m->next = broker->history;
-    broker->history = m;
-    pthread_mutex_unlock(&broker->mutex_history);
+    if (write_snapshot(broker, broker->snapshot_path, NULL, NULL) < 0) {
+        LOG_ERROR("[BROKER] No se pudo escribir el snapshot '%s': %s",
+                  broker->snapshot_path, strerror(errno));
+        return;
+    }
+    LOG_DEBUG("[BROKER] Snapshot escrito en %.1f ms", (stats_now() - start) / 1e6);
 }
 
+// Como stats_thread: duerme de a un segundo para notar que el broker se
+// detiene. El ultimo snapshot lo escribe broker_cleanup().
+static void* snapshot_thread(void* arg) {
+    Broker* broker = (Broker*)arg;
 
-// =========================================================
-// THREAD DEL CLIENTE
-// =========================================================
+    while (broker->running) {
+        for (int i = 0; i < broker->snapshot_interval && broker->running; i++)
+            sleep(1);
+        if (broker->running)
+            save_snapshot(broker);
+    }
+    return NULL;
+}
 
-typedef struct {
-    Broker* broker;
-    int client_socket;
-} ClientArgs;
+static void start_snapshots(Broker* broker) {
+    if (!broker->snapshot_path || broker->snapshot_interval == 0)
+        return;
+    if (pthread_create(&broker->snapshot_thread, NULL, snapshot_thread, broker) == 0)
+        broker->snapshot_started = 1;
+}
 
-static void* client_thread(void* arg) {
-    ClientArgs* args = (ClientArgs*)arg;
-    Broker* broker = args->broker;
-    int client_socket = args->client_socket;
-    free(arg);
+// ------------------- Carga -------------------
 
-    char buffer[1024];
+enum {
+    RESTORE_HISTORY = 1,
+    RESTORE_RETAINED = 2,
+    RESTORE_IF_ABSENT = 4,        // el retenido solo si el topic no tiene
+    RESTORE_BRIDGED = 8           // llego por un puente
+};
 
-    printf("[BROKER] Nuevo cliente conectado (socket %d)\n", client_socket);
+// Guarda un mensaje recuperado (del log o del snapshot) en el historial
+// y/o como valor retenido, en el broker o en el shard dueno del topic.
+static void store_restored(Broker* broker, const char* topic, size_t topic_len,
+                           const char* data, size_t data_len, time_t timestamp, int what) {
+    if (topic_len >= MAX_TOPIC_LEN || data_len >= MAX_DATA_LEN)
+        return;
 
-	while (1) {
-        memset(buffer, 0, sizeof(buffer));
-        int r = recv(client_socket, buffer, sizeof(buffer), 0);
+    Message* msg = message_create(topic, topic_len, data, data_len, timestamp);
+    if (!msg)
+        return;
+    msg->bridged = (what & RESTORE_BRIDGED) != 0;
 
-        if (r <= 0) {
-            printf("[BROKER] Cliente desconectado (socket %d)\n", client_socket);
-            close(client_socket);
-            return NULL;
+    HistoryStore* history = &broker->history;
+    RetainedStore* retained = &broker->retained;
+    if (broker->shards) {
+        Shard* shard = &broker->shards[shard_of(broker, msg->topic)];
+        history = &shard->history;
+        retained = &shard->retained;
+    }
+
+    if (what & RESTORE_HISTORY)
+        history_append(history, msg);
+    if ((what & RESTORE_RETAINED) &&
+        (!(what & RESTORE_IF_ABSENT) || !retained_has(retained, msg->topic)))
+        retained_set(retained, msg);
+    message_release(msg);
+}
+
+// Con log persistente el historial ya se recupero de ahi: del snapshot
+// solo se toman los retenidos de los topics que el log no trajo.
+static int restore_messages(Broker* broker, SnapshotReader* r) {
+    SnapshotEntry e;
+    int n = 0;
+
+    snapshot_rewind(r);
+    while (snapshot_next(r, &e)) {
+        if (e.type == SNAP_HISTORY && !broker->log)
+            store_restored(broker, e.key, e.key_len, e.data, e.data_len, e.value, RESTORE_HISTORY);
+        else if (e.type == SNAP_RETAINED || e.type == SNAP_BRIDGED)
+            store_restored(broker, e.key, e.key_len, e.data, e.data_len, e.value,
+                           RESTORE_RETAINED | (broker->log ? RESTORE_IF_ABSENT : 0) |
+                           (e.type == SNAP_BRIDGED ? RESTORE_BRIDGED : 0));
+        else
+            continue;
+        n++;
+    }
+    return n;
+}
+
+// El del traspaso, o el de snapshot_path. En modo sharded se llama con
+// los shards ya creados, y cada topic va a su dueno.
+static void restore_snapshot(Broker* broker) {
+    SnapshotReader own;
+    SnapshotReader* r = &own;
+    uint64_t start = stats_now();
+
+    if (broker->takeover) {
+        r = &broker->takeover->snap;
+    } else {
+        if (!broker->snapshot_path)
+            return;
+        errno = 0;
+        if (snapshot_open(&own, broker->snapshot_path) < 0) {
+            if (errno != ENOENT)
+                LOG_WARN("[BROKER] Se ignora el snapshot '%s': no es valido", broker->snapshot_path);
+            return;
         }
+    }
+
+    int n = restore_messages(broker, r);
+    if (r == &own)
+        snapshot_close(&own);
+
+    LOG_INFO("[BROKER] Snapshot cargado: %d mensajes en %.1f ms", n, (stats_now() - start) / 1e6);
+}
+
+// ------------------- Traspaso: proceso nuevo -------------------
+
+// Si hay un broker atendiendo en handoff_path, le pide sus sockets y su
+// estado. Devuelve 0 (tambien si no habia ninguno), o -1 si el traspaso
+// empezo y fallo.
+static int take_over(Broker* broker) {
+    struct sockaddr_un addr;
+    char req[SNAPSHOT_PATH_LEN + 16];
+
+    if (!broker->handoff_path)
+        return 0;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, broker->handoff_path);   // largo validado en broker_enable_handoff
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        return 0;
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return 0;
+    }
+
+    Takeover* t = calloc(1, sizeof(Takeover));
+    if (!t) {
+        close(sock);
+        return -1;
+    }
+
+    // Sin snapshot propio se usa uno temporal junto al socket de control
+    t->temporary = broker->snapshot_path == NULL;
+    if (t->temporary)
+        snprintf(t->path, sizeof(t->path), "%s.snap", broker->handoff_path);
+    else
+        snprintf(t->path, sizeof(t->path), "%s", broker->snapshot_path);
+
+    LOG_INFO("[BROKER] Tomando el traspaso del broker en %s", broker->handoff_path);
+    uint64_t start = stats_now();
+
+    int len = snprintf(req, sizeof(req), "HANDOFF %s\n", t->path);
+    if (send(sock, req, len, MSG_NOSIGNAL) != len ||
+        (t->num_fds = snapshot_recv_fds(sock, &t->fds)) < 0 ||
+        snapshot_open(&t->snap, t->path) < 0) {
+        LOG_ERROR("[BROKER] Fallo el traspaso desde %s", broker->handoff_path);
+        for (int i = 0; i < t->num_fds; i++)
+            close(t->fds[i]);
+        free(t->fds);
+        free(t);
+        close(sock);
+        return -1;
+    }
+    close(sock);
+
+    broker->takeover = t;
+    LOG_INFO("[BROKER] Recibidos %d descriptores en %.1f ms", t->num_fds, (stats_now() - start) / 1e6);
+    return 0;
+}
+
+static int take_fd(Takeover* t, int64_t idx) {
+    if (idx < 0 || idx >= t->num_fds)
+        return -1;
+
+    int fd = t->fds[idx];
+    t->fds[idx] = -1;
+    return fd;
+}
+
+// Proximo socket de escucha de ese tipo que paso el proceso anterior, o -1.
+static int take_listener(Broker* broker, const char* kind) {
+    Takeover* t = broker->takeover;
+    SnapshotEntry e;
+
+    if (!t)
+        return -1;
+
+    snapshot_rewind(&t->snap);
+    while (snapshot_next(&t->snap, &e)) {
+        if (e.type != SNAP_LISTENER || e.key_len != strlen(kind) || memcmp(e.key, kind, e.key_len) != 0)
+            continue;
+
+        int fd = take_fd(t, e.value);
+        if (fd >= 0)
+            return fd;
+    }
+    return -1;
+}
 
-        // ------------------- REGISTER -------------------
-        if (strncmp(buffer, "REGISTER GATEWAY", 16) == 0) {
-            char id[64];
-            sscanf(buffer, "REGISTER GATEWAY %s", id);
-            add_gateway(broker, client_socket, id);
-            send(client_socket, "OK REGISTERED\n", 14, 0);
+static Connection* restore_connection(Broker* broker, Takeover* t, const SnapshotEntry* e) {
+    SnapConnection sc;
+
+    if (e->data_len < sizeof(sc))
+        return NULL;
+    memcpy(&sc, e->data, sizeof(sc));
+    if (sc.input_len > FRAMER_BUF_LEN || sc.input_len != e->data_len - sizeof(sc))
+        return NULL;
+
+    int fd = take_fd(t, e->value);
+    if (fd < 0)
+        return NULL;
+
+    Connection* conn = new_connection(broker, fd, sc.local);
+    if (!conn) {
+        close(fd);
+        return NULL;
+    }
+
+    conn->binary = sc.binary;
+    conn->negotiated = sc.negotiated;
+    conn->credit_window = sc.credit_window;
+    conn->credit = sc.credit;
+    conn->framer.mode = sc.framer_mode == FRAMING_BINARY ? FRAMING_BINARY : FRAMING_TEXT;
+    conn->framer.discarding = sc.framer_discarding;
+    conn->framer.skip = sc.framer_skip;
+    conn->framer.len = sc.input_len;
+    memcpy(conn->framer.buf, e->data + sizeof(sc), sc.input_len);
+
+    // El ring se vuelve a mapear: el gateway sigue escribiendo en el mismo
+    if (sc.ring) {
+        for (int i = 0; i < SHM_RING_FDS; i++) {
+            int rfd = take_fd(t, e->value + 1 + i);
+            if (rfd >= 0)
+                conn->passed_fds[conn->num_passed_fds++] = rfd;
+        }
+        if (conn_attach_ring(conn) < 0) {
+            LOG_WARN("[BROKER] No se pudo recuperar el ring de un gateway local (socket %d)", fd);
+            conn_close(conn);
+            conn_release(conn);
+            return NULL;
         }
+    }
+
+    return conn;
+}
+
+// Todavia no hay lectores: el filtro va directo al arbol vigente, o al
+// de cada shard donde vive.
+static void restore_subscription(Broker* broker, Connection* conn, const char* filter, int conflate) {
+    if (!topic_filter_is_valid(filter) || *find_owned_filter(conn, filter))
+        return;
 
-        // ------------------- SUBSCRIBE -------------------
-        else if (strncmp(buffer, "SUBSCRIBE", 9) == 0) {
-            char* line = strtok(buffer, "\n");
+    if (broker->shards) {
+        int first, count;
+        filter_shards(broker, filter, &first, &count);
+        for (int i = first; i < first + count; i++)
+            shard_add_subscription(&broker->shards[i], conn, filter, conflate);
+    } else {
+        SubscriberClient* s = calloc(1, sizeof(SubscriberClient));
+        if (!s)
+            return;
 
-		    while (line != NULL) {
-		        if (strncmp(line, "SUBSCRIBE", 9) == 0) {
-		            char topic[128];
-		            sscanf(line, "SUBSCRIBE %s", topic);
-		            add_subscriber(broker, client_socket, topic);
-		            send(client_socket, "OK SUBSCRIBED\n", 14, 0);
-		        }
-		        line = strtok(NULL, "\n");
-		    }
+        s->conn = conn;
+        s->conflate = conflate;
+        strcpy(s->topic, filter);     // mas corto que MAX_TOPIC_LEN
+        conn_retain(conn);
+
+        if (topic_tree_add(broker->subscriptions, s) != 1) {
+            conn_release(conn);
+            free(s);
+            return;
         }
+    }
+
+    own_filter(conn, filter, conflate);
+}
 
-        // ------------------- PUBLISH -------------------
-        else if (strncmp(buffer, "PUBLISH", 7) == 0) {
-            char topic[128], data[512];
-            sscanf(buffer, "PUBLISH %s %512[^\n]", topic, data);
+typedef struct {
+    Connection* conn;
+    const char* pending;          // salida sin enviar (en el mapeo)
+    size_t pending_len;
+} RestoredConn;
 
-            printf("[BROKER] PUBLISH recibido:\n");
-            printf("         Topic: %s\n", topic);
-            printf("         Data:  %s\n\n", data);
+// Recrea las conexiones del proceso anterior: primero todas con sus
+// gateways, filtros y la salida que faltaba enviarles, sin nadie que
+// publique; despues se reparten entre hilos, loops o shards.
+static void restore_connections(Broker* broker) {
+    Takeover* t = broker->takeover;
+    RestoredConn* list = NULL;
+    RestoredConn* cur = NULL;
+    int count = 0, cap = 0;
+    SnapshotEntry e;
+    char key[MAX_TOPIC_LEN];
 
-            save_message(broker, topic, data);
+    if (!t)
+        return;
 
-            // Reenviar a suscriptores
-            pthread_mutex_lock(&broker->mutex_subscribers);
-            SubscriberClient* s = broker->subscribers;
+    snapshot_rewind(&t->snap);
+    while (snapshot_next(&t->snap, &e)) {
+        if (e.type == SNAP_CONNECTION) {
+            cur = NULL;
+            Connection* conn = restore_connection(broker, t, &e);
+            if (!conn)
+                continue;
 
-            while (s != NULL) {
-                if (strcmp(s->topic, topic) == 0) {
-                    char msg[1024];
-                    snprintf(msg, sizeof(msg), "%s %s\n", topic, data);
-                    send(s->socket, msg, strlen(msg), 0);
+            if (count == cap) {
+                int grown_cap = cap ? cap * 2 : 64;
+                RestoredConn* grown = realloc(list, grown_cap * sizeof(RestoredConn));
+                if (!grown) {
+                    conn_close(conn);
+                    conn_release(conn);
+                    continue;
                 }
-                s = s->next;
+                list = grown;
+                cap = grown_cap;
             }
-            pthread_mutex_unlock(&broker->mutex_subscribers);
+
+            cur = &list[count++];
+            cur->conn = conn;
+            cur->pending = NULL;
+            cur->pending_len = 0;
+            continue;
+        }
+
+        if (!cur || e.key_len >= sizeof(key))
+            continue;
+        memcpy(key, e.key, e.key_len);
+        key[e.key_len] = '\0';
+
+        switch (e.type) {
+        case SNAP_GATEWAY:
+            if (e.key_len == 0 || e.key_len >= MAX_GATEWAY_ID)
+                break;
+            // El primero es el ultimo que registro: el que la limita
+            if (!cur->conn->owned_gateways)
+                cur->conn->rate_bucket = rate_limit_gateway(&broker->limits, key);
+            add_gateway(broker, cur->conn, key);
+            break;
+
+        case SNAP_FILTER:
+            restore_subscription(broker, cur->conn, key, e.value != 0);
+            break;
+
+        case SNAP_PEER:
+            cur->conn->peer = origin_intern(broker, key, e.key_len);
+            break;
+
+        case SNAP_PENDING:
+            cur->pending = e.data;
+            cur->pending_len = e.data_len;
+            break;
+        }
+    }
+
+    // Toda la salida pendiente antes de adoptar la primera: un gateway
+    // ya adoptado podria entregarle algo nuevo a una que todavia no
+    for (int i = 0; i < count; i++) {
+        if (list[i].pending_len > 0)
+            conn_send(list[i].conn, list[i].pending, list[i].pending_len, 1);
+    }
+
+    for (int i = 0; i < count; i++) {
+        Connection* conn = list[i].conn;
+        Shard* shard = broker->shards ? &broker->shards[i % broker->num_loops] : NULL;
+        int r;
+
+        // El gateway local pudo haber escrito sin avisar (el proceso
+        // viejo figuraba despierto): el eventfd queda listo para leer
+        if (conn->ring)
+            conn_ring_poke(conn);
+
+        // Su lector puede cerrarla apenas la adopta
+        conn_retain(conn);
+        if (shard)
+            r = shard_adopt(shard, conn);
+        else if (broker->mode == BROKER_MODE_EPOLL)
+            r = add_to_loop(broker, conn);
+        else
+            r = start_client_thread(broker, conn);
+
+        // Lo que no salio de una vez espera a EPOLLOUT
+        if (r < 0)
+            disconnect_client(broker, shard, conn);
+        else
+            conn_flush(conn);
+        conn_release(conn);
+    }
+
+    if (count > 0)
+        LOG_INFO("[BROKER] %d conexiones recuperadas del proceso anterior", count);
+    free(list);
+}
+
+// Cierra lo que no se uso (otro modo, o menos shards que antes).
+static void finish_takeover(Broker* broker) {
+    Takeover* t = broker->takeover;
+    int unused = 0;
+
+    if (!t)
+        return;
+
+    for (int i = 0; i < t->num_fds; i++) {
+        if (t->fds[i] >= 0) {
+            close(t->fds[i]);
+            unused++;
+        }
+    }
+    if (unused > 0)
+        LOG_WARN("[BROKER] Se cierran %d descriptores del traspaso sin usar", unused);
+
+    snapshot_close(&t->snap);
+    if (t->temporary)
+        unlink(t->path);
+    free(t->fds);
+    free(t);
+    broker->takeover = NULL;
+}
+
+// ------------------- Traspaso: proceso viejo -------------------
+
+// Una linea "HANDOFF <ruta>\n"; el que no la manda en un segundo no
+// detiene al broker.
+static int read_handoff_request(int sock, char* path, size_t cap) {
+    char line[SNAPSHOT_PATH_LEN + 16];
+    struct timeval tv = { 1, 0 };
+    size_t len = 0;
+
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    while (len < sizeof(line) - 1) {
+        if (recv(sock, line + len, 1, 0) <= 0)
+            return -1;
+        if (line[len] == '\n')
+            break;
+        len++;
+    }
+    line[len] = '\0';
+
+    if (strncmp(line, "HANDOFF ", 8) != 0 || line[8] == '\0' || strlen(line + 8) >= cap)
+        return -1;
+    strcpy(path, line + 8);
+    return 0;
+}
+
+// Espera en el socket de control a que otro proceso pida el traspaso y
+// detiene el broker; broker_start() lo completa al salir de su loop.
+static void* handoff_thread(void* arg) {
+    Broker* broker = (Broker*)arg;
+    struct pollfd pfd = { broker->handoff_socket, POLLIN, 0 };
+
+    while (broker->running) {
+        if (poll(&pfd, 1, EPOLL_TIMEOUT_MS) <= 0)
+            continue;
+
+        int peer = accept(broker->handoff_socket, NULL, NULL);
+        if (peer < 0)
+            continue;
+
+        if (read_handoff_request(peer, broker->handoff_target, sizeof(broker->handoff_target)) < 0) {
+            LOG_WARN("[BROKER] Pedido de traspaso invalido en %s", broker->handoff_path);
+            close(peer);
+            continue;
         }
 
-        else {
-        	
-            printf("[BROKER] Comando desconocido: %s\n", buffer);
-            send(client_socket, "ERROR: Unknown command\n", 23, 0);
+        LOG_INFO("[BROKER] Traspaso pedido: se detiene el broker");
+        broker->handoff_peer = peer;
+        broker->running = 0;
+    }
+    return NULL;
+}
+
+static void start_handoff_listener(Broker* broker) {
+    if (!broker->handoff_path)
+        return;
+
+    broker->handoff_socket = open_unix_listener(broker->handoff_path);
+    if (broker->handoff_socket < 0) {
+        LOG_ERROR("[BROKER] No se pudo abrir el socket de traspaso '%s': %s",
+                  broker->handoff_path, strerror(errno));
+        return;
+    }
+    if (pthread_create(&broker->handoff_thread, NULL, handoff_thread, broker) == 0)
+        broker->handoff_started = 1;
+}
+
+// Con los loops, shards e hilos de cliente ya detenidos: completa lo que
+// estaba en camino, escribe el snapshot y pasa los descriptores.
+static void hand_off(Broker* broker) {
+    FdList fds = { NULL, 0, 0, 0 };
+    int conns = 0;
+
+    // Ninguno debe escribir mientras tanto (el snapshot puede ser el mismo)
+    stop_bridges(broker);
+    if (broker->agg_started)
+        pthread_join(broker->agg_thread, NULL);
+    broker->agg_started = 0;
+    if (broker->snapshot_started)
+        pthread_join(broker->snapshot_thread, NULL);
+    broker->snapshot_started = 0;
+
+    // Lo que quedo en las inbox de los shards
+    for (int i = 0; broker->shards && i < broker->num_loops; i++)
+        shard_drain(&broker->shards[i]);
+
+    uint64_t start = stats_now();
+    if (write_snapshot(broker, broker->handoff_target, &fds, &conns) < 0 ||
+        snapshot_send_fds(broker->handoff_peer, fds.fds, fds.count) < 0) {
+        LOG_ERROR("[BROKER] Fallo el traspaso: %s", strerror(errno));
+    } else {
+        broker->handed_off = 1;
+        LOG_INFO("[BROKER] Traspaso completo: %d conexiones en %.1f ms",
+                 conns, (stats_now() - start) / 1e6);
+    }
+
+    close(broker->handoff_peer);
+    broker->handoff_peer = -1;
+    free(fds.fds);
+}
+
+// Al salir, con todos los hilos detenidos. Tras un traspaso close() solo
+// suelta la copia de este proceso: el nuevo sigue atendiendo.
+static void close_connections(Broker* broker) {
+    while (broker->connections) {
+        Connection* conn = broker->connections;
+        unregister_connection(broker, conn);
+
+        while (conn->owned_filters) {
+            OwnedFilter* f = conn->owned_filters;
+            conn->owned_filters = f->next;
+            free(f);
         }
+
+        conn->epoll_fd = -1;          // el del loop ya se cerro
+        conn_close(conn);
+        conn_release(conn);
     }
 }
 
+// En modo hilos cada hilo de cliente termina solo al detenerse el broker.
+static void wait_client_threads(Broker* broker) {
+    while (__atomic_load_n(&broker->client_threads, __ATOMIC_ACQUIRE) > 0)
+        usleep(10000);
+}
+
 
 // =========================================================
 // SERVIDOR PRINCIPAL
@@ -144,46 +3361,390 @@ static void* client_thread(void* arg) {
 
 int broker_init(Broker* broker, int port) {
     broker->port = port;
+    broker->server_socket = -1;
     broker->gateways = NULL;
-    broker->subscribers = NULL;
-    broker->history = NULL;
+    broker->subscriptions = malloc(sizeof(TopicTree));
+    if (!broker->subscriptions)
+        return 0;
+    topic_tree_init(broker->subscriptions, free_subscription);
+    epoch_init(&broker->sub_epoch);
     broker->running = 1;
+    broker->log = NULL;
+
+    broker->mode = BROKER_MODE_THREADS;
+    broker->num_loops = 0;
+    broker->next_loop = 0;
+    broker->loops = NULL;
+    broker->shards = NULL;
+
+    broker->slow_policy = SLOW_DROP_OLDEST;
+    broker->out_queue_len = DEFAULT_OUT_QUEUE_LEN;
+    broker->gateway_credit = DEFAULT_GATEWAY_CREDIT;
+    broker->share_policy = SHARE_ROUND_ROBIN;
+    rate_limits_init(&broker->limits);
+    broker->unix_path = NULL;
+    broker->unix_socket = -1;
+
+    if (!stats_init(&broker->stats))
+        return 0;
+    broker->stats_file = NULL;
+    broker->stats_interval = DEFAULT_STATS_INTERVAL;
+    broker->stats_started = 0;
+
+    pthread_mutex_init(&broker->mutex_connections, NULL);
+    broker->connections = NULL;
+    broker->client_threads = 0;
+
+    broker->snapshot_path = NULL;
+    broker->snapshot_interval = DEFAULT_SNAPSHOT_INTERVAL;
+    broker->snapshot_started = 0;
+    broker->handoff_path = NULL;
+    broker->handoff_socket = -1;
+    broker->handoff_peer = -1;
+    broker->handoff_started = 0;
+    broker->handed_off = 0;
+    broker->restored = 0;
+    broker->takeover = NULL;
+
+    char host[BROKER_NAME_LEN - 8];
+    if (gethostname(host, sizeof(host)) < 0)
+        strcpy(host, "broker");
+    host[sizeof(host) - 1] = '\0';
+    snprintf(broker->name, sizeof(broker->name), "%s:%d", host, port);
+    broker->bridges = NULL;
+    broker->next_bridge_shard = 0;
+    broker->bridge_started = 0;
+
+    // Los numeros de los mensajes propios siguen creciendo aunque el
+    // broker se reinicie: los otros no los toman por repetidos
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    broker->relay_seq = (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+    pthread_mutex_init(&broker->mutex_origins, NULL);
+    broker->origins = NULL;
+    broker->num_origins = 0;
 
     pthread_mutex_init(&broker->mutex_gateways, NULL);
     pthread_mutex_init(&broker->mutex_subscribers, NULL);
-    pthread_mutex_init(&broker->mutex_history, NULL);
 
+    if (!history_init(&broker->history, DEFAULT_HISTORY_DEPTH, DEFAULT_HISTORY_MAX_AGE))
+        return 0;
+    if (!retained_init(&broker->retained))
+        return 0;
+    if (!agg_init(&broker->agg))
+        return 0;
+    broker->agg_started = 0;
+
+    return 1;
+}
+
+int broker_set_mode(Broker* broker, BrokerMode mode, int num_loops) {
+    if (mode == BROKER_MODE_EPOLL || mode == BROKER_MODE_SHARDED) {
+        if (num_loops <= 0)
+            num_loops = DEFAULT_EVENT_LOOPS;
+        if (num_loops > MAX_EVENT_LOOPS)
+            return 0;
+    } else {
+        num_loops = 0;
+    }
+
+    broker->mode = mode;
+    broker->num_loops = num_loops;
+    return 1;
+}
+
+// Debe llamarse antes de broker_start(): la profundidad se aplica al
+// crear el buffer de cada topic.
+int broker_set_history_limits(Broker* broker, int depth, int max_age) {
+    if (depth <= 0 || max_age < 0)
+        return 0;
+
+    broker->history.depth = depth;
+    broker->history.max_age = max_age;
+    return 1;
+}
+
+static void restore_from_log(const char* topic, size_t topic_len,
+                             const char* data, size_t data_len,
+                             time_t timestamp, void* ctx) {
+    store_restored((Broker*)ctx, topic, topic_len, data, data_len, timestamp,
+                   RESTORE_HISTORY | RESTORE_RETAINED);
+}
+
+static void restore_history(Broker* broker) {
+    time_t since = 0;
+    if (broker->history.max_age > 0)
+        since = time(NULL) - broker->history.max_age;
+
+    msglog_replay(broker->log, NULL, since, 1, restore_from_log, broker);
+}
+
+// Abre (o crea) el log persistente y recarga el historial en memoria con
+// el segmento mas reciente. Debe llamarse antes de broker_start().
+int broker_enable_log(Broker* broker, const MsgLogConfig* config) {
+    broker->log = msglog_open(config);
+    if (!broker->log)
+        return 0;
+
+    restore_history(broker);
+    return 1;
+}
+
+int broker_set_slow_consumer_policy(Broker* broker, SlowConsumerPolicy policy, int queue_len) {
+    if (queue_len <= 0)
+        return 0;
+
+    broker->slow_policy = policy;
+    broker->out_queue_len = queue_len;
+    return 1;
+}
+
+int broker_limit_gateway(Broker* broker, const char* id, double rate, double burst) {
+    return rate_limit_add_gateway(&broker->limits, id, rate, burst);
+}
+
+int broker_limit_topic(Broker* broker, const char* prefix, double rate, double burst) {
+    return rate_limit_add_topic(&broker->limits, prefix, rate, burst);
+}
+
+int broker_set_gateway_credit(Broker* broker, int window) {
+    if (window < 0)
+        return 0;
+
+    broker->gateway_credit = window;
+    return 1;
+}
+
+void broker_set_share_policy(Broker* broker, SharePolicy policy) {
+    broker->share_policy = policy;
+}
+
+// Ademas del puerto TCP, acepta clientes en un socket Unix en 'path'.
+// Por ahi un gateway del mismo host puede pasar a memoria compartida.
+int broker_listen_unix(Broker* broker, const char* path) {
+    if (strlen(path) >= sizeof(((struct sockaddr_un*)0)->sun_path))
+        return 0;
+
+    char* copy = strdup(path);
+    if (!copy)
+        return 0;
+
+    free(broker->unix_path);
+    broker->unix_path = copy;
+    return 1;
+}
+
+// Agrega al final de 'path' las metricas cada 'interval' segundos.
+int broker_enable_stats_dump(Broker* broker, const char* path, int interval) {
+    if (interval <= 0)
+        return 0;
+
+    FILE* f = fopen(path, "a");
+    if (!f)
+        return 0;
+
+    if (broker->stats_file)
+        fclose(broker->stats_file);
+    broker->stats_file = f;
+    broker->stats_interval = interval;
+    return 1;
+}
+
+// Carga 'path' al arrancar (si existe) y lo reescribe cada 'interval'
+// segundos (0 = solo al salir).
+int broker_enable_snapshot(Broker* broker, const char* path, int interval) {
+    if (interval < 0 || strlen(path) >= SNAPSHOT_PATH_LEN)
+        return 0;
+
+    char* copy = strdup(path);
+    if (!copy)
+        return 0;
+
+    free(broker->snapshot_path);
+    broker->snapshot_path = copy;
+    broker->snapshot_interval = interval;
+    return 1;
+}
+
+// Socket de control para el traspaso: al arrancar se le pide al broker
+// que atiende ahi sus conexiones, y despues se atiende en el mismo para
+// el proximo.
+int broker_enable_handoff(Broker* broker, const char* path) {
+    if (strlen(path) >= sizeof(((struct sockaddr_un*)0)->sun_path))
+        return 0;
+
+    char* copy = strdup(path);
+    if (!copy)
+        return 0;
+
+    free(broker->handoff_path);
+    broker->handoff_path = copy;
+    return 1;
+}
+
+// Nombre con el que se presenta como puente; el de cada broker tiene que
+// ser distinto.
+int broker_set_name(Broker* broker, const char* name) {
+    if (name[0] == '\0' || strlen(name) >= BROKER_NAME_LEN || strpbrk(name, " \n"))
+        return 0;
+
+    strcpy(broker->name, name);
+    return 1;
+}
+
+// Agrega un filtro al puente hacia host:puerto (lo crea con el primero).
+int broker_add_bridge(Broker* broker, const char* host, int port, const char* filter) {
+    Bridge** pp = &broker->bridges;
+
+    if (strlen(host) >= BRIDGE_HOST_LEN || port <= 0 || port > 65535 ||
+        strlen(filter) >= MAX_TOPIC_LEN || !topic_filter_is_valid(filter))
+        return 0;
+
+    while (*pp && !(strcmp((*pp)->host, host) == 0 && (*pp)->port == port))
+        pp = &(*pp)->next;
+
+    if (!*pp) {
+        Bridge* b = calloc(1, sizeof(Bridge));
+        if (!b)
+            return 0;
+        strcpy(b->host, host);
+        b->port = port;
+        b->backoff = 1;
+        *pp = b;
+    }
+
+    Bridge* b = *pp;
+    if (b->num_filters == MAX_BRIDGE_FILTERS)
+        return 0;
+    strcpy(b->filters[b->num_filters++], filter);
     return 1;
 }
 
 void broker_start(Broker* broker) {
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (take_over(broker) < 0) {
+        broker->running = 0;
+        return;
+    }
+
+    if (broker->unix_path) {
+        broker->unix_socket = take_listener(broker, "unix");
+        if (broker->unix_socket < 0)
+            broker->unix_socket = open_unix_listener(broker->unix_path);
+        if (broker->unix_socket < 0) {
+            LOG_ERROR("[BROKER] No se pudo abrir el socket Unix '%s': %s",
+                      broker->unix_path, strerror(errno));
+            broker->running = 0;
+            return;
+        }
+        LOG_INFO("[BROKER] Escuchando tambien en %s", broker->unix_path);
+    }
+
+    // Cada shard acepta en su propio socket; el hilo principal solo espera
+    if (broker->mode == BROKER_MODE_SHARDED) {
+        broker->server_socket = -1;
+        if (start_shards(broker) < 0) {
+            broker->running = 0;
+            return;
+        }
+
+        LOG_INFO("[BROKER] Servidor iniciado en puerto %d", broker->port);
+        start_stats_dump(broker);
+        start_snapshots(broker);
+        start_handoff_listener(broker);
+        start_bridges(broker);
+
+        for (int i = 0; i < broker->num_loops; i++)
+            pthread_join(broker->shards[i].thread, NULL);
+
+        if (broker->handoff_peer >= 0)
+            hand_off(broker);
+        return;
+    }
+
+    // Con traspaso el puerto puede pasar a un proceso en modo sharded,
+    // que abre los demas sockets con SO_REUSEPORT
+    int server_fd = take_listener(broker, "tcp");
+    if (server_fd < 0)
+        server_fd = open_listener(broker->port, broker->handoff_path != NULL);
     broker->server_socket = server_fd;
+    if (server_fd < 0) {
+        LOG_ERROR("[BROKER] No se pudo abrir el puerto: %s", strerror(errno));
+        broker->running = 0;
+        return;
+    }
 
-    struct sockaddr_in addr;
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(broker->port);
-    addr.sin_addr.s_addr = INADDR_ANY;
+    LOG_INFO("[BROKER] Servidor iniciado en puerto %d", broker->port);
+
+    if (broker->mode == BROKER_MODE_EPOLL && start_event_loops(broker) < 0) {
+        broker->running = 0;
+        return;
+    }
+
+    restore_snapshot(broker);
+    restore_connections(broker);
+    finish_takeover(broker);
+    broker->restored = 1;
 
-    bind(server_fd, (struct sockaddr*)&addr, sizeof(addr));
-    listen(server_fd, 5);
+    if (pthread_create(&broker->agg_thread, NULL, agg_thread, broker) == 0)
+        broker->agg_started = 1;
+    start_stats_dump(broker);
+    start_snapshots(broker);
+    start_handoff_listener(broker);
+    start_bridges(broker);
 
-    printf("[BROKER] Servidor iniciado en puerto %d\n", broker->port);
+    // El puerto TCP y, si hay, el socket Unix. Con timeout, para notar
+    // que el broker se detiene (o traspasa).
+    struct pollfd listeners[2] = {
+        { server_fd, POLLIN, 0 },
+        { broker->unix_socket, POLLIN, 0 }
+    };
+    int num_listeners = broker->unix_socket >= 0 ? 2 : 1;
+    int next = 0;
 
     while (broker->running) {
-        struct sockaddr_in client;
-        socklen_t c = sizeof(client);
-        int client_socket = accept(server_fd, (struct sockaddr*)&client, &c);
+        int client_socket = -1;
+        int local = 0;
+
+        if (poll(listeners, num_listeners, EPOLL_TIMEOUT_MS) <= 0)
+            continue;
+
+        // Se alterna el que se mira primero: ninguno acapara el accept
+        for (int i = 0; i < num_listeners && client_socket < 0; i++) {
+            int l = (next + i) % num_listeners;
+            if (listeners[l].revents & POLLIN) {
+                client_socket = accept(listeners[l].fd, NULL, NULL);
+                local = l == 1;
+            }
+        }
+        next = (next + 1) % num_listeners;
+
+        if (client_socket < 0)
+            continue;
+
+        if (broker->mode == BROKER_MODE_EPOLL) {
+            dispatch_to_loop(broker, client_socket, local);
+            continue;
+        }
+
+        LOG_DEBUG("[BROKER] Nueva conexin (socket %d)", client_socket);
 
-        printf("[BROKER] Nueva conexin (socket %d)\n", client_socket);
+        Connection* conn = new_connection(broker, client_socket, local);
+        if (!conn) {
+            close(client_socket);
+            continue;
+        }
 
-        ClientArgs* args = malloc(sizeof(ClientArgs));
-        args->broker = broker;
-        args->client_socket = client_socket;
+        if (start_client_thread(broker, conn) < 0) {
+            conn_close(conn);
+            conn_release(conn);
+        }
+    }
 
-        pthread_t th;
-        pthread_create(&th, NULL, client_thread, args);
-        pthread_detach(th);
+    // Los clientes quedan conectados: pasan al proceso que lo pidio
+    if (broker->handoff_peer >= 0) {
+        stop_event_loops(broker);
+        wait_client_threads(broker);
+        hand_off(broker);
     }
 }
 
@@ -192,10 +3753,87 @@ void broker_stop(Broker* broker) {
 }
 
 void broker_cleanup(Broker* broker) {
-    close(broker->server_socket);
+    broker->running = 0;
+    stop_bridges(broker);
+    stop_event_loops(broker);
+    wait_client_threads(broker);
+    if (broker->agg_started)
+        pthread_join(broker->agg_thread, NULL);
+    broker->agg_started = 0;
+    if (broker->stats_started)
+        pthread_join(broker->stats_thread, NULL);
+    broker->stats_started = 0;
+    if (broker->stats_file)
+        fclose(broker->stats_file);
+    broker->stats_file = NULL;
+    if (broker->snapshot_started)
+        pthread_join(broker->snapshot_thread, NULL);
+    broker->snapshot_started = 0;
+    if (broker->handoff_started)
+        pthread_join(broker->handoff_thread, NULL);
+    broker->handoff_started = 0;
+
+    // El ultimo snapshot, con los shards todavia en pie. Si el arranque
+    // fallo antes de cargarlo no se pisa el anterior.
+    if (broker->snapshot_path && broker->restored && !broker->handed_off)
+        save_snapshot(broker);
+    close_connections(broker);
+    stop_shards(broker);
+    finish_takeover(broker);
+
+    // Tras un traspaso las rutas ya son del proceso nuevo
+    if (broker->server_socket >= 0)
+        close(broker->server_socket);
+    if (broker->unix_socket >= 0) {
+        close(broker->unix_socket);
+        if (!broker->handed_off)
+            unlink(broker->unix_path);
+    }
+    broker->unix_socket = -1;
+    free(broker->unix_path);
+    broker->unix_path = NULL;
+    if (broker->handoff_socket >= 0) {
+        close(broker->handoff_socket);
+        if (!broker->handed_off)
+            unlink(broker->handoff_path);
+    }
+    broker->handoff_socket = -1;
+    if (broker->handoff_peer >= 0)
+        close(broker->handoff_peer);
+    broker->handoff_peer = -1;
+    free(broker->handoff_path);
+    broker->handoff_path = NULL;
+    free(broker->snapshot_path);
+    broker->snapshot_path = NULL;
+
+    while (broker->gateways) {
+        GatewayClient* g = broker->gateways;
+        broker->gateways = g->next;
+        free(g);
+    }
+    while (broker->bridges) {
+        Bridge* b = broker->bridges;
+        broker->bridges = b->next;
+        free(b);
+    }
+    while (broker->origins) {
+        Origin* o = broker->origins;
+        broker->origins = o->next;
+        free(o);
+    }
+    pthread_mutex_destroy(&broker->mutex_origins);
     pthread_mutex_destroy(&broker->mutex_gateways);
+    pthread_mutex_destroy(&broker->mutex_connections);
+    subscriptions_discard(broker->subscriptions);
+    broker->subscriptions = NULL;
     pthread_mutex_destroy(&broker->mutex_subscribers);
-    pthread_mutex_destroy(&broker->mutex_history);
+    history_destroy(&broker->history);
+    retained_destroy(&broker->retained);
+    agg_destroy(&broker->agg);
+    rate_limits_destroy(&broker->limits);
+    msglog_close(broker->log);
+    broker->log = NULL;
+    stats_destroy(&broker->stats);
 }
 
 
@@ -203,17 +3841,17 @@ void broker_cleanup(Broker* broker) {
 // DEBUG
 // =========================================================
 
-void broker_print_history(Broker* broker) {
-    pthread_mutex_lock(&broker->mutex_history);
+static void print_history_entry(const char* topic, Message* m, void* ctx) {
+    (void)ctx;
+    printf("[%ld] %s -> %.*s\n", m->timestamp, topic, (int)m->data_len, m->data);
+}
 
-    TopicMessage* m = broker->history;
+void broker_print_history(Broker* broker) {
     printf("=== HISTORIAL ===\n");
-    while (m) {
-        printf("[%ld] %s -> %s\n", m->timestamp, m->topic, m->data);
-        m = m->next;
-    }
+    history_foreach(&broker->history, print_history_entry, NULL);
 
-    pthread_mutex_unlock(&broker->mutex_history);
+    for (int i = 0; broker->shards && i < broker->num_loops; i++)
+        history_foreach(&broker->shards[i].history, print_history_entry, NULL);
 }
 
 void broker_print_gateways(Broker* broker) {
@@ -229,3 +3867,16 @@ void broker_print_gateways(Broker* broker) {
     pthread_mutex_unlock(&broker->mutex_gateways);
 }
 
+static void print_rate_limit(const char* kind, const RateLimit* rl, void* ctx) {
+    (void)ctx;
+    printf(" - %s '%s': %.1f/s, admitidos %lu, rechazados %lu\n", kind, rl->key,
+           1e9 / rl->bucket.interval_ns,
+           __atomic_load_n(&rl->bucket.admitted, __ATOMIC_RELAXED),
+           __atomic_load_n(&rl->bucket.rejected, __ATOMIC_RELAXED));
+}
+
+void broker_print_rate_limits(Broker* broker) {
+    printf("=== LIMITES DE PUBLICACION ===\n");
+    rate_limits_foreach(&broker->limits, print_rate_limit, NULL);
+}
+
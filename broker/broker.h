@@ -3,10 +3,51 @@
 
 #include <pthread.h>
 #include <time.h>
+#include <sys/socket.h>
 
 #define MAX_GATEWAY_ID 64
 #define MAX_TOPIC_LEN 128
 #define MAX_DATA_LEN 512
+#define HISTORY_MAX_RESULTS 10000   // registros por respuesta de HISTORY
+
+#include "topic_tree.h"
+#include "history.h"
+#include "retained.h"
+#include "agg.h"
+#include "ratelimit.h"
+#include "msglog.h"
+#include "connection.h"
+#include "epoch.h"
+#include "stats.h"
+#include "snapshot.h"
+#include <stdio.h>
+
+#define DEFAULT_EVENT_LOOPS 4
+#define MAX_EVENT_LOOPS 64             // tambien el maximo de shards
+
+// PUBLISH que un gateway registrado puede tener en camino: el broker se
+// los repone a medida que los procesa (0 = sin control de flujo).
+#define DEFAULT_GATEWAY_CREDIT 256
+
+// Periodo por defecto del volcado de metricas a archivo (segundos)
+#define DEFAULT_STATS_INTERVAL 10
+
+// Periodo por defecto del snapshot (segundos; 0 = solo al salir)
+#define DEFAULT_SNAPSHOT_INTERVAL 60
+
+// Puentes hacia otros brokers (ver "PUENTES ENTRE BROKERS" en broker.c)
+#define BROKER_NAME_LEN 64             // nombre con el que se presenta
+#define BRIDGE_HOST_LEN 128
+#define MAX_BRIDGE_FILTERS 16          // filtros por puente
+#define BRIDGE_TIMEOUT_MS 1000         // conexion y saludo
+#define BRIDGE_MAX_BACKOFF 30          // segundos entre reintentos, como maximo
+#define BRIDGE_MAX_HOPS 8              // enlaces que puede cruzar un mensaje
+#define BRIDGE_SEEN_WINDOW 65536       // numeros recordados por origen (multiplo de 64)
+#define BRIDGE_MAX_ORIGINS 256         // brokers distintos que se recuerdan
+
+// Conexiones completas esperando accept(). Con el antiguo 5 una rafaga
+// de clientes perdia SYNs y cada reintento costaba un segundo.
+#define BROKER_LISTEN_BACKLOG SOMAXCONN
 
 // ----------------------
 // Estructuras
@@ -16,33 +57,160 @@ typedef struct GatewayClient {
     int socket;
     char id[MAX_GATEWAY_ID];
     struct GatewayClient* next;
+    struct GatewayClient* prev;         // lista doble: se quita en O(1)
+    struct GatewayClient* owner_next;   // registros de la misma conexion
 } GatewayClient;
 
+// Filtro suscripto por una conexion (Connection.owned_filters), para
+// quitar sus suscripciones al desconectarse sin recorrer el arbol.
+typedef struct OwnedFilter {
+    char filter[MAX_TOPIC_LEN];
+    int conflate;
+    struct OwnedFilter* next;
+} OwnedFilter;
+
+// Turno de un grupo compartido. Va aparte de la entrada del grupo: cada
+// version nueva del arbol copia la entrada pero sigue con el mismo turno.
+// 'turn' es atomico; 'refs' (entradas que lo apuntan) cambia solo con el
+// arbol, bajo su lock.
+typedef struct ShareCursor {
+    unsigned int turn;
+    int refs;
+} ShareCursor;
+
+// Suscripcion: 'topic' es el filtro (puede tener '+' y '#').
+// Se almacena en el nodo del TopicTree que corresponde al filtro.
+// Con 'conflate' un suscriptor atrasado recibe solo el ultimo valor
+// pendiente de cada topic (ver conn_queue).
+//
+// Un grupo compartido ("$share/<grupo>/<filtro>") es una entrada sin
+// conexion cuyos miembros cuelgan de 'members'; cada mensaje va a uno
+// solo de ellos.
 typedef struct SubscriberClient {
-    int socket;
+    Connection* conn;             // referencia propia (conn_retain); NULL en un grupo
     char topic[MAX_TOPIC_LEN];
+    int conflate;                 // SUBSCRIBE <filtro> CONFLATE
     struct SubscriberClient* next;
+
+    struct SubscriberClient* members;
+    int num_members;
+    ShareCursor* cursor;          // grupo: proximo miembro en round-robin
 } SubscriberClient;
 
-typedef struct TopicMessage {
-    char topic[MAX_TOPIC_LEN];
-    char data[MAX_DATA_LEN];
-    time_t timestamp;
-    struct TopicMessage* next;
-} TopicMessage;
+// Puente hacia otro broker: sus filtros y el estado del enlace. Lo
+// configura broker_add_bridge() antes de arrancar; despues lo toca solo
+// el hilo de puentes, salvo 'up', que baja el lector del enlace al
+// perderlo.
+typedef struct Bridge {
+    char host[BRIDGE_HOST_LEN];
+    int port;
+    char filters[MAX_BRIDGE_FILTERS][MAX_TOPIC_LEN];
+    int num_filters;
+
+    int up;                       // hay enlace (atomico)
+    int backoff;                  // segundos hasta el proximo reintento
+    time_t next_attempt;
+    int warned;                   // ya se aviso que esta caido
+    struct Origin* peer;          // el otro broker, segun su saludo
+    struct Bridge* next;
+} Bridge;
+
+// Broker donde se publico lo que llega por los puentes, con los numeros
+// de sus mensajes ya vistos: los ultimos BRIDGE_SEEN_WINDOW desde el
+// mayor. Se crea al verlo por primera vez y dura lo que el broker; lo
+// protege su mutex_origins.
+typedef struct Origin {
+    char name[BROKER_NAME_LEN];
+    uint64_t high;                // mayor numero visto (0 = ninguno)
+    uint64_t seen[BRIDGE_SEEN_WINDOW / 64];
+    struct Origin* next;
+} Origin;
+
+// A que miembro de un grupo compartido va cada mensaje
+typedef enum {
+    SHARE_ROUND_ROBIN = 0,        // en turno, salteando los que no pueden recibir
+    SHARE_LEAST_OUTSTANDING       // el de menos entregas sin enviar
+} SharePolicy;
+
+// Modo de atencion de conexiones
+typedef enum {
+    BROKER_MODE_THREADS = 0,   // un pthread por conexion
+    BROKER_MODE_EPOLL,         // pool fijo de event loops sobre epoll
+    BROKER_MODE_SHARDED        // un shard por core: topics particionados
+                               // por hash, sin estado compartido
+} BrokerMode;
+
+struct EventLoop;
+struct Shard;
+struct Takeover;
 
 typedef struct {
     int port;
     int server_socket;
+    char* unix_path;              // socket Unix, o NULL
+    int unix_socket;
     int running;
 
     GatewayClient* gateways;
-    SubscriberClient* subscribers;
-    TopicMessage* history;
+    TopicTree* subscriptions;     // version vigente, inmutable: se reemplaza entera
+    EpochDomain sub_epoch;        // lectores de 'subscriptions' (PUBLISH)
+    HistoryStore history;
+    RetainedStore retained;       // ultimo valor por topic
+    AggStore agg;                 // ventanas de $agg/... (sin shards)
+    pthread_t agg_thread;         // cierra las ventanas vencidas
+    int agg_started;
+    MsgLog* log;                  // NULL si no hay log persistente
 
     pthread_mutex_t mutex_gateways;
-    pthread_mutex_t mutex_subscribers;
-    pthread_mutex_t mutex_history;
+    pthread_mutex_t mutex_subscribers;   // serializa a quienes cambian suscripciones
+
+    BrokerMode mode;
+    int num_loops;
+    int next_loop;
+    struct EventLoop* loops;
+    struct Shard* shards;         // modo sharded (num_loops shards)
+
+    SlowConsumerPolicy slow_policy;
+    int out_queue_len;
+    int gateway_credit;           // ventana de PUBLISH por gateway
+    SharePolicy share_policy;     // reparto en suscripciones compartidas
+    RateLimits limits;            // admision por gateway y por topic
+
+    Stats stats;                  // contadores por hilo (comando STATS)
+    FILE* stats_file;             // volcado periodico, o NULL
+    int stats_interval;
+    pthread_t stats_thread;
+    int stats_started;
+
+    pthread_mutex_t mutex_connections;
+    Connection* connections;      // conexiones vivas (para el traspaso)
+    int client_threads;           // hilos de cliente vivos (modo hilos)
+
+    // Snapshot y traspaso (ver "SNAPSHOT Y TRASPASO" en broker.c)
+    char* snapshot_path;          // NULL: sin snapshot
+    int snapshot_interval;        // 0 = solo al salir
+    pthread_t snapshot_thread;
+    int snapshot_started;
+    char* handoff_path;           // socket de control, o NULL
+    int handoff_socket;
+    int handoff_peer;             // proceso que pidio el traspaso, o -1
+    char handoff_target[SNAPSHOT_PATH_LEN];   // donde espera el snapshot
+    pthread_t handoff_thread;
+    int handoff_started;
+    int handed_off;               // ya traspaso: al salir no toca lo compartido
+    int restored;                 // ya cargo el snapshot (el de salida no lo pisa)
+    struct Takeover* takeover;    // lo recibido del proceso anterior, al arrancar
+
+    // Puentes (ver "PUENTES ENTRE BROKERS" en broker.c)
+    char name[BROKER_NAME_LEN];   // por defecto "<host>:<puerto>"
+    Bridge* bridges;
+    int next_bridge_shard;        // reparto de los enlaces entre shards
+    pthread_t bridge_thread;
+    int bridge_started;
+    Origin* origins;
+    int num_origins;
+    pthread_mutex_t mutex_origins;
+    uint64_t relay_seq;           // ultimo numero dado a un mensaje propio (atomico)
 
 } Broker;
 
@@ -51,6 +219,20 @@ typedef struct {
 // ----------------------
 
 int  broker_init(Broker* broker, int port);
+int  broker_set_mode(Broker* broker, BrokerMode mode, int num_loops);
+int  broker_set_history_limits(Broker* broker, int depth, int max_age);
+int  broker_enable_log(Broker* broker, const MsgLogConfig* config);
+int  broker_set_slow_consumer_policy(Broker* broker, SlowConsumerPolicy policy, int queue_len);
+int  broker_set_gateway_credit(Broker* broker, int window);
+int  broker_listen_unix(Broker* broker, const char* path);
+int  broker_enable_stats_dump(Broker* broker, const char* path, int interval);
+int  broker_enable_snapshot(Broker* broker, const char* path, int interval);
+int  broker_enable_handoff(Broker* broker, const char* path);
+int  broker_set_name(Broker* broker, const char* name);
+int  broker_add_bridge(Broker* broker, const char* host, int port, const char* filter);
+void broker_set_share_policy(Broker* broker, SharePolicy policy);
+int  broker_limit_gateway(Broker* broker, const char* id, double rate, double burst);
+int  broker_limit_topic(Broker* broker, const char* prefix, double rate, double burst);
 void broker_start(Broker* broker);
 void broker_stop(Broker* broker);
 void broker_cleanup(Broker* broker);
@@ -58,6 +240,7 @@ void broker_cleanup(Broker* broker);
 // Debug
 void broker_print_history(Broker* broker);
 void broker_print_gateways(Broker* broker);
+void broker_print_rate_limits(Broker* broker);
 
 #endif
 
@@ -0,0 +1,557 @@
+#include "connection.h"
+#include "logger.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// =========================================================
+// COLA DE SALIDA (con out_mutex tomado)
+// =========================================================
+
+static void queue_pop(Connection* c) {
+    message_release(c->out[c->out_head].msg);
+    c->out[c->out_head].msg = NULL;
+    c->out_head = (c->out_head + 1) % c->out_cap;
+    c->out_count--;
+    c->out_seq++;
+    c->out_offset = 0;
+}
+
+static void queue_clear(Connection* c) {
+    while (c->out_count > 0)
+        queue_pop(c);
+}
+
+// Descarta el mensaje mas viejo que todavia no empezo a enviarse.
+static void queue_drop_oldest(Connection* c) {
+    if (c->out_offset == 0) {
+        queue_pop(c);
+        return;
+    }
+
+    // El primero esta a medio enviar: se descarta el segundo y el primero
+    // ocupa su lugar.
+    int second = (c->out_head + 1) % c->out_cap;
+    message_release(c->out[second].msg);
+    c->out[second] = c->out[c->out_head];
+    c->out[c->out_head].msg = NULL;
+    c->out_head = second;
+    c->out_count--;
+    c->out_seq++;
+}
+
+// Solo para respuestas de control, y hasta CONN_CONTROL_RESERVE entradas
+// por encima del largo de la cola.
+static int queue_grow(Connection* c) {
+    int max = c->out_len + CONN_CONTROL_RESERVE;
+    int cap = c->out_cap * 2 < max ? c->out_cap * 2 : max;
+    if (cap <= c->out_cap)
+        return -1;
+
+    OutMsg* out = calloc(cap, sizeof(OutMsg));
+    if (!out)
+        return -1;
+
+    for (int i = 0; i < c->out_count; i++)
+        out[i] = c->out[(c->out_head + i) % c->out_cap];
+
+    free(c->out);
+    c->out = out;
+    c->out_cap = cap;
+    c->out_head = 0;
+    return 0;
+}
+
+// A otro broker va el frame WIRE_RELAY que armo broker.c antes de
+// encolar; las respuestas de control no lo tienen y salen como frames.
+static void out_set(Connection* c, OutMsg* m, Message* msg) {
+    m->msg = msg;
+    if (c->peer && msg->relay) {
+        m->data = msg->relay;
+        m->len = msg->relay_len;
+    } else if (__atomic_load_n(&c->binary, __ATOMIC_ACQUIRE)) {
+        m->data = msg->frame;
+        m->len = msg->frame_len;
+    } else {
+        m->data = msg->text;
+        m->len = msg->text_len;
+    }
+}
+
+// FNV-1a del topic
+static unsigned int topic_hash(const Message* msg) {
+    unsigned int h = 2166136261u;
+    for (size_t i = 0; i < msg->topic_len; i++) {
+        h ^= (unsigned char)msg->topic[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Lugar del indice que corresponde al topic de 'msg', o NULL sin memoria.
+static unsigned long* latest_slot(Connection* c, const Message* msg) {
+    if (!c->latest) {
+        int cap = 16;
+        while (cap < 2 * c->out_len)
+            cap *= 2;
+
+        c->latest = calloc(cap, sizeof(unsigned long));
+        if (!c->latest)
+            return NULL;
+        c->latest_cap = cap;
+    }
+    return &c->latest[topic_hash(msg) & (c->latest_cap - 1)];
+}
+
+// Reemplaza en su lugar la entrega pendiente del mismo topic que apunta
+// 'slot'. Devuelve 1 si la reemplazo; no toca la que esta a medio enviar.
+static int queue_replace(Connection* c, unsigned long slot, Message* msg) {
+    if (slot < c->out_seq || slot >= c->out_seq + c->out_count)
+        return 0;
+    if (slot == c->out_seq && c->out_offset > 0)
+        return 0;
+
+    OutMsg* m = &c->out[(c->out_head + (slot - c->out_seq)) % c->out_cap];
+    if (!m->conflate || m->msg->topic_len != msg->topic_len ||
+        memcmp(m->msg->topic, msg->topic, msg->topic_len) != 0)
+        return 0;
+
+    message_release(m->msg);
+    out_set(c, m, msg);
+    c->conflated++;
+    return 1;
+}
+
+static void update_epoll_interest(Connection* c) {
+    if (c->epoll_fd < 0)
+        return;
+
+    int want = c->out_count > 0;
+    if (want == c->want_write)
+        return;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | (want ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+
+    if (epoll_ctl(c->epoll_fd, EPOLL_CTL_MOD, c->socket, &ev) == 0)
+        c->want_write = want;
+}
+
+static size_t iov_total(const struct iovec* iov, int cnt) {
+    size_t total = 0;
+    for (int i = 0; i < cnt; i++)
+        total += iov[i].iov_len;
+    return total;
+}
+
+static int flush_locked(Connection* c) {
+    c->flush_owed = 0;
+
+    while (c->out_count > 0 && !c->closed) {
+        // Todo lo encolado (hasta FLUSH_IOV mensajes) en una sola llamada
+        struct iovec iov[FLUSH_IOV];
+        int cnt = c->out_count < FLUSH_IOV ? c->out_count : FLUSH_IOV;
+
+        for (int i = 0; i < cnt; i++) {
+            OutMsg* m = &c->out[(c->out_head + i) % c->out_cap];
+            iov[i].iov_base = (void*)m->data;
+            iov[i].iov_len = m->len;
+        }
+        iov[0].iov_base = (char*)iov[0].iov_base + c->out_offset;
+        iov[0].iov_len -= c->out_offset;
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = cnt;
+
+        ssize_t n = sendmsg(c->socket, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                queue_clear(c);    // el lector vera el error y cerrara
+            break;
+        }
+
+        if (c->stats)
+            stats_add(stats_local(c->stats), STAT_BYTES_OUT, (uint64_t)n);
+
+        // Se sacan los mensajes enviados completos; el ultimo puede quedar
+        // a medias.
+        size_t sent = (size_t)n;
+        while (sent > 0) {
+            OutMsg* m = &c->out[c->out_head];
+            size_t left = m->len - c->out_offset;
+
+            if (sent < left) {
+                c->out_offset += sent;
+                break;
+            }
+            sent -= left;
+            queue_pop(c);
+        }
+
+        if (c->out_count > 0 && (size_t)n < iov_total(iov, cnt))
+            break;                 // buffer del socket lleno
+    }
+
+    if (!c->closed)
+        update_epoll_interest(c);
+
+    return c->out_count > 0;
+}
+
+
+// =========================================================
+// GATEWAY LOCAL (ring en memoria compartida)
+// =========================================================
+
+static void close_passed_fds(Connection* c) {
+    for (int i = 0; i < c->num_passed_fds; i++)
+        close(c->passed_fds[i]);
+    c->num_passed_fds = 0;
+}
+
+static void detach_ring(Connection* c) {
+    if (!c->ring)
+        return;
+
+    // El gateway tiene su copia del eventfd: cerrar el nuestro no lo saca
+    // del epoll
+    if (c->epoll_fd >= 0)
+        epoll_ctl(c->epoll_fd, EPOLL_CTL_DEL, c->ring_data_fd, NULL);
+
+    munmap(c->ring, shm_ring_bytes(c->ring_size));
+    close(c->ring_mem_fd);
+    close(c->ring_data_fd);
+    close(c->ring_space_fd);
+    c->ring = NULL;
+    c->ring_mem_fd = c->ring_data_fd = c->ring_space_fd = -1;
+}
+
+int conn_recv(Connection* c, char* buf, size_t len) {
+    if (!c->local)
+        return recv(c->socket, buf, len, 0);
+
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(SHM_RING_FDS * sizeof(int))];
+    } control;
+    struct iovec iov = { buf, len };
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    int r = recvmsg(c->socket, &msg, MSG_CMSG_CLOEXEC);
+    if (r < 0)
+        return r;
+
+    for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+            continue;
+
+        int n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int* fds = (int*)CMSG_DATA(cm);
+
+        // Solo cuentan los del ultimo mensaje
+        close_passed_fds(c);
+        for (int i = 0; i < n; i++) {
+            if (i < SHM_RING_FDS)
+                c->passed_fds[c->num_passed_fds++] = fds[i];
+            else
+                close(fds[i]);
+        }
+    }
+    return r;
+}
+
+int conn_attach_ring(Connection* c) {
+    struct stat st;
+    ShmRing* ring = MAP_FAILED;
+
+    if (!c->ring && c->num_passed_fds == SHM_RING_FDS && fstat(c->passed_fds[0], &st) == 0 &&
+        (size_t)st.st_size > sizeof(ShmRing))
+        ring = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, c->passed_fds[0], 0);
+
+    if (ring == MAP_FAILED) {
+        close_passed_fds(c);
+        return -1;
+    }
+
+    // El tamano se lee una vez y tiene que coincidir con el del memfd
+    uint32_t size = __atomic_load_n(&ring->size, __ATOMIC_RELAXED);
+    if (ring->magic != SHM_RING_MAGIC || size == 0 || (size & (size - 1)) != 0 ||
+        shm_ring_bytes(size) != (size_t)st.st_size) {
+        munmap(ring, st.st_size);
+        close_passed_fds(c);
+        return -1;
+    }
+
+    c->ring = ring;
+    c->ring_size = size;
+    c->ring_mem_fd = c->passed_fds[0];
+    c->ring_data_fd = c->passed_fds[1];
+    c->ring_space_fd = c->passed_fds[2];
+    c->num_passed_fds = 0;
+
+    // Los eventfd los creo el gateway: el lector nunca se tiene que
+    // bloquear en ellos
+    fcntl(c->ring_data_fd, F_SETFL, O_NONBLOCK);
+    fcntl(c->ring_space_fd, F_SETFL, O_NONBLOCK);
+
+    if (c->epoll_fd >= 0) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+
+        if (epoll_ctl(c->epoll_fd, EPOLL_CTL_ADD, c->ring_data_fd, &ev) < 0) {
+            detach_ring(c);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int conn_ring_read(Connection* c, char* buf, size_t len) {
+    size_t n = shm_ring_read(c->ring, c->ring_size, buf, len);
+    uint64_t one = 1;
+
+    if (n > 0 && shm_ring_wake(&c->ring->producer_waiting) &&
+        write(c->ring_space_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        LOG_WARN("[BROKER] eventfd del gateway local: %s", strerror(errno));
+    return (int)n;
+}
+
+int conn_ring_idle(Connection* c) {
+    uint64_t count;
+
+    // Primero se vacia el eventfd: un aviso que llegue despues queda
+    if (read(c->ring_data_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        return 1;
+    return shm_ring_sleep(c->ring, &c->ring->consumer_waiting, 0);
+}
+
+void conn_ring_poke(Connection* c) {
+    uint64_t one = 1;
+    if (write(c->ring_data_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        LOG_WARN("[BROKER] eventfd del gateway local: %s", strerror(errno));
+}
+
+
+// =========================================================
+// API
+// =========================================================
+
+Connection* conn_create(int socket, int queue_len, SlowConsumerPolicy policy) {
+    Connection* c = calloc(1, sizeof(Connection));
+    if (!c)
+        return NULL;
+
+    c->out_len = queue_len > 0 ? queue_len : DEFAULT_OUT_QUEUE_LEN;
+    c->out_cap = c->out_len;
+    c->out = calloc(c->out_cap, sizeof(OutMsg));
+    if (!c->out) {
+        free(c);
+        return NULL;
+    }
+
+    c->socket = socket;
+    c->epoll_fd = -1;
+    c->ring_mem_fd = -1;
+    c->ring_data_fd = -1;
+    c->ring_space_fd = -1;
+    c->out_seq = 1;               // 0 en el indice de conflacion = libre
+    framer_init(&c->framer);
+    c->policy = policy;
+    c->refs = 1;
+    pthread_mutex_init(&c->out_mutex, NULL);
+    return c;
+}
+
+void conn_retain(Connection* c) {
+    __atomic_add_fetch(&c->refs, 1, __ATOMIC_RELAXED);
+}
+
+void conn_release(Connection* c) {
+    if (__atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    queue_clear(c);
+    free(c->out);
+    free(c->latest);
+    close_passed_fds(c);
+    pthread_mutex_destroy(&c->out_mutex);
+    free(c);
+}
+
+// Encola con out_mutex tomado; la cola se queda con la referencia a
+// 'msg'. Devuelve 0, o -1 si se descarto (y la referencia se suelta).
+static int enqueue_locked(Connection* c, Message* msg, int control, int conflate) {
+    if (c->closed) {
+        message_release(msg);
+        return -1;
+    }
+
+    // Las entregas ocupan hasta out_len; las respuestas de control, que
+    // no se descartan, pueden usar ademas la reserva
+    if (control ? c->out_count == c->out_cap : c->out_count >= c->out_len) {
+        int room = control ? queue_grow(c) == 0 : 0;
+
+        if (!room && control) {
+            // Manda comandos y no lee las respuestas: no se le guardan mas
+            LOG_WARN("[BROKER] Cliente que no lee sus respuestas desconectado (socket %d)", c->socket);
+            shutdown(c->socket, SHUT_RDWR);
+            queue_clear(c);
+        } else if (!room) {
+            c->dropped++;
+
+            switch (c->policy) {
+                case SLOW_DROP_OLDEST:
+                    queue_drop_oldest(c);
+                    room = 1;
+                    break;
+                case SLOW_DROP_NEWEST:
+                    break;
+                case SLOW_DISCONNECT:
+                    LOG_WARN("[BROKER] Suscriptor lento desconectado (socket %d)", c->socket);
+                    shutdown(c->socket, SHUT_RDWR);
+                    queue_clear(c);
+                    break;
+            }
+        }
+
+        if (!room) {
+            message_release(msg);
+            return -1;
+        }
+    }
+
+    OutMsg* m = &c->out[(c->out_head + c->out_count) % c->out_cap];
+    out_set(c, m, msg);
+    m->conflate = conflate;
+    c->out_count++;
+    return 0;
+}
+
+int conn_send(Connection* c, const char* data, size_t len, int control) {
+    Message* m = message_create_raw(data, len);
+    if (!m)
+        return -1;
+
+    pthread_mutex_lock(&c->out_mutex);
+
+    int r = enqueue_locked(c, m, control, 0);
+    if (r == 0)
+        flush_locked(c);
+
+    pthread_mutex_unlock(&c->out_mutex);
+    return r;
+}
+
+int conn_queue(Connection* c, Message* msg, int conflate) {
+    message_retain(msg);
+
+    pthread_mutex_lock(&c->out_mutex);
+
+    unsigned long* slot = conflate && !c->closed ? latest_slot(c, msg) : NULL;
+    if (slot && queue_replace(c, *slot, msg)) {
+        // Ya habia un vaciado pendiente por la entrega reemplazada
+        pthread_mutex_unlock(&c->out_mutex);
+        return 0;
+    }
+
+    int r = enqueue_locked(c, msg, 0, conflate);
+    if (r == 0 && slot)
+        *slot = c->out_seq + c->out_count - 1;
+    if (r == 0 && !c->flush_owed) {
+        c->flush_owed = 1;
+        r = 1;
+    }
+
+    pthread_mutex_unlock(&c->out_mutex);
+    return r;
+}
+
+int conn_flush(Connection* c) {
+    pthread_mutex_lock(&c->out_mutex);
+    int pending = flush_locked(c);
+    pthread_mutex_unlock(&c->out_mutex);
+    return pending;
+}
+
+int conn_has_pending(Connection* c) {
+    pthread_mutex_lock(&c->out_mutex);
+    int pending = c->out_count > 0;
+    pthread_mutex_unlock(&c->out_mutex);
+    return pending;
+}
+
+int conn_backlog(Connection* c) {
+    pthread_mutex_lock(&c->out_mutex);
+    int n = c->closed || c->out_count >= c->out_len ? -1 : c->out_count;
+    pthread_mutex_unlock(&c->out_mutex);
+    return n;
+}
+
+void conn_close(Connection* c) {
+    pthread_mutex_lock(&c->out_mutex);
+
+    if (!c->closed) {
+        if (c->epoll_fd >= 0)
+            epoll_ctl(c->epoll_fd, EPOLL_CTL_DEL, c->socket, NULL);
+        close(c->socket);
+        c->closed = 1;
+        queue_clear(c);
+    }
+
+    pthread_mutex_unlock(&c->out_mutex);
+
+    detach_ring(c);
+}
+
+char* conn_take_output(Connection* c, size_t* len) {
+    size_t total = 0;
+
+    pthread_mutex_lock(&c->out_mutex);
+
+    for (int i = 0; i < c->out_count; i++)
+        total += c->out[(c->out_head + i) % c->out_cap].len;
+    total -= c->out_count > 0 ? c->out_offset : 0;
+
+    char* buf = total > 0 ? malloc(total) : NULL;
+    size_t pos = 0;
+
+    if (buf) {
+        for (int i = 0; i < c->out_count; i++) {
+            OutMsg* m = &c->out[(c->out_head + i) % c->out_cap];
+            size_t skip = i == 0 ? c->out_offset : 0;
+
+            memcpy(buf + pos, m->data + skip, m->len - skip);
+            pos += m->len - skip;
+        }
+    }
+    queue_clear(c);
+
+    pthread_mutex_unlock(&c->out_mutex);
+
+    *len = pos;
+    return buf;
+}
@@ -0,0 +1,176 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include "protocol.h"
+#include "message.h"
+#include "shm_ring.h"
+
+// =========================================================
+// Conexion de un cliente con su cola de salida acotada.
+//
+// Toda escritura hacia el cliente pasa por la cola y se vacia con
+// send() no bloqueante, asi un suscriptor lento nunca frena a quien
+// publica. Lo que no se pudo enviar queda pendiente hasta que el
+// socket vuelva a aceptar datos (EPOLLOUT / POLLOUT).
+//
+// Cada vaciado junta hasta FLUSH_IOV mensajes de la cola en un solo
+// sendmsg(). Quien publica muchos mensajes seguidos puede encolarlos con
+// conn_queue() y vaciar cada conexion una vez al final.
+//
+// La cola no copia: guarda una referencia al Message y apunta a la
+// codificacion (texto o frame) que negocio la conexion.
+//
+// Conflacion: una entrega marcada 'conflate' (suscripcion CONFLATE) que
+// encuentra en la cola otra del mismo topic todavia sin enviar la
+// reemplaza en su lugar. Un suscriptor atrasado tiene asi a lo sumo una
+// entrega pendiente por topic y, al ponerse al dia, recibe el ultimo
+// valor de cada uno.
+// =========================================================
+
+#define DEFAULT_OUT_QUEUE_LEN 1024
+#define FLUSH_IOV 64
+
+// Lugar extra para respuestas de control (OK/ERROR/CREDIT) con la cola
+// llena. Un cliente que agota tambien la reserva no lee lo que pide y
+// se desconecta.
+#define CONN_CONTROL_RESERVE 64
+
+// Que hacer cuando la cola de un suscriptor esta llena
+typedef enum {
+    SLOW_DROP_OLDEST = 0,
+    SLOW_DROP_NEWEST,
+    SLOW_DISCONNECT
+} SlowConsumerPolicy;
+
+typedef struct {
+    Message* msg;
+    const char* data;             // msg->text o msg->frame
+    size_t len;
+    int conflate;                 // la puede reemplazar una mas nueva del topic
+} OutMsg;
+
+typedef struct Connection {
+    int socket;
+    int epoll_fd;                 // -1 en modo hilo por conexion
+
+    Framer framer;                // entrada: solo la toca quien lee el socket
+    int negotiated;               // ya recibio un comando (HELLO solo va primero)
+    int binary;                   // salida en frames de wire.h (tras HELLO BINARY)
+
+    // Lo que registro esta conexion en el broker; lo toca solo su lector
+    // y se deshace al desconectarse.
+    struct OwnedFilter* owned_filters;
+    struct GatewayClient* owned_gateways;
+
+    // Control de flujo de un gateway: PUBLISH que puede mandar antes de
+    // recibir mas credito. Tambien lo toca solo su lector.
+    int credit_window;            // 0 = sin control de flujo
+    int credit;                   // negativo si se paso
+    unsigned long credit_overruns;  // PUBLISH recibidos sin credito
+    struct TokenBucket* rate_bucket;  // limite del gateway registrado, o NULL
+
+    pthread_mutex_t out_mutex;    // protege la cola y el socket al escribir
+    OutMsg* out;                  // buffer circular de mensajes
+    int out_len;                  // entregas como maximo
+    int out_cap;                  // hasta out_len + CONN_CONTROL_RESERVE
+    int out_head;
+    int out_count;
+    unsigned long out_seq;        // numero de la entrada en out_head (desde 1)
+    size_t out_offset;            // bytes ya enviados del primer mensaje
+    int want_write;               // EPOLLOUT registrado
+    int flush_owed;               // alguien encolo con conn_queue() y debe vaciar
+
+    // Ultima entrega reemplazable de cada topic: numero de entrada,
+    // indexado por hash del topic (se crea con la primera). Un valor
+    // viejo o de otro topic solo hace que no se reemplace.
+    unsigned long* latest;
+    int latest_cap;               // potencia de 2
+
+    SlowConsumerPolicy policy;
+    unsigned long dropped;
+    unsigned long conflated;      // entregas reemplazadas por una mas nueva
+
+    struct Stats* stats;          // cuenta los bytes enviados, o NULL
+
+    // Gateway local (shm_ring.h): la entrada llega por un ring en memoria
+    // compartida; el socket queda para las respuestas. Lo toca solo su
+    // lector.
+    int local;                    // socket Unix: puede recibir descriptores
+    int passed_fds[SHM_RING_FDS]; // recibidos con el ultimo recvmsg
+    int num_passed_fds;
+    struct ShmRing* ring;         // NULL: entrada por el socket
+    uint32_t ring_size;           // validado al mapear
+    int ring_mem_fd;              // memfd del ring (para un traspaso)
+    int ring_data_fd;             // eventfd: el gateway escribio
+    int ring_space_fd;            // eventfd: el broker libero lugar
+
+    // Puentes entre brokers (ver broker.c). 'bridge': la abrio este
+    // broker hacia otro, lo que llega son entregas para republicar.
+    // 'peer': la abrio otro broker (BRIDGE), con ese nombre; recibe las
+    // entregas en frames WIRE_RELAY.
+    struct Bridge* bridge;
+    struct Origin* peer;
+
+    // Registro de conexiones vivas del broker (su mutex_connections)
+    struct Connection* prev_conn;
+    struct Connection* next_conn;
+
+    int closed;
+    int refs;
+} Connection;
+
+Connection* conn_create(int socket, int queue_len, SlowConsumerPolicy policy);
+void conn_retain(Connection* c);
+void conn_release(Connection* c);
+
+// Encola y trata de enviar. 'control' marca respuestas del protocolo
+// (OK/ERROR), que no se descartan aunque la cola este llena: usan la
+// reserva y, si tambien se agota, la conexion se corta.
+// Devuelve 0 si quedo encolado, -1 si se descarto.
+int  conn_send(Connection* c, const char* data, size_t len, int control);
+
+// Encola una entrega (retiene 'msg') sin enviar. Devuelve 1 si el que
+// llama queda a cargo de llamar a conn_flush() (la primera vez desde el
+// ultimo vaciado), 0 si otro ya lo esta, -1 si el mensaje se descarto.
+// Con 'conflate' reemplaza la entrega pendiente del mismo topic, si hay.
+int  conn_queue(Connection* c, Message* msg, int conflate);
+
+// Envia lo pendiente sin bloquear. Devuelve 1 si queda algo pendiente.
+int  conn_flush(Connection* c);
+int  conn_has_pending(Connection* c);
+
+// Entregas en cola sin enviar, o -1 si la conexion esta cerrada o su
+// cola esta llena (una entrega mas se descartaria).
+int  conn_backlog(Connection* c);
+
+// Cierra el socket (lo llama solo el hilo/loop que lee de la conexion).
+void conn_close(Connection* c);
+
+// Saca de la cola los bytes que faltaba enviar (desde la mitad del
+// primer mensaje, si quedo a medias) en un buffer nuevo. Es para pasar
+// la conexion a otro proceso: nadie mas la puede estar usando.
+char* conn_take_output(Connection* c, size_t* len);
+
+// Lee del socket como recv(). En un socket Unix guarda ademas los
+// descriptores que vengan adjuntos (para "HELLO SHM").
+int  conn_recv(Connection* c, char* buf, size_t len);
+
+// Mapea el ring que paso el gateway y lo anota en el epoll de la
+// conexion. Devuelve 0, o -1 si los descriptores no son validos.
+int  conn_attach_ring(Connection* c);
+
+// Lee del ring y despierta al gateway si esperaba lugar. Devuelve los
+// bytes leidos (0 si no hay nada).
+int  conn_ring_read(Connection* c, char* buf, size_t len);
+
+// Se llama al quedar vacio el ring: devuelve 1 si el gateway va a avisar
+// por ring_data_fd, 0 si ya llego algo y hay que seguir leyendo.
+int  conn_ring_idle(Connection* c);
+
+// Se reaviso a si mismo: el lector dejo datos en el ring para la proxima
+// vuelta del loop.
+void conn_ring_poke(Connection* c);
+
+#endif
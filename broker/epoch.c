@@ -0,0 +1,46 @@
+#include "epoch.h"
+#include <string.h>
+#include <sched.h>
+
+// Cada hilo usa siempre la misma franja (se asigna la primera vez)
+static __thread int stripe_of_thread = -1;
+static int next_stripe;
+
+static int my_stripe(void) {
+    if (stripe_of_thread < 0)
+        stripe_of_thread = __atomic_fetch_add(&next_stripe, 1, __ATOMIC_RELAXED) % EPOCH_STRIPES;
+    return stripe_of_thread;
+}
+
+void epoch_init(EpochDomain* d) {
+    memset(d, 0, sizeof(EpochDomain));
+}
+
+int epoch_enter(EpochDomain* d) {
+    int stripe = my_stripe();
+    int parity = __atomic_load_n(&d->parity, __ATOMIC_SEQ_CST);
+
+    __atomic_add_fetch(&d->stripes[stripe].readers[parity], 1, __ATOMIC_SEQ_CST);
+    return stripe * 2 + parity;
+}
+
+void epoch_exit(EpochDomain* d, int token) {
+    __atomic_sub_fetch(&d->stripes[token / 2].readers[token % 2], 1, __ATOMIC_RELEASE);
+}
+
+static void wait_for_readers(EpochDomain* d, int parity) {
+    for (int i = 0; i < EPOCH_STRIPES; i++)
+        while (__atomic_load_n(&d->stripes[i].readers[parity], __ATOMIC_ACQUIRE) != 0)
+            sched_yield();
+}
+
+// Un lector pudo leer la paridad vieja justo antes del cambio y sumarse
+// despues: por eso se cambia y se espera dos veces (como userspace RCU).
+// Tras las dos esperas, todo lector que vio la version anterior salio.
+void epoch_synchronize(EpochDomain* d) {
+    for (int round = 0; round < 2; round++) {
+        int old = __atomic_load_n(&d->parity, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&d->parity, !old, __ATOMIC_SEQ_CST);
+        wait_for_readers(d, old);
+    }
+}
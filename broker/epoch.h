@@ -0,0 +1,41 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+// =========================================================
+// Reclamacion por epocas (estilo RCU) para estructuras de solo
+// lectura que se reemplazan enteras.
+//
+// Los lectores marcan su seccion con epoch_enter()/epoch_exit(): dos
+// operaciones atomicas sobre un contador propio del hilo, sin mutex.
+// Quien reemplaza una version publica la nueva y llama a
+// epoch_synchronize(), que vuelve cuando ya no queda ningun lector que
+// haya podido ver la anterior; recien ahi se puede liberar.
+//
+// Los contadores se reparten en EPOCH_STRIPES lineas de cache para que
+// lectores en distintos cores no compitan por la misma.
+// =========================================================
+
+#define EPOCH_STRIPES 64
+
+typedef struct {
+    long readers[2];                 // lectores activos por paridad
+    char pad[64 - 2 * sizeof(long)];
+} EpochStripe;
+
+typedef struct {
+    int parity;                      // a que contador entran los lectores nuevos
+    EpochStripe stripes[EPOCH_STRIPES];
+} EpochDomain;
+
+void epoch_init(EpochDomain* d);
+
+// Devuelve un token que hay que pasar a epoch_exit().
+int  epoch_enter(EpochDomain* d);
+void epoch_exit(EpochDomain* d, int token);
+
+// Espera a que terminen todos los lectores que entraron antes de la
+// llamada. No se debe llamar desde dentro de una seccion de lectura, y
+// los que escriben deben estar serializados entre si.
+void epoch_synchronize(EpochDomain* d);
+
+#endif
@@ -0,0 +1,747 @@
+#include "broker.h"
+#include "series.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// =========================================================
+// TABLA DE TOPICS
+// =========================================================
+
+#define HISTORY_INITIAL_BUCKETS 64
+
+static unsigned int hash_topic(const char* topic) {
+    unsigned int h = 2166136261u;   // FNV-1a
+    while (*topic) {
+        h ^= (unsigned char)*topic++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static TopicHistory* find_topic(HistoryStore* store, const char* topic) {
+    TopicHistory* t = store->buckets[hash_topic(topic) & (store->num_buckets - 1)];
+    while (t) {
+        if (strcmp(t->topic, topic) == 0)
+            return t;
+        t = t->next;
+    }
+    return NULL;
+}
+
+// Se llama con el lock de la tabla tomado en escritura.
+static void grow_table(HistoryStore* store) {
+    unsigned int size = store->num_buckets * 2;
+    TopicHistory** buckets = calloc(size, sizeof(TopicHistory*));
+    if (!buckets)
+        return;
+
+    for (unsigned int i = 0; i < store->num_buckets; i++) {
+        TopicHistory* t = store->buckets[i];
+        while (t) {
+            TopicHistory* nx = t->next;
+            unsigned int b = hash_topic(t->topic) & (size - 1);
+            t->next = buckets[b];
+            buckets[b] = t;
+            t = nx;
+        }
+    }
+
+    free(store->buckets);
+    store->buckets = buckets;
+    store->num_buckets = size;
+}
+
+static TopicHistory* create_topic(HistoryStore* store, const char* topic) {
+    TopicHistory* t = calloc(1, sizeof(TopicHistory));
+    if (!t)
+        return NULL;
+
+    // 'depth' mensajes ocupan a lo sumo depth / LEN + 2 bloques (el mas
+    // viejo puede estar a medio vaciar)
+    t->block_cap = store->depth / HISTORY_BLOCK_LEN + 2;
+    t->blocks = calloc(t->block_cap, sizeof(HistoryBlock*));
+    if (!t->blocks) {
+        free(t);
+        return NULL;
+    }
+
+    strncpy(t->topic, topic, MAX_TOPIC_LEN - 1);
+    pthread_mutex_init(&t->mutex, NULL);
+
+    __atomic_add_fetch(&store->bytes, sizeof(TopicHistory) + t->block_cap * sizeof(HistoryBlock*),
+                       __ATOMIC_RELAXED);
+    return t;
+}
+
+static void free_topic(TopicHistory* t) {
+    for (int i = 0; i < t->num_blocks; i++) {
+        HistoryBlock* b = t->blocks[(t->first_block + i) % t->block_cap];
+        if (b->encoding == BLOCK_OPEN)
+            for (int j = b->start; j < b->count; j++)
+                message_release(b->msgs[j]);
+        free(b);
+    }
+
+    pthread_mutex_destroy(&t->mutex);
+    free(t->spare);
+    free(t->blocks);
+    free(t);
+}
+
+static TopicHistory* get_topic(HistoryStore* store, const char* topic) {
+    pthread_rwlock_rdlock(&store->lock);
+    TopicHistory* t = find_topic(store, topic);
+    pthread_rwlock_unlock(&store->lock);
+
+    if (t)
+        return t;
+
+    pthread_rwlock_wrlock(&store->lock);
+
+    t = find_topic(store, topic);
+    if (!t && (t = create_topic(store, topic)) != NULL) {
+        if (store->num_topics >= store->num_buckets)
+            grow_table(store);
+
+        unsigned int b = hash_topic(topic) & (store->num_buckets - 1);
+        t->next = store->buckets[b];
+        store->buckets[b] = t;
+        store->num_topics++;
+    }
+
+    pthread_rwlock_unlock(&store->lock);
+    return t;
+}
+
+
+// =========================================================
+// LECTURAS DE GATEWAY
+// =========================================================
+
+// Mayor payload que se arma desde un bloque BLOCK_SERIES.
+#define READING_MAX_LEN 96
+#define READING_MAX_DECIMALS 9
+
+static int format_reading(char* out, size_t cap, double value, int decimals, int64_t ts) {
+    return snprintf(out, cap, "{\"value\":%.*f,\"timestamp\":%lld}",
+                    decimals, value, (long long)ts);
+}
+
+// Reconoce {"value":<numero>,"timestamp":<entero>} tal como lo arma el
+// gateway. Solo se acepta si al volver a formatearlo se obtienen los
+// mismos bytes: el payload que se reconstruye es identico al original.
+static int parse_reading(const char* data, size_t len, double* value, int* decimals, int64_t* ts) {
+    static const char head[] = "{\"value\":";
+    char buf[READING_MAX_LEN];
+
+    if (len >= sizeof(buf) || len < sizeof(head) || memcmp(data, head, sizeof(head) - 1) != 0)
+        return 0;
+
+    memcpy(buf, data, len);
+    buf[len] = '\0';
+
+    char* num = buf + sizeof(head) - 1;
+    char* end;
+    *value = strtod(num, &end);
+    if (end == num)
+        return 0;
+
+    const char* dot = memchr(num, '.', end - num);
+    *decimals = dot ? (int)(end - dot - 1) : 0;
+    if (*decimals > READING_MAX_DECIMALS)
+        return 0;
+
+    if (strncmp(end, ",\"timestamp\":", 13) != 0)
+        return 0;
+    *ts = strtoll(end + 13, NULL, 10);
+
+    char check[READING_MAX_LEN];
+    int n = format_reading(check, sizeof(check), *value, *decimals, *ts);
+    return n == (int)len && memcmp(check, data, len) == 0;
+}
+
+
+// =========================================================
+// BLOQUES
+// =========================================================
+
+// Lo que ocupa un Message armado por message_create.
+static size_t message_size(const Message* m) {
+    return sizeof(Message) + m->frame_len + 1 + m->text_len + m->topic_len + 1;
+}
+
+static void account(HistoryStore* store, long delta) {
+    __atomic_add_fetch(&store->bytes, (size_t)delta, __ATOMIC_RELAXED);
+}
+
+// i = 0 es el bloque mas viejo.
+static HistoryBlock* block_at(const TopicHistory* t, int i) {
+    return t->blocks[(t->first_block + i) % t->block_cap];
+}
+
+#define OPEN_BLOCK_SIZE \
+    (sizeof(HistoryBlock) + HISTORY_BLOCK_LEN * (sizeof(Message*) + sizeof(time_t)))
+
+static HistoryBlock* new_open_block(HistoryStore* store, TopicHistory* t) {
+    HistoryBlock* b = t->spare;
+
+    if (b) {
+        t->spare = NULL;
+    } else {
+        b = malloc(OPEN_BLOCK_SIZE);
+        if (!b)
+            return NULL;
+        b->msgs = (Message**)b->data;
+        b->keys = (time_t*)(b->data + HISTORY_BLOCK_LEN * sizeof(Message*));
+        b->size = OPEN_BLOCK_SIZE;
+        account(store, OPEN_BLOCK_SIZE);
+    }
+
+    b->encoding = BLOCK_OPEN;
+    b->start = 0;
+    b->count = 0;
+    return b;
+}
+
+static void free_block(HistoryStore* store, TopicHistory* t, HistoryBlock* b) {
+    if (t->head == b)
+        t->head = NULL;
+
+    if (b->encoding == BLOCK_OPEN && !t->spare) {
+        t->spare = b;
+        return;
+    }
+
+    account(store, -(long)b->size);
+    free(b);
+}
+
+// Arma la forma sellada de un bloque lleno en 'out' (con lugar para el
+// peor caso): dos bytes de cabecera (decimales y primera posicion) y el
+// flujo de bits con una columna detras de otra. La de claves va primero,
+// asi leer solo las claves no decodifica nada mas. Devuelve los bytes
+// usados, o 0 si el bloque no se puede sellar.
+static size_t pack_block(const HistoryBlock* b, unsigned char* out, BlockEncoding* encoding) {
+    double values[HISTORY_BLOCK_LEN];
+    int64_t stamps[HISTORY_BLOCK_LEN];
+    int decimals = -1;
+    int series = 1;
+
+    for (int i = b->start; i < b->count; i++) {
+        Message* m = b->msgs[i];
+        int d = 0;
+
+        if (m->timestamp != b->keys[i])
+            return 0;
+
+        if (series && (!parse_reading(m->data, m->data_len, &values[i], &d, &stamps[i]) ||
+                       (decimals >= 0 && d != decimals)))
+            series = 0;
+        decimals = d;
+    }
+
+    SeriesTime st = {0};
+    BitWriter w = { out + 2, 0 };
+
+    out[1] = (unsigned char)b->start;
+
+    if (series) {
+        SeriesXor sx = {0};
+
+        out[0] = (unsigned char)decimals;
+        for (int i = b->start; i < b->count; i++)
+            series_put_time(&w, &st, b->keys[i]);
+        for (int i = b->start; i < b->count; i++)
+            series_put_double(&w, &sx, values[i]);
+        for (int i = b->start; i < b->count; i++)
+            series_put_int(&w, stamps[i] - b->keys[i]);
+
+        *encoding = BLOCK_SERIES;
+        return 2 + bits_bytes(&w);
+    }
+
+    // Claves y largos en bits; los payloads despues, alineados a byte
+    out[0] = 0;
+    for (int i = b->start; i < b->count; i++)
+        series_put_time(&w, &st, b->keys[i]);
+    for (int i = b->start; i < b->count; i++)
+        series_put_int(&w, (int64_t)b->msgs[i]->data_len);
+
+    size_t len = 2 + bits_bytes(&w);
+    for (int i = b->start; i < b->count; i++) {
+        memcpy(out + len, b->msgs[i]->data, b->msgs[i]->data_len);
+        len += b->msgs[i]->data_len;
+    }
+
+    *encoding = BLOCK_PACKED;
+    return len;
+}
+
+// Reemplaza un bloque abierto y lleno por su forma sellada. Si no se
+// puede (reloj que retrocedio, falta de memoria) queda abierto.
+static void seal_block(HistoryStore* store, TopicHistory* t, int i) {
+    HistoryBlock* b = block_at(t, i);
+    size_t payload = 0;
+
+    for (int j = b->start; j < b->count; j++)
+        payload += b->msgs[j]->data_len;
+
+    size_t worst = 2 + HISTORY_BLOCK_LEN * (SERIES_TIME_MAX_BITS + SERIES_DOUBLE_MAX_BITS +
+                                            SERIES_INT_MAX_BITS) / 8 + 1 + payload;
+    unsigned char* out = malloc(worst);
+    if (!out)
+        return;
+
+    BlockEncoding encoding;
+    size_t len = pack_block(b, out, &encoding);
+
+    HistoryBlock* sealed = len ? malloc(sizeof(HistoryBlock) + len) : NULL;
+    if (!sealed) {
+        free(out);
+        return;
+    }
+
+    sealed->encoding = encoding;
+    sealed->start = b->start;
+    sealed->count = b->count;
+    sealed->last_key = b->last_key;
+    sealed->size = sizeof(HistoryBlock) + len;
+    sealed->msgs = NULL;
+    sealed->keys = NULL;
+    memcpy(sealed->data, out, len);
+    free(out);
+
+    account(store, (long)sealed->size);
+    for (int j = b->start; j < b->count; j++) {
+        account(store, -(long)message_size(b->msgs[j]));
+        message_release(b->msgs[j]);
+    }
+
+    t->blocks[(t->first_block + i) % t->block_cap] = sealed;
+    free_block(store, t, b);
+}
+
+// Posiciones de un bloque sellado: claves y, si 'text' no es NULL, los
+// payloads (apuntan al bloque o a 'text', que necesita
+// HISTORY_BLOCK_LEN * READING_MAX_LEN bytes). Sin 'text' se lee solo la
+// columna de claves.
+static void unpack_block(const HistoryBlock* b, time_t* keys,
+                         const char** data, size_t* lens, char* text) {
+    BitReader r = { b->data + 2, b->size - sizeof(HistoryBlock) - 2, 0 };
+    SeriesTime st = {0};
+    int base = b->data[1];
+
+    for (int i = base; i < b->count; i++)
+        keys[i] = (time_t)series_get_time(&r, &st);
+
+    if (!text)
+        return;
+
+    if (b->encoding == BLOCK_SERIES) {
+        double values[HISTORY_BLOCK_LEN];
+        SeriesXor sx = {0};
+        int decimals = b->data[0];
+
+        for (int i = base; i < b->count; i++)
+            values[i] = series_get_double(&r, &sx);
+
+        for (int i = base; i < b->count; i++) {
+            int64_t ts = keys[i] + series_get_int(&r);
+
+            if (i >= b->start) {
+                char* out = text + i * READING_MAX_LEN;
+                data[i] = out;
+                lens[i] = format_reading(out, READING_MAX_LEN, values[i], decimals, ts);
+            }
+        }
+        return;
+    }
+
+    for (int i = base; i < b->count; i++)
+        lens[i] = (size_t)series_get_int(&r);
+
+    const char* p = (const char*)b->data + 2 + (r.pos + 7) / 8;
+    for (int i = base; i < b->count; i++) {
+        data[i] = p;
+        p += lens[i];
+    }
+}
+
+static int push_message(HistoryStore* store, TopicHistory* t, Message* msg) {
+    HistoryBlock* b = t->num_blocks ? block_at(t, t->num_blocks - 1) : NULL;
+
+    if (!b || b->count == HISTORY_BLOCK_LEN) {
+        if (t->num_blocks == t->block_cap)
+            return -1;
+
+        if (b)
+            seal_block(store, t, t->num_blocks - 1);
+
+        b = new_open_block(store, t);
+        if (!b)
+            return -1;
+
+        t->blocks[(t->first_block + t->num_blocks) % t->block_cap] = b;
+        t->num_blocks++;
+    }
+
+    // La clave nunca retrocede: el indice queda ordenado aunque dos
+    // publicaciones del mismo segundo lleguen cruzadas
+    time_t key = msg->timestamp > t->last_key ? msg->timestamp : t->last_key;
+
+    b->msgs[b->count] = msg;
+    b->keys[b->count] = key;
+    b->last_key = key;
+    b->count++;
+    account(store, (long)message_size(msg));
+
+    t->last_key = key;
+    t->count++;
+    return 0;
+}
+
+// Suelta el mensaje mas viejo; un bloque que queda vacio se libera.
+static void pop_oldest(HistoryStore* store, TopicHistory* t) {
+    HistoryBlock* b = block_at(t, 0);
+
+    if (b->encoding == BLOCK_OPEN) {
+        account(store, -(long)message_size(b->msgs[b->start]));
+        message_release(b->msgs[b->start]);
+    }
+    b->start++;
+    t->count--;
+
+    if (b->start == b->count) {
+        t->first_block = (t->first_block + 1) % t->block_cap;
+        t->num_blocks--;
+        free_block(store, t, b);
+    }
+}
+
+// Las claves de un bloque sellado se decodifican una vez, cuando pasa a
+// ser el mas viejo.
+static time_t oldest_key(TopicHistory* t) {
+    HistoryBlock* b = block_at(t, 0);
+
+    if (b->encoding == BLOCK_OPEN)
+        return b->keys[b->start];
+
+    if (t->head != b) {
+        unpack_block(b, t->head_keys, NULL, NULL, NULL);
+        t->head = b;
+    }
+    return t->head_keys[b->start];
+}
+
+// Descarta desde el mas viejo los mensajes que superan max_age.
+static void evict_expired(HistoryStore* store, TopicHistory* t, time_t now) {
+    if (store->max_age <= 0)
+        return;
+
+    while (t->count > 0 && now - oldest_key(t) > store->max_age)
+        pop_oldest(store, t);
+}
+
+// Primer bloque cuya ultima clave es >= since, o -1 si no hay.
+static int seek_block(const TopicHistory* t, time_t since) {
+    int lo = 0, hi = t->num_blocks;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (block_at(t, mid)->last_key < since)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < t->num_blocks ? lo : -1;
+}
+
+// Primera posicion de [lo, hi) con clave >= since.
+static int seek_key(const time_t* keys, int lo, int hi, time_t since) {
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (keys[mid] < since)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Los resultados van por clave y, a igual clave, por orden de llegada.
+static int hit_after(const HistoryHit* a, const HistoryHit* b) {
+    if (a->key != b->key)
+        return a->key > b->key;
+    return a->seq > b->seq;
+}
+
+// Mientras se junta, 'r' es un heap de a lo sumo 'limit' hits con el mas
+// nuevo arriba. Uno con esta clave entra si hay lugar o si es anterior
+// al de arriba (a igual clave llego despues y queda afuera).
+static int result_accepts(const HistoryResult* r, time_t key, int limit) {
+    return r->count < limit || (r->count > 0 && key < r->hits[0].key);
+}
+
+static void heap_up(HistoryHit* h, int i) {
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!hit_after(&h[i], &h[parent]))
+            break;
+        HistoryHit tmp = h[i];
+        h[i] = h[parent];
+        h[parent] = tmp;
+        i = parent;
+    }
+}
+
+static void heap_down(HistoryHit* h, int count, int i) {
+    while (1) {
+        int top = i;
+        int l = 2 * i + 1, r = l + 1;
+        if (l < count && hit_after(&h[l], &h[top]))
+            top = l;
+        if (r < count && hit_after(&h[r], &h[top]))
+            top = r;
+        if (top == i)
+            break;
+        HistoryHit tmp = h[i];
+        h[i] = h[top];
+        h[top] = tmp;
+        i = top;
+    }
+}
+
+// Solo si result_accepts(): con el heap lleno reemplaza al mas nuevo.
+static int result_add(HistoryResult* r, Message* msg, time_t key, int limit) {
+    HistoryHit hit = { msg, key, r->next_seq++ };
+
+    if (r->count == limit) {
+        message_release(r->hits[0].msg);
+        message_retain(msg);
+        r->hits[0] = hit;
+        heap_down(r->hits, r->count, 0);
+        return 0;
+    }
+
+    if (r->count == r->cap) {
+        int cap = r->cap ? r->cap * 2 : 64;
+        HistoryHit* hits = realloc(r->hits, cap * sizeof(HistoryHit));
+        if (!hits)
+            return -1;
+        r->hits = hits;
+        r->cap = cap;
+    }
+
+    message_retain(msg);
+    r->hits[r->count] = hit;
+    heap_up(r->hits, r->count++);
+    return 0;
+}
+
+// Posiciones de un bloque, abierto o sellado.
+typedef struct {
+    time_t keys[HISTORY_BLOCK_LEN];
+    const char* data[HISTORY_BLOCK_LEN];
+    size_t lens[HISTORY_BLOCK_LEN];
+    char text[HISTORY_BLOCK_LEN * READING_MAX_LEN];
+} BlockView;
+
+static const time_t* view_block(const HistoryBlock* b, BlockView* v) {
+    if (b->encoding == BLOCK_OPEN)
+        return b->keys;
+
+    unpack_block(b, v->keys, v->data, v->lens, v->text);
+    return v->keys;
+}
+
+// Referencia propia al mensaje de la posicion 'i' (NULL si falta memoria).
+static Message* view_message(const TopicHistory* t, const HistoryBlock* b,
+                             const BlockView* v, int i) {
+    if (b->encoding == BLOCK_OPEN) {
+        message_retain(b->msgs[i]);
+        return b->msgs[i];
+    }
+    return message_create(t->topic, strlen(t->topic), v->data[i], v->lens[i], v->keys[i]);
+}
+
+// Con el mutex del topic tomado. Las claves no decrecen: la primera que
+// ya no entra en 'out' corta el topic, sin abrir los bloques que siguen.
+static int collect_topic(HistoryStore* store, TopicHistory* t, time_t since, time_t until,
+                         int limit, HistoryResult* out) {
+    BlockView view;
+    int bi;
+
+    evict_expired(store, t, time(NULL));
+    if (t->count == 0 || (bi = seek_block(t, since)) < 0)
+        return 0;
+
+    for (int first = bi; bi < t->num_blocks; bi++) {
+        HistoryBlock* b = block_at(t, bi);
+
+        // Sus claves no son menores que la ultima del bloque anterior
+        if (bi > first && !result_accepts(out, block_at(t, bi - 1)->last_key, limit))
+            return 0;
+
+        const time_t* keys = view_block(b, &view);
+
+        for (int pos = seek_key(keys, b->start, b->count, since); pos < b->count; pos++) {
+            if (keys[pos] > until || !result_accepts(out, keys[pos], limit))
+                return 0;
+
+            Message* m = view_message(t, b, &view, pos);
+            int r = m ? result_add(out, m, keys[pos], limit) : -1;
+            if (m)
+                message_release(m);
+            if (r < 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+
+// =========================================================
+// API
+// =========================================================
+
+int history_init(HistoryStore* store, int depth, int max_age) {
+    store->buckets = calloc(HISTORY_INITIAL_BUCKETS, sizeof(TopicHistory*));
+    if (!store->buckets)
+        return 0;
+
+    store->num_buckets = HISTORY_INITIAL_BUCKETS;
+    store->num_topics = 0;
+    store->depth = depth > 0 ? depth : DEFAULT_HISTORY_DEPTH;
+    store->max_age = max_age;
+    store->bytes = 0;
+    pthread_rwlock_init(&store->lock, NULL);
+    return 1;
+}
+
+void history_destroy(HistoryStore* store) {
+    for (unsigned int i = 0; i < store->num_buckets; i++) {
+        TopicHistory* t = store->buckets[i];
+        while (t) {
+            TopicHistory* nx = t->next;
+            free_topic(t);
+            t = nx;
+        }
+    }
+
+    free(store->buckets);
+    store->buckets = NULL;
+    store->num_buckets = 0;
+    store->num_topics = 0;
+    pthread_rwlock_destroy(&store->lock);
+}
+
+void history_append(HistoryStore* store, Message* msg) {
+    TopicHistory* t = get_topic(store, msg->topic);
+    if (!t)
+        return;
+
+    pthread_mutex_lock(&t->mutex);
+
+    if (push_message(store, t, msg) == 0) {
+        message_retain(msg);
+
+        // Lleno: se suelta el mas viejo
+        while (t->count > store->depth)
+            pop_oldest(store, t);
+    }
+
+    evict_expired(store, t, msg->timestamp);
+
+    pthread_mutex_unlock(&t->mutex);
+}
+
+void history_foreach(HistoryStore* store, HistoryVisitFn fn, void* ctx) {
+    BlockView* view = malloc(sizeof(BlockView));
+    time_t now = time(NULL);
+
+    if (!view)
+        return;
+
+    pthread_rwlock_rdlock(&store->lock);
+
+    for (unsigned int i = 0; i < store->num_buckets; i++) {
+        for (TopicHistory* t = store->buckets[i]; t; t = t->next) {
+            pthread_mutex_lock(&t->mutex);
+            evict_expired(store, t, now);
+
+            for (int bi = t->num_blocks - 1; bi >= 0; bi--) {
+                HistoryBlock* b = block_at(t, bi);
+                view_block(b, view);
+
+                for (int j = b->count - 1; j >= b->start; j--) {
+                    Message* m = view_message(t, b, view, j);
+                    if (m) {
+                        fn(t->topic, m, ctx);
+                        message_release(m);
+                    }
+                }
+            }
+
+            pthread_mutex_unlock(&t->mutex);
+        }
+    }
+
+    pthread_rwlock_unlock(&store->lock);
+    free(view);
+}
+
+int history_collect(HistoryStore* store, const char* filter, time_t since, time_t until,
+                    int limit, HistoryResult* out) {
+    int r = 0;
+
+    pthread_rwlock_rdlock(&store->lock);
+
+    if (!strpbrk(filter, "+#")) {
+        TopicHistory* t = find_topic(store, filter);
+        if (t) {
+            pthread_mutex_lock(&t->mutex);
+            r = collect_topic(store, t, since, until, limit, out);
+            pthread_mutex_unlock(&t->mutex);
+        }
+    } else {
+        for (unsigned int i = 0; i < store->num_buckets && r == 0; i++) {
+            for (TopicHistory* t = store->buckets[i]; t && r == 0; t = t->next) {
+                if (!topic_filter_matches(filter, t->topic))
+                    continue;
+
+                pthread_mutex_lock(&t->mutex);
+                r = collect_topic(store, t, since, until, limit, out);
+                pthread_mutex_unlock(&t->mutex);
+            }
+        }
+    }
+
+    pthread_rwlock_unlock(&store->lock);
+    return r;
+}
+
+size_t history_memory(HistoryStore* store) {
+    return __atomic_load_n(&store->bytes, __ATOMIC_RELAXED);
+}
+
+static int compare_hits(const void* a, const void* b) {
+    return hit_after(a, b) - hit_after(b, a);
+}
+
+void history_result_finish(HistoryResult* r, int limit) {
+    qsort(r->hits, r->count, sizeof(HistoryHit), compare_hits);
+
+    while (r->count > limit)
+        message_release(r->hits[--r->count].msg);
+}
+
+void history_result_free(HistoryResult* r) {
+    for (int i = 0; i < r->count; i++)
+        message_release(r->hits[i].msg);
+
+    free(r->hits);
+    r->hits = NULL;
+    r->count = 0;
+    r->cap = 0;
+}
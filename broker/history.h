@@ -0,0 +1,137 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <pthread.h>
+#include <time.h>
+#include "message.h"
+
+// Se incluye desde broker.h (usa MAX_TOPIC_LEN).
+
+// =========================================================
+// Historial por topic: cada topic guarda sus mensajes en bloques de
+// HISTORY_BLOCK_LEN, del mas viejo al mas nuevo, con su propio mutex.
+// Pasado 'depth' se suelta el mensaje mas viejo; opcionalmente tambien
+// los que tienen mas de 'max_age' segundos.
+//
+// El bloque que se esta llenando guarda referencias a los mismos
+// Message que se entregan a los suscriptores. Cuando se llena se sella
+// en una forma compacta (ver series.h) y suelta los Message:
+//
+//   - BLOCK_SERIES: lecturas de gateway ({"value":..,"timestamp":..})
+//     en columnas: claves con delta de la delta, valores con XOR y el
+//     timestamp del payload como diferencia con la clave
+//   - BLOCK_PACKED: cualquier otro payload, con las columnas de claves y
+//     de largos comprimidas y los bytes tal cual
+//
+// Al consultar, las posiciones de un bloque sellado se vuelven a armar
+// como Message nuevos (con los mismos bytes de payload).
+//
+// Cada posicion tiene ademas una clave de tiempo no decreciente (el
+// timestamp del mensaje, o el de la anterior si el reloj retrocedio):
+// es el indice que permite buscar un rango de tiempo con busqueda
+// binaria, primero entre bloques y despues dentro del bloque. Un bloque
+// donde alguna clave no coincide con el timestamp queda sin sellar.
+// =========================================================
+
+#define DEFAULT_HISTORY_DEPTH 64
+#define DEFAULT_HISTORY_MAX_AGE 0     // 0 = sin limite de edad
+#define HISTORY_BLOCK_LEN 64
+
+typedef enum {
+    BLOCK_OPEN = 0,               // referencias a Message
+    BLOCK_SERIES,                 // sellado: lecturas numericas en columnas
+    BLOCK_PACKED                  // sellado: payloads genericos
+} BlockEncoding;
+
+typedef struct HistoryBlock {
+    BlockEncoding encoding;
+    int start;                    // primera posicion vigente
+    int count;                    // posiciones escritas
+    time_t last_key;
+    size_t size;                  // bytes reservados (sin contar los Message)
+
+    Message** msgs;               // BLOCK_OPEN: apuntan a 'data'
+    time_t* keys;                 // clave de tiempo de cada posicion
+
+    unsigned char data[];         // sellado: flujo de series.h
+} HistoryBlock;
+
+typedef struct TopicHistory {
+    char topic[MAX_TOPIC_LEN];
+    pthread_mutex_t mutex;
+
+    HistoryBlock** blocks;        // circular: del bloque mas viejo al mas nuevo
+    int block_cap;
+    int first_block;
+    int num_blocks;
+    HistoryBlock* spare;          // bloque abierto vaciado, para no pedir otro
+
+    const HistoryBlock* head;     // bloque sellado cuyas claves estan en head_keys
+    time_t head_keys[HISTORY_BLOCK_LEN];
+
+    int count;                    // mensajes vigentes
+    time_t last_key;
+
+    struct TopicHistory* next;    // cadena del bucket
+} TopicHistory;
+
+typedef struct {
+    TopicHistory** buckets;
+    unsigned int num_buckets;
+    unsigned int num_topics;
+    pthread_rwlock_t lock;        // protege solo la tabla de topics
+
+    int depth;
+    int max_age;
+
+    size_t bytes;                 // memoria ocupada (atomico)
+} HistoryStore;
+
+typedef void (*HistoryVisitFn)(const char* topic, Message* msg, void* ctx);
+
+// Resultado de una consulta por rango de tiempo: referencias propias a
+// los mensajes, con su clave de tiempo. Mientras se junta es un heap (el
+// mas nuevo arriba); history_result_finish() lo deja ordenado.
+typedef struct {
+    Message* msg;
+    time_t key;
+    unsigned int seq;             // orden de llegada, para desempatar
+} HistoryHit;
+
+typedef struct {
+    HistoryHit* hits;
+    int count;
+    int cap;
+    unsigned int next_seq;
+} HistoryResult;
+
+int  history_init(HistoryStore* store, int depth, int max_age);
+void history_destroy(HistoryStore* store);
+
+// Guarda una referencia a 'msg' (la retiene; quien llama conserva la suya).
+void history_append(HistoryStore* store, Message* msg);
+
+// Recorre todos los topics, del mensaje mas nuevo al mas viejo.
+void history_foreach(HistoryStore* store, HistoryVisitFn fn, void* ctx);
+
+// Agrega a 'out' los mensajes de los topics que coinciden con 'filter'
+// (con wildcards) y tienen since <= timestamp <= until. 'out' se queda
+// con los 'limit' mas viejos en total, contando los que ya tenia (se
+// pueden juntar varios stores); cada topic se deja de leer apenas sus
+// mensajes ya no entrarian, asi el trabajo depende de 'limit' y no de
+// cuantos topics coinciden. Sin wildcards es una busqueda en la tabla;
+// con wildcards solo se abren los topics que coinciden.
+// Devuelve -1 si falta memoria.
+int  history_collect(HistoryStore* store, const char* filter, time_t since, time_t until,
+                     int limit, HistoryResult* out);
+
+// Bytes que ocupa el historial: topics, bloques y los Message que
+// todavia referencian los bloques abiertos.
+size_t history_memory(HistoryStore* store);
+
+// Ordena por tiempo (a igual tiempo, por llegada) y deja los 'limit'
+// primeros.
+void history_result_finish(HistoryResult* r, int limit);
+void history_result_free(HistoryResult* r);
+
+#endif
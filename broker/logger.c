@@ -0,0 +1,556 @@
+#include "logger.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+// Una linea pendiente: el formato y los argumentos copiados en 'args'
+// (enteros y doubles de 8 bytes, strings como largo de 2 bytes + bytes
+// + '\0'). Con fmt NULL 'args' ya tiene el texto.
+typedef struct {
+    const char* fmt;
+    time_t sec;
+    long nsec;
+    int level;
+    unsigned char args[LOGGER_ARGS_LEN];
+} LogEntry;
+
+// Una conversion del formato: "%[flags][ancho][.precision][largo]conv"
+typedef struct {
+    const char* flags;
+    int flags_len;
+    const char* width;            // digitos o "*"
+    int width_len;
+    const char* prec;             // idem; NULL si no hay precision
+    int prec_len;
+    char size;                    // 0, 'H' (hh), 'h', 'l', 'q' (ll), 'L', 'j', 'z', 't'
+    char conv;
+} FormatSpec;
+
+// Como se lee y se guarda cada argumento
+enum {
+    ARG_INT, ARG_SCHAR, ARG_SHORT, ARG_LONG, ARG_LLONG, ARG_INTMAX, ARG_PTRDIFF,
+    ARG_UINT, ARG_UCHAR, ARG_USHORT, ARG_ULONG, ARG_ULLONG, ARG_UINTMAX, ARG_SIZE,
+    ARG_PTR, ARG_DOUBLE, ARG_LDOUBLE,
+    ARG_PREC,                     // el int de ".*"
+    ARG_STR
+};
+
+#define LOGGER_MAX_ARGS 16
+#define LOGGER_SIGNATURES 32      // formatos recordados por hilo (potencia de 2)
+
+// Los argumentos que lleva un formato, para no recorrerlo en cada
+// llamada. Cada hilo guarda las de sus formatos indexadas por la
+// direccion del literal.
+typedef struct {
+    const char* fmt;
+    int count;                    // -1: se formatea al loguear
+    unsigned char kind[LOGGER_MAX_ARGS];
+    short prec[LOGGER_MAX_ARGS];  // ARG_STR: precision literal, o -1
+} ArgSignature;
+
+// Buffer de un hilo. 'head' lo avanza solo el hilo que lo usa y 'tail'
+// solo quien vacia; cada uno en su linea de cache.
+typedef struct LogRing {
+    unsigned int head;
+    char pad[60];
+    unsigned int tail;
+    unsigned long dropped;        // atomico
+    int in_use;                   // atomico: tiene un hilo vivo
+    struct LogRing* next;         // la lista solo crece: al terminar el
+                                  // hilo el buffer queda para otro
+    ArgSignature signatures[LOGGER_SIGNATURES];
+    LogEntry entries[LOGGER_RING_LEN];
+} LogRing;
+
+int logger_level = LOG_LEVEL_INFO;
+
+static LogRing* rings;            // atomico
+static __thread LogRing* my_ring;
+
+static pthread_once_t start_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t flusher;
+static int flusher_running;
+static int stopping;
+
+static const char* level_names[] = { "debug", "info", "warn", "error" };
+
+int logger_parse_level(const char* name, LogLevel* level) {
+    for (int i = LOG_LEVEL_DEBUG; i <= LOG_LEVEL_ERROR; i++) {
+        if (strcmp(name, level_names[i]) == 0) {
+            *level = (LogLevel)i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void logger_set_level(LogLevel level) {
+    __atomic_store_n(&logger_level, (int)level, __ATOMIC_RELAXED);
+}
+
+__attribute__((constructor))
+static void level_from_env(void) {
+    const char* env = getenv("LOG_LEVEL");
+    LogLevel level;
+
+    if (env && logger_parse_level(env, &level))
+        logger_level = level;
+}
+
+
+// =========================================================
+// FORMATO DIFERIDO
+// =========================================================
+
+// 'p' apunta despues del '%'. Devuelve lo que sigue a la conversion.
+static const char* parse_spec(const char* p, FormatSpec* s) {
+    s->flags = p;
+    while (*p == '-' || *p == '+' || *p == ' ' || *p == '#' || *p == '0' || *p == '\'')
+        p++;
+    s->flags_len = p - s->flags;
+
+    s->width = p;
+    if (*p == '*')
+        p++;
+    else
+        while (*p >= '0' && *p <= '9')
+            p++;
+    s->width_len = p - s->width;
+
+    s->prec = NULL;
+    s->prec_len = 0;
+    if (*p == '.') {
+        s->prec = ++p;
+        if (*p == '*')
+            p++;
+        else
+            while (*p >= '0' && *p <= '9')
+                p++;
+        s->prec_len = p - s->prec;
+    }
+
+    s->size = 0;
+    switch (*p) {
+    case 'h': case 'l':
+        if (p[1] == p[0]) {
+            s->size = *p == 'h' ? 'H' : 'q';
+            p++;
+        } else {
+            s->size = *p;
+        }
+        p++;
+        break;
+    case 'L': case 'j': case 'z': case 't':
+        s->size = *p++;
+        break;
+    }
+
+    s->conv = *p;
+    return *p ? p + 1 : p;
+}
+
+static uint64_t get_u64(const unsigned char* buf, size_t* n) {
+    uint64_t v;
+    memcpy(&v, buf + *n, sizeof(v));
+    *n += sizeof(v);
+    return v;
+}
+
+static int int_kind(char conv, char size) {
+    int u = conv != 'd' && conv != 'i';
+
+    switch (size) {
+        case 'H': return u ? ARG_UCHAR : ARG_SCHAR;
+        case 'h': return u ? ARG_USHORT : ARG_SHORT;
+        case 'l': return u ? ARG_ULONG : ARG_LONG;
+        case 'q': return u ? ARG_ULLONG : ARG_LLONG;
+        case 'j': return u ? ARG_UINTMAX : ARG_INTMAX;
+        case 'z': return ARG_SIZE;
+        case 't': return ARG_PTRDIFF;
+        default:  return u ? ARG_UINT : ARG_INT;
+    }
+}
+
+// Recorre el formato una vez y anota que argumentos lleva. Queda con
+// count -1 si hay una conversion que no se sabe guardar (%n, %ls...).
+static void compile_signature(const char* fmt, ArgSignature* sig) {
+    FormatSpec s;
+    int k = 0;
+
+    sig->fmt = fmt;
+    sig->count = -1;
+
+    for (const char* p = fmt; (p = strchr(p, '%')); ) {
+        p = parse_spec(p + 1, &s);
+        if (s.conv == '%')
+            continue;
+        if (k + 3 > LOGGER_MAX_ARGS)
+            return;
+
+        if (s.width_len == 1 && s.width[0] == '*')
+            sig->kind[k++] = ARG_INT;
+
+        int prec_arg = s.prec_len == 1 && s.prec[0] == '*';
+        if (prec_arg)
+            sig->kind[k++] = ARG_PREC;
+        sig->prec[k] = s.prec && !prec_arg ? (short)atoi(s.prec) : -1;
+
+        switch (s.conv) {
+        case 'd': case 'i': case 'u': case 'x': case 'X': case 'o':
+            sig->kind[k] = int_kind(s.conv, s.size);
+            break;
+        case 'c':
+            if (s.size)
+                return;
+            sig->kind[k] = ARG_INT;
+            break;
+        case 'p':
+            sig->kind[k] = ARG_PTR;
+            break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            sig->kind[k] = s.size == 'L' ? ARG_LDOUBLE : ARG_DOUBLE;
+            break;
+        case 's':
+            if (s.size)
+                return;
+            sig->kind[k] = ARG_STR;
+            break;
+        default:
+            return;
+        }
+        k++;
+    }
+    sig->count = k;
+}
+
+// Copia los argumentos segun la firma del formato. Devuelve 0 si no
+// entran en 'buf'.
+static int capture_args(const ArgSignature* sig, va_list* ap, unsigned char* buf) {
+    size_t n = 0;
+    int prec = -1;
+
+    for (int i = 0; i < sig->count; i++) {
+        int str_prec = prec;
+        uint64_t v;
+        double d;
+
+        prec = -1;
+
+        switch (sig->kind[i]) {
+        case ARG_INT:     v = (uint64_t)(int64_t)va_arg(*ap, int); break;
+        case ARG_PREC:    prec = va_arg(*ap, int); v = (uint64_t)(int64_t)prec; break;
+        case ARG_SCHAR:   v = (uint64_t)(int64_t)(signed char)va_arg(*ap, int); break;
+        case ARG_SHORT:   v = (uint64_t)(int64_t)(short)va_arg(*ap, int); break;
+        case ARG_LONG:    v = (uint64_t)(int64_t)va_arg(*ap, long); break;
+        case ARG_LLONG:   v = (uint64_t)va_arg(*ap, long long); break;
+        case ARG_INTMAX:  v = (uint64_t)va_arg(*ap, intmax_t); break;
+        case ARG_PTRDIFF: v = (uint64_t)va_arg(*ap, ptrdiff_t); break;
+        case ARG_UINT:    v = va_arg(*ap, unsigned int); break;
+        case ARG_UCHAR:   v = (unsigned char)va_arg(*ap, unsigned int); break;
+        case ARG_USHORT:  v = (unsigned short)va_arg(*ap, unsigned int); break;
+        case ARG_ULONG:   v = va_arg(*ap, unsigned long); break;
+        case ARG_ULLONG:  v = va_arg(*ap, unsigned long long); break;
+        case ARG_UINTMAX: v = va_arg(*ap, uintmax_t); break;
+        case ARG_SIZE:    v = va_arg(*ap, size_t); break;
+        case ARG_PTR:     v = (uintptr_t)va_arg(*ap, void*); break;
+        case ARG_DOUBLE:
+            d = va_arg(*ap, double);
+            memcpy(&v, &d, sizeof(v));
+            break;
+        case ARG_LDOUBLE:
+            d = (double)va_arg(*ap, long double);
+            memcpy(&v, &d, sizeof(v));
+            break;
+        default: {
+            if (n + 3 > LOGGER_ARGS_LEN)
+                return 0;
+
+            const char* str = va_arg(*ap, const char*);
+            if (!str)
+                str = "(null)";
+
+            // Un string largo se corta para que entre
+            size_t max = LOGGER_ARGS_LEN - n - 3;
+            if (sig->prec[i] >= 0)
+                str_prec = sig->prec[i];
+            if (str_prec >= 0 && (size_t)str_prec < max)
+                max = (size_t)str_prec;
+
+            // Largo y copia en una pasada (un memcpy de largo variable
+            // sale como "rep movs", mucho mas caro en strings cortos)
+            unsigned char* dst = buf + n + 2;
+            unsigned short len = 0;
+            while (len < max && str[len]) {
+                dst[len] = (unsigned char)str[len];
+                len++;
+            }
+            dst[len] = '\0';
+
+            memcpy(buf + n, &len, sizeof(len));
+            n += 3 + len;
+            continue;
+        }
+        }
+
+        if (n + sizeof(v) > LOGGER_ARGS_LEN)
+            return 0;
+        memcpy(buf + n, &v, sizeof(v));
+        n += sizeof(v);
+    }
+    return 1;
+}
+
+// Suma lo que escribio snprintf sin pasarse del final de la linea.
+static void advance(size_t* len, size_t cap, int written) {
+    *len += written > 0 ? (size_t)written : 0;
+    if (*len >= cap)
+        *len = cap - 1;
+}
+
+// Arma la linea de una entrada en 'out' (cap > 0). Cada conversion se
+// vuelve a formatear con snprintf con su argumento guardado.
+static size_t render(const LogEntry* e, char* out, size_t cap) {
+    size_t len = 0;
+    size_t n = 0;
+    FormatSpec s;
+
+    for (const char* p = e->fmt; *p; ) {
+        const char* pct = strchr(p, '%');
+        size_t lit = pct ? (size_t)(pct - p) : strlen(p);
+
+        if (lit > cap - 1 - len)
+            lit = cap - 1 - len;
+        memcpy(out + len, p, lit);
+        len += lit;
+        if (!pct)
+            break;
+
+        p = parse_spec(pct + 1, &s);
+        if (s.conv == '%') {
+            advance(&len, cap, snprintf(out + len, cap - len, "%%"));
+            continue;
+        }
+
+        // La conversion con ancho y precision ya resueltos
+        char spec[64];
+        int k = snprintf(spec, sizeof(spec), "%%%.*s", s.flags_len < 8 ? s.flags_len : 8, s.flags);
+
+        if (s.width_len == 1 && s.width[0] == '*')
+            k += snprintf(spec + k, sizeof(spec) - k, "%d", (int)(int64_t)get_u64(e->args, &n));
+        else
+            k += snprintf(spec + k, sizeof(spec) - k, "%.*s", s.width_len < 8 ? s.width_len : 8, s.width);
+
+        int prec = -1;
+        if (s.prec_len == 1 && s.prec[0] == '*')
+            prec = (int)(int64_t)get_u64(e->args, &n);
+        else if (s.prec)
+            prec = atoi(s.prec);
+
+        uint64_t v;
+        double d;
+        unsigned short slen;
+
+        switch (s.conv) {
+        case 's':
+            memcpy(&slen, e->args + n, sizeof(slen));
+            snprintf(spec + k, sizeof(spec) - k, ".%us", (unsigned int)slen);
+            advance(&len, cap, snprintf(out + len, cap - len, spec, (const char*)e->args + n + 2));
+            n += 3 + slen;
+            continue;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            v = get_u64(e->args, &n);
+            memcpy(&d, &v, sizeof(d));
+            if (prec >= 0)
+                k += snprintf(spec + k, sizeof(spec) - k, ".%d", prec);
+            snprintf(spec + k, sizeof(spec) - k, "%c", s.conv);
+            advance(&len, cap, snprintf(out + len, cap - len, spec, d));
+            continue;
+        case 'p':
+            snprintf(spec + k, sizeof(spec) - k, "p");
+            advance(&len, cap, snprintf(out + len, cap - len, spec, (void*)(uintptr_t)get_u64(e->args, &n)));
+            continue;
+        case 'c':
+            snprintf(spec + k, sizeof(spec) - k, "c");
+            advance(&len, cap, snprintf(out + len, cap - len, spec, (int)get_u64(e->args, &n)));
+            continue;
+        default:
+            // Enteros: todos se guardaron en 64 bits
+            if (prec >= 0)
+                k += snprintf(spec + k, sizeof(spec) - k, ".%d", prec);
+            snprintf(spec + k, sizeof(spec) - k, "ll%c", s.conv);
+            advance(&len, cap, snprintf(out + len, cap - len, spec, (long long)get_u64(e->args, &n)));
+            continue;
+        }
+    }
+
+    out[len] = '\0';
+    return len;
+}
+
+
+// =========================================================
+// VACIADO
+// =========================================================
+
+static void write_entry(const LogEntry* e) {
+    char line[1024];
+    struct tm tm;
+
+    if (e->fmt)
+        render(e, line, sizeof(line));
+    else
+        snprintf(line, sizeof(line), "%s", (const char*)e->args);
+
+    localtime_r(&e->sec, &tm);
+
+    FILE* out = e->level >= LOG_LEVEL_WARN ? stderr : stdout;
+    fprintf(out, "%02d:%02d:%02d.%03ld %s\n", tm.tm_hour, tm.tm_min, tm.tm_sec,
+            e->nsec / 1000000, line);
+}
+
+void logger_flush(void) {
+    int lines = 0;
+
+    pthread_mutex_lock(&drain_mutex);
+
+    for (LogRing* r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        unsigned int head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        unsigned int tail = r->tail;
+
+        for (; tail != head; tail++, lines++)
+            write_entry(&r->entries[tail & (LOGGER_RING_LEN - 1)]);
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+
+        unsigned long dropped = __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED);
+        if (dropped) {
+            fprintf(stderr, "[LOG] %lu lineas descartadas (buffer de log lleno)\n", dropped);
+            lines++;
+        }
+    }
+
+    if (lines) {
+        fflush(stdout);
+        fflush(stderr);
+    }
+
+    pthread_mutex_unlock(&drain_mutex);
+}
+
+static void* flusher_thread(void* arg) {
+    (void)arg;
+    struct timespec period = { 0, LOGGER_FLUSH_MS * 1000000L };
+
+    while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        nanosleep(&period, NULL);
+        logger_flush();
+    }
+    return NULL;
+}
+
+static void logger_stop(void) {
+    if (flusher_running) {
+        __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+        pthread_join(flusher, NULL);
+        flusher_running = 0;
+    }
+    logger_flush();
+}
+
+// Al terminar un hilo su buffer queda libre para el proximo que loguee
+// (lo pendiente se sigue vaciando normalmente).
+static void ring_release(void* arg) {
+    LogRing* r = (LogRing*)arg;
+    __atomic_store_n(&r->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void logger_start(void) {
+    pthread_key_create(&ring_key, ring_release);
+
+    flusher_running = pthread_create(&flusher, NULL, flusher_thread, NULL) == 0;
+    atexit(logger_stop);
+}
+
+
+// =========================================================
+// ESCRITURA
+// =========================================================
+
+static LogRing* ring_acquire(void) {
+    pthread_once(&start_once, logger_start);
+
+    LogRing* r;
+    for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        int free_ring = 0;
+        if (__atomic_compare_exchange_n(&r->in_use, &free_ring, 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            break;
+    }
+
+    if (!r) {
+        r = calloc(1, sizeof(LogRing));
+        if (!r)
+            return NULL;
+
+        r->in_use = 1;
+        r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&rings, &r->next, r, 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+
+    pthread_setspecific(ring_key, r);
+    return r;
+}
+
+void logger_write(LogLevel level, const char* fmt, ...) {
+    LogRing* r = my_ring;
+    if (!r && !(r = my_ring = ring_acquire()))
+        return;
+
+    unsigned int head = r->head;
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == LOGGER_RING_LEN) {
+        __atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    LogEntry* e = &r->entries[head & (LOGGER_RING_LEN - 1)];
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    e->sec = now.tv_sec;
+    e->nsec = now.tv_nsec;
+    e->level = level;
+    e->fmt = fmt;
+
+    ArgSignature* sig = &r->signatures[((uintptr_t)fmt >> 3) & (LOGGER_SIGNATURES - 1)];
+    if (sig->fmt != fmt)
+        compile_signature(fmt, sig);
+
+    va_list ap;
+    int captured = 0;
+    if (sig->count >= 0) {
+        va_start(ap, fmt);
+        captured = capture_args(sig, &ap, e->args);
+        va_end(ap);
+    }
+
+    // No entra (o no se sabe guardar): se formatea aca, cortado
+    if (!captured) {
+        e->fmt = NULL;
+        va_start(ap, fmt);
+        vsnprintf((char*)e->args, sizeof(e->args), fmt, ap);
+        va_end(ap);
+    }
+
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+
+    // Sin flusher (no se pudo crear el hilo) se escribe en el momento
+    if (!flusher_running)
+        logger_flush();
+}
@@ -0,0 +1,65 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+// =========================================================
+// Log asincronico por niveles (compartido con gateway).
+//
+// Cada hilo escribe en su propio buffer circular (un productor, un
+// consumidor) sin locks ni syscalls, y un hilo aparte vacia todos los
+// buffers cada pocos milisegundos: DEBUG e INFO van a stdout, WARN y
+// ERROR a stderr. Las lineas de un mismo hilo salen en orden; entre
+// hilos distintos el orden es aproximado (se vacia buffer por buffer) y
+// la hora tiene resolucion de milisegundos.
+//
+// Quien loguea no formatea: guarda el puntero al formato (tiene que ser
+// un literal) y copia los argumentos tal cual, con los strings
+// incluidos. El texto lo arma el flusher. Un mensaje por debajo del
+// nivel vigente cuesta una comparacion (los argumentos ni se evaluan).
+//
+// Si el buffer de un hilo esta lleno la linea se descarta y se cuenta:
+// quien loguea nunca se bloquea. El flusher avisa cuantas se perdieron.
+//
+// El nivel inicial es INFO, o el de la variable de entorno LOG_LEVEL
+// (debug | info | warn | error).
+// =========================================================
+
+#define LOGGER_RING_LEN 256       // entradas por hilo (potencia de 2)
+#define LOGGER_ARGS_LEN 224       // argumentos de una entrada; lo que no
+                                  // entra se corta
+#define LOGGER_FLUSH_MS 5         // periodo del flusher
+
+typedef enum {
+    LOG_LEVEL_DEBUG = 0,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR
+} LogLevel;
+
+extern int logger_level;
+
+// El "" obliga a que el formato sea un literal: el flusher lo lee
+// despues de que volvio la llamada.
+#define LOG_AT(level, ...) \
+    do { \
+        if ((int)(level) >= logger_level) \
+            logger_write((level), "" __VA_ARGS__); \
+    } while (0)
+
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...)  LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARN(...)  LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+void logger_set_level(LogLevel level);
+
+// "debug", "info", "warn" o "error". Devuelve 0 si no lo reconoce.
+int  logger_parse_level(const char* name, LogLevel* level);
+
+// Encola una linea (sin '\n' final). Usar las macros LOG_*.
+void logger_write(LogLevel level, const char* fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+// Escribe ya todo lo pendiente (antes de un printf directo, o al salir).
+void logger_flush(void);
+
+#endif
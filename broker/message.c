@@ -0,0 +1,111 @@
+#include "message.h"
+#include "wire.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Todo va en un solo bloque:
+//
+//   | frame: cabecera, topic, data | '\0' | text: topic ' ' data '\n' | topic '\0' |
+//
+// El '\0' despues del frame termina el data; el topic se repite al final
+// para tenerlo terminado en '\0'.
+//
+// En el texto cada '\n' del data (que llega en frames binarios) va como
+// "\\n": si no, cortaria la linea del suscriptor de texto. Cada '\\' va
+// como "\\\\", asi un "\\n" del data no se confunde con un salto de
+// linea. El data del frame queda intacto.
+
+Message* message_create(const char* topic, size_t topic_len,
+                        const char* data, size_t data_len, time_t timestamp) {
+    size_t escapes = 0;
+    for (size_t i = 0; i < data_len; i++)
+        escapes += data[i] == '\n' || data[i] == '\\';
+
+    size_t frame_len = WIRE_HEADER_LEN + topic_len + data_len;
+    size_t text_len = topic_len + 1 + data_len + escapes + 1;
+
+    Message* m = malloc(sizeof(Message) + frame_len + 1 + text_len + topic_len + 1);
+    if (!m)
+        return NULL;
+
+    char* p = m->buf;
+
+    m->frame = p;
+    m->frame_len = wire_encode(p, frame_len, WIRE_MESSAGE, topic, topic_len, data, data_len);
+    p[frame_len] = '\0';
+    m->data = p + WIRE_HEADER_LEN + topic_len;
+    m->data_len = data_len;
+    p += frame_len + 1;
+
+    m->text = p;
+    m->text_len = text_len;
+    memcpy(p, topic, topic_len);
+    p[topic_len] = ' ';
+    if (escapes == 0) {
+        memcpy(p + topic_len + 1, data, data_len);
+    } else {
+        char* out = p + topic_len + 1;
+        for (size_t i = 0; i < data_len; i++) {
+            if (data[i] == '\n') {
+                *out++ = '\\';
+                *out++ = 'n';
+            } else if (data[i] == '\\') {
+                *out++ = '\\';
+                *out++ = '\\';
+            } else {
+                *out++ = data[i];
+            }
+        }
+    }
+    p[text_len - 1] = '\n';
+    p += text_len;
+
+    memcpy(p, topic, topic_len);
+    p[topic_len] = '\0';
+    m->topic = p;
+    m->topic_len = topic_len;
+
+    m->refs = 1;
+    m->timestamp = timestamp;
+    m->bridged = 0;
+    m->origin = m->via = NULL;
+    m->seq = 0;
+    m->hops = 0;
+    m->relay = NULL;
+    m->relay_len = 0;
+    return m;
+}
+
+Message* message_create_raw(const char* bytes, size_t len) {
+    Message* m = malloc(sizeof(Message) + len + 1);
+    if (!m)
+        return NULL;
+
+    memcpy(m->buf, bytes, len);
+    m->buf[len] = '\0';
+
+    m->refs = 1;
+    m->timestamp = 0;
+    m->bridged = 0;
+    m->origin = m->via = NULL;
+    m->seq = 0;
+    m->hops = 0;
+    m->relay = NULL;
+    m->relay_len = 0;
+    m->topic = "";
+    m->topic_len = 0;
+    m->data = m->text = m->frame = m->buf;
+    m->data_len = m->text_len = m->frame_len = len;
+    return m;
+}
+
+void message_retain(Message* m) {
+    __atomic_add_fetch(&m->refs, 1, __ATOMIC_RELAXED);
+}
+
+void message_release(Message* m) {
+    if (__atomic_sub_fetch(&m->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(m->relay);
+        free(m);
+    }
+}
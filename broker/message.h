@@ -0,0 +1,60 @@
+#ifndef MESSAGE_H
+#define MESSAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// =========================================================
+// Mensaje publicado, codificado una sola vez e inmutable.
+//
+// Al publicar se arma un Message con las dos codificaciones de salida
+// (linea de texto y frame WIRE_MESSAGE) y se comparte por referencia:
+// el historial y la cola de cada suscriptor guardan un puntero y lo
+// sueltan con message_release(); el ultimo lo libera.
+//
+// La codificacion para otro broker (WIRE_RELAY) se arma recien cuando
+// hace falta, una sola vez (ver "PUENTES ENTRE BROKERS" en broker.c).
+// =========================================================
+
+struct Origin;
+
+typedef struct Message {
+    int refs;
+    time_t timestamp;
+
+    // Llego de otro broker por un puente: donde se publico y con que
+    // numero, por cual vino y cuantos enlaces lleva. 'origin' NULL en un
+    // retenido restaurado, que ya no se reenvia.
+    int bridged;
+    struct Origin* origin;
+    struct Origin* via;
+    uint64_t seq;
+    int hops;
+
+    const char* topic;            // terminado en '\0'
+    size_t topic_len;
+    const char* data;             // terminado en '\0' (puede tener '\0' adentro)
+    size_t data_len;
+
+    const char* text;             // "topic data\n" ('\n' y '\\' del data escapados)
+    size_t text_len;
+    const char* frame;            // frame WIRE_MESSAGE
+    size_t frame_len;
+    char* relay;                  // frame WIRE_RELAY, o NULL (se arma con CAS)
+    size_t relay_len;
+
+    char buf[];
+} Message;
+
+Message* message_create(const char* topic, size_t topic_len,
+                        const char* data, size_t data_len, time_t timestamp);
+
+// Mensaje con bytes ya armados (respuestas OK / ERROR): texto y frame
+// apuntan al mismo contenido.
+Message* message_create_raw(const char* bytes, size_t len);
+
+void message_retain(Message* m);
+void message_release(Message* m);
+
+#endif
@@ -0,0 +1,490 @@
+#include "msglog.h"
+#include "logger.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define LOG_RECORD_MAGIC 0x474F4C4Du   // "MLOG"
+#define LOG_TRACK_EMPTY  0xFFFFFFFFu
+
+typedef struct {
+    uint32_t magic;
+    uint16_t topic_len;
+    uint16_t data_len;
+    int64_t timestamp;
+} LogRecordHeader;
+
+// =========================================================
+// UTILIDADES
+// =========================================================
+
+static uint32_t hash_topic(const char* topic, size_t len) {
+    uint32_t h = 2166136261u;   // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)topic[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void segment_path(const MsgLog* log, uint64_t seq, const char* ext, char* out, size_t len) {
+    snprintf(out, len, "%s/%016llx.%s", log->config.dir, (unsigned long long)seq, ext);
+}
+
+// Lee la cabecera del registro en 'off'. Devuelve el tamanio total del
+// registro, o 0 si no hay un registro completo y valido.
+static size_t read_record(const char* base, size_t size, size_t off, LogRecordHeader* h) {
+    if (off + sizeof(LogRecordHeader) > size)
+        return 0;
+
+    memcpy(h, base + off, sizeof(LogRecordHeader));
+    if (h->magic != LOG_RECORD_MAGIC)
+        return 0;
+
+    size_t total = sizeof(LogRecordHeader) + h->topic_len + h->data_len;
+    if (off + total > size)
+        return 0;
+
+    return total;
+}
+
+static void reset_tracking(MsgLog* log) {
+    memset(log->track_hash, 0, sizeof(log->track_hash));
+    memset(log->track_offset, 0xFF, sizeof(log->track_offset));
+}
+
+
+// =========================================================
+// SEGMENTOS
+// =========================================================
+
+static void segment_free(LogSegment* seg) {
+    if (seg->fd >= 0)
+        close(seg->fd);
+    if (seg->idx_fd >= 0)
+        close(seg->idx_fd);
+    free(seg->index);
+    free(seg);
+}
+
+static int segment_load_index(LogSegment* seg) {
+    struct stat st;
+    if (fstat(seg->idx_fd, &st) < 0)
+        return -1;
+
+    size_t count = st.st_size / sizeof(LogIndexEntry);
+    seg->index_cap = count > 64 ? count : 64;
+    seg->index = malloc(seg->index_cap * sizeof(LogIndexEntry));
+    if (!seg->index)
+        return -1;
+
+    if (count > 0 && pread(seg->idx_fd, seg->index, count * sizeof(LogIndexEntry), 0)
+                         != (ssize_t)(count * sizeof(LogIndexEntry)))
+        return -1;
+
+    // Entradas que apuntan mas alla de los datos (caida entre write del
+    // registro y write del indice) se descartan.
+    while (count > 0 && seg->index[count - 1].offset >= seg->size)
+        count--;
+
+    seg->index_count = count;
+    return 0;
+}
+
+static LogSegment* segment_open(MsgLog* log, uint64_t seq) {
+    char path[LOG_PATH_LEN + 32];
+    struct stat st;
+
+    LogSegment* seg = calloc(1, sizeof(LogSegment));
+    if (!seg)
+        return NULL;
+
+    seg->seq = seq;
+    seg->idx_fd = -1;
+
+    segment_path(log, seq, "log", path, sizeof(path));
+    seg->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (seg->fd < 0 || fstat(seg->fd, &st) < 0) {
+        segment_free(seg);
+        return NULL;
+    }
+    seg->size = st.st_size;
+
+    segment_path(log, seq, "idx", path, sizeof(path));
+    seg->idx_fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (seg->idx_fd < 0 || segment_load_index(seg) < 0) {
+        segment_free(seg);
+        return NULL;
+    }
+
+    // El primer registro de cada segmento siempre queda indexado
+    seg->created = seg->index_count > 0 ? (time_t)seg->index[0].timestamp : time(NULL);
+    return seg;
+}
+
+// Descarta un registro incompleto al final del segmento activo. Solo se
+// recorre desde la ultima entrada del indice, no el segmento entero.
+static void segment_recover_tail(LogSegment* seg) {
+    if (seg->size == 0)
+        return;
+
+    size_t off = seg->index_count > 0 ? seg->index[seg->index_count - 1].offset : 0;
+
+    char* base = mmap(NULL, seg->size, PROT_READ, MAP_SHARED, seg->fd, 0);
+    if (base == MAP_FAILED)
+        return;
+
+    LogRecordHeader h;
+    size_t len;
+    while ((len = read_record(base, seg->size, off, &h)) > 0)
+        off += len;
+
+    munmap(base, seg->size);
+
+    if (off < seg->size) {
+        LOG_WARN("[LOG] Segmento %016llx truncado de %zu a %zu bytes",
+                 (unsigned long long)seg->seq, seg->size, off);
+        if (ftruncate(seg->fd, off) == 0)
+            seg->size = off;
+    }
+}
+
+static int segment_add_index(LogSegment* seg, uint32_t hash, uint32_t offset, int64_t ts) {
+    LogIndexEntry e = { hash, offset, ts };
+
+    if (seg->index_count == seg->index_cap) {
+        size_t cap = seg->index_cap * 2;
+        LogIndexEntry* idx = realloc(seg->index, cap * sizeof(LogIndexEntry));
+        if (!idx)
+            return -1;
+        seg->index = idx;
+        seg->index_cap = cap;
+    }
+
+    if (write(seg->idx_fd, &e, sizeof(e)) != (ssize_t)sizeof(e))
+        return -1;
+
+    seg->index[seg->index_count++] = e;
+    return 0;
+}
+
+static void segment_release(MsgLog* log, LogSegment* seg) {
+    pthread_mutex_lock(&log->mutex);
+    seg->refs--;
+    int free_it = seg->deleted && seg->refs == 0;
+    pthread_mutex_unlock(&log->mutex);
+
+    if (free_it)
+        segment_free(seg);
+}
+
+
+// =========================================================
+// ROTACION Y RETENCION (con log->mutex tomado)
+// =========================================================
+
+static void apply_retention(MsgLog* log, time_t now) {
+    while (log->oldest && log->oldest != log->active) {
+        LogSegment* seg = log->oldest;
+        struct stat st;
+        int expired = 0;
+
+        if (log->config.retention_age > 0 && fstat(seg->fd, &st) == 0)
+            expired = now - st.st_mtime > log->config.retention_age;
+
+        int oversize = log->config.retention_bytes > 0 &&
+                       log->total_bytes > log->config.retention_bytes;
+
+        if (!expired && !oversize)
+            break;
+
+        char path[LOG_PATH_LEN + 32];
+        segment_path(log, seg->seq, "log", path, sizeof(path));
+        unlink(path);
+        segment_path(log, seg->seq, "idx", path, sizeof(path));
+        unlink(path);
+
+        log->oldest = seg->next;
+        log->total_bytes -= seg->size;
+        seg->deleted = 1;
+
+        if (seg->refs == 0)
+            segment_free(seg);
+    }
+}
+
+static int rotate(MsgLog* log, time_t now) {
+    LogSegment* seg = segment_open(log, log->active->seq + 1);
+    if (!seg)
+        return -1;
+
+    fdatasync(log->active->fd);
+
+    log->active->next = seg;
+    log->active = seg;
+    seg->created = now;
+    reset_tracking(log);
+
+    apply_retention(log, now);
+    return 0;
+}
+
+static int needs_rotation(const MsgLog* log, size_t record_len, time_t now) {
+    const LogSegment* seg = log->active;
+
+    if (seg->size == 0)
+        return 0;
+    if (seg->size + record_len > log->config.segment_bytes)
+        return 1;
+    return log->config.segment_age > 0 && now - seg->created >= log->config.segment_age;
+}
+
+
+// =========================================================
+// API
+// =========================================================
+
+void msglog_default_config(MsgLogConfig* config, const char* dir) {
+    memset(config, 0, sizeof(MsgLogConfig));
+    strncpy(config->dir, dir, LOG_PATH_LEN - 1);
+    config->segment_bytes = LOG_DEFAULT_SEGMENT_BYTES;
+}
+
+static int select_log_file(const struct dirent* d) {
+    size_t len = strlen(d->d_name);
+    return len > 4 && strcmp(d->d_name + len - 4, ".log") == 0;
+}
+
+static int compare_seq(const struct dirent** a, const struct dirent** b) {
+    unsigned long long sa = strtoull((*a)->d_name, NULL, 16);
+    unsigned long long sb = strtoull((*b)->d_name, NULL, 16);
+    return (sa > sb) - (sa < sb);
+}
+
+MsgLog* msglog_open(const MsgLogConfig* config) {
+    if (mkdir(config->dir, 0755) < 0 && errno != EEXIST)
+        return NULL;
+
+    MsgLog* log = calloc(1, sizeof(MsgLog));
+    if (!log)
+        return NULL;
+
+    log->config = *config;
+    if (log->config.segment_bytes == 0)
+        log->config.segment_bytes = LOG_DEFAULT_SEGMENT_BYTES;
+    pthread_mutex_init(&log->mutex, NULL);
+    reset_tracking(log);
+
+    struct dirent** names;
+    int n = scandir(config->dir, &names, select_log_file, compare_seq);
+    if (n < 0) {
+        msglog_close(log);
+        return NULL;
+    }
+
+    LogSegment* last = NULL;
+    for (int i = 0; i < n; i++) {
+        LogSegment* seg = segment_open(log, strtoull(names[i]->d_name, NULL, 16));
+        free(names[i]);
+
+        if (!seg)
+            continue;
+
+        if (last)
+            last->next = seg;
+        else
+            log->oldest = seg;
+        last = seg;
+        log->total_bytes += seg->size;
+    }
+    free(names);
+
+    if (!last) {
+        last = log->oldest = segment_open(log, 0);
+        if (!last) {
+            msglog_close(log);
+            return NULL;
+        }
+    }
+
+    log->active = last;
+    log->total_bytes -= last->size;
+    segment_recover_tail(last);
+    log->total_bytes += last->size;
+    apply_retention(log, time(NULL));
+
+    LOG_INFO("[LOG] Abierto '%s': %zu bytes en segmentos, activo %016llx",
+             config->dir, log->total_bytes, (unsigned long long)last->seq);
+    return log;
+}
+
+void msglog_close(MsgLog* log) {
+    if (!log)
+        return;
+
+    LogSegment* seg = log->oldest;
+    while (seg) {
+        LogSegment* nx = seg->next;
+        if (seg == log->active)
+            fdatasync(seg->fd);
+        segment_free(seg);
+        seg = nx;
+    }
+
+    pthread_mutex_destroy(&log->mutex);
+    free(log);
+}
+
+int msglog_append(MsgLog* log, const char* topic, const char* data, size_t data_len, time_t timestamp) {
+    char buf[sizeof(LogRecordHeader) + 1024];
+    size_t topic_len = strlen(topic);
+    size_t total = sizeof(LogRecordHeader) + topic_len + data_len;
+
+    if (total > sizeof(buf))
+        return -1;
+
+    LogRecordHeader h = { LOG_RECORD_MAGIC, (uint16_t)topic_len, (uint16_t)data_len, timestamp };
+    memcpy(buf, &h, sizeof(h));
+    memcpy(buf + sizeof(h), topic, topic_len);
+    memcpy(buf + sizeof(h) + topic_len, data, data_len);
+
+    uint32_t hash = hash_topic(topic, topic_len);
+
+    pthread_mutex_lock(&log->mutex);
+
+    if (needs_rotation(log, total, timestamp) && rotate(log, timestamp) < 0)
+        LOG_ERROR("[LOG] No se pudo rotar el segmento: %s", strerror(errno));
+
+    LogSegment* seg = log->active;
+    uint32_t offset = (uint32_t)seg->size;
+
+    if (write(seg->fd, buf, total) != (ssize_t)total) {
+        pthread_mutex_unlock(&log->mutex);
+        return -1;
+    }
+
+    seg->size += total;
+    log->total_bytes += total;
+
+    // Indice disperso: primera aparicion del topic en el segmento y luego
+    // una entrada cada LOG_INDEX_INTERVAL bytes.
+    unsigned int slot = hash & (LOG_TRACK_SLOTS - 1);
+    if (log->track_hash[slot] != hash || log->track_offset[slot] == LOG_TRACK_EMPTY ||
+        offset - log->track_offset[slot] >= LOG_INDEX_INTERVAL) {
+        if (segment_add_index(seg, hash, offset, timestamp) == 0) {
+            log->track_hash[slot] = hash;
+            log->track_offset[slot] = offset;
+        }
+    }
+
+    pthread_mutex_unlock(&log->mutex);
+    return 0;
+}
+
+// Offset desde el que hay que leer 'hash' en el segmento, o -1 si el
+// topic no aparece en el.
+static long start_offset(const LogSegment* seg, uint32_t hash, time_t since) {
+    long start = -1;
+
+    for (size_t i = 0; i < seg->index_count; i++) {
+        const LogIndexEntry* e = &seg->index[i];
+        if (e->topic_hash != hash)
+            continue;
+        if (start < 0 || e->timestamp <= since)
+            start = e->offset;
+        if (e->timestamp > since)
+            break;
+    }
+    return start;
+}
+
+void msglog_replay(MsgLog* log, const char* topic, time_t since,
+                   int last_segments, MsgLogVisitFn fn, void* ctx) {
+    size_t topic_len = topic ? strlen(topic) : 0;
+    uint32_t hash = topic ? hash_topic(topic, topic_len) : 0;
+
+    // Se toma una referencia a cada segmento para poder leerlos sin el
+    // mutex; la retencion no los libera mientras esten en uso.
+    pthread_mutex_lock(&log->mutex);
+
+    int count = 0;
+    for (LogSegment* s = log->oldest; s; s = s->next)
+        count++;
+
+    LogSegment** segs = malloc(count * sizeof(LogSegment*));
+    size_t* sizes = malloc(count * sizeof(size_t));
+    if (!segs || !sizes) {
+        pthread_mutex_unlock(&log->mutex);
+        free(segs);
+        free(sizes);
+        return;
+    }
+
+    int skip = (last_segments > 0 && count > last_segments) ? count - last_segments : 0;
+    int n = 0;
+    for (LogSegment* s = log->oldest; s; s = s->next) {
+        if (skip-- > 0)
+            continue;
+        s->refs++;
+        sizes[n] = s->size;
+        segs[n++] = s;
+    }
+
+    pthread_mutex_unlock(&log->mutex);
+
+    for (int i = 0; i < n; i++) {
+        LogSegment* seg = segs[i];
+        size_t size = sizes[i];
+        long off = 0;
+        struct stat st;
+
+        if (size == 0 || (fstat(seg->fd, &st) == 0 && st.st_mtime < since)) {
+            segment_release(log, seg);
+            continue;
+        }
+
+        // El indice del segmento activo puede crecer (realloc), por eso
+        // se consulta con el mutex tomado.
+        if (topic) {
+            pthread_mutex_lock(&log->mutex);
+            off = start_offset(seg, hash, since);
+            pthread_mutex_unlock(&log->mutex);
+
+            if (off < 0) {
+                segment_release(log, seg);
+                continue;
+            }
+        }
+
+        char* base = mmap(NULL, size, PROT_READ, MAP_SHARED, seg->fd, 0);
+        if (base == MAP_FAILED) {
+            segment_release(log, seg);
+            continue;
+        }
+        madvise(base, size, MADV_SEQUENTIAL);
+
+        LogRecordHeader h;
+        size_t len;
+        while ((len = read_record(base, size, off, &h)) > 0) {
+            const char* t = base + off + sizeof(LogRecordHeader);
+
+            if (h.timestamp >= since &&
+                (!topic || (h.topic_len == topic_len && memcmp(t, topic, topic_len) == 0)))
+                fn(t, h.topic_len, t + h.topic_len, h.data_len, (time_t)h.timestamp, ctx);
+
+            off += len;
+        }
+
+        munmap(base, size);
+        segment_release(log, seg);
+    }
+
+    free(segs);
+    free(sizes);
+}
@@ -0,0 +1,86 @@
+#ifndef MSGLOG_H
+#define MSGLOG_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+// =========================================================
+// Log persistente de mensajes: segmentos append-only en disco.
+//
+//   <dir>/<seq>.log   registros [cabecera | topic | data]
+//   <dir>/<seq>.idx   indice disperso (hash topic, timestamp) -> offset
+//
+// Las escrituras son secuenciales; la lectura se hace con mmap.
+// Al abrir solo se leen los .idx, no los datos, asi que el
+// arranque es proporcional al tamanio del indice.
+// =========================================================
+
+#define LOG_DEFAULT_SEGMENT_BYTES   (16 * 1024 * 1024)
+#define LOG_INDEX_INTERVAL          (64 * 1024)   // bytes entre entradas de un mismo topic
+#define LOG_TRACK_SLOTS             1024
+#define LOG_PATH_LEN                256
+
+typedef struct {
+    char dir[LOG_PATH_LEN];
+    size_t segment_bytes;      // rotar al superar este tamanio
+    int segment_age;           // o al superar esta edad en segundos (0 = no)
+    size_t retention_bytes;    // borrar segmentos viejos por encima de este total (0 = no)
+    int retention_age;         // o con mas de esta edad en segundos (0 = no)
+} MsgLogConfig;
+
+typedef struct {
+    uint32_t topic_hash;
+    uint32_t offset;
+    int64_t timestamp;
+} LogIndexEntry;
+
+typedef struct LogSegment {
+    uint64_t seq;
+    int fd;
+    int idx_fd;
+    size_t size;
+    time_t created;
+
+    LogIndexEntry* index;
+    size_t index_count;
+    size_t index_cap;
+
+    int refs;                  // lectores con el segmento mapeado
+    int deleted;
+
+    struct LogSegment* next;   // del mas viejo al mas nuevo
+} LogSegment;
+
+typedef struct {
+    MsgLogConfig config;
+    pthread_mutex_t mutex;
+
+    LogSegment* oldest;
+    LogSegment* active;
+    size_t total_bytes;
+
+    // Ultimo offset indexado por topic en el segmento activo
+    uint32_t track_hash[LOG_TRACK_SLOTS];
+    uint32_t track_offset[LOG_TRACK_SLOTS];
+} MsgLog;
+
+typedef void (*MsgLogVisitFn)(const char* topic, size_t topic_len,
+                              const char* data, size_t data_len,
+                              time_t timestamp, void* ctx);
+
+void msglog_default_config(MsgLogConfig* config, const char* dir);
+
+MsgLog* msglog_open(const MsgLogConfig* config);
+void    msglog_close(MsgLog* log);
+
+int  msglog_append(MsgLog* log, const char* topic, const char* data, size_t data_len, time_t timestamp);
+
+// Recorre en orden los registros con timestamp >= since. Si 'topic' no es
+// NULL solo visita ese topic y usa el indice para saltar directo a el.
+// Con 'last_segments' > 0 solo se leen los N segmentos mas nuevos.
+void msglog_replay(MsgLog* log, const char* topic, time_t since,
+                   int last_segments, MsgLogVisitFn fn, void* ctx);
+
+#endif
@@ -0,0 +1,228 @@
+#include "protocol.h"
+#include "wire.h"
+#include <string.h>
+
+// =========================================================
+// FRAMER
+// =========================================================
+
+void framer_init(Framer* f) {
+    f->len = 0;
+    f->mode = FRAMING_TEXT;
+    f->discarding = 0;
+    f->skip = 0;
+}
+
+char* framer_space(Framer* f, size_t* avail) {
+    *avail = sizeof(f->buf) - f->len;
+    return f->buf + f->len;
+}
+
+static void decode_frame(char* frame, const WireHeader* h, Command* cmd) {
+    char* topic = frame + WIRE_HEADER_LEN;
+
+    memset(cmd, 0, sizeof(Command));
+
+    // El topic se corre sobre la cabecera (ya leida) para terminarlo en
+    // '\0' sin pisar el payload.
+    memmove(frame, topic, h->topic_len);
+    frame[h->topic_len] = '\0';
+
+    cmd->arg = frame;
+    cmd->arg_len = h->topic_len;
+    cmd->data = topic + h->topic_len;
+    cmd->data_len = h->payload_len;
+
+    switch (h->opcode) {
+        case WIRE_PUBLISH:   cmd->type = CMD_PUBLISH; break;
+        case WIRE_SUBSCRIBE: cmd->type = CMD_SUBSCRIBE; break;
+        case WIRE_UNSUBSCRIBE: cmd->type = CMD_UNSUBSCRIBE; break;
+        case WIRE_HISTORY:   cmd->type = CMD_HISTORY; break;
+        case WIRE_REGISTER:  cmd->type = CMD_REGISTER; break;
+        case WIRE_BRIDGE:    cmd->type = CMD_BRIDGE; break;
+        case WIRE_RELAY:     cmd->type = CMD_RELAY; break;
+        case WIRE_PUBLISH_BATCH: cmd->type = CMD_PUBLISH_BATCH; return;
+        case WIRE_STATS:     cmd->type = CMD_STATS; return;
+        default:             cmd->type = CMD_UNKNOWN; return;
+    }
+
+    if (cmd->arg_len == 0)
+        cmd->type = CMD_INVALID;
+}
+
+int protocol_next_record(char** pos, char* end, Command* cmd) {
+    WireHeader h;
+    size_t avail = end - *pos;
+
+    if (avail == 0)
+        return 0;
+
+    size_t total = wire_decode_header(*pos, avail, &h);
+    if (total == 0 || total > avail || h.opcode != WIRE_PUBLISH)
+        return -1;
+
+    decode_frame(*pos, &h, cmd);
+    *pos += total;
+    return 1;
+}
+
+int framer_commit(Framer* f, size_t n, CommandFn fn, void* ctx) {
+    int overflow = 0;
+    Command cmd;
+
+    // En modo texto lo que ya estaba en el buffer se reviso en la llamada
+    // anterior y no tenia '\n': solo se busca en los bytes nuevos.
+    char* start = f->buf;
+    char* scan = f->buf + f->len;
+    char* end = scan + n;
+
+    while (start < end) {
+        if (f->mode == FRAMING_TEXT) {
+            char* nl = memchr(scan, '\n', end - scan);
+            if (!nl)
+                break;
+
+            if (f->discarding) {
+                f->discarding = 0;
+            } else {
+                size_t len = nl - start;
+                if (len > 0 && start[len - 1] == '\r')
+                    len--;
+                start[len] = '\0';
+
+                protocol_parse(start, len, &cmd);
+                fn(&cmd, ctx);
+            }
+            start = scan = nl + 1;
+        } else {
+            size_t avail = end - start;
+
+            if (f->skip > 0) {
+                size_t k = f->skip < avail ? f->skip : avail;
+                f->skip -= k;
+                start = scan = start + k;
+                continue;
+            }
+
+            WireHeader h;
+            size_t total = wire_decode_header(start, avail, &h);
+            if (total == 0)
+                break;
+
+            // Un frame que no entra en el buffer se descarta entero
+            if (total > sizeof(f->buf)) {
+                f->skip = total;
+                overflow++;
+                continue;
+            }
+            if (avail < total)
+                break;
+
+            decode_frame(start, &h, &cmd);
+            fn(&cmd, ctx);
+            start = scan = start + total;
+        }
+    }
+
+    size_t rest = end - start;
+
+    // Buffer lleno sin fin de linea: la linea no entra y se descarta
+    // hasta el proximo '\n'.
+    if (f->mode == FRAMING_TEXT) {
+        if (rest == sizeof(f->buf) && !f->discarding) {
+            f->discarding = 1;
+            overflow++;
+        }
+        if (f->discarding)
+            rest = 0;
+    }
+
+    if (rest > 0 && start != f->buf)
+        memmove(f->buf, start, rest);
+    f->len = rest;
+
+    return overflow;
+}
+
+
+// =========================================================
+// PARSER
+// =========================================================
+
+static int has_prefix(const char* line, size_t len, const char* prefix, size_t plen) {
+    return len >= plen && memcmp(line, prefix, plen) == 0;
+}
+
+static char* skip_spaces(char* p, char* end) {
+    while (p < end && *p == ' ')
+        p++;
+    return p;
+}
+
+// Toma el token que empieza en 'p' y lo termina en '\0'. Devuelve el
+// resto de la linea.
+static char* take_token(char* p, char* end, char** tok, size_t* tok_len) {
+    char* sp = memchr(p, ' ', end - p);
+    char* tok_end = sp ? sp : end;
+
+    *tok = p;
+    *tok_len = tok_end - p;
+    *tok_end = '\0';
+
+    return sp ? skip_spaces(sp + 1, end) : end;
+}
+
+void protocol_parse(char* line, size_t len, Command* cmd) {
+    char* end = line + len;
+    char* rest;
+
+    memset(cmd, 0, sizeof(Command));
+    cmd->line = line;
+
+    if (len == 0) {
+        cmd->type = CMD_EMPTY;
+        return;
+    }
+
+    // PUBLISH primero: es el comando del camino caliente
+    if (has_prefix(line, len, "PUBLISH ", 8)) {
+        rest = take_token(skip_spaces(line + 8, end), end, &cmd->arg, &cmd->arg_len);
+        cmd->data = rest;
+        cmd->data_len = end - rest;
+        cmd->type = cmd->arg_len > 0 ? CMD_PUBLISH : CMD_INVALID;
+    }
+    else if (has_prefix(line, len, "SUBSCRIBE ", 10)) {
+        rest = take_token(skip_spaces(line + 10, end), end, &cmd->arg, &cmd->arg_len);
+        cmd->data = rest;
+        cmd->data_len = end - rest;
+        cmd->type = cmd->arg_len > 0 ? CMD_SUBSCRIBE : CMD_INVALID;
+    }
+    else if (has_prefix(line, len, "UNSUBSCRIBE ", 12)) {
+        take_token(skip_spaces(line + 12, end), end, &cmd->arg, &cmd->arg_len);
+        cmd->type = cmd->arg_len > 0 ? CMD_UNSUBSCRIBE : CMD_INVALID;
+    }
+    else if (has_prefix(line, len, "REGISTER GATEWAY ", 17)) {
+        take_token(skip_spaces(line + 17, end), end, &cmd->arg, &cmd->arg_len);
+        cmd->type = cmd->arg_len > 0 ? CMD_REGISTER : CMD_INVALID;
+    }
+    else if (has_prefix(line, len, "HISTORY ", 8)) {
+        rest = take_token(skip_spaces(line + 8, end), end, &cmd->arg, &cmd->arg_len);
+        cmd->data = rest;
+        cmd->data_len = end - rest;
+        cmd->type = cmd->arg_len > 0 ? CMD_HISTORY : CMD_INVALID;
+    }
+    else if (has_prefix(line, len, "HELLO ", 6)) {
+        take_token(skip_spaces(line + 6, end), end, &cmd->arg, &cmd->arg_len);
+        cmd->type = cmd->arg_len > 0 ? CMD_HELLO : CMD_INVALID;
+    }
+    else if (len == 5 && memcmp(line, "STATS", 5) == 0) {
+        cmd->type = CMD_STATS;
+    }
+    else if (has_prefix(line, len, "BRIDGE ", 7)) {
+        take_token(skip_spaces(line + 7, end), end, &cmd->arg, &cmd->arg_len);
+        cmd->type = cmd->arg_len > 0 ? CMD_BRIDGE : CMD_INVALID;
+    }
+    else {
+        cmd->type = CMD_UNKNOWN;
+    }
+}
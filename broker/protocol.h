@@ -0,0 +1,107 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+
+// =========================================================
+// Protocolo de texto del broker (una linea por comando):
+//
+//   HELLO BINARY | HELLO TEXT | HELLO SHM
+//   REGISTER GATEWAY <id>
+//   SUBSCRIBE <filtro> [CONFLATE]
+//   UNSUBSCRIBE <filtro>
+//   PUBLISH <topic> <data>
+//   HISTORY <filtro> <since> <until> <limit>
+//   STATS
+//   BRIDGE <nombre>
+//
+// Despues de "HELLO BINARY" la conexion usa los frames de wire.h.
+//
+// "HELLO SHM" (solo por el socket Unix, con el ring adjunto) pasa la
+// entrada de la conexion a memoria compartida (shm_ring.h); despues
+// todavia se puede elegir el formato con otro HELLO.
+//
+// "SUBSCRIBE $share/<grupo>/<filtro>" se une a un grupo compartido:
+// cada mensaje que coincide con <filtro> va a uno solo de los miembros.
+//
+// Con CONFLATE, si el suscriptor se atrasa, de cada topic queda
+// pendiente solo el valor mas nuevo (en binario va en el payload).
+//
+// STATS responde una linea "STAT <nombre> <valor>" por metrica y
+// "OK STATS <n>" al final (ver stats.h).
+//
+// A un gateway registrado el broker le manda "CREDIT <n>": cuantos
+// PUBLISH mas puede mandar (control de flujo, ver broker.h).
+//
+// BRIDGE lo manda otro broker que se conecta como puente (ver "PUENTES
+// ENTRE BROKERS" en broker.c), despues de HELLO BINARY. Por el puente
+// vuelven entregas WIRE_RELAY, que solo se interpretan en una conexion
+// saliente de puente.
+//
+// El Framer acumula lo recibido por una conexion y entrega cada
+// comando completo; lo que llega partido entre dos recv se completa
+// en la siguiente lectura. El parseo trabaja sobre el mismo buffer
+// (inserta '\0' al final del topic), sin sscanf ni copias.
+// =========================================================
+
+#define FRAMER_BUF_LEN 4096          // igual a WIRE_MAX_FRAME
+
+typedef enum {
+    FRAMING_TEXT = 0,
+    FRAMING_BINARY
+} FramingMode;
+
+typedef struct {
+    char buf[FRAMER_BUF_LEN];
+    size_t len;
+    FramingMode mode;
+    int discarding;          // texto: descartando una linea demasiado larga
+    size_t skip;             // binario: bytes que faltan de un frame descartado
+} Framer;
+
+typedef enum {
+    CMD_REGISTER,
+    CMD_SUBSCRIBE,
+    CMD_UNSUBSCRIBE,
+    CMD_PUBLISH,
+    CMD_PUBLISH_BATCH,       // data = registros, se recorren con protocol_next_record
+    CMD_HELLO,
+    CMD_HISTORY,             // data = "<since> <until> <limit>"
+    CMD_STATS,
+    CMD_BRIDGE,              // arg = nombre del broker que se conecta
+    CMD_RELAY,               // entrega de otro broker (solo en un puente)
+    CMD_EMPTY,
+    CMD_UNKNOWN,
+    CMD_INVALID              // comando conocido con argumentos invalidos
+} CommandType;
+
+typedef struct {
+    CommandType type;
+    char* arg;               // id del gateway, filtro, topic o modo de HELLO
+    size_t arg_len;          // (siempre terminado en '\0')
+    char* data;              // payload de PUBLISH, rango de HISTORY u opciones de
+    size_t data_len;         // SUBSCRIBE (no necesariamente terminado en '\0')
+    char* line;              // linea original en modo texto, si no NULL
+} Command;
+
+// Se llama por cada comando completo. Puede cambiar f->mode (HELLO) y
+// el resto del buffer se interpreta con el nuevo modo.
+typedef void (*CommandFn)(Command* cmd, void* ctx);
+
+void   framer_init(Framer* f);
+
+// Espacio libre donde hacer recv() directamente.
+char*  framer_space(Framer* f, size_t* avail);
+
+// Registra 'n' bytes recibidos y entrega los comandos completos.
+// Devuelve cuantos comandos se descartaron por exceder FRAMER_BUF_LEN.
+int    framer_commit(Framer* f, size_t n, CommandFn fn, void* ctx);
+
+void   protocol_parse(char* line, size_t len, Command* cmd);
+
+// Saca el proximo PUBLISH de un lote (avanza *pos hasta 'end') y lo deja
+// en 'cmd' igual que un PUBLISH suelto. Devuelve 1 si hay registro, 0 al
+// terminar y -1 si el resto del lote esta mal formado.
+int    protocol_next_record(char** pos, char* end, Command* cmd);
+
+#endif
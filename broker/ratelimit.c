@@ -0,0 +1,188 @@
+#include "broker.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// =========================================================
+// BUCKETS
+// =========================================================
+
+static int bucket_init(TokenBucket* b, double rate, double burst) {
+    if (rate <= 0 || burst < 1)
+        return 0;
+
+    b->interval_ns = (uint64_t)(1e9 / rate);
+    b->tolerance_ns = (uint64_t)((burst - 1) * b->interval_ns);
+    b->tat = 0;
+    b->admitted = 0;
+    b->rejected = 0;
+    return 1;
+}
+
+uint64_t rate_limit_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// GCRA: se admite si la proxima llegada teorica no esta mas adelante
+// que la rafaga permitida; admitir la corre un intervalo.
+int token_bucket_take(TokenBucket* b, uint64_t now_ns) {
+    uint64_t tat = __atomic_load_n(&b->tat, __ATOMIC_RELAXED);
+
+    for (;;) {
+        uint64_t base = tat > now_ns ? tat : now_ns;
+
+        if (base - now_ns > b->tolerance_ns) {
+            __atomic_add_fetch(&b->rejected, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+
+        if (__atomic_compare_exchange_n(&b->tat, &tat, base + b->interval_ns, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+    }
+
+    __atomic_add_fetch(&b->admitted, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+// Cada token corrio la llegada teorica un intervalo: se la vuelve atras.
+// Si ya paso no importa, take() parte del tiempo actual.
+void token_bucket_refund(TokenBucket* b) {
+    __atomic_sub_fetch(&b->tat, b->interval_ns, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&b->admitted, 1, __ATOMIC_RELAXED);
+}
+
+
+// =========================================================
+// CONFIGURACION
+// =========================================================
+
+static RateLimit* new_limit(const char* key, double rate, double burst) {
+    size_t len = strlen(key);
+    if (len == 0 || len >= MAX_TOPIC_LEN)
+        return NULL;
+
+    RateLimit* l = calloc(1, sizeof(RateLimit));
+    if (!l)
+        return NULL;
+
+    if (!bucket_init(&l->bucket, rate, burst)) {
+        free(l);
+        return NULL;
+    }
+
+    memcpy(l->key, key, len + 1);
+    l->key_len = len;
+    return l;
+}
+
+static void free_list(RateLimit* l) {
+    while (l) {
+        RateLimit* nx = l->next;
+        free(l);
+        l = nx;
+    }
+}
+
+void rate_limits_init(RateLimits* rl) {
+    rl->topics = NULL;
+    rl->gateways = NULL;
+    rl->gateway_default = NULL;
+    pthread_mutex_init(&rl->lock, NULL);
+}
+
+void rate_limits_destroy(RateLimits* rl) {
+    free_list(rl->topics);
+    free_list(rl->gateways);
+    free(rl->gateway_default);
+    rl->topics = NULL;
+    rl->gateways = NULL;
+    rl->gateway_default = NULL;
+    pthread_mutex_destroy(&rl->lock);
+}
+
+int rate_limit_add_gateway(RateLimits* rl, const char* id, double rate, double burst) {
+    if (strlen(id) >= MAX_GATEWAY_ID)
+        return 0;
+
+    RateLimit* l = new_limit(id, rate, burst);
+    if (!l)
+        return 0;
+
+    if (strcmp(id, RATE_LIMIT_ANY) == 0) {
+        free(rl->gateway_default);
+        rl->gateway_default = l;
+    } else {
+        l->next = rl->gateways;
+        rl->gateways = l;
+    }
+    return 1;
+}
+
+int rate_limit_add_topic(RateLimits* rl, const char* prefix, double rate, double burst) {
+    RateLimit* l = new_limit(prefix, rate, burst);
+    if (!l)
+        return 0;
+
+    // Ordenados del mas largo al mas corto: el primero que coincide es
+    // el mas especifico
+    RateLimit** pp = &rl->topics;
+    while (*pp && (*pp)->key_len >= l->key_len)
+        pp = &(*pp)->next;
+
+    l->next = *pp;
+    *pp = l;
+    return 1;
+}
+
+
+// =========================================================
+// CONSULTAS
+// =========================================================
+
+TokenBucket* rate_limit_gateway(RateLimits* rl, const char* id) {
+    TokenBucket* b = NULL;
+
+    pthread_mutex_lock(&rl->lock);
+
+    for (RateLimit* l = rl->gateways; l && !b; l = l->next)
+        if (strcmp(l->key, id) == 0)
+            b = &l->bucket;
+
+    // Primer REGISTER de un id sin limite propio: su bucket sale de "*"
+    if (!b && rl->gateway_default) {
+        RateLimit* l = malloc(sizeof(RateLimit));
+        if (l) {
+            *l = *rl->gateway_default;
+            strncpy(l->key, id, MAX_TOPIC_LEN - 1);
+            l->key[MAX_TOPIC_LEN - 1] = '\0';
+            l->key_len = strlen(l->key);
+            l->next = rl->gateways;
+            rl->gateways = l;
+            b = &l->bucket;
+        }
+    }
+
+    pthread_mutex_unlock(&rl->lock);
+    return b;
+}
+
+// La lista de topics no cambia despues de arrancar: se lee sin lock.
+TokenBucket* rate_limit_topic(RateLimits* rl, const char* topic, size_t len) {
+    for (RateLimit* l = rl->topics; l; l = l->next)
+        if (l->key_len <= len && memcmp(topic, l->key, l->key_len) == 0)
+            return &l->bucket;
+    return NULL;
+}
+
+void rate_limits_foreach(RateLimits* rl, RateLimitVisitFn fn, void* ctx) {
+    for (RateLimit* l = rl->topics; l; l = l->next)
+        fn("topic", l, ctx);
+
+    pthread_mutex_lock(&rl->lock);
+    for (RateLimit* l = rl->gateways; l; l = l->next)
+        fn("gateway", l, ctx);
+    pthread_mutex_unlock(&rl->lock);
+}
@@ -0,0 +1,76 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Se incluye desde broker.h (usa MAX_TOPIC_LEN).
+
+// =========================================================
+// Control de admision de PUBLISH con token buckets: uno por id de
+// gateway (el de REGISTER GATEWAY) y uno por prefijo de topic. Un
+// bucket de 'rate' por segundo y rafaga 'burst' se implementa como GCRA:
+// el estado es un solo entero (el tiempo teorico de la proxima llegada)
+// que se avanza con CAS, sin locks en el camino de PUBLISH.
+//
+// Los limites de gateway se configuran por id; el id "*" es el limite
+// de cada gateway sin uno propio (cada id tiene su bucket). Para un
+// topic vale el prefijo configurado mas largo que coincida.
+//
+// Cada bucket cuenta sus decisiones (admitidos / rechazados).
+// =========================================================
+
+#define RATE_LIMIT_ANY "*"
+
+typedef struct TokenBucket {
+    uint64_t interval_ns;         // 1 / rate
+    uint64_t tolerance_ns;        // (burst - 1) * interval
+    uint64_t tat;                 // atomico
+    unsigned long admitted;       // atomicos
+    unsigned long rejected;
+} TokenBucket;
+
+typedef struct RateLimit {
+    char key[MAX_TOPIC_LEN];      // id de gateway o prefijo de topic
+    size_t key_len;
+    TokenBucket bucket;
+    struct RateLimit* next;
+} RateLimit;
+
+typedef struct {
+    RateLimit* topics;            // del prefijo mas largo al mas corto
+    RateLimit* gateways;
+    RateLimit* gateway_default;   // plantilla de "*", o NULL
+    pthread_mutex_t lock;         // protege la lista de gateways
+} RateLimits;
+
+typedef void (*RateLimitVisitFn)(const char* kind, const RateLimit* rl, void* ctx);
+
+void rate_limits_init(RateLimits* rl);
+void rate_limits_destroy(RateLimits* rl);
+
+// Configuracion (antes de arrancar el broker). Devuelve 0 si los
+// parametros no son validos.
+int  rate_limit_add_gateway(RateLimits* rl, const char* id, double rate, double burst);
+int  rate_limit_add_topic(RateLimits* rl, const char* prefix, double rate, double burst);
+
+// Bucket del gateway 'id' (creado con el limite "*" si no tiene uno
+// propio), o NULL si no esta limitado. Vive hasta rate_limits_destroy().
+TokenBucket* rate_limit_gateway(RateLimits* rl, const char* id);
+
+// Bucket del prefijo mas largo que coincide con 'topic', o NULL.
+TokenBucket* rate_limit_topic(RateLimits* rl, const char* topic, size_t len);
+
+// Consume un token. Devuelve 1 si se admite, 0 si se rechaza.
+int  token_bucket_take(TokenBucket* b, uint64_t now_ns);
+
+// Devuelve el token que tomo token_bucket_take() para algo que despues
+// rechazo otro limite; deja de contarse como admitido.
+void token_bucket_refund(TokenBucket* b);
+
+uint64_t rate_limit_now(void);
+
+void rate_limits_foreach(RateLimits* rl, RateLimitVisitFn fn, void* ctx);
+
+#endif
@@ -0,0 +1,194 @@
+#include "broker.h"
+#include <stdlib.h>
+#include <string.h>
+
+// =========================================================
+// TABLA DE TOPICS
+// =========================================================
+
+#define RETAINED_INITIAL_BUCKETS 64
+
+static unsigned int hash_topic(const char* topic) {
+    unsigned int h = 2166136261u;   // FNV-1a
+    while (*topic) {
+        h ^= (unsigned char)*topic++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static RetainedEntry* find_entry(RetainedStore* store, const char* topic) {
+    RetainedEntry* e = store->buckets[hash_topic(topic) & (store->num_buckets - 1)];
+    while (e) {
+        if (strcmp(e->topic, topic) == 0)
+            return e;
+        e = e->next;
+    }
+    return NULL;
+}
+
+// Se llama con el lock de la tabla tomado en escritura.
+static void grow_table(RetainedStore* store) {
+    unsigned int size = store->num_buckets * 2;
+    RetainedEntry** buckets = calloc(size, sizeof(RetainedEntry*));
+    if (!buckets)
+        return;
+
+    for (unsigned int i = 0; i < store->num_buckets; i++) {
+        RetainedEntry* e = store->buckets[i];
+        while (e) {
+            RetainedEntry* nx = e->next;
+            unsigned int b = hash_topic(e->topic) & (size - 1);
+            e->next = buckets[b];
+            buckets[b] = e;
+            e = nx;
+        }
+    }
+
+    free(store->buckets);
+    store->buckets = buckets;
+    store->num_buckets = size;
+}
+
+static RetainedEntry* get_entry(RetainedStore* store, const char* topic) {
+    pthread_rwlock_rdlock(&store->lock);
+    RetainedEntry* e = find_entry(store, topic);
+    pthread_rwlock_unlock(&store->lock);
+
+    if (e)
+        return e;
+
+    pthread_rwlock_wrlock(&store->lock);
+
+    e = find_entry(store, topic);
+    if (!e && (e = calloc(1, sizeof(RetainedEntry))) != NULL) {
+        strncpy(e->topic, topic, MAX_TOPIC_LEN - 1);
+        pthread_mutex_init(&e->mutex, NULL);
+
+        if (store->num_topics >= store->num_buckets)
+            grow_table(store);
+
+        unsigned int b = hash_topic(topic) & (store->num_buckets - 1);
+        e->next = store->buckets[b];
+        store->buckets[b] = e;
+        store->num_topics++;
+    }
+
+    pthread_rwlock_unlock(&store->lock);
+    return e;
+}
+
+// Entrega el valor de 'e', si ya tiene uno. Devuelve 1 si lo entrego.
+static int visit_entry(RetainedEntry* e, RetainedVisitFn fn, void* ctx) {
+    int found = 0;
+
+    pthread_mutex_lock(&e->mutex);
+    if (e->msg) {
+        fn(e->msg, ctx);
+        found = 1;
+    }
+    pthread_mutex_unlock(&e->mutex);
+
+    return found;
+}
+
+
+// =========================================================
+// API
+// =========================================================
+
+int retained_init(RetainedStore* store) {
+    store->buckets = calloc(RETAINED_INITIAL_BUCKETS, sizeof(RetainedEntry*));
+    if (!store->buckets)
+        return 0;
+
+    store->num_buckets = RETAINED_INITIAL_BUCKETS;
+    store->num_topics = 0;
+    pthread_rwlock_init(&store->lock, NULL);
+    return 1;
+}
+
+void retained_destroy(RetainedStore* store) {
+    for (unsigned int i = 0; i < store->num_buckets; i++) {
+        RetainedEntry* e = store->buckets[i];
+        while (e) {
+            RetainedEntry* nx = e->next;
+            if (e->msg)
+                message_release(e->msg);
+            pthread_mutex_destroy(&e->mutex);
+            free(e);
+            e = nx;
+        }
+    }
+
+    free(store->buckets);
+    store->buckets = NULL;
+    store->num_buckets = 0;
+    store->num_topics = 0;
+    pthread_rwlock_destroy(&store->lock);
+}
+
+void retained_set(RetainedStore* store, Message* msg) {
+    RetainedEntry* e = get_entry(store, msg->topic);
+    if (!e)
+        return;
+
+    message_retain(msg);
+
+    pthread_mutex_lock(&e->mutex);
+    Message* old = e->msg;
+    e->msg = msg;
+    pthread_mutex_unlock(&e->mutex);
+
+    if (old)
+        message_release(old);
+}
+
+int retained_has(RetainedStore* store, const char* topic) {
+    int found = 0;
+
+    pthread_rwlock_rdlock(&store->lock);
+
+    RetainedEntry* e = find_entry(store, topic);
+    if (e) {
+        pthread_mutex_lock(&e->mutex);
+        found = e->msg != NULL;
+        pthread_mutex_unlock(&e->mutex);
+    }
+
+    pthread_rwlock_unlock(&store->lock);
+    return found;
+}
+
+int retained_match(RetainedStore* store, const char* filter, RetainedVisitFn fn, void* ctx) {
+    int count = 0;
+
+    pthread_rwlock_rdlock(&store->lock);
+
+    if (!strpbrk(filter, "+#")) {
+        RetainedEntry* e = find_entry(store, filter);
+        if (e)
+            count += visit_entry(e, fn, ctx);
+    } else {
+        for (unsigned int b = 0; b < store->num_buckets; b++) {
+            for (RetainedEntry* e = store->buckets[b]; e; e = e->next) {
+                if (topic_filter_matches(filter, e->topic))
+                    count += visit_entry(e, fn, ctx);
+            }
+        }
+    }
+
+    pthread_rwlock_unlock(&store->lock);
+    return count;
+}
+
+void retained_foreach(RetainedStore* store, RetainedVisitFn fn, void* ctx) {
+    pthread_rwlock_rdlock(&store->lock);
+
+    for (unsigned int b = 0; b < store->num_buckets; b++) {
+        for (RetainedEntry* e = store->buckets[b]; e; e = e->next)
+            visit_entry(e, fn, ctx);
+    }
+
+    pthread_rwlock_unlock(&store->lock);
+}
@@ -0,0 +1,54 @@
+#ifndef RETAINED_H
+#define RETAINED_H
+
+#include <pthread.h>
+#include "message.h"
+
+// Se incluye desde broker.h (usa MAX_TOPIC_LEN).
+
+// =========================================================
+// Ultimo valor de cada topic (mensajes retenidos): tabla hash
+// topic -> Message, con la misma referencia que se entrega a los
+// suscriptores. Al suscribirse, un cliente recibe enseguida el valor
+// vigente de cada topic que coincide con su filtro, sin esperar a la
+// proxima publicacion ni recorrer el historial.
+//
+// A diferencia del historial no vence por edad: el ultimo valor de un
+// topic se conserva hasta que se publica otro.
+// =========================================================
+
+typedef struct RetainedEntry {
+    char topic[MAX_TOPIC_LEN];
+    pthread_mutex_t mutex;
+    Message* msg;
+    struct RetainedEntry* next;   // cadena del bucket
+} RetainedEntry;
+
+typedef struct {
+    RetainedEntry** buckets;
+    unsigned int num_buckets;
+    unsigned int num_topics;
+    pthread_rwlock_t lock;        // protege solo la tabla de topics
+} RetainedStore;
+
+typedef void (*RetainedVisitFn)(Message* msg, void* ctx);
+
+int  retained_init(RetainedStore* store);
+void retained_destroy(RetainedStore* store);
+
+// Reemplaza el valor del topic de 'msg' (lo retiene; suelta el anterior).
+void retained_set(RetainedStore* store, Message* msg);
+
+// 1 si 'topic' (sin wildcards) tiene un valor vigente.
+int  retained_has(RetainedStore* store, const char* topic);
+
+// Llama a fn con el valor vigente de cada topic que coincide con
+// 'filter'. Sin wildcards es una busqueda en la tabla; con wildcards
+// recorre los topics. Devuelve cuantos valores visito.
+int  retained_match(RetainedStore* store, const char* filter, RetainedVisitFn fn, void* ctx);
+
+// Todos los valores vigentes, incluidos los de topics '$' (que "#" no
+// alcanza). Para el snapshot.
+void retained_foreach(RetainedStore* store, RetainedVisitFn fn, void* ctx);
+
+#endif
@@ -0,0 +1,196 @@
+#include "series.h"
+#include <string.h>
+
+// =========================================================
+// BITS
+// =========================================================
+
+// De a un byte por vez, del bit mas significativo al menos.
+void bits_put(BitWriter* w, uint64_t value, int nbits) {
+    while (nbits > 0) {
+        int free_bits = 8 - (int)(w->bits & 7);
+        int take = nbits < free_bits ? nbits : free_bits;
+        unsigned char chunk = (unsigned char)((value >> (nbits - take)) & ((1u << take) - 1));
+
+        if ((w->bits & 7) == 0)
+            w->buf[w->bits >> 3] = 0;
+        w->buf[w->bits >> 3] |= (unsigned char)(chunk << (free_bits - take));
+
+        w->bits += take;
+        nbits -= take;
+    }
+}
+
+// Leer mas alla del final devuelve ceros.
+uint64_t bits_get(BitReader* r, int nbits) {
+    uint64_t v = 0;
+
+    while (nbits > 0) {
+        int avail = 8 - (int)(r->pos & 7);
+        int take = nbits < avail ? nbits : avail;
+        size_t byte = r->pos >> 3;
+        unsigned char b = byte < r->len ? r->buf[byte] : 0;
+
+        v = (v << take) | ((b >> (avail - take)) & ((1u << take) - 1));
+
+        r->pos += take;
+        nbits -= take;
+    }
+    return v;
+}
+
+size_t bits_bytes(const BitWriter* w) {
+    return (w->bits + 7) >> 3;
+}
+
+
+// =========================================================
+// ENTEROS
+// =========================================================
+
+static int fits(int64_t v, int nbits) {
+    int64_t lim = (int64_t)1 << (nbits - 1);
+    return v >= -lim && v < lim;
+}
+
+static int64_t sign_extend(uint64_t v, int nbits) {
+    uint64_t m = (uint64_t)1 << (nbits - 1);
+    return (int64_t)((v ^ m) - m);
+}
+
+void series_put_int(BitWriter* w, int64_t v) {
+    if (v == 0) {
+        bits_put(w, 0, 1);
+    } else if (fits(v, 7)) {
+        bits_put(w, 0x2, 2);
+        bits_put(w, (uint64_t)v & 0x7F, 7);
+    } else if (fits(v, 9)) {
+        bits_put(w, 0x6, 3);
+        bits_put(w, (uint64_t)v & 0x1FF, 9);
+    } else if (fits(v, 12)) {
+        bits_put(w, 0xE, 4);
+        bits_put(w, (uint64_t)v & 0xFFF, 12);
+    } else {
+        bits_put(w, 0xF, 4);
+        bits_put(w, (uint64_t)v, 64);
+    }
+}
+
+int64_t series_get_int(BitReader* r) {
+    if (!bits_get(r, 1))
+        return 0;
+    if (!bits_get(r, 1))
+        return sign_extend(bits_get(r, 7), 7);
+    if (!bits_get(r, 1))
+        return sign_extend(bits_get(r, 9), 9);
+    if (!bits_get(r, 1))
+        return sign_extend(bits_get(r, 12), 12);
+    return (int64_t)bits_get(r, 64);
+}
+
+
+// =========================================================
+// TIMESTAMPS
+// =========================================================
+
+void series_put_time(BitWriter* w, SeriesTime* s, int64_t ts) {
+    if (s->n == 0) {
+        bits_put(w, (uint64_t)ts, 64);
+    } else {
+        int64_t delta = ts - s->prev;
+        series_put_int(w, s->n == 1 ? delta : delta - s->delta);
+        s->delta = delta;
+    }
+
+    s->prev = ts;
+    s->n++;
+}
+
+int64_t series_get_time(BitReader* r, SeriesTime* s) {
+    if (s->n == 0) {
+        s->prev = (int64_t)bits_get(r, 64);
+    } else {
+        int64_t d = series_get_int(r);
+        s->delta = s->n == 1 ? d : s->delta + d;
+        s->prev += s->delta;
+    }
+
+    s->n++;
+    return s->prev;
+}
+
+
+// =========================================================
+// DOUBLES
+// =========================================================
+
+static uint64_t double_bits(double v) {
+    uint64_t u;
+    memcpy(&u, &v, sizeof(u));
+    return u;
+}
+
+static double bits_double(uint64_t u) {
+    double v;
+    memcpy(&v, &u, sizeof(v));
+    return v;
+}
+
+void series_put_double(BitWriter* w, SeriesXor* s, double v) {
+    uint64_t u = double_bits(v);
+
+    if (s->n++ == 0) {
+        bits_put(w, u, 64);
+        s->prev = u;
+        return;
+    }
+
+    uint64_t x = u ^ s->prev;
+    s->prev = u;
+
+    if (x == 0) {
+        bits_put(w, 0, 1);
+        return;
+    }
+
+    int lead = __builtin_clzll(x);
+    int trail = __builtin_ctzll(x);
+    if (lead > 31)
+        lead = 31;
+
+    // Entra en la ventana anterior: solo los bits de esa ventana
+    if (s->n > 2 && lead >= s->lead && trail >= s->trail) {
+        bits_put(w, 0x2, 2);
+        bits_put(w, x >> s->trail, 64 - s->lead - s->trail);
+        return;
+    }
+
+    int sig = 64 - lead - trail;
+    bits_put(w, 0x3, 2);
+    bits_put(w, (uint64_t)lead, 5);
+    bits_put(w, (uint64_t)(sig - 1), 6);
+    bits_put(w, x >> trail, sig);
+
+    s->lead = lead;
+    s->trail = trail;
+}
+
+double series_get_double(BitReader* r, SeriesXor* s) {
+    if (s->n++ == 0) {
+        s->prev = bits_get(r, 64);
+        return bits_double(s->prev);
+    }
+
+    if (!bits_get(r, 1))
+        return bits_double(s->prev);
+
+    if (bits_get(r, 1)) {
+        s->lead = (int)bits_get(r, 5);
+        int sig = (int)bits_get(r, 6) + 1;
+        s->trail = 64 - s->lead - sig;
+    }
+
+    int sig = 64 - s->lead - s->trail;
+    s->prev ^= bits_get(r, sig) << s->trail;
+    return bits_double(s->prev);
+}
@@ -0,0 +1,60 @@
+#ifndef SERIES_H
+#define SERIES_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// =========================================================
+// Codificacion de series de tiempo (estilo Gorilla) sobre un flujo de
+// bits:
+//
+//   - enteros chicos con signo en cubetas de 7/9/12 bits ('0' si es 0)
+//   - timestamps como delta de la delta: a intervalo regular cuestan
+//     un bit por muestra
+//   - doubles como XOR con el anterior: solo los bits significativos
+//     que cambiaron, reusando la ventana anterior si alcanza
+// =========================================================
+
+typedef struct {
+    unsigned char* buf;           // con espacio suficiente (lo dimensiona quien llama)
+    size_t bits;
+} BitWriter;
+
+typedef struct {
+    const unsigned char* buf;
+    size_t len;                   // bytes
+    size_t pos;                   // bits leidos
+} BitReader;
+
+typedef struct {
+    int64_t prev;
+    int64_t delta;
+    int n;                        // muestras vistas
+} SeriesTime;
+
+typedef struct {
+    uint64_t prev;
+    int lead;                     // ventana de bits significativos anterior
+    int trail;
+    int n;
+} SeriesXor;
+
+// Peor caso en bits de cada codificacion (para dimensionar el buffer).
+#define SERIES_INT_MAX_BITS     68
+#define SERIES_TIME_MAX_BITS    68
+#define SERIES_DOUBLE_MAX_BITS  77
+
+void     bits_put(BitWriter* w, uint64_t value, int nbits);
+uint64_t bits_get(BitReader* r, int nbits);
+size_t   bits_bytes(const BitWriter* w);
+
+void     series_put_int(BitWriter* w, int64_t v);
+int64_t  series_get_int(BitReader* r);
+
+void     series_put_time(BitWriter* w, SeriesTime* s, int64_t ts);
+int64_t  series_get_time(BitReader* r, SeriesTime* s);
+
+void     series_put_double(BitWriter* w, SeriesXor* s, double v);
+double   series_get_double(BitReader* r, SeriesXor* s);
+
+#endif
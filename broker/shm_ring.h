@@ -0,0 +1,123 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// =========================================================
+// Ring de bytes en memoria compartida (compartido con gateway): un
+// gateway en el mismo host le manda al broker sus comandos sin pasar por
+// el stack TCP.
+//
+// El gateway se conecta por el socket Unix del broker, crea el ring
+// (memfd) y dos eventfd, y los pasa con "HELLO SHM" (SCM_RIGHTS). Desde
+// el "OK SHM" todo lo que manda va por el ring: los mismos bytes que
+// irian por el socket (lineas o frames de wire.h). Las respuestas del
+// broker siguen por el socket.
+//
+// Un productor (gateway) y un consumidor (broker), como spsc.h: cada
+// uno escribe solo su indice, en su propia linea de cache. Los eventfd
+// se usan solo para despertar al otro lado cuando marco que se iba a
+// dormir ('*_waiting'), asi con el broker ocupado no hay syscalls:
+//
+//   - data:  gateway -> broker, hay bytes nuevos
+//   - space: broker -> gateway, se libero lugar
+// =========================================================
+
+#define SHM_RING_MAGIC 0x53484d31u        // "SHM1"
+#define SHM_RING_DEFAULT_SIZE (1u << 20)  // bytes de datos (potencia de 2)
+#define SHM_RING_FDS 3                    // memfd, eventfd data, eventfd space
+
+typedef struct ShmRing {
+    uint32_t magic;
+    uint32_t size;                // bytes de datos, potencia de 2
+    char pad0[64 - 2 * sizeof(uint32_t)];
+
+    uint64_t head;                // proximo byte a leer (broker)
+    int producer_waiting;         // el gateway espera lugar
+    char pad1[64 - sizeof(uint64_t) - sizeof(int)];
+
+    uint64_t tail;                // proximo byte a escribir (gateway)
+    int consumer_waiting;         // el broker espera datos
+    char pad2[64 - sizeof(uint64_t) - sizeof(int)];
+
+    char data[];
+} ShmRing;
+
+// Bytes a mapear para un ring de 'size' bytes de datos
+static inline size_t shm_ring_bytes(uint32_t size) {
+    return sizeof(ShmRing) + size;
+}
+
+static inline void shm_ring_init(ShmRing* r, uint32_t size) {
+    memset(r, 0, sizeof(ShmRing));
+    r->magic = SHM_RING_MAGIC;
+    r->size = size;
+    r->consumer_waiting = 1;      // el primer dato tiene que despertarlo
+}
+
+// Solo el productor. Escribe los 'len' bytes enteros o nada (devuelve 0
+// si no hay lugar).
+static inline int shm_ring_write(ShmRing* r, const void* buf, size_t len) {
+    uint64_t tail = r->tail;
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+    if (len > r->size - (tail - head))
+        return 0;
+
+    size_t pos = tail & (r->size - 1);
+    size_t first = len < r->size - pos ? len : r->size - pos;
+
+    memcpy(r->data + pos, buf, first);
+    memcpy(r->data, (const char*)buf + first, len - first);
+    __atomic_store_n(&r->tail, tail + len, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// Solo el consumidor. 'size' es el que se valido al mapear: los indices
+// los escribe el otro proceso y no se confia en ellos.
+static inline size_t shm_ring_read(ShmRing* r, uint32_t size, void* buf, size_t cap) {
+    uint64_t head = r->head;
+    uint64_t avail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) - head;
+
+    if (avail > size)
+        avail = size;
+    if (avail < cap)
+        cap = (size_t)avail;
+
+    size_t pos = head & (size - 1);
+    size_t first = cap < size - pos ? cap : size - pos;
+
+    memcpy(buf, r->data + pos, first);
+    memcpy((char*)buf + first, r->data, cap - first);
+    __atomic_store_n(&r->head, head + cap, __ATOMIC_RELEASE);
+    return cap;
+}
+
+// Despues de escribir (leer): 1 si el otro lado se habia dormido y hay
+// que escribir su eventfd. La barrera ordena el indice publicado contra
+// la lectura de la marca (el otro lado hace lo inverso al dormirse).
+static inline int shm_ring_wake(int* waiting) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return __atomic_load_n(waiting, __ATOMIC_RELAXED) &&
+           __atomic_exchange_n(waiting, 0, __ATOMIC_ACQ_REL);
+}
+
+// Antes de dormirse: marca la espera y revisa de nuevo. Devuelve 1 si
+// puede dormir (el otro lado va a despertarlo), 0 si la condicion ya se
+// cumplio y hay que seguir.
+static inline int shm_ring_sleep(ShmRing* r, int* waiting, size_t need_space) {
+    __atomic_store_n(waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    uint64_t used = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) -
+                    __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    int ready = need_space ? r->size - used >= need_space : used > 0;
+
+    if (ready)
+        __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+    return !ready;
+}
+
+#endif
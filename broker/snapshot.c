@@ -0,0 +1,260 @@
+#include "snapshot.h"
+#include "logger.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+static size_t record_len(size_t key_len, size_t data_len) {
+    size_t len = sizeof(SnapshotRecord) + key_len + data_len;
+    return (len + 7) & ~(size_t)7;
+}
+
+
+// =========================================================
+// ESCRITURA
+// =========================================================
+
+int snapshot_begin(SnapshotWriter* w, const char* path) {
+    memset(w, 0, sizeof(*w));
+
+    if (strlen(path) >= sizeof(w->path))
+        return -1;
+    strcpy(w->path, path);
+    snprintf(w->tmp, sizeof(w->tmp), "%s.tmp", path);
+
+    w->f = fopen(w->tmp, "wb");
+    if (!w->f)
+        return -1;
+
+    // La cabecera se completa al final
+    w->header.magic = SNAPSHOT_MAGIC;
+    w->header.version = SNAPSHOT_VERSION;
+    w->header.created = time(NULL);
+    w->header.bytes = sizeof(SnapshotHeader);
+    if (fwrite(&w->header, sizeof(w->header), 1, w->f) != 1)
+        w->error = 1;
+    return 0;
+}
+
+void snapshot_put(SnapshotWriter* w, int type, const char* key, size_t key_len,
+                  const void* data, size_t data_len, const void* data2, size_t data2_len,
+                  int64_t value) {
+    static const char zeros[8];
+
+    if (w->error)
+        return;
+    if (key_len > UINT16_MAX || data_len + data2_len > UINT32_MAX) {
+        w->error = 1;
+        return;
+    }
+
+    SnapshotRecord rec = { (uint16_t)type, (uint16_t)key_len, (uint32_t)(data_len + data2_len), value };
+    size_t len = record_len(key_len, data_len + data2_len);
+    size_t pad = len - sizeof(rec) - key_len - data_len - data2_len;
+
+    if (fwrite(&rec, sizeof(rec), 1, w->f) != 1 ||
+        (key_len && fwrite(key, key_len, 1, w->f) != 1) ||
+        (data_len && fwrite(data, data_len, 1, w->f) != 1) ||
+        (data2_len && fwrite(data2, data2_len, 1, w->f) != 1) ||
+        (pad && fwrite(zeros, pad, 1, w->f) != 1)) {
+        w->error = 1;
+        return;
+    }
+
+    w->header.bytes += len;
+    w->header.records++;
+}
+
+int snapshot_commit(SnapshotWriter* w) {
+    int ok = !w->error &&
+             fseek(w->f, 0, SEEK_SET) == 0 &&
+             fwrite(&w->header, sizeof(w->header), 1, w->f) == 1 &&
+             fflush(w->f) == 0 &&
+             fsync(fileno(w->f)) == 0;
+
+    if (fclose(w->f) != 0)
+        ok = 0;
+    w->f = NULL;
+
+    if (!ok || rename(w->tmp, w->path) < 0) {
+        unlink(w->tmp);
+        return -1;
+    }
+    return 0;
+}
+
+
+// =========================================================
+// LECTURA
+// =========================================================
+
+int snapshot_open(SnapshotReader* r, const char* path) {
+    struct stat st;
+    SnapshotHeader h;
+
+    memset(r, 0, sizeof(*r));
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+        close(fd);
+        return -1;
+    }
+
+    char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    memcpy(&h, map, sizeof(h));
+    if (h.magic != SNAPSHOT_MAGIC || h.version != SNAPSHOT_VERSION) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    // Se va a leer de corrido: que el kernel adelante las paginas
+    madvise(map, st.st_size, MADV_SEQUENTIAL | MADV_WILLNEED);
+
+    if (h.bytes != (uint64_t)st.st_size)
+        LOG_WARN("[SNAPSHOT] '%s' esta incompleto: se lee hasta el ultimo registro entero", path);
+
+    r->map = map;
+    r->len = st.st_size;
+    r->pos = sizeof(SnapshotHeader);
+    return 0;
+}
+
+void snapshot_close(SnapshotReader* r) {
+    if (r->map)
+        munmap(r->map, r->len);
+    r->map = NULL;
+}
+
+int snapshot_next(SnapshotReader* r, SnapshotEntry* e) {
+    SnapshotRecord rec;
+
+    if (!r->map || r->pos + sizeof(rec) > r->len)
+        return 0;
+
+    memcpy(&rec, r->map + r->pos, sizeof(rec));
+    size_t len = record_len(rec.key_len, rec.data_len);
+    if (len > r->len - r->pos)
+        return 0;
+
+    const char* p = r->map + r->pos + sizeof(rec);
+    e->type = rec.type;
+    e->key = p;
+    e->key_len = rec.key_len;
+    e->data = p + rec.key_len;
+    e->data_len = rec.data_len;
+    e->value = rec.value;
+
+    r->pos += len;
+    return 1;
+}
+
+void snapshot_rewind(SnapshotReader* r) {
+    r->pos = sizeof(SnapshotHeader);
+}
+
+
+// =========================================================
+// DESCRIPTORES (SCM_RIGHTS)
+// =========================================================
+
+// Cada mensaje lleva como dato la cantidad de descriptores adjuntos
+// (uint32_t); 0 marca el final.
+static int send_chunk(int sock, const int* fds, uint32_t n) {
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(SNAPSHOT_FDS_PER_MSG * sizeof(int))];
+    } control;
+    struct iovec iov = { &n, sizeof(n) };
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (n > 0) {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+
+        struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(n * sizeof(int));
+        memcpy(CMSG_DATA(cm), fds, n * sizeof(int));
+    }
+
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)sizeof(n) ? 0 : -1;
+}
+
+int snapshot_send_fds(int sock, const int* fds, int n) {
+    for (int i = 0; i < n; i += SNAPSHOT_FDS_PER_MSG) {
+        int chunk = n - i < SNAPSHOT_FDS_PER_MSG ? n - i : SNAPSHOT_FDS_PER_MSG;
+        if (send_chunk(sock, fds + i, (uint32_t)chunk) < 0)
+            return -1;
+    }
+    return send_chunk(sock, NULL, 0);
+}
+
+int snapshot_recv_fds(int sock, int** fds) {
+    int* all = NULL;
+    int n = 0;
+
+    while (1) {
+        union {
+            struct cmsghdr hdr;
+            char buf[CMSG_SPACE(SNAPSHOT_FDS_PER_MSG * sizeof(int))];
+        } control;
+        uint32_t count;
+        struct iovec iov = { &count, sizeof(count) };
+        struct msghdr msg;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        ssize_t r = recvmsg(sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+        if (r != (ssize_t)sizeof(count))
+            break;
+
+        struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+        int got = 0;
+        if (cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+            got = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+        if (count == 0 && got == 0) {
+            *fds = all;
+            return n;
+        }
+
+        int* grown = got > 0 ? realloc(all, (n + got) * sizeof(int)) : all;
+        if (!grown || (uint32_t)got != count || (msg.msg_flags & MSG_CTRUNC)) {
+            // Lo recibido igual se cierra
+            for (int i = 0; i < got; i++)
+                close(((int*)CMSG_DATA(cm))[i]);
+            break;
+        }
+
+        all = grown;
+        memcpy(all + n, CMSG_DATA(cm), got * sizeof(int));
+        n += got;
+    }
+
+    for (int i = 0; i < n; i++)
+        close(all[i]);
+    free(all);
+    return -1;
+}
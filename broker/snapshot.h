@@ -0,0 +1,103 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// =========================================================
+// Snapshot del broker: un archivo de registros que se escribe de
+// corrido y se lee con mmap, sin copiar ni parsear texto.
+//
+//   | SnapshotHeader | SnapshotRecord | clave | datos | relleno | ...
+//
+// Cada registro queda alineado a 8 bytes. Que significa cada tipo lo
+// decide el broker (ver "SNAPSHOT Y TRASPASO" en broker.c); aca solo
+// esta el formato.
+//
+// Se escribe en <ruta>.tmp y se renombra al terminar: un corte a mitad
+// de camino deja el snapshot anterior entero. Al leer se valida la
+// cabecera y el largo de cada registro: un archivo cortado o ajeno se
+// rechaza o se lee hasta el ultimo registro completo.
+//
+// Tambien estan aca las funciones para pasar descriptores por un socket
+// Unix (SCM_RIGHTS), que usa el traspaso entre procesos.
+// =========================================================
+
+#define SNAPSHOT_MAGIC 0x50414e53u        // "SNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_PATH_LEN 256
+#define SNAPSHOT_FDS_PER_MSG 64           // descriptores por sendmsg()
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    int64_t created;
+    uint64_t bytes;               // largo total del archivo
+    uint64_t records;
+} SnapshotHeader;
+
+typedef struct {
+    uint16_t type;
+    uint16_t key_len;
+    uint32_t data_len;
+    int64_t value;
+} SnapshotRecord;
+
+// Un registro leido: 'key' y 'data' apuntan al mapeo (sin '\0' final y
+// sin alinear; los datos con estructura se copian con memcpy).
+typedef struct {
+    int type;
+    const char* key;
+    size_t key_len;
+    const char* data;
+    size_t data_len;
+    int64_t value;
+} SnapshotEntry;
+
+typedef struct {
+    FILE* f;
+    char path[SNAPSHOT_PATH_LEN];
+    char tmp[SNAPSHOT_PATH_LEN + 4];
+    SnapshotHeader header;
+    int error;
+} SnapshotWriter;
+
+typedef struct {
+    char* map;
+    size_t len;
+    size_t pos;
+} SnapshotReader;
+
+// Devuelve 0, o -1 si no se pudo crear el archivo temporal.
+int  snapshot_begin(SnapshotWriter* w, const char* path);
+
+// Agrega un registro; los errores se acumulan hasta snapshot_commit().
+// 'data2' se escribe a continuacion de 'data' (puede ser NULL).
+void snapshot_put(SnapshotWriter* w, int type, const char* key, size_t key_len,
+                  const void* data, size_t data_len, const void* data2, size_t data2_len,
+                  int64_t value);
+
+// Completa la cabecera, baja todo a disco y reemplaza el snapshot
+// anterior. Devuelve 0, o -1 (y no toca el anterior).
+int  snapshot_commit(SnapshotWriter* w);
+
+// Devuelve 0, o -1 si no existe o no es un snapshot valido.
+int  snapshot_open(SnapshotReader* r, const char* path);
+void snapshot_close(SnapshotReader* r);
+
+// Proximo registro: 1 si hay, 0 al terminar.
+int  snapshot_next(SnapshotReader* r, SnapshotEntry* e);
+
+// Vuelve al primer registro (cada etapa de la carga lo recorre entero).
+void snapshot_rewind(SnapshotReader* r);
+
+// Manda 'n' descriptores de a SNAPSHOT_FDS_PER_MSG y un mensaje vacio al
+// final. Devuelve 0, o -1 si se corto el socket.
+int  snapshot_send_fds(int sock, const int* fds, int n);
+
+// Recibe lo que mando snapshot_send_fds(). Devuelve un arreglo nuevo en
+// *fds y su largo, o -1.
+int  snapshot_recv_fds(int sock, int** fds);
+
+#endif
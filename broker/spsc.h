@@ -0,0 +1,70 @@
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <stdlib.h>
+
+// =========================================================
+// Cola lock-free de un solo productor y un solo consumidor.
+//
+// Buffer circular de punteros con capacidad potencia de 2. El productor
+// solo escribe 'tail' y el consumidor solo 'head', cada uno en su propia
+// linea de cache; la sincronizacion es un par release/acquire por
+// operacion, sin mutex ni CAS.
+// =========================================================
+
+typedef struct {
+    void** slots;
+    unsigned int mask;
+    char pad0[64 - sizeof(void**) - sizeof(unsigned int)];
+
+    unsigned int head;            // proxima posicion a leer (consumidor)
+    char pad1[64 - sizeof(unsigned int)];
+
+    unsigned int tail;            // proxima posicion a escribir (productor)
+    char pad2[64 - sizeof(unsigned int)];
+} SpscRing;
+
+// 'capacity' debe ser potencia de 2. Devuelve 0, o -1 si falta memoria.
+static inline int spsc_init(SpscRing* r, unsigned int capacity) {
+    r->slots = calloc(capacity, sizeof(void*));
+    if (!r->slots)
+        return -1;
+
+    r->mask = capacity - 1;
+    r->head = 0;
+    r->tail = 0;
+    return 0;
+}
+
+static inline void spsc_destroy(SpscRing* r) {
+    free(r->slots);
+    r->slots = NULL;
+}
+
+// Solo el productor. Devuelve 0 si la cola esta llena.
+static inline int spsc_push(SpscRing* r, void* item) {
+    unsigned int tail = r->tail;
+    unsigned int head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+    if (tail - head > r->mask)
+        return 0;
+
+    r->slots[tail & r->mask] = item;
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// Solo el consumidor. Devuelve NULL si la cola esta vacia.
+static inline void* spsc_pop(SpscRing* r) {
+    unsigned int head = r->head;
+    unsigned int tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+
+    if (head == tail)
+        return NULL;
+
+    void* item = r->slots[head & r->mask];
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    return item;
+}
+
+#endif
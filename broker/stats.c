@@ -0,0 +1,222 @@
+#include "stats.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Nombres en STATS, en el orden de StatCounter y CommandType. Los NULL
+// no se reportan.
+static const char* counter_names[STAT_NUM_COUNTERS] = {
+    [STAT_CONNECTIONS_OPENED]    = "connections_total",
+    [STAT_CONNECTIONS_CLOSED]    = "connections_closed",
+    [STAT_SUBSCRIPTIONS_ADDED]   = "subscriptions_total",
+    [STAT_SUBSCRIPTIONS_REMOVED] = "subscriptions_removed",
+    [STAT_MESSAGES_IN]           = "messages_in",
+    [STAT_MESSAGES_LIMITED]      = "messages_limited",
+    [STAT_MESSAGES_BRIDGED]      = "messages_bridged",
+    [STAT_BRIDGE_DROPPED]        = "bridge_dropped",
+    [STAT_DELIVERIES]            = "deliveries",
+    [STAT_BYTES_IN]              = "bytes_in",
+    [STAT_BYTES_OUT]             = "bytes_out",
+};
+
+static const char* command_names[STATS_NUM_COMMANDS] = {
+    [CMD_REGISTER]      = "cmd_register",
+    [CMD_SUBSCRIBE]     = "cmd_subscribe",
+    [CMD_UNSUBSCRIBE]   = "cmd_unsubscribe",
+    [CMD_PUBLISH]       = "cmd_publish",
+    [CMD_PUBLISH_BATCH] = "cmd_publish_batch",
+    [CMD_HELLO]         = "cmd_hello",
+    [CMD_HISTORY]       = "cmd_history",
+    [CMD_STATS]         = "cmd_stats",
+    [CMD_BRIDGE]        = "cmd_bridge",
+    [CMD_RELAY]         = "cmd_relay",
+    [CMD_UNKNOWN]       = "cmd_unknown",
+    [CMD_INVALID]       = "cmd_invalid",
+};
+
+
+// =========================================================
+// BLOQUES POR HILO
+// =========================================================
+
+// Al terminar el hilo su bloque queda libre para otro (con lo contado).
+static void thread_release(void* arg) {
+    StatsThread* t = (StatsThread*)arg;
+    __atomic_store_n(&t->in_use, 0, __ATOMIC_RELEASE);
+}
+
+int stats_init(Stats* s) {
+    memset(&s->shared, 0, sizeof(s->shared));
+    s->threads = NULL;
+    s->started = time(NULL);
+
+    if (pthread_key_create(&s->key, thread_release) != 0)
+        return 0;
+    pthread_mutex_init(&s->lock, NULL);
+    return 1;
+}
+
+void stats_destroy(Stats* s) {
+    pthread_key_delete(s->key);
+    pthread_mutex_destroy(&s->lock);
+
+    while (s->threads) {
+        StatsThread* t = s->threads;
+        s->threads = t->next;
+        free(t);
+    }
+}
+
+StatsThread* stats_attach(Stats* s) {
+    StatsThread* t;
+
+    pthread_mutex_lock(&s->lock);
+
+    for (t = s->threads; t; t = t->next) {
+        int free_slot = 0;
+        if (__atomic_compare_exchange_n(&t->in_use, &free_slot, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+
+    if (!t) {
+        t = calloc(1, sizeof(StatsThread));
+        if (t) {
+            t->in_use = 1;
+            t->next = s->threads;
+            __atomic_store_n(&s->threads, t, __ATOMIC_RELEASE);
+        }
+    }
+
+    pthread_mutex_unlock(&s->lock);
+
+    if (!t)
+        return &s->shared;
+
+    pthread_setspecific(s->key, t);
+    return t;
+}
+
+
+// =========================================================
+// HISTOGRAMA
+// =========================================================
+
+// Los valores menores a 16 tienen bucket propio; desde ahi cada potencia
+// de 2 se parte en 16 buckets iguales.
+static int bucket_of(uint64_t v) {
+    if (v < (1u << STATS_HIST_SUB_BITS))
+        return (int)v;
+
+    int e = 63 - __builtin_clzll(v);
+    if (e > STATS_HIST_MAX_EXP)
+        return STATS_HIST_BUCKETS - 1;
+
+    int shift = e - STATS_HIST_SUB_BITS;
+    return ((shift + 1) << STATS_HIST_SUB_BITS) +
+           (int)((v >> shift) & ((1u << STATS_HIST_SUB_BITS) - 1));
+}
+
+// Mayor valor que cae en el bucket
+static uint64_t bucket_high(int b) {
+    if (b < (1 << STATS_HIST_SUB_BITS))
+        return (uint64_t)b;
+
+    int shift = (b >> STATS_HIST_SUB_BITS) - 1;
+    uint64_t sub = (uint64_t)(b & ((1 << STATS_HIST_SUB_BITS) - 1));
+    uint64_t low = ((1ull << STATS_HIST_SUB_BITS) + sub) << shift;
+    return low + (1ull << shift) - 1;
+}
+
+void stats_record_fanout(StatsThread* t, uint64_t since) {
+    StatsHistogram* h = &t->fanout;
+    uint64_t ns = stats_now() - since;
+
+    stats_bump(&h->buckets[bucket_of(ns)], 1);
+    stats_bump(&h->count, 1);
+    stats_bump(&h->sum, ns);
+    if (ns > h->max)
+        __atomic_store_n(&h->max, ns, __ATOMIC_RELAXED);
+}
+
+uint64_t stats_percentile(const StatsHistogram* h, double q) {
+    if (h->count == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t)(q * h->count + 0.5);
+    if (rank == 0)
+        rank = 1;
+
+    uint64_t seen = 0;
+    for (int b = 0; b < STATS_HIST_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= rank) {
+            uint64_t v = bucket_high(b);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+
+// =========================================================
+// CONSULTA
+// =========================================================
+
+static uint64_t load(const uint64_t* c) {
+    return __atomic_load_n(c, __ATOMIC_RELAXED);
+}
+
+static void add_block(StatsSnapshot* out, StatsThread* t) {
+    for (int i = 0; i < STAT_NUM_COUNTERS; i++)
+        out->counters[i] += load(&t->counters[i]);
+    for (int i = 0; i < STATS_NUM_COMMANDS; i++)
+        out->commands[i] += load(&t->commands[i]);
+
+    StatsHistogram* h = &t->fanout;
+    for (int b = 0; b < STATS_HIST_BUCKETS; b++)
+        out->fanout.buckets[b] += load(&h->buckets[b]);
+    out->fanout.count += load(&h->count);
+    out->fanout.sum += load(&h->sum);
+
+    uint64_t max = load(&h->max);
+    if (max > out->fanout.max)
+        out->fanout.max = max;
+}
+
+// Sin lock: los bloques se agregan al principio de la lista y nunca se
+// sacan mientras el broker corre.
+void stats_collect(Stats* s, StatsSnapshot* out) {
+    memset(out, 0, sizeof(*out));
+
+    for (StatsThread* t = __atomic_load_n(&s->threads, __ATOMIC_ACQUIRE); t; t = t->next)
+        add_block(out, t);
+    add_block(out, &s->shared);
+
+    // El conteo total se lee aparte de los buckets: se ajusta para que
+    // los percentiles sean coherentes con lo que se sumo
+    uint64_t total = 0;
+    for (int b = 0; b < STATS_HIST_BUCKETS; b++)
+        total += out->fanout.buckets[b];
+    out->fanout.count = total;
+
+    out->uptime = time(NULL) - s->started;
+}
+
+void stats_foreach(const StatsSnapshot* snap, StatsVisitFn fn, void* ctx) {
+    for (int i = 0; i < STAT_NUM_COUNTERS; i++)
+        fn(counter_names[i], snap->counters[i], ctx);
+
+    for (int i = 0; i < STATS_NUM_COMMANDS; i++) {
+        if (command_names[i])
+            fn(command_names[i], snap->commands[i], ctx);
+    }
+
+    const StatsHistogram* h = &snap->fanout;
+    fn("fanout_count", h->count, ctx);
+    fn("fanout_mean_ns", h->count ? h->sum / h->count : 0, ctx);
+    fn("fanout_p50_ns", stats_percentile(h, 0.50), ctx);
+    fn("fanout_p90_ns", stats_percentile(h, 0.90), ctx);
+    fn("fanout_p99_ns", stats_percentile(h, 0.99), ctx);
+    fn("fanout_p999_ns", stats_percentile(h, 0.999), ctx);
+    fn("fanout_max_ns", h->max, ctx);
+}
@@ -0,0 +1,124 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include "protocol.h"
+
+// =========================================================
+// Metricas del broker: contadores e histogramas de latencia.
+//
+// Cada hilo que atiende clientes cuenta en su propio bloque (un solo
+// escritor: sumar es un load y un store, sin atomicos con lock ni
+// lineas de cache compartidas). Quien consulta suma los bloques de
+// todos los hilos; un hilo que termina deja su bloque para el
+// proximo, asi lo contado no se pierde.
+//
+// La latencia de fan-out va desde que el PUBLISH se leyo del socket
+// hasta que quedo encolado en todos los suscriptores (en modo sharded
+// incluye el paso al shard dueno). Se guarda en un histograma
+// log-lineal al estilo HDR: 16 sub-buckets por potencia de 2, error
+// relativo menor a 6.25%, de 1 ns a ~68 s.
+// =========================================================
+
+typedef enum {
+    STAT_CONNECTIONS_OPENED = 0,
+    STAT_CONNECTIONS_CLOSED,
+    STAT_SUBSCRIPTIONS_ADDED,     // filtros anotados en las conexiones
+    STAT_SUBSCRIPTIONS_REMOVED,
+    STAT_MESSAGES_IN,             // PUBLISH aceptados
+    STAT_MESSAGES_LIMITED,        // PUBLISH rechazados por limite de tasa
+    STAT_MESSAGES_BRIDGED,        // recibidos de otro broker por un puente
+    STAT_BRIDGE_DROPPED,          // de un puente, repetidos o de vuelta
+    STAT_DELIVERIES,              // entregas encoladas a suscriptores
+    STAT_BYTES_IN,
+    STAT_BYTES_OUT,
+    STAT_NUM_COUNTERS
+} StatCounter;
+
+#define STATS_NUM_COMMANDS (CMD_INVALID + 1)
+
+#define STATS_HIST_SUB_BITS 4
+#define STATS_HIST_MAX_EXP 35                 // valores hasta 2^36 - 1 ns
+#define STATS_HIST_BUCKETS ((STATS_HIST_MAX_EXP - STATS_HIST_SUB_BITS + 2) << STATS_HIST_SUB_BITS)
+
+typedef struct {
+    uint64_t buckets[STATS_HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+} StatsHistogram;
+
+// Bloque de un hilo. Solo lo escribe su hilo; los demas lo leen con
+// loads relajados.
+typedef struct StatsThread {
+    uint64_t counters[STAT_NUM_COUNTERS];
+    uint64_t commands[STATS_NUM_COMMANDS];
+    StatsHistogram fanout;
+
+    int in_use;                   // tomado por un hilo vivo (atomico)
+    struct StatsThread* next;     // la lista solo crece
+} StatsThread;
+
+typedef struct Stats {
+    pthread_key_t key;            // bloque del hilo actual
+    pthread_mutex_t lock;         // solo para agregar bloques
+    StatsThread* threads;
+    StatsThread shared;           // sin memoria para un bloque propio:
+                                  // compartido, puede perder cuentas
+    time_t started;
+} Stats;
+
+// Suma de todos los bloques en un momento dado
+typedef struct {
+    uint64_t counters[STAT_NUM_COUNTERS];
+    uint64_t commands[STATS_NUM_COMMANDS];
+    StatsHistogram fanout;
+    time_t uptime;
+} StatsSnapshot;
+
+typedef void (*StatsVisitFn)(const char* name, uint64_t value, void* ctx);
+
+int  stats_init(Stats* s);
+void stats_destroy(Stats* s);
+
+// Bloque del hilo que llama; lo crea (o reusa uno libre) la primera vez.
+StatsThread* stats_attach(Stats* s);
+
+static inline StatsThread* stats_local(Stats* s) {
+    StatsThread* t = pthread_getspecific(s->key);
+    return t ? t : stats_attach(s);
+}
+
+static inline void stats_bump(uint64_t* c, uint64_t n) {
+    __atomic_store_n(c, *c + n, __ATOMIC_RELAXED);
+}
+
+static inline void stats_add(StatsThread* t, StatCounter c, uint64_t n) {
+    stats_bump(&t->counters[c], n);
+}
+
+static inline void stats_command(StatsThread* t, CommandType type) {
+    stats_bump(&t->commands[type], 1);
+}
+
+static inline uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Registra una latencia de fan-out medida desde 'since' (stats_now()).
+void stats_record_fanout(StatsThread* t, uint64_t since);
+
+void stats_collect(Stats* s, StatsSnapshot* out);
+
+// Valor por debajo del cual queda la fraccion 'q' de las muestras (el
+// mayor valor equivalente de su bucket, como HdrHistogram).
+uint64_t stats_percentile(const StatsHistogram* h, double q);
+
+// Contadores, comandos e histograma del snapshot, con su nombre.
+void stats_foreach(const StatsSnapshot* snap, StatsVisitFn fn, void* ctx);
+
+#endif
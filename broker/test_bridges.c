@@ -0,0 +1,442 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+// ==================== PRUEBA DE PUENTES EN LOCALHOST ====================
+//
+// Levanta varios brokers (el binario test_broker) unidos por puentes en
+// los dos sentidos y comprueba que lo publicado en cada uno llega una
+// sola vez a un suscriptor de cada broker, aunque cruce varios enlaces
+// (cadena) o pueda volver por otro camino (anillo, malla), que un broker
+// reiniciado recupera los valores retenidos del otro, y que ningun
+// broker se cae. Uso:
+//
+//   test_bridges [binario] [opciones del broker...]
+//
+// por ejemplo "./test_bridges ./test_broker -S 4".
+
+#define MAX_BROKERS 8
+#define MESSAGES 200                  // por broker
+#define WAIT_MS 5000
+
+typedef struct {
+    const char* name;
+    int num_brokers;
+    int links[MAX_BROKERS * MAX_BROKERS][2];
+    int num_links;
+} Topology;
+
+static const Topology topologies[] = {
+    { "cadena A-B-C",       3, { {0, 1}, {1, 2} }, 2 },
+    { "anillo A-B-C-D",     4, { {0, 1}, {1, 2}, {2, 3}, {3, 0} }, 4 },
+    { "malla A-B-C",        3, { {0, 1}, {1, 2}, {2, 0} }, 3 },
+    { "anillo con cuerda",  5, { {0, 1}, {1, 2}, {2, 3}, {3, 4}, {4, 0}, {0, 2} }, 6 },
+};
+
+static const char* binary = "./test_broker";
+static char** extra_args;
+static int num_extra_args;
+static int base_port;
+
+static long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static int neighbors(const Topology* t, int b, int* out) {
+    int n = 0;
+    for (int i = 0; i < t->num_links; i++) {
+        if (t->links[i][0] == b)
+            out[n++] = t->links[i][1];
+        else if (t->links[i][1] == b)
+            out[n++] = t->links[i][0];
+    }
+    return n;
+}
+
+// Un broker con un puente hacia cada vecino. La salida va a /dev/null.
+static pid_t start_broker(const Topology* t, int b) {
+    char port[16], name[8];
+    char bridges[MAX_BROKERS][64];
+    char* argv[16 + 2 * MAX_BROKERS + 32];
+    int near[MAX_BROKERS * 2];
+    int argc = 0;
+
+    snprintf(port, sizeof(port), "%d", base_port + b);
+    snprintf(name, sizeof(name), "%c", 'A' + b);
+    argv[argc++] = (char*)binary;
+    argv[argc++] = "-p";
+    argv[argc++] = port;
+    argv[argc++] = "-N";
+    argv[argc++] = name;
+    argv[argc++] = "-q";
+    argv[argc++] = "100000";
+    argv[argc++] = "-C";
+    argv[argc++] = "0";
+
+    int n = neighbors(t, b, near);
+    for (int i = 0; i < n; i++) {
+        snprintf(bridges[i], sizeof(bridges[i]), "127.0.0.1:%d=t/#", base_port + near[i]);
+        argv[argc++] = "-B";
+        argv[argc++] = bridges[i];
+    }
+    for (int i = 0; i < num_extra_args && argc < (int)(sizeof(argv) / sizeof(argv[0])) - 1; i++)
+        argv[argc++] = extra_args[i];
+    argv[argc] = NULL;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0) {
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+        }
+        execv(binary, argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+static int connect_broker(int b) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(base_port + b);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock >= 0 && connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0)
+        return sock;
+    if (sock >= 0)
+        close(sock);
+    return -1;
+}
+
+static int send_all(int sock, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(sock, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Lector de lineas de un socket
+typedef struct {
+    int sock;
+    char buf[65536];
+    size_t len;
+} Reader;
+
+// Siguiente linea (sin el '\n') en 'line', esperando hasta 'deadline'.
+// Devuelve 1, o 0 si no llego a tiempo o se cerro.
+static int read_line(Reader* r, char* line, size_t cap, long deadline) {
+    for (;;) {
+        char* nl = memchr(r->buf, '\n', r->len);
+        if (nl) {
+            size_t n = nl - r->buf;
+            size_t copy = n < cap - 1 ? n : cap - 1;
+            memcpy(line, r->buf, copy);
+            line[copy] = '\0';
+            memmove(r->buf, nl + 1, r->len - n - 1);
+            r->len -= n + 1;
+            return 1;
+        }
+
+        long left = deadline - now_ms();
+        struct pollfd pfd = { r->sock, POLLIN, 0 };
+        if (left <= 0 || poll(&pfd, 1, (int)left) <= 0 || r->len == sizeof(r->buf))
+            return 0;
+
+        ssize_t got = recv(r->sock, r->buf + r->len, sizeof(r->buf) - r->len, 0);
+        if (got <= 0)
+            return 0;
+        r->len += got;
+    }
+}
+
+// Valor de una metrica de STATS, o -1
+static long stat_value(int b, const char* key) {
+    Reader r = { connect_broker(b), "", 0 };
+    char line[256];
+    long value = -1;
+    size_t key_len = strlen(key);
+
+    if (r.sock < 0)
+        return -1;
+
+    if (send_all(r.sock, "STATS\n", 6) == 0) {
+        long deadline = now_ms() + 1000;
+        while (read_line(&r, line, sizeof(line), deadline) && strncmp(line, "OK", 2) != 0) {
+            if (strncmp(line, "STAT ", 5) == 0 && strncmp(line + 5, key, key_len) == 0 &&
+                line[5 + key_len] == ' ')
+                value = atol(line + 6 + key_len);
+        }
+    }
+    close(r.sock);
+    return value;
+}
+
+// Espera a que el broker 'b' tenga arriba un puente por vecino
+static int wait_bridges(const Topology* t, int b) {
+    int near[MAX_BROKERS * 2];
+    long want = neighbors(t, b, near);
+    long deadline = now_ms() + WAIT_MS;
+
+    while (stat_value(b, "bridges_up") != want) {
+        if (now_ms() > deadline) {
+            printf("%s: el broker %c no levanto sus puentes\n", t->name, 'A' + b);
+            return 0;
+        }
+        usleep(50000);
+    }
+    return 1;
+}
+
+// Comprueba que sigue vivo y lo detiene; tiene que terminar bien
+static int stop_broker(const Topology* t, int b, pid_t pid) {
+    int status;
+
+    if (waitpid(pid, &status, WNOHANG) != 0) {
+        printf("%s: el broker %c se cayo\n", t->name, 'A' + b);
+        return 0;
+    }
+    kill(pid, SIGINT);
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("%s: el broker %c no termino bien\n", t->name, 'A' + b);
+        return 0;
+    }
+    return 1;
+}
+
+static int run_topology(const Topology* t) {
+    pid_t pids[MAX_BROKERS];
+    Reader* subs = calloc(t->num_brokers, sizeof(Reader));
+    static unsigned char counts[MAX_BROKERS][MAX_BROKERS][MESSAGES];
+    char line[256];
+    int ok = 1;
+
+    memset(counts, 0, sizeof(counts));
+    for (int b = 0; b < t->num_brokers; b++) {
+        subs[b].sock = -1;
+        pids[b] = start_broker(t, b);
+    }
+
+    // Todos los puentes arriba
+    for (int b = 0; b < t->num_brokers && ok; b++)
+        ok = wait_bridges(t, b);
+    usleep(200000);               // los SUBSCRIBE de los puentes
+
+    for (int b = 0; b < t->num_brokers && ok; b++) {
+        subs[b].sock = connect_broker(b);
+        if (subs[b].sock < 0 || send_all(subs[b].sock, "SUBSCRIBE t/#\n", 14) < 0 ||
+            !read_line(&subs[b], line, sizeof(line), now_ms() + 1000) ||
+            strcmp(line, "OK SUBSCRIBED") != 0) {
+            printf("%s: no se pudo suscribir en %c\n", t->name, 'A' + b);
+            ok = 0;
+        }
+    }
+
+    // El OK sale antes de buscar los retenidos: publicando enseguida, la
+    // primera entrega podria llegar ademas como retenido
+    usleep(100000);
+
+    for (int b = 0; b < t->num_brokers && ok; b++) {
+        int sock = connect_broker(b);
+        char buf[MESSAGES * 32];
+        size_t len = 0;
+
+        for (int i = 0; i < MESSAGES; i++)
+            len += snprintf(buf + len, sizeof(buf) - len, "PUBLISH t/%c %d\n", 'A' + b, i);
+        if (sock < 0 || send_all(sock, buf, len) < 0)
+            ok = 0;
+        if (sock >= 0)
+            close(sock);
+    }
+
+    // Se espera todo y un poco mas, por si llega algo repetido
+    int expected = t->num_brokers * MESSAGES;
+    for (int b = 0; b < t->num_brokers && ok; b++) {
+        int got = 0;
+        long deadline = now_ms() + WAIT_MS;
+        while (read_line(&subs[b], line, sizeof(line), got < expected ? deadline : now_ms() + 300)) {
+            int from, i;
+            char c;
+            if (sscanf(line, "t/%c %d", &c, &i) != 2 || (from = c - 'A') < 0 ||
+                from >= t->num_brokers || i < 0 || i >= MESSAGES) {
+                printf("%s: entrega inesperada en %c: %s\n", t->name, 'A' + b, line);
+                ok = 0;
+                continue;
+            }
+            if (counts[b][from][i]++ == 0)
+                got++;
+            else
+                ok = 0;
+        }
+
+        int repeated = 0;
+        for (int from = 0; from < t->num_brokers; from++) {
+            for (int i = 0; i < MESSAGES; i++)
+                repeated += counts[b][from][i] > 1;
+        }
+        if (got != expected || repeated) {
+            printf("%s: %c recibio %d de %d, %d repetidos\n", t->name, 'A' + b, got, expected, repeated);
+            ok = 0;
+        }
+    }
+
+    long dropped = 0;
+    for (int b = 0; b < t->num_brokers; b++) {
+        long d = stat_value(b, "bridge_dropped");
+        if (d > 0)
+            dropped += d;
+    }
+
+    // Siguen vivos y terminan bien
+    for (int b = 0; b < t->num_brokers; b++) {
+        if (!stop_broker(t, b, pids[b]))
+            ok = 0;
+    }
+
+    for (int b = 0; b < t->num_brokers; b++) {
+        if (subs[b].sock >= 0)
+            close(subs[b].sock);
+    }
+    free(subs);
+
+    printf("%-20s %d brokers, %d mensajes cada uno, %ld repetidos descartados: %s\n",
+           t->name, t->num_brokers, MESSAGES, dropped, ok ? "OK" : "FALLA");
+    return ok;
+}
+
+// Reinicio de un broker: al volver, su puente trae como retenido el
+// ultimo valor de cada topic del otro. Los valores viejos se publicaron
+// mas de BRIDGE_SEEN_WINDOW mensajes antes que el ultimo: un retenido
+// anterior a la ventana de repetidos tiene que aceptarse igual.
+#define RESTART_OLD_TOPICS 10
+#define RESTART_FLOOD 70000
+
+static int run_restart(void) {
+    static const Topology t = { "reinicio A-B", 2, { {0, 1} }, 1 };
+    pid_t pids[2];
+    Reader sub = { -1, "", 0 };
+    char line[256];
+    int seen[RESTART_OLD_TOPICS + 1] = { 0 };
+    int ok = 1;
+
+    pids[0] = start_broker(&t, 0);
+    pids[1] = start_broker(&t, 1);
+    ok = wait_bridges(&t, 0) && wait_bridges(&t, 1);
+    usleep(200000);               // los SUBSCRIBE de los puentes
+
+    // Los viejos primero; despues muchos en un solo topic
+    int sock = ok ? connect_broker(0) : -1;
+    if (sock < 0) {
+        ok = 0;
+    } else {
+        char buf[64 * 1024];
+        size_t len = 0;
+
+        for (int k = 0; k < RESTART_OLD_TOPICS; k++)
+            len += snprintf(buf + len, sizeof(buf) - len, "PUBLISH t/old/%d %d\n", k, k);
+        for (int i = 0; i < RESTART_FLOOD && ok; i++) {
+            len += snprintf(buf + len, sizeof(buf) - len, "PUBLISH t/new %d\n", i);
+            if (len > sizeof(buf) - 64 || i == RESTART_FLOOD - 1) {
+                ok = send_all(sock, buf, len) == 0;
+                len = 0;
+            }
+        }
+        close(sock);
+    }
+
+    // B ya los vio todos (numerados por A al mandarselos)
+    long deadline = now_ms() + 4 * WAIT_MS;
+    while (ok && stat_value(1, "messages_bridged") < RESTART_OLD_TOPICS + RESTART_FLOOD) {
+        if (now_ms() > deadline) {
+            printf("%s: B no recibio todo antes del reinicio\n", t.name);
+            ok = 0;
+        }
+        usleep(50000);
+    }
+
+    if (ok && stop_broker(&t, 1, pids[1])) {
+        pids[1] = start_broker(&t, 1);
+        ok = wait_bridges(&t, 1);
+        deadline = now_ms() + WAIT_MS;
+        while (ok && stat_value(1, "messages_bridged") < RESTART_OLD_TOPICS + 1 && now_ms() < deadline)
+            usleep(50000);
+    } else {
+        ok = 0;
+        pids[1] = -1;
+    }
+
+    // Un cliente nuevo de B recibe los retenidos que trajo el puente
+    if (ok) {
+        sub.sock = connect_broker(1);
+        if (sub.sock < 0 || send_all(sub.sock, "SUBSCRIBE t/#\n", 14) < 0)
+            ok = 0;
+    }
+    while (ok && read_line(&sub, line, sizeof(line), now_ms() + 500)) {
+        int k, v;
+        if (sscanf(line, "t/old/%d %d", &k, &v) == 2 && k >= 0 && k < RESTART_OLD_TOPICS && v == k)
+            seen[k]++;
+        else if (sscanf(line, "t/new %d", &v) == 1 && v == RESTART_FLOOD - 1)
+            seen[RESTART_OLD_TOPICS]++;
+    }
+
+    int recovered = 0;
+    for (int k = 0; k <= RESTART_OLD_TOPICS; k++)
+        recovered += seen[k] == 1;
+    if (ok && recovered != RESTART_OLD_TOPICS + 1) {
+        printf("%s: B recupero %d de %d valores retenidos\n", t.name, recovered, RESTART_OLD_TOPICS + 1);
+        ok = 0;
+    }
+
+    if (sub.sock >= 0)
+        close(sub.sock);
+    if (!stop_broker(&t, 0, pids[0]))
+        ok = 0;
+    if (pids[1] > 0 && !stop_broker(&t, 1, pids[1]))
+        ok = 0;
+
+    printf("%-20s %d valores retenidos recuperados: %s\n", t.name, recovered, ok ? "OK" : "FALLA");
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1)
+        binary = argv[1];
+    if (argc > 2) {
+        extra_args = argv + 2;
+        num_extra_args = argc - 2;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    base_port = 20000 + (int)(getpid() % 2000) * 8;
+
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(topologies) / sizeof(topologies[0]); i++) {
+        if (!run_topology(&topologies[i]))
+            failed++;
+        base_port += MAX_BROKERS;     // sin esperar a que se liberen los puertos
+    }
+    if (!run_restart())
+        failed++;
+
+    return failed ? 1 : 0;
+}
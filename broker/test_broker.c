@@ -1,15 +1,270 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <signal.h>
 #include "broker.h"
+#include "logger.h"
 
-int main() {
+static void print_usage(const char* prog) {
+    printf("Uso: %s [-p puerto] [-U socket_unix] [-e event_loops | -S shards] [-H profundidad] [-A segundos]\n"
+           "          [-L directorio] [-R segundos] [-q mensajes] [-s politica] [-C creditos]\n"
+           "          [-G id=tasa[,rafaga]] [-T prefijo=tasa[,rafaga]] [-D reparto]\n"
+           "          [-M archivo] [-I segundos] [-F archivo] [-W segundos] [-K socket]\n"
+           "          [-N nombre] [-B host:puerto=filtro[,filtro...]] [-v]\n", prog);
+    printf("  -p  Puerto de escucha (por defecto 9000)\n");
+    printf("  -U  Aceptar tambien clientes locales en un socket Unix (y gateways por\n"
+           "      memoria compartida, ver broker/shm_ring.h)\n");
+    printf("  -e  Modo epoll con N event loops (por defecto: un hilo por conexion)\n");
+    printf("  -S  Modo sharded con N shards (topics repartidos por hash)\n");
+    printf("  -H  Mensajes de historial por topic (por defecto %d)\n", DEFAULT_HISTORY_DEPTH);
+    printf("  -A  Edad maxima del historial en segundos (0 = sin limite)\n");
+    printf("  -L  Guardar los mensajes en un log persistente en el directorio\n");
+    printf("  -R  Retencion del log en segundos (0 = sin limite)\n");
+    printf("  -q  Mensajes pendientes por suscriptor (por defecto %d)\n", DEFAULT_OUT_QUEUE_LEN);
+    printf("  -s  Con la cola llena: oldest | newest | disconnect (por defecto oldest)\n");
+    printf("  -C  PUBLISH en camino por gateway (por defecto %d, 0 = sin control de flujo)\n",
+           DEFAULT_GATEWAY_CREDIT);
+    printf("  -G  Limite de PUBLISH/s de un gateway ('*' = cada gateway); se repite\n");
+    printf("  -T  Limite de PUBLISH/s de los topics con ese prefijo; se repite\n");
+    printf("  -D  Reparto en $share/<grupo>/<filtro>: rr | least (por defecto rr)\n");
+    printf("  -M  Agregar las metricas (las de STATS) al archivo periodicamente\n");
+    printf("  -I  Periodo del volcado de metricas en segundos (por defecto %d)\n",
+           DEFAULT_STATS_INTERVAL);
+    printf("  -F  Snapshot de historial y retenidos: se carga al arrancar y se escribe\n"
+           "      periodicamente y al salir\n");
+    printf("  -W  Periodo del snapshot en segundos (por defecto %d, 0 = solo al salir)\n",
+           DEFAULT_SNAPSHOT_INTERVAL);
+    printf("  -K  Socket de traspaso: si ya hay un broker ahi, toma sus sockets y\n"
+           "      conexiones sin cortarlas; despues espera ahi al proximo\n");
+    printf("  -N  Nombre con el que se presenta a otros brokers (por defecto <host>:<puerto>)\n");
+    printf("  -B  Puente: suscribe los filtros en el broker host:puerto y publica aca lo\n"
+           "      que llega; se repite (ver \"PUENTES ENTRE BROKERS\" en broker.c)\n");
+    printf("  -v  Loguear cada conexion, suscripcion y PUBLISH (nivel debug)\n");
+}
+
+#define MAX_LIMIT_ARGS 32
+#define MAX_BRIDGE_ARGS 16
+
+// SIGINT/SIGTERM: el broker sale de su loop y escribe el snapshot
+static Broker* running_broker;
+
+static void on_signal(int sig) {
+    (void)sig;
+    broker_stop(running_broker);
+}
+
+// "<clave>=<tasa>[,<rafaga>]"; sin rafaga se permite un segundo de tasa.
+static int add_limit(Broker* broker, int gateway, const char* arg) {
+    char key[MAX_TOPIC_LEN];
+    const char* eq = strrchr(arg, '=');
+    double rate, burst;
+
+    if (!eq || eq == arg || (size_t)(eq - arg) >= sizeof(key))
+        return 0;
+
+    memcpy(key, arg, eq - arg);
+    key[eq - arg] = '\0';
+
+    int n = sscanf(eq + 1, "%lf,%lf", &rate, &burst);
+    if (n < 1)
+        return 0;
+    if (n == 1)
+        burst = rate < 1 ? 1 : rate;
+
+    return gateway ? broker_limit_gateway(broker, key, rate, burst)
+                   : broker_limit_topic(broker, key, rate, burst);
+}
+
+// "<host>:<puerto>=<filtro>[,<filtro>...]"
+static int add_bridge(Broker* broker, const char* arg) {
+    char spec[512];
+    char* save;
+
+    if (strlen(arg) >= sizeof(spec))
+        return 0;
+    strcpy(spec, arg);
+
+    char* eq = strchr(spec, '=');
+    if (!eq)
+        return 0;
+    *eq = '\0';
+
+    char* colon = strrchr(spec, ':');
+    if (!colon || colon == spec)
+        return 0;
+    *colon = '\0';
+
+    int port = atoi(colon + 1);
+    int n = 0;
+    for (char* f = strtok_r(eq + 1, ",", &save); f; f = strtok_r(NULL, ",", &save), n++) {
+        if (!broker_add_bridge(broker, spec, port, f))
+            return 0;
+    }
+    return n > 0;
+}
+
+int main(int argc, char* argv[]) {
     Broker broker;
+    int port = 9000;
+    int loops = -1;
+    BrokerMode mode = BROKER_MODE_EPOLL;
+    int depth = DEFAULT_HISTORY_DEPTH;
+    int max_age = DEFAULT_HISTORY_MAX_AGE;
+    const char* log_dir = NULL;
+    int retention = 0;
+    const char* stats_path = NULL;
+    const char* unix_path = NULL;
+    const char* snapshot_path = NULL;
+    int snapshot_interval = DEFAULT_SNAPSHOT_INTERVAL;
+    const char* handoff_path = NULL;
+    const char* name = NULL;
+    const char* bridges[MAX_BRIDGE_ARGS];
+    int num_bridges = 0;
+    int stats_interval = DEFAULT_STATS_INTERVAL;
+    int queue_len = DEFAULT_OUT_QUEUE_LEN;
+    SlowConsumerPolicy policy = SLOW_DROP_OLDEST;
+    int credit = DEFAULT_GATEWAY_CREDIT;
+    SharePolicy share = SHARE_ROUND_ROBIN;
+    const char* limits[MAX_LIMIT_ARGS];
+    int limit_is_gateway[MAX_LIMIT_ARGS];
+    int num_limits = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:U:e:S:H:A:L:R:q:s:C:G:T:D:M:I:F:W:K:N:B:vh")) != -1) {
+        switch (opt) {
+            case 'p': port = atoi(optarg); break;
+            case 'U': unix_path = optarg; break;
+            case 'e': loops = atoi(optarg); mode = BROKER_MODE_EPOLL; break;
+            case 'S': loops = atoi(optarg); mode = BROKER_MODE_SHARDED; break;
+            case 'H': depth = atoi(optarg); break;
+            case 'A': max_age = atoi(optarg); break;
+            case 'L': log_dir = optarg; break;
+            case 'R': retention = atoi(optarg); break;
+            case 'q': queue_len = atoi(optarg); break;
+            case 'C': credit = atoi(optarg); break;
+            case 'M': stats_path = optarg; break;
+            case 'I': stats_interval = atoi(optarg); break;
+            case 'F': snapshot_path = optarg; break;
+            case 'W': snapshot_interval = atoi(optarg); break;
+            case 'K': handoff_path = optarg; break;
+            case 'N': name = optarg; break;
+            case 'B':
+                if (num_bridges < MAX_BRIDGE_ARGS)
+                    bridges[num_bridges++] = optarg;
+                break;
+            case 'G':
+            case 'T':
+                if (num_limits < MAX_LIMIT_ARGS) {
+                    limit_is_gateway[num_limits] = opt == 'G';
+                    limits[num_limits++] = optarg;
+                }
+                break;
+            case 'v': logger_set_level(LOG_LEVEL_DEBUG); break;
+            case 'D':
+                share = strcmp(optarg, "least") == 0 ? SHARE_LEAST_OUTSTANDING : SHARE_ROUND_ROBIN;
+                break;
+            case 's':
+                if (strcmp(optarg, "newest") == 0)
+                    policy = SLOW_DROP_NEWEST;
+                else if (strcmp(optarg, "disconnect") == 0)
+                    policy = SLOW_DISCONNECT;
+                else
+                    policy = SLOW_DROP_OLDEST;
+                break;
+            default:
+                print_usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (!broker_init(&broker, port)) {
+        printf("Error inicializando broker\n");
+        return 1;
+    }
+
+    if (!broker_set_history_limits(&broker, depth, max_age)) {
+        printf("Error: limites de historial invalidos\n");
+        return 1;
+    }
+
+    if (!broker_set_slow_consumer_policy(&broker, policy, queue_len)) {
+        printf("Error: largo de cola invalido\n");
+        return 1;
+    }
+
+    if (!broker_set_gateway_credit(&broker, credit)) {
+        printf("Error: credito de gateway invalido\n");
+        return 1;
+    }
+
+    broker_set_share_policy(&broker, share);
+
+    for (int i = 0; i < num_limits; i++) {
+        if (!add_limit(&broker, limit_is_gateway[i], limits[i])) {
+            printf("Error: limite invalido '%s'\n", limits[i]);
+            return 1;
+        }
+    }
+
+    if (log_dir) {
+        MsgLogConfig config;
+        msglog_default_config(&config, log_dir);
+        config.retention_age = retention;
+
+        if (!broker_enable_log(&broker, &config)) {
+            printf("Error abriendo el log en '%s'\n", log_dir);
+            return 1;
+        }
+    }
+
+    if (unix_path && !broker_listen_unix(&broker, unix_path)) {
+        printf("Error: ruta de socket Unix invalida '%s'\n", unix_path);
+        return 1;
+    }
+
+    if (stats_path && !broker_enable_stats_dump(&broker, stats_path, stats_interval)) {
+        printf("Error abriendo el archivo de metricas '%s'\n", stats_path);
+        return 1;
+    }
+
+    if (snapshot_path && !broker_enable_snapshot(&broker, snapshot_path, snapshot_interval)) {
+        printf("Error: snapshot invalido '%s'\n", snapshot_path);
+        return 1;
+    }
+
+    if (handoff_path && !broker_enable_handoff(&broker, handoff_path)) {
+        printf("Error: ruta de socket de traspaso invalida '%s'\n", handoff_path);
+        return 1;
+    }
+
+    if (name && !broker_set_name(&broker, name)) {
+        printf("Error: nombre de broker invalido '%s'\n", name);
+        return 1;
+    }
+
+    for (int i = 0; i < num_bridges; i++) {
+        if (!add_bridge(&broker, bridges[i])) {
+            printf("Error: puente invalido '%s'\n", bridges[i]);
+            return 1;
+        }
+    }
+
+    if (loops >= 0 && !broker_set_mode(&broker, mode, loops)) {
+        printf("Error: numero de event loops o shards invalido (maximo %d)\n", MAX_EVENT_LOOPS);
+        return 1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    running_broker = &broker;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
 
-    broker_init(&broker, 9000);
     broker_start(&broker);
 
     broker_cleanup(&broker);
 
     return 0;
 }
-
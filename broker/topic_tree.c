@@ -0,0 +1,624 @@
+#include "topic_tree.h"
+#include "broker.h"
+#include <stdlib.h>
+#include <string.h>
+
+// =========================================================
+// NIVELES
+// =========================================================
+
+typedef struct {
+    const char* name[MAX_TOPIC_LEVELS];
+    int len[MAX_TOPIC_LEVELS];
+    int count;
+} TopicLevels;
+
+// Separa "a/b/c" en niveles sin copiar. Devuelve -1 si hay demasiados.
+static int split_levels(const char* topic, TopicLevels* out) {
+    const char* start = topic;
+    out->count = 0;
+
+    while (1) {
+        const char* slash = strchr(start, '/');
+        int len = slash ? (int)(slash - start) : (int)strlen(start);
+
+        if (out->count == MAX_TOPIC_LEVELS)
+            return -1;
+
+        out->name[out->count] = start;
+        out->len[out->count] = len;
+        out->count++;
+
+        if (!slash)
+            return 0;
+        start = slash + 1;
+    }
+}
+
+static int level_is(const char* name, int len, char c) {
+    return len == 1 && name[0] == c;
+}
+
+const char* topic_share_filter(const char* filter) {
+    size_t plen = sizeof(TOPIC_SHARE_PREFIX) - 1;
+
+    if (strncmp(filter, TOPIC_SHARE_PREFIX, plen) != 0)
+        return NULL;
+
+    const char* slash = strchr(filter + plen, '/');
+    return slash ? slash + 1 : NULL;
+}
+
+int topic_filter_is_valid(const char* filter) {
+    TopicLevels lv;
+
+    if (!filter || !*filter || strlen(filter) >= MAX_TOPIC_LEN)
+        return 0;
+
+    // Compartido: grupo no vacio y sin wildcards; se valida el filtro
+    if (strncmp(filter, TOPIC_SHARE_PREFIX, sizeof(TOPIC_SHARE_PREFIX) - 1) == 0) {
+        const char* group = filter + sizeof(TOPIC_SHARE_PREFIX) - 1;
+        const char* inner = topic_share_filter(filter);
+
+        size_t glen = inner ? (size_t)(inner - 1 - group) : 0;
+
+        if (glen == 0 || memchr(group, '+', glen) || memchr(group, '#', glen) || !*inner)
+            return 0;
+        filter = inner;
+    }
+
+    if (split_levels(filter, &lv) < 0)
+        return 0;
+
+    for (int i = 0; i < lv.count; i++) {
+        int wildcard = memchr(lv.name[i], '+', lv.len[i]) || memchr(lv.name[i], '#', lv.len[i]);
+
+        if (!wildcard)
+            continue;
+        if (level_is(lv.name[i], lv.len[i], '+'))
+            continue;
+        if (level_is(lv.name[i], lv.len[i], '#') && i == lv.count - 1)
+            continue;
+        return 0;
+    }
+
+    return 1;
+}
+
+int topic_name_is_valid(const char* topic) {
+    if (!topic || !*topic || strlen(topic) >= MAX_TOPIC_LEN)
+        return 0;
+    return strpbrk(topic, "+#") == NULL;
+}
+
+int topic_filter_matches(const char* filter, const char* topic) {
+    TopicLevels f, t;
+
+    if (split_levels(filter, &f) < 0 || split_levels(topic, &t) < 0)
+        return 0;
+
+    // Igual que en match_level: los wildcards del primer nivel no
+    // coinciden con topics que empiezan con '$'
+    if (t.len[0] > 0 && t.name[0][0] == '$' &&
+        (level_is(f.name[0], f.len[0], '+') || level_is(f.name[0], f.len[0], '#')))
+        return 0;
+
+    for (int i = 0; i < f.count; i++) {
+        if (level_is(f.name[i], f.len[i], '#'))
+            return 1;
+        if (i == t.count)
+            return 0;
+        if (level_is(f.name[i], f.len[i], '+'))
+            continue;
+        if (f.len[i] != t.len[i] || memcmp(f.name[i], t.name[i], f.len[i]) != 0)
+            return 0;
+    }
+
+    return f.count == t.count;
+}
+
+
+// =========================================================
+// NODOS
+//
+// Un nodo puede estar en varias versiones del arbol (topic_tree_clone):
+// 'refs' cuenta los enlaces que llegan a el (padres o raices). Lo
+// compartido no se modifica: antes de tocar un nodo se copia, y con el
+// todo el camino desde la raiz (own_path). Los hijos de la copia siguen
+// compartidos hasta que se toquen a su vez.
+// =========================================================
+
+static unsigned int hash_level(const char* name, int len) {
+    unsigned int h = 2166136261u;   // FNV-1a
+    for (int i = 0; i < len; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static TopicNode* node_create(const char* name, int len) {
+    TopicNode* n = calloc(1, sizeof(TopicNode) + len + 1);
+    if (!n)
+        return NULL;
+
+    n->refs = 1;
+    n->level_hash = hash_level(name, len);
+    memcpy(n->level, name, len);
+    n->level[len] = '\0';
+    return n;
+}
+
+// Posicion de 'name' en la tabla de hijos: la del hijo, o el lugar
+// libre donde iria. La tabla tiene lugar (num_slots > 0).
+static unsigned int child_index(const TopicNode* n, const char* name, int len, unsigned int h) {
+    unsigned int mask = n->num_slots - 1;
+    unsigned int i = h & mask;
+
+    for (TopicNode* c; (c = n->children[i]); i = (i + 1) & mask)
+        if (c->level_hash == h && strncmp(c->level, name, len) == 0 && c->level[len] == '\0')
+            break;
+    return i;
+}
+
+static TopicNode* node_find_child(const TopicNode* n, const char* name, int len) {
+    if (n->num_slots == 0)
+        return NULL;
+    return n->children[child_index(n, name, len, hash_level(name, len))];
+}
+
+// Duplica la tabla (se mantiene a lo sumo a la mitad)
+static int node_grow(TopicNode* n) {
+    unsigned int size = n->num_slots ? n->num_slots * 2 : 4;
+    TopicNode** children = calloc(size, sizeof(TopicNode*));
+    if (!children)
+        return -1;
+
+    for (unsigned int i = 0; i < n->num_slots; i++) {
+        TopicNode* c = n->children[i];
+        if (!c)
+            continue;
+
+        unsigned int b = c->level_hash & (size - 1);
+        while (children[b])
+            b = (b + 1) & (size - 1);
+        children[b] = c;
+    }
+
+    free(n->children);
+    n->children = children;
+    n->num_slots = size;
+    return 0;
+}
+
+// Saca de la tabla el hijo de la posicion 'i' corriendo hacia atras los
+// que le siguen en la misma racha (sondeo lineal, sin marcas de borrado).
+static void remove_slot(TopicNode* n, unsigned int i) {
+    unsigned int mask = n->num_slots - 1;
+    unsigned int j = i;
+
+    while (1) {
+        j = (j + 1) & mask;
+        TopicNode* c = n->children[j];
+        if (!c)
+            break;
+
+        // Se corre solo si su posicion ideal no queda entre i y j
+        unsigned int k = c->level_hash & mask;
+        if (i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+            n->children[i] = c;
+            i = j;
+        }
+    }
+
+    n->children[i] = NULL;
+    n->num_children--;
+}
+
+// Enlace al hijo 'name' (NULL si no esta y no se pide crearlo)
+static TopicNode** child_link(TopicNode* n, const char* name, int len, int create) {
+    TopicNode** link;
+
+    if (level_is(name, len, '+')) {
+        link = &n->plus;
+    } else if (level_is(name, len, '#')) {
+        link = &n->hash;
+    } else {
+        if (create && 2 * (n->num_children + 1) > n->num_slots && node_grow(n) < 0)
+            return NULL;
+        if (n->num_slots == 0)
+            return NULL;
+
+        link = &n->children[child_index(n, name, len, hash_level(name, len))];
+        if (!*link && create) {
+            if (!(*link = node_create(name, len)))
+                return NULL;
+            n->num_children++;
+        }
+        return *link ? link : NULL;
+    }
+
+    if (!*link && create)
+        *link = node_create(name, len);
+    return *link ? link : NULL;
+}
+
+static int node_is_empty(TopicNode* n) {
+    return !n->subscribers && !n->plus && !n->hash && n->num_children == 0;
+}
+
+static void node_unlink(TopicNode* parent, TopicNode* n) {
+    if (parent->plus == n) {
+        parent->plus = NULL;
+        return;
+    }
+    if (parent->hash == n) {
+        parent->hash = NULL;
+        return;
+    }
+
+    unsigned int i = child_index(parent, n->level, strlen(n->level), n->level_hash);
+    if (parent->children[i] == n)
+        remove_slot(parent, i);
+}
+
+// Entrada de grupo de una suscripcion compartida: no tiene conexion.
+static int is_group(const SubscriberClient* s) {
+    return s->conn == NULL;
+}
+
+static void free_entry(TopicTree* tree, SubscriberClient* s) {
+    if (!is_group(s)) {
+        tree->free_sub(s);
+        return;
+    }
+
+    while (s->members) {
+        SubscriberClient* m = s->members;
+        s->members = m->next;
+        tree->free_sub(m);
+    }
+    if (--s->cursor->refs == 0)
+        free(s->cursor);
+    free(s);
+}
+
+// Copia una entrada; los miembros de un grupo se copian con clone_sub.
+static SubscriberClient* clone_entry(TopicTree* tree, const SubscriberClient* s, TopicCloneFn clone_sub) {
+    if (!is_group(s))
+        return clone_sub(s);
+
+    SubscriberClient* g = malloc(sizeof(SubscriberClient));
+    if (!g)
+        return NULL;
+
+    *g = *s;
+    g->members = NULL;
+    g->num_members = 0;
+    g->next = NULL;
+    g->cursor->refs++;
+
+    for (const SubscriberClient* m = s->members; m; m = m->next) {
+        SubscriberClient* copy = clone_sub(m);
+        if (!copy) {
+            free_entry(tree, g);
+            return NULL;
+        }
+        copy->next = g->members;
+        g->members = copy;
+        g->num_members++;
+    }
+    return g;
+}
+
+// Suelta un enlace al nodo; el ultimo libera el nodo y sus enlaces.
+static void node_release(TopicTree* tree, TopicNode* n) {
+    if (!n || --n->refs > 0)
+        return;
+
+    for (unsigned int i = 0; i < n->num_slots; i++)
+        node_release(tree, n->children[i]);
+    node_release(tree, n->plus);
+    node_release(tree, n->hash);
+
+    SubscriberClient* s = n->subscribers;
+    while (s) {
+        SubscriberClient* nx = s->next;
+        free_entry(tree, s);
+        s = nx;
+    }
+
+    free(n->children);
+    free(n);
+}
+
+// Copia de un nodo para una sola version: comparte los hijos (un enlace
+// mas a cada uno) y copia sus suscripciones con tree->clone_sub.
+static TopicNode* node_copy(TopicTree* tree, const TopicNode* src) {
+    TopicNode* n = node_create(src->level, strlen(src->level));
+    if (!n)
+        return NULL;
+
+    if (src->num_slots > 0) {
+        n->children = malloc(src->num_slots * sizeof(TopicNode*));
+        if (!n->children) {
+            free(n);
+            return NULL;
+        }
+        memcpy(n->children, src->children, src->num_slots * sizeof(TopicNode*));
+        n->num_slots = src->num_slots;
+        n->num_children = src->num_children;
+
+        for (unsigned int i = 0; i < n->num_slots; i++)
+            if (n->children[i])
+                n->children[i]->refs++;
+    }
+    if ((n->plus = src->plus))
+        n->plus->refs++;
+    if ((n->hash = src->hash))
+        n->hash->refs++;
+
+    // Desde aca node_release(n) deshace lo hecho si algo falla
+    for (SubscriberClient* s = src->subscribers; s; s = s->next) {
+        SubscriberClient* copy = clone_entry(tree, s, tree->clone_sub);
+        if (!copy) {
+            node_release(tree, n);
+            return NULL;
+        }
+        copy->next = n->subscribers;
+        n->subscribers = copy;
+    }
+    return n;
+}
+
+// El nodo de '*link' (un enlace de un padre ya propio, o la raiz), copiado
+// si lo comparte otra version.
+static TopicNode* node_own(TopicTree* tree, TopicNode** link) {
+    TopicNode* n = *link;
+    if (n->refs == 1)
+        return n;
+
+    TopicNode* copy = node_copy(tree, n);
+    if (!copy)
+        return NULL;
+
+    n->refs--;          // lo sigue apuntando la otra version
+    *link = copy;
+    return copy;
+}
+
+// Hace propios los nodos del camino de 'filter' (sin "$share/..."),
+// creando los que falten si 'create'. Deja en nodes[0..n] la raiz y cada
+// nivel, y devuelve n, o -1 si el camino no esta o falta memoria.
+static int own_path(TopicTree* tree, const char* filter, TopicNode** nodes, int create) {
+    TopicLevels lv;
+    if (split_levels(filter, &lv) < 0)
+        return -1;
+
+    TopicNode* n = node_own(tree, &tree->root);
+    if (!n)
+        return -1;
+    nodes[0] = n;
+
+    for (int i = 0; i < lv.count; i++) {
+        TopicNode** link = child_link(n, lv.name[i], lv.len[i], create);
+        if (!link || !(n = node_own(tree, link)))
+            return -1;
+        nodes[i + 1] = n;
+    }
+    return lv.count;
+}
+
+// Libera los nodos que quedaron vacios, desde el final del camino hacia
+// la raiz.
+static void prune_path(TopicTree* tree, TopicNode** nodes, int depth) {
+    for (int i = depth; i > 0 && node_is_empty(nodes[i]); i--) {
+        node_unlink(nodes[i - 1], nodes[i]);
+        node_release(tree, nodes[i]);
+    }
+}
+
+static TopicNode* node_lookup(TopicTree* tree, const char* filter) {
+    TopicLevels lv;
+    if (split_levels(filter, &lv) < 0)
+        return NULL;
+
+    TopicNode* n = tree->root;
+    for (int i = 0; i < lv.count && n; i++) {
+        if (level_is(lv.name[i], lv.len[i], '+'))
+            n = n->plus;
+        else if (level_is(lv.name[i], lv.len[i], '#'))
+            n = n->hash;
+        else
+            n = node_find_child(n, lv.name[i], lv.len[i]);
+    }
+    return n;
+}
+
+
+// =========================================================
+// API
+// =========================================================
+
+static void default_free_sub(SubscriberClient* sub) {
+    free(sub);
+}
+
+void topic_tree_init(TopicTree* tree, TopicFreeFn free_sub) {
+    tree->root = node_create("", 0);
+    tree->count = 0;
+    tree->free_sub = free_sub ? free_sub : default_free_sub;
+    tree->clone_sub = NULL;
+}
+
+void topic_tree_destroy(TopicTree* tree) {
+    node_release(tree, tree->root);
+    tree->root = NULL;
+    tree->count = 0;
+}
+
+int topic_tree_clone(TopicTree* dst, const TopicTree* src, TopicCloneFn clone_sub) {
+    *dst = *src;
+    dst->clone_sub = clone_sub;
+    dst->root->refs++;
+    return 0;
+}
+
+// Enlace a la entrada del grupo 'filter' ("$share/...") en el nodo
+// ('*' es NULL si no esta).
+static SubscriberClient** find_group(TopicNode* n, const char* filter) {
+    SubscriberClient** pp = &n->subscribers;
+    while (*pp && !(is_group(*pp) && strcmp((*pp)->topic, filter) == 0))
+        pp = &(*pp)->next;
+    return pp;
+}
+
+// Enlace a la suscripcion de 'conn' con 'filter' en el nodo del filtro
+// (para uno compartido, en los miembros de su grupo); '*' es NULL si no
+// esta. 'gp' recibe el enlace al grupo.
+static SubscriberClient** find_entry(TopicNode* n, const char* filter, int shared,
+                                     Connection* conn, SubscriberClient*** gp) {
+    SubscriberClient** pp = &n->subscribers;
+
+    if (shared) {
+        *gp = find_group(n, filter);
+        if (!**gp)
+            return *gp;
+        pp = &(**gp)->members;
+    }
+
+    while (*pp && (*pp)->conn != conn)
+        pp = &(*pp)->next;
+    return pp;
+}
+
+static int add_member(TopicTree* tree, TopicNode* n, SubscriberClient* sub) {
+    SubscriberClient* g = *find_group(n, sub->topic);
+
+    if (!g) {
+        g = calloc(1, sizeof(SubscriberClient));
+        if (g && !(g->cursor = calloc(1, sizeof(ShareCursor)))) {
+            free(g);
+            g = NULL;
+        }
+        if (!g)
+            return -1;
+        g->cursor->refs = 1;
+        memcpy(g->topic, sub->topic, MAX_TOPIC_LEN);
+        g->next = n->subscribers;
+        n->subscribers = g;
+    }
+
+    sub->next = g->members;
+    g->members = sub;
+    g->num_members++;
+    tree->count++;
+    return 1;
+}
+
+int topic_tree_add(TopicTree* tree, SubscriberClient* sub) {
+    TopicNode* nodes[MAX_TOPIC_LEVELS + 1];
+    const char* path = topic_share_filter(sub->topic);
+
+    if (!topic_filter_is_valid(sub->topic))
+        return -1;
+
+    // Si ya esta solo puede cambiar su 'conflate'; igual no hace falta
+    // copiar el camino
+    TopicNode* found = node_lookup(tree, path ? path : sub->topic);
+    SubscriberClient** gp;
+    SubscriberClient* old = found ? *find_entry(found, sub->topic, path != NULL, sub->conn, &gp) : NULL;
+    if (old && old->conflate == sub->conflate)
+        return 0;
+
+    int depth = own_path(tree, path ? path : sub->topic, nodes, 1);
+    if (depth < 0)
+        return -1;
+
+    TopicNode* n = nodes[depth];
+    if (old) {
+        (*find_entry(n, sub->topic, path != NULL, sub->conn, &gp))->conflate = sub->conflate;
+        return 2;
+    }
+    if (path)
+        return add_member(tree, n, sub);
+
+    sub->next = n->subscribers;
+    n->subscribers = sub;
+    tree->count++;
+    return 1;
+}
+
+int topic_tree_remove(TopicTree* tree, const char* filter, Connection* conn) {
+    TopicNode* nodes[MAX_TOPIC_LEVELS + 1];
+    const char* path = topic_share_filter(filter);
+
+    // Se busca antes de copiar nada
+    TopicNode* found = node_lookup(tree, path ? path : filter);
+    SubscriberClient** gp;
+    if (!found || !*find_entry(found, filter, path != NULL, conn, &gp))
+        return 0;
+
+    int depth = own_path(tree, path ? path : filter, nodes, 0);
+    if (depth < 0)
+        return 0;
+
+    TopicNode* n = nodes[depth];
+    SubscriberClient** pp = find_entry(n, filter, path != NULL, conn, &gp);
+    SubscriberClient* s = *pp;
+    *pp = s->next;
+    tree->free_sub(s);
+    tree->count--;
+
+    // El ultimo miembro se lleva el grupo
+    if (path && --(*gp)->num_members == 0) {
+        SubscriberClient* g = *gp;
+        *gp = g->next;
+        free_entry(tree, g);
+    }
+
+    prune_path(tree, nodes, depth);
+    return 1;
+}
+
+static int deliver_all(TopicNode* n, TopicMatchFn fn, void* ctx) {
+    int count = 0;
+    for (SubscriberClient* s = n->subscribers; s; s = s->next) {
+        fn(s, ctx);
+        count++;
+    }
+    return count;
+}
+
+static int match_level(TopicNode* n, const TopicLevels* lv, int i, TopicMatchFn fn, void* ctx) {
+    int count = 0;
+
+    // Los topics que empiezan con '$' no coinciden con wildcards en el
+    // primer nivel (convencion MQTT para topics del sistema).
+    int wildcards = !(i == 0 && lv->len[0] > 0 && lv->name[0][0] == '$');
+
+    // '#' tambien coincide con el nivel padre ("a/#" recibe "a")
+    if (n->hash && wildcards)
+        count += deliver_all(n->hash, fn, ctx);
+
+    if (i == lv->count)
+        return count + deliver_all(n, fn, ctx);
+
+    TopicNode* c = node_find_child(n, lv->name[i], lv->len[i]);
+    if (c)
+        count += match_level(c, lv, i + 1, fn, ctx);
+
+    if (n->plus && wildcards)
+        count += match_level(n->plus, lv, i + 1, fn, ctx);
+
+    return count;
+}
+
+int topic_tree_match(TopicTree* tree, const char* topic, TopicMatchFn fn, void* ctx) {
+    TopicLevels lv;
+
+    if (!tree->root || split_levels(topic, &lv) < 0)
+        return 0;
+
+    return match_level(tree->root, &lv, 0, fn, ctx);
+}
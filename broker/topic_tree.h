@@ -0,0 +1,88 @@
+#ifndef TOPIC_TREE_H
+#define TOPIC_TREE_H
+
+// =========================================================
+// Arbol de topics por niveles ("a/b/c") con wildcards MQTT:
+//   '+'  coincide con exactamente un nivel
+//   '#'  coincide con cero o mas niveles (solo como ultimo nivel)
+//
+// El coste de un match depende de la profundidad del topic y de los
+// suscriptores que coinciden, no del total de suscripciones.
+// El arbol no es thread-safe: el llamador debe protegerlo.
+//
+// Suscripciones compartidas "$share/<grupo>/<filtro>": los miembros de
+// un mismo grupo y filtro se juntan bajo una entrada de grupo (sin
+// conexion) en el nodo de <filtro>. El match entrega la entrada de
+// grupo una sola vez y quien recibe elige a que miembro mandar.
+// =========================================================
+
+#define MAX_TOPIC_LEVELS 64
+#define TOPIC_SHARE_PREFIX "$share/"
+
+struct SubscriberClient;
+struct Connection;
+
+typedef void (*TopicFreeFn)(struct SubscriberClient* sub);
+typedef struct SubscriberClient* (*TopicCloneFn)(const struct SubscriberClient* sub);
+
+typedef struct TopicNode {
+    int refs;                        // versiones del arbol que lo enlazan
+    unsigned int level_hash;
+
+    struct TopicNode** children;     // hijos literales: tabla por hash
+    unsigned int num_slots;          // potencia de 2, a lo sumo la mitad ocupada
+    unsigned int num_children;
+
+    struct TopicNode* plus;          // hijo '+'
+    struct TopicNode* hash;          // hijo '#'
+
+    struct SubscriberClient* subscribers;
+
+    char level[];
+} TopicNode;
+
+typedef struct {
+    TopicNode* root;
+    int count;                       // suscripciones almacenadas
+    TopicFreeFn free_sub;            // libera una suscripcion del arbol
+    TopicCloneFn clone_sub;          // copia una de un nodo compartido
+} TopicTree;
+
+typedef void (*TopicMatchFn)(struct SubscriberClient* sub, void* ctx);
+
+void topic_tree_init(TopicTree* tree, TopicFreeFn free_sub);
+void topic_tree_destroy(TopicTree* tree);
+
+// Version nueva de 'src' en 'dst' que comparte todos sus nodos: no copia
+// nada. Al modificar 'dst' se copian solo los nodos del camino del filtro
+// (y las suscripciones de esos nodos, con clone_sub); el resto sigue
+// compartido y sin cambios, asi otros hilos pueden seguir leyendo 'src'.
+// 'src' ya no se modifica; las dos versiones se modifican y destruyen
+// bajo el mismo lock. Devuelve 0.
+int  topic_tree_clone(TopicTree* dst, const TopicTree* src, TopicCloneFn clone_sub);
+
+// 1 = agregada, 0 = ya existia igual (mismo filtro y conexion), 2 = ya
+// existia y se le cambio 'conflate' al de 'sub', -1 = filtro invalido.
+// Si devuelve 1 el arbol pasa a ser duenio de 'sub' (en un filtro
+// compartido, como miembro de su grupo); si no, 'sub' sigue siendo de
+// quien llama.
+int  topic_tree_add(TopicTree* tree, struct SubscriberClient* sub);
+
+// Devuelve 1 si se elimino la suscripcion (se libera con free_sub).
+int  topic_tree_remove(TopicTree* tree, const char* filter, struct Connection* conn);
+
+// Llama a fn por cada suscripcion cuyo filtro coincide con 'topic'.
+// Devuelve el numero de coincidencias.
+int  topic_tree_match(TopicTree* tree, const char* topic, TopicMatchFn fn, void* ctx);
+
+int  topic_filter_is_valid(const char* filter);
+int  topic_name_is_valid(const char* topic);
+
+// <filtro> de "$share/<grupo>/<filtro>", o NULL si no es compartido.
+const char* topic_share_filter(const char* filter);
+
+// 1 si el topic coincide con el filtro, con las mismas reglas que
+// topic_tree_match (sirve para comparar sin armar un arbol).
+int  topic_filter_matches(const char* filter, const char* topic);
+
+#endif
@@ -0,0 +1,120 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// =========================================================
+// Protocolo binario del broker (compartido con gateway y subscriber).
+//
+// El cliente lo negocia con la linea de texto "HELLO BINARY\n"; el
+// broker responde "OK BINARY\n" y desde ahi ambos lados usan frames:
+//
+//   | opcode (1) | reservado (1) | largo topic (2) | largo payload (4) |
+//   | topic ... | payload ... |
+//
+// Los largos van en orden de red. El payload puede tener cualquier
+// byte, incluidos '\0' y '\n'.
+//
+// WIRE_PUBLISH_BATCH lleva varias publicaciones en un frame: sin topic,
+// y el payload es una secuencia de frames WIRE_PUBLISH completos.
+//
+// WIRE_HISTORY pide registros del historial (payload en texto:
+// "<since> <until> <limit>"); cada registro vuelve como WIRE_RECORD, con
+// el timestamp en los primeros 8 bytes del payload, y al final llega un
+// WIRE_OK "HISTORY <n>".
+//
+// WIRE_STATS pide las metricas del broker: vuelve un WIRE_STAT por
+// metrica (el valor en texto decimal) y un WIRE_OK "STATS <n>".
+//
+// WIRE_CREDIT (en texto "CREDIT <n>") habilita a un gateway registrado a
+// mandar <n> PUBLISH mas; el payload son 4 bytes en orden de red.
+//
+// WIRE_BRIDGE lo manda un broker que se conecta a otro como puente; la
+// respuesta es un WIRE_OK "BRIDGE <nombre del otro>". Despues suscribe
+// como cualquier cliente y recibe WIRE_RELAY: el topic y un payload
+//
+//   | saltos (1) | largo origen (1) | origen | secuencia (8) | payload |
+//
+// con el broker donde se publico, los enlaces que lleva cruzados
+// (contando este) y su numero en ese broker, en orden de red. Los valores
+// retenidos que se mandan al suscribir llevan ademas WIRE_RELAY_RETAINED
+// en el byte de saltos.
+// =========================================================
+
+#define WIRE_HELLO_BINARY   "HELLO BINARY\n"
+#define WIRE_HELLO_OK       "OK BINARY\n"
+
+#define WIRE_HEADER_LEN     8
+#define WIRE_MAX_TOPIC      0xFFFF
+#define WIRE_MAX_FRAME      4096      // el mayor frame que acepta el broker
+
+#define WIRE_RELAY_RETAINED 0x80      // WIRE_RELAY: es un valor retenido
+
+enum {
+    WIRE_PUBLISH   = 1,   // cliente -> broker: topic + payload
+    WIRE_SUBSCRIBE = 2,   // cliente -> broker: topic = filtro
+    WIRE_REGISTER  = 3,   // gateway -> broker: topic = id del gateway
+    WIRE_MESSAGE   = 4,   // broker -> suscriptor: topic + payload
+    WIRE_OK        = 5,   // broker -> cliente: payload = respuesta
+    WIRE_ERROR     = 6,   // broker -> cliente: payload = descripcion
+    WIRE_PUBLISH_BATCH = 7, // cliente -> broker: payload = frames WIRE_PUBLISH
+    WIRE_UNSUBSCRIBE = 8,   // cliente -> broker: topic = filtro
+    WIRE_HISTORY   = 9,   // cliente -> broker: topic = filtro, payload = rango
+    WIRE_RECORD    = 10,  // broker -> cliente: topic + timestamp (8) + payload
+    WIRE_CREDIT    = 11,  // broker -> gateway: payload = creditos (4)
+    WIRE_STATS     = 12,  // cliente -> broker: sin topic ni payload
+    WIRE_STAT      = 13,  // broker -> cliente: topic = metrica, payload = valor
+    WIRE_BRIDGE    = 14,  // broker -> broker: topic = nombre del que se conecta
+    WIRE_RELAY     = 15   // broker -> broker: topic + origen + payload
+};
+
+typedef struct {
+    uint8_t opcode;
+    uint16_t topic_len;
+    uint32_t payload_len;
+} WireHeader;
+
+static inline void wire_put_header(char* out, uint8_t opcode, size_t topic_len, size_t payload_len) {
+    out[0] = (char)opcode;
+    out[1] = 0;
+    out[2] = (char)((topic_len >> 8) & 0xFF);
+    out[3] = (char)(topic_len & 0xFF);
+    out[4] = (char)((payload_len >> 24) & 0xFF);
+    out[5] = (char)((payload_len >> 16) & 0xFF);
+    out[6] = (char)((payload_len >> 8) & 0xFF);
+    out[7] = (char)(payload_len & 0xFF);
+}
+
+// Arma un frame completo en 'out'. Devuelve su largo, o 0 si no entra.
+static inline size_t wire_encode(char* out, size_t cap, uint8_t opcode,
+                                 const char* topic, size_t topic_len,
+                                 const char* payload, size_t payload_len) {
+    size_t total = WIRE_HEADER_LEN + topic_len + payload_len;
+    if (total > cap || topic_len > WIRE_MAX_TOPIC)
+        return 0;
+
+    wire_put_header(out, opcode, topic_len, payload_len);
+    memcpy(out + WIRE_HEADER_LEN, topic, topic_len);
+    memcpy(out + WIRE_HEADER_LEN + topic_len, payload, payload_len);
+    return total;
+}
+
+// Lee la cabecera. Devuelve el largo total del frame, o 0 si todavia no
+// hay una cabecera completa.
+static inline size_t wire_decode_header(const char* in, size_t len, WireHeader* h) {
+    const unsigned char* p = (const unsigned char*)in;
+
+    if (len < WIRE_HEADER_LEN)
+        return 0;
+
+    h->opcode = p[0];
+    h->topic_len = (uint16_t)((p[2] << 8) | p[3]);
+    h->payload_len = ((uint32_t)p[4] << 24) | ((uint32_t)p[5] << 16) |
+                     ((uint32_t)p[6] << 8) | (uint32_t)p[7];
+
+    return WIRE_HEADER_LEN + h->topic_len + (size_t)h->payload_len;
+}
+
+#endif
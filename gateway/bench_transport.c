@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "gateway.h"
+#include "../broker/broker.h"
+#include "../broker/logger.h"
+
+// ==================== BENCHMARK DE TRANSPORTES ====================
+//
+// Levanta un broker en el mismo proceso (epoll, un loop, sin credito) y
+// le conecta un gateway por cada transporte: TCP por loopback, socket
+// Unix y memoria compartida. Mide:
+//
+//   - rafaga: PUBLISH/segundo desde que el gateway empieza a mandar
+//     hasta que el broker los conto todos (messages_in de STATS)
+//   - latencia: de gateway_send_to_broker() hasta que un suscriptor
+//     (por el socket Unix, igual para todos) recibe el mensaje, de a uno
+//     por vez; p50 y p99
+
+#define BROKER_PORT 19400
+#define BROKER_UNIX "/tmp/bench_transport.sock"
+#define BURST_MESSAGES 500000
+#define LATENCY_ROUNDS 20000
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static Broker broker;
+
+static void* broker_thread(void* arg) {
+    (void)arg;
+    broker_start(&broker);
+    return NULL;
+}
+
+static uint64_t messages_in(void) {
+    static StatsSnapshot snap;
+    stats_collect(&broker.stats, &snap);
+    return snap.counters[STAT_MESSAGES_IN];
+}
+
+// Suscriptor por el socket Unix. Devuelve el socket con la respuesta al
+// SUBSCRIBE ya leida.
+static int subscribe(const char* filter) {
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, BROKER_UNIX);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        exit(1);
+    }
+
+    char line[128];
+    int len = snprintf(line, sizeof(line), "SUBSCRIBE %s\n", filter);
+    send(sock, line, len, 0);
+
+    // La respuesta es una linea; nada mas llega antes de publicar
+    for (char c = 0; c != '\n';) {
+        if (recv(sock, &c, 1, 0) <= 0) {
+            perror("recv");
+            exit(1);
+        }
+    }
+    return sock;
+}
+
+static int cmp_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void bench(const char* name, const char* address, int sub) {
+    Gateway gw;
+    char topic[64], data[64];
+
+    gateway_init(&gw, name, 0);
+    if (gateway_connect(&gw, address) < 0) {
+        fprintf(stderr, "%s: no se pudo conectar a %s\n", name, address);
+        exit(1);
+    }
+
+    // Rafaga: a otro topic, sin suscriptores
+    snprintf(topic, sizeof(topic), "bench/%s/burst", name);
+    uint64_t base = messages_in();
+    double t0 = now_sec();
+
+    for (int i = 0; i < BURST_MESSAGES; i++) {
+        snprintf(data, sizeof(data), "{\"value\":%d.%02d,\"seq\":%d}", 20 + i % 10, i % 100, i);
+        gateway_send_to_broker(&gw, topic, data);
+    }
+    while (messages_in() - base < BURST_MESSAGES)
+        usleep(100);
+
+    double burst = BURST_MESSAGES / (now_sec() - t0);
+
+    // Latencia: el suscriptor esta en "bench/+/latency"
+    static double samples[LATENCY_ROUNDS];
+    char buf[256];
+    snprintf(topic, sizeof(topic), "bench/%s/latency", name);
+
+    for (int i = 0; i < LATENCY_ROUNDS; i++) {
+        snprintf(data, sizeof(data), "%d", i);
+        double start = now_sec();
+        gateway_send_to_broker(&gw, topic, data);
+
+        // Una linea por mensaje, y llegan de a uno
+        ssize_t n;
+        do {
+            n = recv(sub, buf, sizeof(buf), 0);
+        } while (n > 0 && buf[n - 1] != '\n');
+        samples[i] = (now_sec() - start) * 1e6;
+    }
+
+    qsort(samples, LATENCY_ROUNDS, sizeof(double), cmp_double);
+    printf("%-5s  %10.0f msg/s  p50 %6.1f us  p99 %6.1f us\n", name, burst,
+           samples[LATENCY_ROUNDS / 2], samples[LATENCY_ROUNDS * 99 / 100]);
+
+    gateway_stop(&gw);
+    gateway_cleanup(&gw);
+}
+
+int main(void) {
+    pthread_t thread;
+    char address[128];
+
+    logger_set_level(LOG_LEVEL_WARN);
+
+    broker_init(&broker, BROKER_PORT);
+    broker_set_mode(&broker, BROKER_MODE_EPOLL, 1);
+    broker_set_gateway_credit(&broker, 0);
+    if (!broker_listen_unix(&broker, BROKER_UNIX))
+        return 1;
+    pthread_create(&thread, NULL, broker_thread, NULL);
+
+    // Hasta que el broker escucha
+    for (int i = 0; i < 100 && access(BROKER_UNIX, F_OK) != 0; i++)
+        usleep(10000);
+
+    int sub = subscribe("bench/+/latency");
+
+    printf("%d PUBLISH en rafaga, %d de a uno\n\n", BURST_MESSAGES, LATENCY_ROUNDS);
+
+    snprintf(address, sizeof(address), "tcp://127.0.0.1:%d", BROKER_PORT);
+    bench("tcp", address, sub);
+    bench("unix", "unix://" BROKER_UNIX, sub);
+    bench("shm", "shm://" BROKER_UNIX, sub);
+
+    // El loop de accept no se despierta solo: se deja al salir
+    close(sub);
+    broker_stop(&broker);
+    unlink(BROKER_UNIX);
+    logger_flush();
+    return 0;
+}
@@ -1,4 +1,14 @@
+#define _GNU_SOURCE              // memfd_create
 #include "gateway.h"
+#include "../broker/wire.h"
+#include "../broker/shm_ring.h"
+#include "../broker/logger.h"
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 // ==================== FUNCIONES INTERNAS ====================
 
@@ -21,13 +31,13 @@ static PublisherInfo* _find_publisher(Gateway* gw, int socket) {
 
 // Procesar datos de sensor
 static void _process_sensor_data(Gateway* gw, PublisherInfo* p, const char* raw) {
-    printf("[GATEWAY] ?? [Publisher %s] %s\n", p->publisher_id, raw);
+    LOG_DEBUG("[GATEWAY] ?? [Publisher %s] %s", p->publisher_id, raw);
 
     char sensor[50];
     float value;
 
     if (sscanf(raw, "%[^:]:%f", sensor, &value) != 2) {
-        printf("[GATEWAY] ? Formato invlido: %s\n", raw);
+        LOG_WARN("[GATEWAY] ? Formato inv�lido: %s", raw);
         return;
     }
 
@@ -41,7 +51,7 @@ static void _process_sensor_data(Gateway* gw, PublisherInfo* p, const char* raw)
 
     gw->total_messages_received++;
 
-    printf("[GATEWAY] ? Procesado: %s = %.2f\n", sensor, value);
+    LOG_DEBUG("[GATEWAY] ? Procesado: %s = %.2f", sensor, value);
 }
 
 // Registrar publisher
@@ -51,7 +61,7 @@ static void _publisher_register(PublisherInfo* p, const char* msg) {
     const char* id = msg + 9;
     strncpy(p->publisher_id, id, sizeof(p->publisher_id));
 
-    printf("[GATEWAY] ? Publisher registrado como %s\n", id);
+    LOG_DEBUG("[GATEWAY] ? Publisher registrado como %s", id);
 
     char ack[200];
     snprintf(ack, sizeof(ack), "REGACK %s OK\n", id);
@@ -72,7 +82,7 @@ static void* _publisher_thread(void* arg) {
 
         int n = recv(p->socket, buf, sizeof(buf) - 1, 0);
         if (n <= 0) {
-            printf("[GATEWAY] Publisher %s desconectado\n", p->publisher_id);
+            LOG_DEBUG("[GATEWAY] Publisher %s desconectado", p->publisher_id);
             break;
         }
 
@@ -92,14 +102,83 @@ static void* _publisher_thread(void* arg) {
     return NULL;
 }
 
-// Hilo principal de procesamiento
+// Lote de lecturas que se manda al broker con un solo send()
+#define BATCH_BYTES WIRE_MAX_FRAME
+#define BATCH_RECORD_MAX (WIRE_HEADER_LEN + 200 + 400)
+
+// Con el ring lleno se espera el aviso del broker de a este tiempo, para
+// notar si el gateway se detiene o el broker se fue.
+#define RING_WAIT_MS 100
+
+// Todo lo que va al broker pasa por aca: por el ring si se negocio
+// memoria compartida, si no por el socket. Devuelve 0 si salio entero.
+static int _broker_write(Gateway* gw, const char* buf, size_t len) {
+    if (!gw->ring)
+        return send(gw->broker_socket, buf, len, 0) == (ssize_t)len ? 0 : -1;
+
+    if (len > gw->ring->size)
+        return -1;
+
+    int r = 0;
+    pthread_mutex_lock(&gw->ring_mutex);
+
+    while (!shm_ring_write(gw->ring, buf, len)) {
+        if (!gw->running || gw->broker_lost) {
+            r = -1;
+            break;
+        }
+        if (shm_ring_sleep(gw->ring, &gw->ring->producer_waiting, len)) {
+            struct pollfd pfd = { gw->ring_space_fd, POLLIN, 0 };
+            uint64_t count;
+            if (poll(&pfd, 1, RING_WAIT_MS) > 0 && read(gw->ring_space_fd, &count, sizeof(count)) < 0)
+                LOG_WARN("[GATEWAY] eventfd del ring: %s", strerror(errno));
+        }
+    }
+
+    // El broker solo se despierta si se habia dormido
+    if (r == 0 && shm_ring_wake(&gw->ring->consumer_waiting)) {
+        uint64_t one = 1;
+        if (write(gw->ring_data_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            LOG_WARN("[GATEWAY] eventfd del ring: %s", strerror(errno));
+    }
+
+    pthread_mutex_unlock(&gw->ring_mutex);
+    return r;
+}
+
+// Agrega una lectura al lote: un frame WIRE_PUBLISH en binario o una
+// linea PUBLISH en texto. Devuelve los bytes agregados.
+static size_t _append_reading(Gateway* gw, const SensorData* d, char* out, size_t cap) {
+    char topic[200];
+    snprintf(topic, sizeof(topic),
+             "gateway/%s/publisher/%s/sensor/%s",
+             gw->gateway_id, d->publisher_id, d->sensor_type);
+
+    char json[400];
+    snprintf(json, sizeof(json),
+             "{\"value\":%.2f,\"timestamp\":%ld}",
+             d->value, d->timestamp);
+
+    if (gw->binary_protocol)
+        return wire_encode(out, cap, WIRE_PUBLISH, topic, strlen(topic), json, strlen(json));
+
+    int n = snprintf(out, cap, "PUBLISH %s %s\n", topic, json);
+    return n < (int)cap ? (size_t)n : 0;
+}
+
+// Hilo principal de procesamiento. Toma todas las lecturas que haya en
+// la cola (hasta llenar un lote o gastar el credito) y las manda juntas:
+// en binario como un frame WIRE_PUBLISH_BATCH, en texto como varias
+// lineas en un send(). Sin credito las lecturas esperan en la cola.
 static void* _queue_processor(void* arg) {
     Gateway* gw = (Gateway*)arg;
+    char batch[BATCH_BYTES];
 
     while (gw->running) {
         pthread_mutex_lock(&gw->queue->mutex);
 
-        while (message_queue_is_empty(gw->queue) && gw->running)
+        while ((message_queue_is_empty(gw->queue) || (gw->flow_control && gw->credit <= 0)) &&
+               gw->running)
             pthread_cond_wait(&gw->queue->not_empty, &gw->queue->mutex);
 
         if (!gw->running) {
@@ -107,23 +186,195 @@ static void* _queue_processor(void* arg) {
             break;
         }
 
-        SensorData d = message_queue_dequeue(gw->queue);
+        // En binario los primeros bytes quedan para la cabecera del lote
+        size_t start = gw->binary_protocol ? WIRE_HEADER_LEN : 0;
+        size_t len = start;
+        int count = 0;
+
+        while (!message_queue_is_empty(gw->queue) && (!gw->flow_control || gw->credit > 0) &&
+               len + BATCH_RECORD_MAX <= sizeof(batch)) {
+            SensorData d = message_queue_dequeue(gw->queue);
+            len += _append_reading(gw, &d, batch + len, sizeof(batch) - len);
+            count++;
+            gw->credit--;
+        }
         pthread_mutex_unlock(&gw->queue->mutex);
 
-        char topic[200];
-        snprintf(topic, sizeof(topic),
-                 "gateway/%s/publisher/%s/sensor/%s",
-                 gw->gateway_id, d.publisher_id, d.sensor_type);
+        if (gw->binary_protocol)
+            wire_put_header(batch, WIRE_PUBLISH_BATCH, 0, len - start);
+
+        if (_broker_write(gw, batch, len) == 0)
+            gw->total_messages_sent += count;
+    }
+
+    return NULL;
+}
+
+// Lee una linea de respuesta (con su '\n') antes de arrancar el lector.
+static int _read_reply(Gateway* gw, char* line, size_t cap) {
+    size_t len = 0;
+
+    while (len < cap - 1) {
+        if (recv(gw->broker_socket, line + len, 1, 0) <= 0)
+            return -1;
+        if (line[len++] == '\n')
+            break;
+    }
+    line[len] = '\0';
+    return 0;
+}
+
+// Envia "HELLO BINARY" y espera la confirmacion (una linea de texto).
+// Es lo primero que se manda al broker (despues de HELLO SHM), asi que
+// no hay otras respuestas en camino.
+static int _negotiate_binary(Gateway* gw) {
+    char line[64];
+
+    if (_broker_write(gw, WIRE_HELLO_BINARY, strlen(WIRE_HELLO_BINARY)) < 0 ||
+        _read_reply(gw, line, sizeof(line)) < 0)
+        return -1;
+
+    return strcmp(line, WIRE_HELLO_OK) == 0 ? 0 : -1;
+}
+
+// Crea el ring y los eventfd y se los pasa al broker con "HELLO SHM".
+// Si el broker no acepta, la conexion sigue por el socket.
+static int _attach_shm(Gateway* gw) {
+    size_t bytes = shm_ring_bytes(SHM_RING_DEFAULT_SIZE);
+    int fds[SHM_RING_FDS] = {
+        memfd_create("gateway-ring", MFD_CLOEXEC),
+        eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC),
+        eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)
+    };
+    ShmRing* ring = MAP_FAILED;
+    char line[64] = "";
+
+    if (fds[0] >= 0 && fds[1] >= 0 && fds[2] >= 0 && ftruncate(fds[0], bytes) == 0)
+        ring = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+
+    if (ring != MAP_FAILED) {
+        shm_ring_init(ring, SHM_RING_DEFAULT_SIZE);
+
+        union {
+            struct cmsghdr hdr;
+            char buf[CMSG_SPACE(sizeof(fds))];
+        } control;
+        char hello[] = "HELLO SHM\n";
+        struct iovec iov = { hello, strlen(hello) };
+        struct msghdr msg;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(fds));
+        memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+        if (sendmsg(gw->broker_socket, &msg, 0) < 0 || _read_reply(gw, line, sizeof(line)) < 0)
+            line[0] = '\0';
+    }
+
+    // El memfd ya no hace falta: el mapeo lo mantiene
+    if (fds[0] >= 0)
+        close(fds[0]);
+
+    if (strcmp(line, "OK SHM\n") != 0) {
+        if (ring != MAP_FAILED)
+            munmap(ring, bytes);
+        for (int i = 1; i < SHM_RING_FDS; i++) {
+            if (fds[i] >= 0)
+                close(fds[i]);
+        }
+        return -1;
+    }
+
+    gw->ring = ring;
+    gw->ring_data_fd = fds[1];
+    gw->ring_space_fd = fds[2];
+    return 0;
+}
+
+// Suma credito y despierta al procesador si estaba esperandolo.
+static void _add_credit(Gateway* gw, long n) {
+    pthread_mutex_lock(&gw->queue->mutex);
+    gw->flow_control = 1;
+    gw->credit += (int)n;
+    pthread_cond_signal(&gw->queue->not_empty);
+    pthread_mutex_unlock(&gw->queue->mutex);
+}
+
+// Respuestas del broker: CREDIT, y OK / ERROR que solo se muestran.
+static void _broker_line(Gateway* gw, const char* line) {
+    if (strncmp(line, "CREDIT ", 7) == 0)
+        _add_credit(gw, strtol(line + 7, NULL, 10));
+    else if (strncmp(line, "ERROR", 5) == 0)
+        LOG_WARN("[GATEWAY] Broker: %s", line);
+}
+
+static void _broker_frame(Gateway* gw, const WireHeader* h, const char* payload) {
+    const unsigned char* p = (const unsigned char*)payload;
+
+    if (h->opcode == WIRE_CREDIT && h->payload_len == 4)
+        _add_credit(gw, ((long)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]);
+    else if (h->opcode == WIRE_ERROR)
+        LOG_WARN("[GATEWAY] Broker: ERROR: %.*s", (int)h->payload_len, payload);
+}
 
-        char json[400];
-        snprintf(json, sizeof(json),
-                 "{\"value\":%.2f,\"timestamp\":%ld}",
-                 d.value, d.timestamp);
+// Hilo que lee lo que manda el broker (lineas o frames segun el
+// protocolo negociado).
+static void* _broker_reader_thread(void* arg) {
+    Gateway* gw = (Gateway*)arg;
+    char buf[WIRE_MAX_FRAME];
+    size_t len = 0;
+
+    while (gw->running) {
+        int n = recv(gw->broker_socket, buf + len, sizeof(buf) - 1 - len, 0);
+        if (n <= 0)
+            break;
+        len += n;
+
+        char* p = buf;
+        char* end = buf + len;
+
+        if (gw->binary_protocol) {
+            WireHeader h;
+            size_t total;
+
+            while ((total = wire_decode_header(p, end - p, &h)) != 0 && total <= (size_t)(end - p)) {
+                _broker_frame(gw, &h, p + WIRE_HEADER_LEN + h.topic_len);
+                p += total;
+            }
+        } else {
+            char* nl;
+
+            while ((nl = memchr(p, '\n', end - p)) != NULL) {
+                *nl = '\0';
+                _broker_line(gw, p);
+                p = nl + 1;
+            }
+        }
 
-        if (gateway_send_to_broker(gw, topic, json) == 0)
-            gw->total_messages_sent++;
+        // Lo que no entra en el buffer no es una respuesta valida
+        len = end - p;
+        if (len == sizeof(buf) - 1)
+            len = 0;
+        memmove(buf, p, len);
     }
 
+    // Sin broker no llega mas credito: el procesador deja de esperarlo
+    // (los send() van a fallar igual, y las esperas por lugar en el ring
+    // terminan)
+    pthread_mutex_lock(&gw->queue->mutex);
+    gw->broker_lost = 1;
+    gw->flow_control = 0;
+    pthread_cond_signal(&gw->queue->not_empty);
+    pthread_mutex_unlock(&gw->queue->mutex);
+
     return NULL;
 }
 
@@ -133,6 +384,8 @@ MessageQueue* message_queue_create(void) {
     MessageQueue* q = malloc(sizeof(MessageQueue));
     q->front = q->rear = NULL;
     q->count = 0;
+    q->max_count = 0;
+    q->dropped = 0;
     pthread_mutex_init(&q->mutex, NULL);
     pthread_cond_init(&q->not_empty, NULL);
     return q;
@@ -145,6 +398,16 @@ void message_queue_enqueue(MessageQueue* q, SensorData d) {
 
     pthread_mutex_lock(&q->mutex);
 
+    // Llena: se descarta la mas vieja, que es la que menos vale
+    if (q->max_count > 0 && q->count >= q->max_count) {
+        QueueNode* old = q->front;
+        q->front = old->next;
+        if (!q->front) q->rear = NULL;
+        free(old);
+        q->count--;
+        q->dropped++;
+    }
+
     if (!q->rear) q->front = q->rear = n;
     else {
         q->rear->next = n;
@@ -172,11 +435,25 @@ int message_queue_is_empty(MessageQueue* q) {
     return q->front == NULL;
 }
 
+void message_queue_cleanup(MessageQueue* q) {
+    while (q->front) {
+        QueueNode* n = q->front;
+        q->front = n->next;
+        free(n);
+    }
+    pthread_mutex_destroy(&q->mutex);
+    pthread_cond_destroy(&q->not_empty);
+    free(q);
+}
+
 // ==================== API DEL GATEWAY ====================
 
 int gateway_init(Gateway* gw, const char* id, int port) {
     memset(gw, 0, sizeof(Gateway));
     strcpy(gw->gateway_id, id);
+    gw->broker_socket = -1;
+    gw->ring_data_fd = gw->ring_space_fd = -1;
+    pthread_mutex_init(&gw->ring_mutex, NULL);
 
     gw->server_socket = socket(AF_INET, SOCK_STREAM, 0);
 
@@ -195,11 +472,37 @@ int gateway_init(Gateway* gw, const char* id, int port) {
 
     pthread_mutex_init(&gw->publishers_mutex, NULL);
     gw->queue = message_queue_create();
+    gw->queue->max_count = MAX_QUEUED_READINGS;
     gw->running = 1;
 
     return 0;
 }
 
+// Lo comun a todos los transportes, ya conectado: formato, registro y
+// lector de respuestas.
+static int _start_session(Gateway* gw) {
+    if (gw->binary_protocol && _negotiate_binary(gw) != 0) {
+        LOG_WARN("[GATEWAY] El broker no acepta el protocolo binario, se usa texto");
+        gw->binary_protocol = 0;
+    }
+
+    char msg[100];
+    size_t len;
+
+    if (gw->binary_protocol)
+        len = wire_encode(msg, sizeof(msg), WIRE_REGISTER,
+                          gw->gateway_id, strlen(gw->gateway_id), "", 0);
+    else
+        len = snprintf(msg, sizeof(msg), "REGISTER GATEWAY %s\n", gw->gateway_id);
+
+    _broker_write(gw, msg, len);
+
+    if (pthread_create(&gw->broker_reader, NULL, _broker_reader_thread, gw) == 0)
+        gw->broker_reader_started = 1;
+
+    return 0;
+}
+
 int gateway_connect_to_broker(Gateway* gw, const char* ip, int port) {
     gw->broker_socket = socket(AF_INET, SOCK_STREAM, 0);
 
@@ -211,18 +514,62 @@ int gateway_connect_to_broker(Gateway* gw, const char* ip, int port) {
     if (connect(gw->broker_socket, (struct sockaddr*)&addr, sizeof(addr)) < 0)
         return -1;
 
-    char msg[100];
-    snprintf(msg, sizeof(msg), "REGISTER GATEWAY %s\n", gw->gateway_id);
-    send(gw->broker_socket, msg, strlen(msg), 0);
+    return _start_session(gw);
+}
 
-    return 0;
+int gateway_connect(Gateway* gw, const char* address) {
+    if (strncmp(address, "tcp://", 6) == 0) {
+        char ip[64];
+        const char* colon = strrchr(address + 6, ':');
+        size_t n = colon ? (size_t)(colon - (address + 6)) : 0;
+
+        if (n == 0 || n >= sizeof(ip))
+            return -1;
+        memcpy(ip, address + 6, n);
+        ip[n] = '\0';
+        return gateway_connect_to_broker(gw, ip, atoi(colon + 1));
+    }
+
+    int shm = strncmp(address, "shm://", 6) == 0;
+    if (!shm && strncmp(address, "unix://", 7) != 0)
+        return -1;
+
+    const char* path = address + (shm ? 6 : 7);
+    struct sockaddr_un addr = {0};
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    gw->broker_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connect(gw->broker_socket, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+        return -1;
+
+    if (shm && _attach_shm(gw) != 0)
+        LOG_WARN("[GATEWAY] El broker no acepta memoria compartida, se usa el socket Unix");
+
+    return _start_session(gw);
+}
+
+void gateway_use_binary_protocol(Gateway* gw, int enabled) {
+    gw->binary_protocol = enabled;
 }
 
 int gateway_send_to_broker(Gateway* gw, const char* topic, const char* message) {
     char out[600];
-    snprintf(out, sizeof(out), "PUBLISH %s %s\n", topic, message);
+    size_t len;
+
+    if (gw->binary_protocol) {
+        len = wire_encode(out, sizeof(out), WIRE_PUBLISH,
+                          topic, strlen(topic), message, strlen(message));
+        if (len == 0)
+            return -1;
+    } else {
+        snprintf(out, sizeof(out), "PUBLISH %s %s\n", topic, message);
+        len = strlen(out);
+    }
 
-    return send(gw->broker_socket, out, strlen(out), 0) < 0 ? -1 : 0;
+    return _broker_write(gw, out, len);
 }
 
 void gateway_add_publisher(Gateway* gw, int sock, struct sockaddr_in addr) {
@@ -256,11 +603,21 @@ void gateway_start(Gateway* gw) {
     }
 
     pthread_join(processor, NULL);
+
+    if (gw->broker_reader_started) {
+        pthread_join(gw->broker_reader, NULL);
+        gw->broker_reader_started = 0;
+    }
 }
 
 void gateway_stop(Gateway* gw) {
     gw->running = 0;
+
+    // close() solo no despierta al accept() bloqueado
+    shutdown(gw->server_socket, SHUT_RDWR);
     close(gw->server_socket);
+    if (gw->broker_reader_started)
+        shutdown(gw->broker_socket, SHUT_RD);
 
     pthread_mutex_lock(&gw->queue->mutex);
     pthread_cond_signal(&gw->queue->not_empty);
@@ -268,6 +625,13 @@ void gateway_stop(Gateway* gw) {
 }
 
 void gateway_cleanup(Gateway* gw) {
+    // Sin gateway_start() nadie espero al lector (gateway_stop() ya le
+    // corto el socket)
+    if (gw->broker_reader_started) {
+        pthread_join(gw->broker_reader, NULL);
+        gw->broker_reader_started = 0;
+    }
+
     PublisherInfo* p = gw->publishers;
     while (p) {
         PublisherInfo* nx = p->next;
@@ -278,11 +642,29 @@ void gateway_cleanup(Gateway* gw) {
 
     message_queue_cleanup(gw->queue);
     pthread_mutex_destroy(&gw->publishers_mutex);
+
+    if (gw->ring) {
+        munmap(gw->ring, shm_ring_bytes(gw->ring->size));
+        close(gw->ring_data_fd);
+        close(gw->ring_space_fd);
+        gw->ring = NULL;
+    }
+    pthread_mutex_destroy(&gw->ring_mutex);
+
+    if (gw->broker_socket >= 0)
+        close(gw->broker_socket);
+    gw->broker_socket = -1;
 }
 
 void gateway_print_stats(Gateway* gw) {
     printf("\n=== STATS %s ===\n", gw->gateway_id);
     printf("Mensajes recibidos: %d\n", gw->total_messages_received);
     printf("Mensajes enviados: %d\n", gw->total_messages_sent);
+
+    pthread_mutex_lock(&gw->queue->mutex);
+    printf("En cola: %d (descartados: %d)\n", gw->queue->count, gw->queue->dropped);
+    if (gw->flow_control)
+        printf("Credito del broker: %d\n", gw->credit);
+    pthread_mutex_unlock(&gw->queue->mutex);
 }
 
@@ -11,6 +11,10 @@
 
 #define MAX_PUBLISHERS 100
 
+// Lecturas que el gateway retiene mientras el broker no le da credito;
+// pasado el limite se descartan las mas viejas.
+#define MAX_QUEUED_READINGS 10000
+
 // ====================== ESTRUCTURAS ==========================
 
 // Datos producidos por un publisher
@@ -32,6 +36,8 @@ typedef struct {
     QueueNode* front;
     QueueNode* rear;
     int count;
+    int max_count;           // 0 = sin limite
+    int dropped;             // descartadas por estar llena
     pthread_mutex_t mutex;
     pthread_cond_t not_empty;
 } MessageQueue;
@@ -52,7 +58,25 @@ typedef struct Gateway {
     char gateway_id[50];
 
     int server_socket;
-    int broker_socket;
+    int broker_socket;       // -1 sin conectar
+    int binary_protocol;     // 1 = frames binarios hacia el broker (wire.h)
+
+    // Con "shm://" lo que va al broker se escribe en un ring en memoria
+    // compartida (../broker/shm_ring.h); el socket queda para las
+    // respuestas. NULL: todo por el socket.
+    struct ShmRing* ring;
+    int ring_data_fd;        // eventfd: hay datos para el broker
+    int ring_space_fd;       // eventfd: el broker libero lugar
+    pthread_mutex_t ring_mutex;  // el ring admite un solo productor
+    int broker_lost;         // el broker cerro la conexion
+
+    // PUBLISH que el broker todavia acepta (protegido por el mutex de la
+    // cola). Se descuenta cada envio, aun antes del primer CREDIT; hasta
+    // recibirlo no se espera: un broker sin control de flujo no lo manda.
+    int flow_control;
+    int credit;
+    pthread_t broker_reader;
+    int broker_reader_started;
 
     MessageQueue* queue;
 
@@ -72,6 +96,18 @@ typedef struct Gateway {
 int gateway_init(Gateway* gateway, const char* id, int port);
 int gateway_connect_to_broker(Gateway* gateway, const char* ip, int port);
 
+// Conecta segun el esquema de la direccion:
+//   tcp://<ip>:<puerto>   por TCP (igual que gateway_connect_to_broker)
+//   unix://<ruta>         por el socket Unix del broker (-U)
+//   shm://<ruta>          por el socket Unix, y los PUBLISH por memoria
+//                         compartida; si el broker no la acepta, socket Unix
+// Devuelve 0, o -1 si la direccion no es valida o no se pudo conectar.
+int gateway_connect(Gateway* gateway, const char* address);
+
+// Pide el protocolo binario al conectarse (llamar antes de conectar).
+// Si el broker no lo soporta se sigue en texto.
+void gateway_use_binary_protocol(Gateway* gateway, int enabled);
+
 void gateway_start(Gateway* gateway);
 void gateway_stop(Gateway* gateway);
 void gateway_cleanup(Gateway* gateway);
@@ -4,17 +4,69 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include "../broker/wire.h"
 
 #define BUFFER_SIZE 1024
 
 int server_socket;
+int binary_protocol = 0;
 
 // ==============================
 // Hilo escuchando mensajes
 // ==============================
+
+// En binario los frames pueden llegar partidos o varios juntos: se
+// acumulan en 'buffer' y se imprime cada frame completo.
+static void listen_binary(void) {
+    char buffer[BUFFER_SIZE * 8];
+    size_t len = 0;
+
+    while (1) {
+        int r = recv(server_socket, buffer + len, sizeof(buffer) - len, 0);
+
+        if (r <= 0) {
+            printf("[SUBSCRIBER] Desconectado del broker.\n");
+            close(server_socket);
+            exit(0);
+        }
+        len += r;
+
+        size_t off = 0;
+        WireHeader h;
+        size_t total;
+
+        while ((total = wire_decode_header(buffer + off, len - off, &h)) > 0 &&
+               total <= len - off) {
+            const char* topic = buffer + off + WIRE_HEADER_LEN;
+            const char* payload = topic + h.topic_len;
+
+            if (h.opcode == WIRE_MESSAGE)
+                printf("[MESSAGE RECEIVED] %.*s %.*s\n",
+                       (int)h.topic_len, topic, (int)h.payload_len, payload);
+            else
+                printf("[SUBSCRIBER] %s %.*s\n", h.opcode == WIRE_OK ? "OK" : "ERROR",
+                       (int)h.payload_len, payload);
+
+            off += total;
+        }
+
+        if (total > sizeof(buffer)) {
+            printf("[SUBSCRIBER] Frame demasiado grande, se corta la conexion.\n");
+            close(server_socket);
+            exit(1);
+        }
+
+        memmove(buffer, buffer + off, len - off);
+        len -= off;
+    }
+}
+
 void* listener_thread(void* arg) {
     char buffer[BUFFER_SIZE];
 
+    if (binary_protocol)
+        listen_binary();
+
     while (1) {
         memset(buffer, 0, sizeof(buffer));
         int r = recv(server_socket, buffer, sizeof(buffer), 0);
@@ -35,13 +87,26 @@ void* listener_thread(void* arg) {
 // Programa principal
 // ==============================
 int main(int argc, char* argv[]) {
-    if (argc < 4) {
-        printf("Uso: %s <ip_broker> <puerto> <topic1> [topic2] [topic3] ...\n", argv[0]);
+    // -b: protocolo binario (frames de broker/wire.h)
+    // -l: solo el ultimo valor de cada topic si nos atrasamos (CONFLATE)
+    int first = 1;
+    int latest_only = 0;
+    for (; first < argc; first++) {
+        if (strcmp(argv[first], "-b") == 0)
+            binary_protocol = 1;
+        else if (strcmp(argv[first], "-l") == 0)
+            latest_only = 1;
+        else
+            break;
+    }
+
+    if (argc < first + 3) {
+        printf("Uso: %s [-b] [-l] <ip_broker> <puerto> <topic1> [topic2] [topic3] ...\n", argv[0]);
         return 1;
     }
 
-    const char* ip = argv[1];
-    int port = atoi(argv[2]);
+    const char* ip = argv[first];
+    int port = atoi(argv[first + 1]);
 
     // Crear socket
     server_socket = socket(AF_INET, SOCK_STREAM, 0);
@@ -59,13 +124,36 @@ int main(int argc, char* argv[]) {
 
     printf("[SUBSCRIBER] Conectado al broker %s:%d\n", ip, port);
 
+    if (binary_protocol) {
+        // La confirmacion es una linea de texto; despues todo son frames
+        send(server_socket, WIRE_HELLO_BINARY, strlen(WIRE_HELLO_BINARY), 0);
+
+        char line[64];
+        size_t len = 0;
+        while (len < sizeof(line) - 1 && recv(server_socket, line + len, 1, 0) == 1)
+            if (line[len++] == '\n')
+                break;
+        line[len] = '\0';
+
+        if (strcmp(line, WIRE_HELLO_OK) != 0) {
+            printf("[SUBSCRIBER] El broker no acepta el protocolo binario\n");
+            return 1;
+        }
+    }
+
     // ============================================
     // Enviar SUBSCRIBE por cada topic ingresado
     // ============================================
-    for (int i = 3; i < argc; i++) {
+    const char* opts = latest_only ? "CONFLATE" : "";
+
+    for (int i = first + 2; i < argc; i++) {
         char cmd[256];
-        snprintf(cmd, sizeof(cmd), "SUBSCRIBE %s\n", argv[i]);
-        send(server_socket, cmd, strlen(cmd), 0);
+        size_t len;
+        if (binary_protocol)
+            len = wire_encode(cmd, sizeof(cmd), WIRE_SUBSCRIBE, argv[i], strlen(argv[i]), opts, strlen(opts));
+        else
+            len = snprintf(cmd, sizeof(cmd), "SUBSCRIBE %s%s%s\n", argv[i], *opts ? " " : "", opts);
+        send(server_socket, cmd, len, 0);
         printf("[SUBSCRIBER] Suscrito al topic: %s\n", argv[i]);
     }
 